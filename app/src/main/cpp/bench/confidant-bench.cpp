@@ -0,0 +1,528 @@
+// Headless benchmark for the inference core: replays recorded conversations
+// against a GGUF model and prints per-turn and summary timings as JSON on
+// stdout (engine logs go to stderr). Built for Linux hosts so CI can catch
+// prefill, decode and cache-reuse regressions without a device.
+//
+//   confidant-bench -m model.gguf -c conversations.json [-t 4] [--ctx 2048]
+//                   [--draft 0] [--draft-model small.gguf] [--seed 42] [--prompt-cache DIR]
+//                   [--ngram-cache DIR] [--residency 0-4] [--prefill-budget N]
+//                   [--kv-type q8_0|q4_0v|q4_0] [--perplexity text.txt] [--ppl-window 512]
+//                   [--early-exit N|auto] [--calibration text.txt] [--retrieval notes.txt]
+//                   [--embedding-model embed.gguf] [-o result.json] [--verbose]
+//
+// conversations.json:
+//   {"conversations": [{"name": "...", "system": "...", "max_tokens": 128,
+//     "temperature": 0.0, "history": true, "turns": ["...", "..."]}]}
+//
+// With "history" every turn resends the whole transcript (as the chat screen
+// does), so later turns measure prefix reuse. Without it each turn is an
+// independent system + user request (the proactive path).
+//
+// --draft-model drafts from a small model with the same vocabulary instead of
+// prompt lookup; --draft then caps its adaptive draft length. --early-exit
+// drafts from the model's own first N layers instead (LFM2), with "auto" picking
+// N by calibration on --calibration text (default: a built-in sample).
+//
+// --residency trims the engine to that EngineResidency level after every turn,
+// so each following turn's TTFT includes the cost of coming back from it.
+//
+// --perplexity scores a reference text before the conversations (which are
+// then optional), so a KV cache type can be compared against q8_0.
+//
+// --retrieval embeds every line of a notes file into a vector index and then
+// searches it with the first half of each line: recall@1/@5 of the line it
+// came from, embedding throughput and search latency. The embeddings come from
+// the chat model unless --embedding-model names a dedicated GGUF.
+
+#include "inference-engine.h"
+#include "engine-log.h"
+#include "vector-index.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using json = nlohmann::ordered_json;
+
+struct BenchArgs {
+    std::string model_path;
+    std::string draft_model_path;
+    std::string conversations_path;
+    std::string output_path;
+    std::string prompt_cache_dir;
+    std::string ngram_cache_dir;
+    std::string perplexity_path;
+    std::string calibration_path;
+    std::string retrieval_path;
+    std::string embedding_model_path;
+    int n_threads = 4;
+    int ctx_size = 2048;
+    int n_draft = 0;
+    int seed = 42;
+    int residency = ENGINE_RESIDENCY_ACTIVE;
+    int prefill_budget = -1;  // engine default
+    int kv_cache_type = ENGINE_KV_Q8_0;
+    int ppl_window = 512;
+    int early_exit_layer = 0;
+    bool verbose = false;
+};
+
+struct Conversation {
+    std::string name;
+    std::string system;
+    std::vector<std::string> turns;
+    int max_tokens = 128;
+    float temperature = 0.0f;
+    bool history = true;
+};
+
+struct TurnStats {
+    double ttft_ms = 0.0;
+    double total_ms = 0.0;
+    GenerationResult result;
+};
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s -m model.gguf -c conversations.json [-t threads] [--ctx n] [--draft n]\n"
+            "          [--draft-model small.gguf] [--seed n] [--prompt-cache dir] [--ngram-cache dir]\n"
+            "          [--residency 0-4] [--prefill-budget n] [--kv-type q8_0|q4_0v|q4_0]\n"
+            "          [--perplexity text.txt] [--ppl-window n] [--early-exit n|auto]\n"
+            "          [--calibration text.txt] [--retrieval notes.txt] [--embedding-model embed.gguf]\n"
+            "          [-o result.json] [--verbose]\n",
+            argv0);
+}
+
+static bool parse_args(int argc, char** argv, BenchArgs& args) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--verbose") {
+            args.verbose = true;
+        } else if (!has_value) {
+            return false;
+        } else if (arg == "-m" || arg == "--model") {
+            args.model_path = argv[++i];
+        } else if (arg == "-c" || arg == "--conversations") {
+            args.conversations_path = argv[++i];
+        } else if (arg == "-o" || arg == "--output") {
+            args.output_path = argv[++i];
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = atoi(argv[++i]);
+        } else if (arg == "--ctx") {
+            args.ctx_size = atoi(argv[++i]);
+        } else if (arg == "--draft") {
+            args.n_draft = atoi(argv[++i]);
+        } else if (arg == "--draft-model") {
+            args.draft_model_path = argv[++i];
+        } else if (arg == "--seed") {
+            args.seed = atoi(argv[++i]);
+        } else if (arg == "--prompt-cache") {
+            args.prompt_cache_dir = argv[++i];
+        } else if (arg == "--ngram-cache") {
+            args.ngram_cache_dir = argv[++i];
+        } else if (arg == "--residency") {
+            args.residency = atoi(argv[++i]);
+        } else if (arg == "--prefill-budget") {
+            args.prefill_budget = atoi(argv[++i]);
+        } else if (arg == "--kv-type") {
+            std::string type = argv[++i];
+            if (type == "q8_0") {
+                args.kv_cache_type = ENGINE_KV_Q8_0;
+            } else if (type == "q4_0v") {
+                args.kv_cache_type = ENGINE_KV_Q4_0_V;
+            } else if (type == "q4_0") {
+                args.kv_cache_type = ENGINE_KV_Q4_0;
+            } else {
+                return false;
+            }
+        } else if (arg == "--perplexity") {
+            args.perplexity_path = argv[++i];
+        } else if (arg == "--ppl-window") {
+            args.ppl_window = atoi(argv[++i]);
+        } else if (arg == "--early-exit") {
+            std::string layer = argv[++i];
+            args.early_exit_layer = layer == "auto" ? -1 : atoi(layer.c_str());
+        } else if (arg == "--calibration") {
+            args.calibration_path = argv[++i];
+        } else if (arg == "--retrieval") {
+            args.retrieval_path = argv[++i];
+        } else if (arg == "--embedding-model") {
+            args.embedding_model_path = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return !args.model_path.empty() &&
+           (!args.conversations_path.empty() || !args.perplexity_path.empty() || !args.retrieval_path.empty());
+}
+
+static bool read_text_file(const std::string& path, std::string& out) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path.c_str());
+        return false;
+    }
+    out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool load_conversations(const std::string& path, std::vector<Conversation>& out) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path.c_str());
+        return false;
+    }
+    json doc = json::parse(file, nullptr, false);
+    if (doc.is_discarded() || !doc.contains("conversations") || !doc["conversations"].is_array()) {
+        fprintf(stderr, "%s: expected {\"conversations\": [...]}\n", path.c_str());
+        return false;
+    }
+    for (const json& item : doc["conversations"]) {
+        Conversation conversation;
+        conversation.name = item.value("name", "conversation-" + std::to_string(out.size()));
+        conversation.system = item.value("system", "");
+        conversation.max_tokens = item.value("max_tokens", conversation.max_tokens);
+        conversation.temperature = item.value("temperature", conversation.temperature);
+        conversation.history = item.value("history", conversation.history);
+        if (item.contains("turns") && item["turns"].is_array()) {
+            for (const json& turn : item["turns"]) {
+                if (turn.is_string()) {
+                    conversation.turns.push_back(turn.get<std::string>());
+                }
+            }
+        }
+        out.push_back(std::move(conversation));
+    }
+    return true;
+}
+
+static double ms_between(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+static double percentile(std::vector<double> values, int pct) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(values.size() - 1) * pct / 100];
+}
+
+static double peak_rss_mb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.0;
+    }
+    return usage.ru_maxrss / 1024.0;  // kilobytes on Linux
+}
+
+// Self-retrieval over the lines of a notes file, see --retrieval. False if
+// embedding or the index failed.
+static bool run_retrieval(int64_t session, const std::string& text, json& out) {
+    std::vector<std::string> notes;
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = text.find('\n', begin);
+        end = end == std::string::npos ? text.size() : end;
+        if (end > begin) {
+            notes.push_back(text.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    if (notes.empty()) {
+        fprintf(stderr, "No notes to index\n");
+        return false;
+    }
+
+    const std::string index_path = "/tmp/confidant-bench-" + std::to_string(getpid()) + ".idx";
+    VectorIndex* index = vector_index_open(index_path, engine_embedding_model_id());
+    if (index == nullptr) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EmbeddingResult embedded;
+    engine_embed(session, notes, false, embedded);
+    const double embed_ms = ms_between(start, std::chrono::steady_clock::now());
+    bool ok = embedded.error == nullptr && !embedded.cancelled;
+    for (size_t i = 0; ok && i < notes.size(); i++) {
+        ok = vector_index_put(index, (int64_t)i, embedded.values.data() + i * embedded.dim, embedded.dim);
+    }
+
+    int n_top1 = 0, n_top5 = 0;
+    std::vector<double> search_ms;
+    for (size_t i = 0; ok && i < notes.size(); i++) {
+        // The first half of the note's words
+        const std::string& note = notes[i];
+        size_t cut = note.size() / 2;
+        while (cut < note.size() && note[cut] != ' ') {
+            cut++;
+        }
+        EmbeddingResult query;
+        engine_embed(session, {note.substr(0, cut)}, true, query);
+        ok = query.error == nullptr && !query.cancelled;
+
+        int64_t ids[5];
+        float scores[5];
+        start = std::chrono::steady_clock::now();
+        const int n = ok ? vector_index_search(index, query.values.data(), query.dim, 5, ids, scores) : -1;
+        search_ms.push_back(ms_between(start, std::chrono::steady_clock::now()));
+        ok = n >= 0;
+        n_top1 += n > 0 && ids[0] == (int64_t)i;
+        n_top5 += std::find(ids, ids + std::max(n, 0), (int64_t)i) != ids + std::max(n, 0);
+    }
+    vector_index_close(index);
+    unlink(index_path.c_str());
+    if (!ok) {
+        fprintf(stderr, "Retrieval check failed\n");
+        return false;
+    }
+
+    out["notes"] = (int)notes.size();
+    out["dim"] = embedded.dim;
+    out["embed_ms"] = embed_ms;
+    out["notes_per_s"] = embed_ms > 0.0 ? notes.size() * 1000.0 / embed_ms : 0.0;
+    out["recall_at_1"] = (double)n_top1 / notes.size();
+    out["recall_at_5"] = (double)n_top5 / notes.size();
+    out["search_ms"] = {{"p50", percentile(search_ms, 50)}, {"max", percentile(search_ms, 100)}};
+    return true;
+}
+
+static TurnStats run_turn(int64_t session, const Conversation& conversation, const std::string& transcript,
+                          const std::string& user, int seed) {
+    GenerationOptions options;
+    options.max_tokens = conversation.max_tokens;
+    options.temperature = conversation.temperature;
+    options.seed = seed;
+
+    TurnStats stats;
+    const auto start = std::chrono::steady_clock::now();
+    auto first_token = start;
+    bool seen_token = false;
+    TokenCallback on_token = [&](const char* /* piece */, int /* length */) {
+        if (!seen_token) {
+            first_token = std::chrono::steady_clock::now();
+            seen_token = true;
+        }
+    };
+
+    if (conversation.history) {
+        engine_generate(session, transcript, options, on_token, stats.result);
+    } else {
+        engine_generate_chat(session, conversation.system, user, options, on_token, stats.result);
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    stats.total_ms = ms_between(start, end);
+    stats.ttft_ms = ms_between(start, seen_token ? first_token : end);
+    return stats;
+}
+
+// Trims apply asynchronously once the scheduler is idle
+static void trim_engine(int level) {
+    engine_set_residency(level);
+    for (int i = 0; i < 5000 && engine_get_residency() != level; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchArgs args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    engine_set_log_level(args.verbose ? ENGINE_LOG_INFO : ENGINE_LOG_WARN);
+
+    std::vector<Conversation> conversations;
+    if (!args.conversations_path.empty() && !load_conversations(args.conversations_path, conversations)) {
+        return 2;
+    }
+    std::string perplexity_text;
+    if (!args.perplexity_path.empty() && !read_text_file(args.perplexity_path, perplexity_text)) {
+        return 2;
+    }
+    std::string calibration_text;
+    if (!args.calibration_path.empty() && !read_text_file(args.calibration_path, calibration_text)) {
+        return 2;
+    }
+
+    if (!args.prompt_cache_dir.empty()) {
+        engine_set_prompt_cache_dir(args.prompt_cache_dir, 64 * 1024 * 1024);
+    }
+    if (!args.ngram_cache_dir.empty()) {
+        engine_set_ngram_cache_dir(args.ngram_cache_dir);
+    }
+    std::string retrieval_text;
+    if (!args.retrieval_path.empty() && !read_text_file(args.retrieval_path, retrieval_text)) {
+        return 2;
+    }
+    engine_set_embedding_model(args.embedding_model_path);
+
+    EngineConfig config;
+    config.model_path = args.model_path;
+    config.draft_model_path = args.draft_model_path;
+    config.n_threads = args.n_threads;
+    config.ctx_size = args.ctx_size;
+    config.kv_cache_type = args.kv_cache_type;
+    config.early_exit_layer = args.early_exit_layer;
+    config.calibration_text = calibration_text;
+
+    const auto load_start = std::chrono::steady_clock::now();
+    if (!engine_load_model(config)) {
+        fprintf(stderr, "Failed to load %s\n", args.model_path.c_str());
+        return 1;
+    }
+    const double load_ms = ms_between(load_start, std::chrono::steady_clock::now());
+    engine_set_speculative_draft(args.n_draft);
+    if (args.prefill_budget >= 0) {
+        engine_set_prefill_budget(args.prefill_budget);
+    }
+
+    double perplexity = 0.0;
+    if (!perplexity_text.empty()) {
+        perplexity = engine_measure_perplexity(perplexity_text, args.ppl_window);
+        if (perplexity < 0.0) {
+            fprintf(stderr, "Perplexity measurement failed\n");
+            engine_free_model();
+            return 1;
+        }
+    }
+
+    const int64_t session = engine_create_session();
+    const auto bench_start = std::chrono::steady_clock::now();
+
+    json report;
+    report["model"] = args.model_path;
+    report["threads"] = args.n_threads;
+    report["ctx"] = args.ctx_size;
+    report["draft"] = args.n_draft;
+    report["draft_model"] = args.draft_model_path;
+    report["residency"] = args.residency;
+    report["prefill_budget"] = args.prefill_budget;
+    report["kv_type"] = args.kv_cache_type;
+    report["early_exit"] = args.early_exit_layer;
+    if (!perplexity_text.empty()) {
+        report["perplexity"] = {{"text", args.perplexity_path}, {"window", args.ppl_window}, {"value", perplexity}};
+    }
+    report["load_ms"] = load_ms;
+    if (!retrieval_text.empty()) {
+        json retrieval;
+        if (!run_retrieval(session, retrieval_text, retrieval)) {
+            engine_destroy_session(session);
+            engine_free_model();
+            return 1;
+        }
+        retrieval["notes_file"] = args.retrieval_path;
+        retrieval["embedding_model"] = args.embedding_model_path;
+        report["retrieval"] = retrieval;
+    }
+    report["conversations"] = json::array();
+
+    std::vector<double> ttfts;
+    long long n_prompt = 0, n_reused = 0, n_new = 0, n_generated = 0, n_drafted = 0, n_accepted = 0;
+    long long prefill_ms = 0, gen_ms = 0;
+    int n_turns = 0, n_errors = 0, n_snapshot_hits = 0;
+
+    for (const Conversation& conversation : conversations) {
+        json conversation_report;
+        conversation_report["name"] = conversation.name;
+        conversation_report["turns"] = json::array();
+
+        std::string transcript = "<|startoftext|><|im_start|>system\n" + conversation.system + "<|im_end|>\n";
+        for (const std::string& user : conversation.turns) {
+            transcript += "<|im_start|>user\n" + user + "<|im_end|>\n<|im_start|>assistant\n";
+            TurnStats stats = run_turn(session, conversation, transcript, user, args.seed);
+            const GenerationResult& result = stats.result;
+            transcript += result.text + "<|im_end|>\n";
+
+            const int n_suffix = result.n_prompt - result.n_reused;
+            json turn;
+            turn["prompt_tokens"] = result.n_prompt;
+            turn["reused_tokens"] = result.n_reused;
+            turn["generated_tokens"] = result.n_generated;
+            turn["ttft_ms"] = stats.ttft_ms;
+            turn["total_ms"] = stats.total_ms;
+            turn["prefill_tps"] = result.prefill_ms > 0 ? n_suffix * 1000.0 / result.prefill_ms : 0.0;
+            turn["decode_tps"] = result.gen_ms > 0 ? result.n_generated * 1000.0 / result.gen_ms : 0.0;
+            turn["snapshot_hit"] = result.snapshot_hit;
+            if (result.n_discarded > 0) {
+                turn["evicted_tokens"] = result.n_discarded;
+            }
+            if (result.error != nullptr) {
+                turn["error"] = result.error;
+                n_errors++;
+            }
+            conversation_report["turns"].push_back(turn);
+
+            ttfts.push_back(stats.ttft_ms);
+            n_turns++;
+            n_prompt += result.n_prompt;
+            n_reused += result.n_reused;
+            n_new += n_suffix;
+            n_generated += result.n_generated;
+            n_drafted += result.n_drafted;
+            n_accepted += result.n_accepted;
+            prefill_ms += result.prefill_ms;
+            gen_ms += result.gen_ms;
+            n_snapshot_hits += result.snapshot_hit ? 1 : 0;
+
+            if (args.residency != ENGINE_RESIDENCY_ACTIVE) {
+                trim_engine(args.residency);
+            }
+        }
+        report["conversations"].push_back(conversation_report);
+    }
+
+    engine_destroy_session(session);
+
+    double sum_ttft = 0.0;
+    for (double ttft : ttfts) {
+        sum_ttft += ttft;
+    }
+
+    json summary;
+    summary["turns"] = n_turns;
+    summary["errors"] = n_errors;
+    summary["wall_ms"] = ms_between(bench_start, std::chrono::steady_clock::now());
+    summary["ttft_ms"] = {
+        {"mean", ttfts.empty() ? 0.0 : sum_ttft / ttfts.size()},
+        {"p50", percentile(ttfts, 50)},
+        {"p90", percentile(ttfts, 90)},
+        {"max", percentile(ttfts, 100)},
+    };
+    summary["prefill_tps"] = prefill_ms > 0 ? n_new * 1000.0 / prefill_ms : 0.0;
+    summary["decode_tps"] = gen_ms > 0 ? n_generated * 1000.0 / gen_ms : 0.0;
+    summary["cache_hit_rate"] = n_prompt > 0 ? (double)n_reused / n_prompt : 0.0;
+    summary["snapshot_hits"] = n_snapshot_hits;
+    summary["draft_acceptance"] = n_drafted > 0 ? (double)n_accepted / n_drafted : 0.0;
+    summary["peak_rss_mb"] = peak_rss_mb();
+    report["summary"] = summary;
+
+    engine_free_model();
+
+    const std::string output = report.dump(2);
+    if (args.output_path.empty()) {
+        printf("%s\n", output.c_str());
+    } else {
+        std::ofstream out(args.output_path);
+        out << output << "\n";
+        if (!out) {
+            fprintf(stderr, "Failed to write %s\n", args.output_path.c_str());
+            return 1;
+        }
+    }
+    return n_errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,322 @@
+// Check and micro-benchmark for the quantized-KV decode kernel of flash
+// attention (ggml_compute_forward_flash_attn_ext_quant_decode in ggml-cpu's
+// ops.cpp): every case is computed by the CPU backend once with the kernel and
+// once with ggml_backend_cpu_set_use_ref, which forces the per-row reference
+// loop, and both outputs must agree within --tol. Prints the largest error and
+// microseconds per call of both paths as JSON on stdout; no model is loaded.
+//
+//   flash-attn-bench [--iters 20] [--seed 42] [--tol 1e-4] [-o result.json]
+//
+// The cases cover the head layouts of the models we ship (GQA groups of 2 to 8,
+// plus an odd group so a 2x2 tile spans two tokens), Q8_0 and Q4_0 K and V,
+// 1 to 16 query rows, cache lengths that are not a multiple of the KV block,
+// masks with dead ranges (another sequence's cells, a causal tail, a row with
+// no live cell at all), logit softcap, ALiBi and sinks. Each case is checked
+// at 1 to 16 threads, since the split-K chunks and their merge depend on the
+// thread count.
+//
+// On arm64 with i8mm the K type's vec_dot takes two K rows by two query rows
+// ("kq_nrows": 2 in the output); run it there as well, x86 only covers the
+// one-row path.
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static const int THREAD_COUNTS[] = {1, 2, 3, 4, 8, 16};
+static const int TIMING_THREADS = 4;
+
+enum mask_kind {
+    MASK_NONE,
+    MASK_DEAD_RANGES,  // Random dead ranges per row and a causal tail
+    MASK_DEAD_ROW,     // Dead ranges, and the last row has no live cell
+    MASK_ALIBI,        // Distance bias, scaled per head by max_bias
+};
+
+struct attn_case {
+    const char* name;
+    int64_t head_dim_k;
+    int64_t head_dim_v;
+    int64_t n_head;
+    int64_t n_head_kv;
+    int64_t n_q;
+    int64_t n_kv;
+    ggml_type type_k;
+    ggml_type type_v;
+    mask_kind mask;
+    float softcap;
+    float max_bias;
+    bool sinks;
+};
+
+static const attn_case CASES[] = {
+    {"lfm2_decode",        64,  64, 32,  8,  1, 2048, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_DEAD_RANGES,  0.0f, 0.0f, false},
+    {"qwen_decode",       128, 128, 14,  2,  1, 4099, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_DEAD_RANGES,  0.0f, 0.0f, false},
+    {"llama_no_mask",     128, 128, 32,  8,  1, 1000, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_NONE,         0.0f, 0.0f, false},
+    {"no_gqa",             64,  64,  8,  8,  1,  777, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_DEAD_RANGES,  0.0f, 0.0f, false},
+    {"q4_0_kv",            64,  64, 32,  8,  2, 1531, GGML_TYPE_Q4_0, GGML_TYPE_Q4_0, MASK_DEAD_RANGES,  0.0f, 0.0f, false},
+    {"q8_0_k_q4_0_v",     128, 128, 16,  4,  3, 1027, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0, MASK_DEAD_RANGES,  0.0f, 0.0f, false},
+    {"q4_0_k_q8_0_v",      64, 128, 16,  4,  1,  513, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, MASK_DEAD_RANGES,  0.0f, 0.0f, false},
+    {"gemma_softcap",     256, 256,  8,  4,  4, 1200, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_DEAD_RANGES, 50.0f, 0.0f, false},
+    {"odd_group_speculative", 64, 64, 12, 4, 5,  901, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_DEAD_ROW,     0.0f, 0.0f, false},
+    {"multi_seq",          64,  64, 32,  8, 16, 2304, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0, MASK_DEAD_ROW,    30.0f, 0.0f, false},
+    {"alibi_sinks",        64,  64, 16,  2,  2,  600, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, MASK_ALIBI,        0.0f, 8.0f, true},
+};
+
+struct attn_graph {
+    ggml_context* ctx = nullptr;
+    ggml_backend_buffer_t buffer = nullptr;
+    ggml_cgraph* graph = nullptr;
+    ggml_tensor* out = nullptr;
+
+    ~attn_graph() {
+        ggml_backend_buffer_free(buffer);
+        ggml_free(ctx);
+    }
+};
+
+static std::vector<uint8_t> quantize(ggml_type type, const std::vector<float>& data, int64_t n_per_row) {
+    const int64_t n_rows = (int64_t)data.size() / n_per_row;
+    std::vector<uint8_t> out(ggml_row_size(type, n_per_row) * n_rows);
+    ggml_quantize_chunk(type, data.data(), out.data(), 0, n_rows, n_per_row, nullptr);
+    return out;
+}
+
+static std::vector<float> uniform(size_t n, float scale, std::mt19937& rng) {
+    std::uniform_real_distribution<float> dist(-scale, scale);
+    std::vector<float> out(n);
+    for (float& x : out) {
+        x = dist(rng);
+    }
+    return out;
+}
+
+// Mask rows are query rows; cells outside a row's live cells are -INF, as in
+// the unified cache where the other sequences' cells are masked out
+static std::vector<ggml_fp16_t> make_mask(const attn_case& c, std::mt19937& rng) {
+    std::vector<float> mask(c.n_kv * c.n_q, 0.0f);
+    for (int64_t iq = 0; iq < c.n_q; iq++) {
+        float* row = mask.data() + iq * c.n_kv;
+        if (c.mask == MASK_ALIBI) {
+            for (int64_t ic = 0; ic < c.n_kv; ic++) {
+                row[ic] = -(float)(c.n_kv - 1 - ic) / (float)c.n_kv;
+            }
+            continue;
+        }
+
+        // Short gaps, and ranges past a KV block or a whole thread's chunk
+        std::uniform_int_distribution<int64_t> start(0, c.n_kv - 1);
+        const int64_t lengths[] = {1, 5, 31, 97, 300, c.n_kv / 3};
+        for (int64_t len : lengths) {
+            const int64_t s = start(rng);
+            std::fill(row + s, row + std::min(c.n_kv, s + len), -INFINITY);
+        }
+        // Speculative rows see one more cell than the row before
+        std::fill(row + c.n_kv - c.n_q + iq + 1, row + c.n_kv, -INFINITY);
+        if (c.mask == MASK_DEAD_ROW && iq == c.n_q - 1) {
+            std::fill(row, row + c.n_kv, -INFINITY);
+        }
+    }
+
+    std::vector<ggml_fp16_t> out(mask.size());
+    for (size_t i = 0; i < mask.size(); i++) {
+        out[i] = ggml_fp32_to_fp16(mask[i]);
+    }
+    return out;
+}
+
+static void build(attn_graph& g, const attn_case& c, ggml_backend_t backend, std::mt19937& rng) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead() * 8 + ggml_graph_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+    g.ctx = ggml_init(params);
+
+    ggml_tensor* q = ggml_new_tensor_4d(g.ctx, GGML_TYPE_F32, c.head_dim_k, c.n_q, c.n_head, 1);
+    ggml_tensor* k = ggml_new_tensor_4d(g.ctx, c.type_k, c.head_dim_k, c.n_kv, c.n_head_kv, 1);
+    ggml_tensor* v = ggml_new_tensor_4d(g.ctx, c.type_v, c.head_dim_v, c.n_kv, c.n_head_kv, 1);
+    ggml_tensor* mask = nullptr;
+    if (c.mask != MASK_NONE) {
+        mask = ggml_new_tensor_4d(g.ctx, GGML_TYPE_F16, c.n_kv, c.n_q, 1, 1);
+    }
+    ggml_tensor* sinks = nullptr;
+    if (c.sinks) {
+        sinks = ggml_new_tensor_1d(g.ctx, GGML_TYPE_F32, c.n_head);
+    }
+
+    g.out = ggml_flash_attn_ext(g.ctx, q, k, v, mask, 1.0f / sqrtf((float)c.head_dim_k), c.max_bias, c.softcap);
+    ggml_flash_attn_ext_set_prec(g.out, GGML_PREC_F32);
+    if (sinks) {
+        ggml_flash_attn_ext_add_sinks(g.out, sinks);
+    }
+    g.graph = ggml_new_graph(g.ctx);
+    ggml_build_forward_expand(g.graph, g.out);
+
+    g.buffer = ggml_backend_alloc_ctx_tensors(g.ctx, backend);
+
+    // Query scale so the softmax is neither flat nor one-hot
+    const std::vector<float> q_data = uniform(ggml_nelements(q), 2.0f, rng);
+    ggml_backend_tensor_set(q, q_data.data(), 0, ggml_nbytes(q));
+    const std::vector<uint8_t> k_data = quantize(c.type_k, uniform(ggml_nelements(k), 1.0f, rng), c.head_dim_k);
+    ggml_backend_tensor_set(k, k_data.data(), 0, ggml_nbytes(k));
+    const std::vector<uint8_t> v_data = quantize(c.type_v, uniform(ggml_nelements(v), 1.0f, rng), c.head_dim_v);
+    ggml_backend_tensor_set(v, v_data.data(), 0, ggml_nbytes(v));
+    if (mask) {
+        const std::vector<ggml_fp16_t> mask_data = make_mask(c, rng);
+        ggml_backend_tensor_set(mask, mask_data.data(), 0, ggml_nbytes(mask));
+    }
+    if (sinks) {
+        const std::vector<float> sink_data = uniform(c.n_head, 3.0f, rng);
+        ggml_backend_tensor_set(sinks, sink_data.data(), 0, ggml_nbytes(sinks));
+    }
+}
+
+static std::vector<float> compute(ggml_backend_t backend, attn_graph& g, int n_threads, bool use_ref) {
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+    ggml_backend_cpu_set_use_ref(backend, use_ref);
+
+    // Poison the output so rows the kernel never writes show up
+    std::vector<float> out(ggml_nelements(g.out), NAN);
+    ggml_backend_tensor_set(g.out, out.data(), 0, ggml_nbytes(g.out));
+    if (ggml_backend_graph_compute(backend, g.graph) != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "graph compute failed\n");
+        exit(1);
+    }
+    ggml_backend_tensor_get(g.out, out.data(), 0, ggml_nbytes(g.out));
+    return out;
+}
+
+// Largest absolute difference; NaN where either side has one
+static float max_error(const std::vector<float>& expected, const std::vector<float>& actual) {
+    float err = 0.0f;
+    for (size_t i = 0; i < expected.size(); i++) {
+        const float d = fabsf(expected[i] - actual[i]);
+        if (std::isnan(d)) {
+            return NAN;
+        }
+        err = std::max(err, d);
+    }
+    return err;
+}
+
+static double time_compute(ggml_backend_t backend, attn_graph& g, bool use_ref, int iters) {
+    ggml_backend_cpu_set_n_threads(backend, TIMING_THREADS);
+    ggml_backend_cpu_set_use_ref(backend, use_ref);
+    ggml_backend_graph_compute(backend, g.graph);  // Warm-up: workspace, thread pool
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; i++) {
+        ggml_backend_graph_compute(backend, g.graph);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::micro>(elapsed).count() / iters;
+}
+
+int main(int argc, char** argv) {
+    int iters = 20;
+    uint32_t seed = 42;
+    float tol = 1e-4f;
+    std::string output_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "usage: %s [--iters n] [--seed n] [--tol x] [-o result.json]\n", argv[0]);
+            return 1;
+        } else if (arg == "--iters") {
+            iters = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--seed") {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--tol") {
+            tol = (float)atof(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            output_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--iters n] [--seed n] [--tol x] [-o result.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    if (!backend) {
+        fprintf(stderr, "Failed to initialize the CPU backend\n");
+        return 1;
+    }
+
+    std::mt19937 rng(seed);
+    json report;
+    report["iters"] = iters;
+    report["tol"] = tol;
+    report["i8mm"] = ggml_cpu_has_matmul_int8() != 0;
+    report["kq_nrows"] = {
+        {"q8_0", ggml_get_type_traits_cpu(GGML_TYPE_Q8_0)->nrows},
+        {"q4_0", ggml_get_type_traits_cpu(GGML_TYPE_Q4_0)->nrows},
+    };
+    json results = json::array();
+    int n_mismatches = 0;
+
+    for (const attn_case& c : CASES) {
+        attn_graph g;
+        build(g, c, backend, rng);
+
+        json result;
+        result["name"] = c.name;
+        result["n_head"] = c.n_head;
+        result["n_head_kv"] = c.n_head_kv;
+        result["n_q"] = c.n_q;
+        result["n_kv"] = c.n_kv;
+        result["type_k"] = ggml_type_name(c.type_k);
+        result["type_v"] = ggml_type_name(c.type_v);
+
+        const std::vector<float> expected = compute(backend, g, 1, true);
+        float case_error = 0.0f;
+        for (int n_threads : THREAD_COUNTS) {
+            const float err = max_error(expected, compute(backend, g, n_threads, false));
+            if (!(err <= tol)) {
+                fprintf(stderr, "%s: max error %g at %d threads\n", c.name, err, n_threads);
+                n_mismatches++;
+            }
+            case_error = std::isnan(err) || std::isnan(case_error) ? NAN : std::max(case_error, err);
+        }
+        result["max_error"] = std::isnan(case_error) ? json(nullptr) : json(case_error);
+        result["ref_us"] = time_compute(backend, g, true, iters);
+        result["decode_us"] = time_compute(backend, g, false, iters);
+        results.push_back(result);
+    }
+    ggml_backend_free(backend);
+
+    report["results"] = results;
+    report["mismatches"] = n_mismatches;
+
+    const std::string output = report.dump(2);
+    if (output_path.empty()) {
+        printf("%s\n", output.c_str());
+    } else {
+        std::ofstream out(output_path);
+        out << output << "\n";
+        if (!out) {
+            fprintf(stderr, "Failed to write %s\n", output_path.c_str());
+            return 1;
+        }
+    }
+    if (n_mismatches > 0) {
+        fprintf(stderr, "%d mismatches between the decode kernel and the reference path\n", n_mismatches);
+        return 1;
+    }
+    return 0;
+}
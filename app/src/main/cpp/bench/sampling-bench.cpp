@@ -0,0 +1,240 @@
+// Micro-benchmark for token selection: times the llama_sampler chains the
+// engine falls back to against the fused top-k path, on synthetic logits at
+// the vocabulary sizes of the models we ship or test (Llama 2, LFM2, Qwen 2.5,
+// Gemma 3). Prints microseconds per sampled token as JSON on stdout; no model
+// is loaded.
+//
+//   sampling-bench [--iters 200] [--seed 42] [-o result.json]
+//
+// "chain_top_k" is top_k(40) -> top_p(0.9) -> temp -> dist, "chain_top_p" is
+// top_p(0.9) -> temp -> dist (the llama_token_data_array_partial_sort path),
+// both compiled into a fused chain by llama_sampler_chain_add; the "_unfused"
+// variants run the same samplers one by one. "heap_scalar" is the fused
+// top-k selection before it was vectorized and "fused_top_k" the current
+// select_top_k. Fused and unfused chains must draw the same tokens and both
+// top-k selections must select the same tokens; a mismatch fails the run.
+
+#include "sampling-kernels.h"
+#include "llama.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static const int VOCAB_SIZES[] = {32000, 65536, 151936, 262144};
+static const int N_LOGIT_SETS = 8;  // Rotated so one set never sits in cache
+static const int TOP_K = 40;
+static const float TOP_P = 0.9f;
+static const float TEMPERATURE = 0.7f;
+
+// Roughly the shape of real logits: a broad normal body and a few dozen
+// plausible continuations well above it
+static std::vector<float> make_logits(int n_vocab, std::mt19937& rng) {
+    std::normal_distribution<float> body(0.0f, 2.5f);
+    std::uniform_int_distribution<int> token(0, n_vocab - 1);
+    std::uniform_real_distribution<float> lift(6.0f, 14.0f);
+
+    std::vector<float> logits(n_vocab);
+    for (float& logit : logits) {
+        logit = body(rng);
+    }
+    for (int i = 0; i < 32; i++) {
+        logits[token(rng)] += lift(rng);
+    }
+    return logits;
+}
+
+static void heap_scalar(const float* logits, int n_vocab, int k, std::vector<llama_token_data>& top) {
+    auto greater_logit = [](const llama_token_data& a, const llama_token_data& b) {
+        return a.logit > b.logit;
+    };
+    top.clear();
+    for (llama_token id = 0; id < k; id++) {
+        top.push_back({id, logits[id], 0.0f});
+    }
+    std::make_heap(top.begin(), top.end(), greater_logit);
+    for (llama_token id = k; id < n_vocab; id++) {
+        if (logits[id] > top.front().logit) {
+            std::pop_heap(top.begin(), top.end(), greater_logit);
+            top.back() = {id, logits[id], 0.0f};
+            std::push_heap(top.begin(), top.end(), greater_logit);
+        }
+    }
+    std::sort_heap(top.begin(), top.end(), greater_logit);
+}
+
+// A sampler that does nothing; appended after dist it keeps the chain from
+// being fused, so the samplers run one by one
+static const char* passthrough_name(const llama_sampler* /* smpl */) {
+    return "passthrough";
+}
+
+static void passthrough_apply(llama_sampler* /* smpl */, llama_token_data_array* /* cur_p */) {
+}
+
+static llama_sampler_i passthrough_iface = {
+    passthrough_name, nullptr, passthrough_apply, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+};
+
+static llama_sampler* make_chain(bool top_k, bool fused, uint32_t seed) {
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    if (top_k) {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(TOP_K));
+    }
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(TOP_P, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(TEMPERATURE));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+    if (!fused) {
+        llama_sampler_chain_add(chain, llama_sampler_init(&passthrough_iface, nullptr));
+    }
+    return chain;
+}
+
+// Builds the candidate array from the logits and samples, as the engine does.
+// The drawn tokens are appended to tokens when given.
+static double time_chain(llama_sampler* chain, const std::vector<std::vector<float>>& sets, int iters,
+                         std::vector<llama_token>* tokens = nullptr) {
+    std::vector<llama_token_data> candidates;
+    llama_token sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; i++) {
+        const std::vector<float>& logits = sets[i % sets.size()];
+        candidates.resize(logits.size());
+        for (size_t id = 0; id < logits.size(); id++) {
+            candidates[id] = {(llama_token)id, logits[id], 0.0f};
+        }
+        llama_token_data_array cur = {candidates.data(), candidates.size(), -1, false};
+        llama_sampler_apply(chain, &cur);
+        sink += cur.data[cur.selected].id;
+        if (tokens) {
+            tokens->push_back(cur.data[cur.selected].id);
+        }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    if (sink == -1) {
+        printf("\n");  // Keeps the loop from being optimized away
+    }
+    return std::chrono::duration<double, std::micro>(end - start).count() / iters;
+}
+
+template <typename Select>
+static double time_select(Select select, const std::vector<std::vector<float>>& sets, int iters) {
+    std::vector<llama_token_data> top;
+    top.reserve(TOP_K);
+    llama_token sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; i++) {
+        const std::vector<float>& logits = sets[i % sets.size()];
+        select(logits.data(), (int)logits.size(), TOP_K, top);
+        sink += top[0].id;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    if (sink == -1) {
+        printf("\n");
+    }
+    return std::chrono::duration<double, std::micro>(end - start).count() / iters;
+}
+
+int main(int argc, char** argv) {
+    int iters = 200;
+    uint32_t seed = 42;
+    std::string output_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "usage: %s [--iters n] [--seed n] [-o result.json]\n", argv[0]);
+            return 1;
+        } else if (arg == "--iters") {
+            iters = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--seed") {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            output_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--iters n] [--seed n] [-o result.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(seed);
+    json report;
+    report["iters"] = iters;
+    report["top_k"] = TOP_K;
+    report["top_p"] = TOP_P;
+    json results = json::array();
+    int n_mismatches = 0;
+
+    for (int n_vocab : VOCAB_SIZES) {
+        std::vector<std::vector<float>> sets;
+        for (int i = 0; i < N_LOGIT_SETS; i++) {
+            sets.push_back(make_logits(n_vocab, rng));
+        }
+
+        // Same tokens in the same order, ties included
+        std::vector<llama_token_data> expected, actual;
+        for (const auto& logits : sets) {
+            heap_scalar(logits.data(), n_vocab, TOP_K, expected);
+            select_top_k(logits.data(), n_vocab, TOP_K, actual);
+            for (int i = 0; i < TOP_K; i++) {
+                if (expected[i].id != actual[i].id || expected[i].logit != actual[i].logit) {
+                    n_mismatches++;
+                    break;
+                }
+            }
+        }
+
+        json result;
+        result["n_vocab"] = n_vocab;
+        for (bool top_k : {true, false}) {
+            // Same seed, so both chains must draw the same tokens
+            llama_sampler* fused = make_chain(top_k, true, seed);
+            llama_sampler* unfused = make_chain(top_k, false, seed);
+            std::vector<llama_token> fused_tokens, unfused_tokens;
+            time_chain(fused, sets, N_LOGIT_SETS, &fused_tokens);  // Warm-up: buffers, CPU dispatch
+            time_chain(unfused, sets, N_LOGIT_SETS, &unfused_tokens);
+
+            const std::string name = top_k ? "chain_top_k" : "chain_top_p";
+            result[name + "_us"] = time_chain(fused, sets, iters, &fused_tokens);
+            result[name + "_unfused_us"] = time_chain(unfused, sets, iters, &unfused_tokens);
+            if (fused_tokens != unfused_tokens) {
+                n_mismatches++;
+            }
+
+            llama_sampler_free(fused);
+            llama_sampler_free(unfused);
+        }
+        result["heap_scalar_us"] = time_select(heap_scalar, sets, iters);
+        result["fused_top_k_us"] = time_select(select_top_k, sets, iters);
+        results.push_back(result);
+    }
+
+    report["results"] = results;
+    report["mismatches"] = n_mismatches;
+
+    const std::string output = report.dump(2);
+    if (output_path.empty()) {
+        printf("%s\n", output.c_str());
+    } else {
+        std::ofstream out(output_path);
+        out << output << "\n";
+        if (!out) {
+            fprintf(stderr, "Failed to write %s\n", output_path.c_str());
+            return 1;
+        }
+    }
+    if (n_mismatches > 0) {
+        fprintf(stderr, "%d mismatches between fused and unfused selection\n", n_mismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,604 @@
+// Micro-benchmark for BPE pre-tokenization: times unicode_regex_split with the
+// compiled pre-tokenizer against the std::regex fallback, for the regexes of
+// every pre-tokenizer type in llama-vocab.cpp, on a synthetic document mixing
+// prose, code, numbers and CJK. Prints MB/s per type as JSON on stdout; no
+// model is loaded.
+//
+//   tokenizer-bench [--iters 2000] [--seed 42] [-o result.json]
+//
+// Before timing, --iters random strings drawn from ASCII, Latin-1, combining
+// marks, CJK, Hangul, kana, full-width forms, Unicode spaces, emoji and invalid
+// bytes are split both ways for every type. The compiled pre-tokenizer must
+// produce the same words as std::regex; a mismatch fails the run.
+//
+// Parallel tokenization is checked against a byte-level BPE vocab learned from
+// the document and written as a vocab-only GGUF for a few pre-tokenizers: the
+// document, a ChatML prompt around it, the fuzz strings joined with special
+// tokens and random slices of them must tokenize to the same tokens with
+// llama_tokenize_parallel at 2-8 threads as with llama_tokenize. Both are timed
+// on the document.
+//
+// The streaming detokenizer is checked on the same BPE vocabs and on an SPM
+// vocab with byte fallback and a space prefix: the fuzz strings and the corpus
+// are tokenized with and without BOS (plus a closing EOS), pushed one token at a time
+// through llama_detokenizer_push, and must give llama_detokenize's text with
+// its invalid UTF-8 dropped, for every remove_special/unparse_special pair.
+// A second stream pushes every token into a buffer of 0-3 bytes first, so the
+// retry after a negative return must not have consumed the token. BPE vocabs
+// whose llama_detokenize cleans up tokenization spaces are not compared.
+
+#include "llama-vocab.h"
+#include "unicode.h"
+#include "gguf.h"
+#include "llama.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static const int DOCUMENT_BYTES = 32 * 1024;
+
+// Pieces the fuzzer strings are built from: single characters of every class
+// the pre-tokenizer regexes distinguish, and short runs that exercise their
+// alternatives (contractions, digit groups, whitespace before newlines)
+static const char* const FUZZ_PIECES[] = {
+    "a", "Z", "q", "I", "x", "0", "7", "123", "4567", "1,000",
+    " ", "  ", "\t", "\n", "\r\n", "\v", "\f", " \n ", "   \n",
+    "!", "?", ".", ",", "-", "_", "/", "\\", "$", "+", "<", "=", "^", "`", "|", "~", "@", "#", "%", "&", "*",
+    "(", ")", "[", "]", "{", "}", "\"", ":", ";",
+    "'", "'s", "'S", "'t", "'re", "'VE", "'m", "'ll", "'d", "'x",
+    "\xc3\xa9", "\xc3\x9f", "\xc2\xb5", "\xc2\xaa", "\xc2\xbf", "\xc3\x97", "\xc2\xa0", "\xc2\x85",        // é ß µ ª ¿ × NBSP NEL
+    "\xcc\x81", "e\xcc\x81",                                                                               // combining acute
+    "\xe4\xb8\x80", "\xe4\xb8\xad", "\xe9\xbe\xa5", "\xe3\x81\x82", "\xe3\x82\xa2", "\xea\xb0\x80",        // 一 中 龥 あ ア 가
+    "\xe3\x84\xb1", "\xe3\x84\x85", "\xef\xbc\x81", "\xef\xbc\xa1", "\xef\xbc\x90", "\xe3\x80\x80",        // ㄱ ㄅ ！ Ａ ０ ideographic space
+    "\xe3\x80\x82", "\xe3\x80\x81", "\xe2\x80\x9c", "\xe2\x80\x94", "\xe2\x80\xa6",                        // 。 、 “ — …
+    "\xd8\x8c", "\xdb\x94", "\xe0\xa5\xa4", "\xd9\xa3", "\xe0\xb8\x81", "\xce\xa9", "\xd0\x96",            // ، ۔ । ٣ ก Ω Ж
+    "\xe2\x80\x8b", "\xe2\x80\xa8", "\xe2\x85\xa7", "\xc2\xb2",                                            // ZWSP, line separator, Ⅷ, ²
+    "\xf0\x9f\x98\x80", "\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd",                                               // emoji
+    "\xff", "\xc3",                                                                                        // invalid UTF-8
+    "IMGIMG", "ABZ", "<sentinel:", "12>", "    ",
+};
+
+static std::string make_fuzz_string(std::mt19937& rng) {
+    std::uniform_int_distribution<int> length(1, 40);
+    std::uniform_int_distribution<size_t> piece(0, sizeof(FUZZ_PIECES) / sizeof(FUZZ_PIECES[0]) - 1);
+    std::string text;
+    for (int i = length(rng); i > 0; i--) {
+        text += FUZZ_PIECES[piece(rng)];
+    }
+    return text;
+}
+
+// Roughly what gets prefilled from retrieved notes and web pages
+static std::string make_document(std::mt19937& rng) {
+    static const char* const PARAGRAPHS[] = {
+        "The meeting with Dr. O'Brien moved to Thursday, 14:30 - we'll need the Q3 numbers (revenue was $1,284,000, up 12.5%).\n\n",
+        "    for (int i = 0; i < n; ++i) {\n        total += values[i] * 2;\n    }\n",
+        "Remember: buy milk, eggs & bread; call +1 (555) 010-9999 before 6pm!!! It's urgent, isn't it?\n",
+        "\xe4\xbb\x8a\xe5\xa4\xa9\xe7\x9a\x84\xe4\xbc\x9a\xe8\xae\xae\xe6\x94\xb9\xe5\x88\xb0\xe6\x98\x8e\xe5\xa4\xa9\xe3\x80\x82"
+        "\xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf\xe4\xb8\x96\xe7\x95\x8c\xef\xbc\x81\n",
+        "Caf\xc3\xa9 na\xc3\xafve r\xc3\xa9sum\xc3\xa9 \xe2\x80\x94 \xe2\x80\x9cquoted\xe2\x80\x9d text\xe2\x80\xa6 2024-06-01T09:15:00Z\n",
+        "| id | name  | score |\n|----|-------|-------|\n| 1  | alpha | 98.6  |\n| 2  | beta  | 77.1  |\n",
+    };
+    std::uniform_int_distribution<size_t> pick(0, sizeof(PARAGRAPHS) / sizeof(PARAGRAPHS[0]) - 1);
+    std::string document;
+    while (document.size() < DOCUMENT_BYTES) {
+        document += PARAGRAPHS[pick(rng)];
+    }
+    return document;
+}
+
+// The words, or the error both ways must agree on (an empty text falls through
+// the Kimi K2 splitter to a \p{Han} std::regex, which throws)
+static std::vector<std::string> split(const std::string& text, const std::vector<std::string>& regex_exprs, bool compiled) {
+    try {
+        return unicode_regex_split(text, regex_exprs, compiled);
+    } catch (const std::exception& e) {
+        return {std::string("error: ") + e.what()};
+    }
+}
+
+// MB/s of unicode_regex_split over the document; the split is returned in words
+static double time_split(const std::string& document, const std::vector<std::string>& regex_exprs, bool compiled,
+                         std::vector<std::string>& words) {
+    words = split(document, regex_exprs, compiled);  // Warm-up: pattern compilation, tables
+    int reps = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto end = start;
+    do {
+        words = split(document, regex_exprs, compiled);
+        reps++;
+        end = std::chrono::steady_clock::now();
+    } while (end - start < std::chrono::milliseconds(200));
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    return document.size() * reps / seconds / 1e6;
+}
+
+static const int BPE_MERGES = 400;
+static const int TOKENIZE_SLICES = 8;
+static const char* const TOKENIZE_PRE_TYPES[] = {"lfm2", "gpt-2", "qwen2", "deepseek-v3"};
+static const char* const SPECIAL_TOKENS[] = {"<|startoftext|>", "<|im_start|>", "<|im_end|>"};
+static const int SPM_WORDS = 300;
+
+static std::string temp_path(const std::string& name) {
+    const char* tmpdir = getenv("TMPDIR");
+    return std::string(tmpdir ? tmpdir : "/tmp") + "/tokenizer-bench-" + name + ".gguf";
+}
+
+// Loads a vocab-only GGUF and deletes the file
+static llama_model* load_vocab(const std::string& path) {
+    llama_model_params params = llama_model_default_params();
+    params.vocab_only = true;
+    llama_model* model = llama_model_load_from_file(path.c_str(), params);
+    std::remove(path.c_str());
+    return model;
+}
+
+// A byte-level BPE vocab learned from text: the 256 byte tokens, up to
+// BPE_MERGES merged ones and the ChatML markers as control tokens
+static bool write_bpe_vocab(const std::string& path, const std::string& pre, const std::string& text) {
+    std::map<std::string, int> word_counts;
+    for (const std::string& word : unicode_regex_split(text, llama_vocab_pre_regex_exprs(LLAMA_VOCAB_PRE_TYPE_LLAMA3))) {
+        word_counts[word]++;
+    }
+    std::vector<std::pair<std::vector<std::string>, int>> words;
+    for (const auto& [word, count] : word_counts) {
+        std::vector<std::string> symbols;
+        for (size_t i = 0; i < word.size();) {
+            const size_t n = std::min(word.size() - i, unicode_len_utf8(word[i]));
+            symbols.push_back(word.substr(i, n));
+            i += n;
+        }
+        words.emplace_back(std::move(symbols), count);
+    }
+
+    std::vector<std::string> tokens;
+    for (int byte = 0; byte < 256; byte++) {
+        tokens.push_back(unicode_byte_to_utf8((uint8_t)byte));
+    }
+    std::vector<std::string> merges;
+    for (int m = 0; m < BPE_MERGES; m++) {
+        std::map<std::pair<std::string, std::string>, int> pair_counts;
+        for (const auto& [symbols, count] : words) {
+            for (size_t i = 1; i < symbols.size(); i++) {
+                pair_counts[{symbols[i - 1], symbols[i]}] += count;
+            }
+        }
+        auto best = pair_counts.end();
+        for (auto it = pair_counts.begin(); it != pair_counts.end(); ++it) {
+            if (best == pair_counts.end() || it->second > best->second) {
+                best = it;
+            }
+        }
+        if (best == pair_counts.end()) {
+            break;
+        }
+        const auto [left, right] = best->first;
+        merges.push_back(left + " " + right);
+        if (std::find(tokens.begin(), tokens.end(), left + right) == tokens.end()) {
+            tokens.push_back(left + right);
+        }
+        for (auto& word : words) {
+            std::vector<std::string>& symbols = word.first;
+            for (size_t i = 1; i < symbols.size(); i++) {
+                if (symbols[i - 1] == left && symbols[i] == right) {
+                    symbols[i - 1] += symbols[i];
+                    symbols.erase(symbols.begin() + i);
+                }
+            }
+        }
+    }
+    std::vector<int32_t> token_types(tokens.size(), LLAMA_TOKEN_TYPE_NORMAL);
+    for (const char* special : SPECIAL_TOKENS) {
+        tokens.push_back(special);
+        token_types.push_back(LLAMA_TOKEN_TYPE_CONTROL);
+    }
+
+    std::vector<const char*> token_ptrs, merge_ptrs;
+    for (const std::string& token : tokens) {
+        token_ptrs.push_back(token.c_str());
+    }
+    for (const std::string& merge : merges) {
+        merge_ptrs.push_back(merge.c_str());
+    }
+    gguf_context* ctx = gguf_init_empty();
+    gguf_set_val_str(ctx, "general.architecture", "llama");
+    gguf_set_val_str(ctx, "tokenizer.ggml.model", "gpt2");
+    gguf_set_val_str(ctx, "tokenizer.ggml.pre", pre.c_str());
+    gguf_set_arr_str(ctx, "tokenizer.ggml.tokens", token_ptrs.data(), token_ptrs.size());
+    gguf_set_arr_data(ctx, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, token_types.data(), token_types.size());
+    gguf_set_arr_str(ctx, "tokenizer.ggml.merges", merge_ptrs.data(), merge_ptrs.size());
+    gguf_set_val_u32(ctx, "tokenizer.ggml.bos_token_id", (uint32_t)tokens.size() - 3);
+    gguf_set_val_u32(ctx, "tokenizer.ggml.eos_token_id", (uint32_t)tokens.size() - 1);
+    gguf_set_val_bool(ctx, "tokenizer.ggml.add_bos_token", true);
+    const bool ok = gguf_write_to_file(ctx, path.c_str(), false);
+    gguf_free(ctx);
+    return ok;
+}
+
+// An SPM vocab for text: <unk>, <s>, </s>, the 256 <0xXX> byte tokens,
+// printable ASCII and every prefix of "▁word" for its SPM_WORDS most frequent
+// words, longer pieces scoring higher. Anything else falls back to bytes.
+static bool write_spm_vocab(const std::string& path, const std::string& text) {
+    std::map<std::string, int> word_counts;
+    std::string word;
+    for (char c : text + " ") {
+        if (isalpha((unsigned char)c)) {
+            word += c;
+        } else if (!word.empty()) {
+            word_counts[word]++;
+            word.clear();
+        }
+    }
+    std::vector<std::pair<int, std::string>> by_count;
+    for (const auto& [w, count] : word_counts) {
+        by_count.emplace_back(-count, w);
+    }
+    std::sort(by_count.begin(), by_count.end());
+
+    std::vector<std::string> tokens = {"<unk>", "<s>", "</s>"};
+    std::vector<int32_t> token_types = {LLAMA_TOKEN_TYPE_UNKNOWN, LLAMA_TOKEN_TYPE_CONTROL, LLAMA_TOKEN_TYPE_CONTROL};
+    for (int byte = 0; byte < 256; byte++) {
+        char name[8];
+        snprintf(name, sizeof(name), "<0x%02X>", byte);
+        tokens.push_back(name);
+        token_types.push_back(LLAMA_TOKEN_TYPE_BYTE);
+    }
+    std::vector<std::string> pieces = {"\xe2\x96\x81"};  // ▁
+    for (char c = '!'; c <= '~'; c++) {
+        pieces.push_back(std::string(1, c));
+    }
+    for (size_t i = 0; i < by_count.size() && i < (size_t)SPM_WORDS; i++) {
+        const std::string piece = "\xe2\x96\x81" + by_count[i].second;
+        for (size_t n = 4; n <= piece.size(); n++) {
+            if (std::find(pieces.begin(), pieces.end(), piece.substr(0, n)) == pieces.end()) {
+                pieces.push_back(piece.substr(0, n));
+            }
+        }
+    }
+    std::vector<float> scores(tokens.size(), 0.0f);
+    for (const std::string& piece : pieces) {
+        tokens.push_back(piece);
+        token_types.push_back(LLAMA_TOKEN_TYPE_NORMAL);
+        scores.push_back((float)piece.size());
+    }
+
+    std::vector<const char*> token_ptrs;
+    for (const std::string& token : tokens) {
+        token_ptrs.push_back(token.c_str());
+    }
+    gguf_context* ctx = gguf_init_empty();
+    gguf_set_val_str(ctx, "general.architecture", "llama");
+    gguf_set_val_str(ctx, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(ctx, "tokenizer.ggml.tokens", token_ptrs.data(), token_ptrs.size());
+    gguf_set_arr_data(ctx, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(ctx, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, token_types.data(), token_types.size());
+    gguf_set_val_bool(ctx, "tokenizer.ggml.add_bos_token", true);
+    gguf_set_val_bool(ctx, "tokenizer.ggml.add_eos_token", true);
+    gguf_set_val_bool(ctx, "tokenizer.ggml.add_space_prefix", true);
+    const bool ok = gguf_write_to_file(ctx, path.c_str(), false);
+    gguf_free(ctx);
+    return ok;
+}
+
+static std::vector<llama_token> tokenize(const llama_vocab* vocab, const std::string& text, bool parse_special, int n_threads,
+                                         bool add_special = true) {
+    const int n = -llama_tokenize_parallel(vocab, text.c_str(), (int32_t)text.size(), nullptr, 0, add_special, parse_special, n_threads);
+    std::vector<llama_token> tokens(std::max(n, 0));
+    if (n > 0) {
+        llama_tokenize_parallel(vocab, text.c_str(), (int32_t)text.size(), tokens.data(), n, add_special, parse_special, n_threads);
+    }
+    return tokens;
+}
+
+// MB/s of tokenizing the document on n_threads
+static double time_tokenize(const llama_vocab* vocab, const std::string& document, int n_threads) {
+    tokenize(vocab, document, false, n_threads);
+    int reps = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto end = start;
+    do {
+        tokenize(vocab, document, false, n_threads);
+        reps++;
+        end = std::chrono::steady_clock::now();
+    } while (end - start < std::chrono::milliseconds(300));
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    return document.size() * reps / seconds / 1e6;
+}
+
+// text with every ill-formed UTF-8 subsequence dropped: a lead byte and the
+// continuation bytes that fit it go when the character is cut short
+static std::string valid_utf8(const std::string& text) {
+    std::string out;
+    for (size_t i = 0; i < text.size();) {
+        const uint8_t lead = text[i];
+        const size_t len = lead <= 0x7F ? 1 : lead >= 0xC2 && lead <= 0xDF ? 2 : lead >= 0xE0 && lead <= 0xEF ? 3
+                         : lead >= 0xF0 && lead <= 0xF4 ? 4 : 0;
+        if (len == 0) {
+            i++;
+            continue;
+        }
+        size_t n = 1;
+        while (n < len && i + n < text.size()) {
+            const uint8_t c = text[i + n];
+            const uint8_t lo = n > 1 ? 0x80 : lead == 0xE0 ? 0xA0 : lead == 0xF0 ? 0x90 : 0x80;
+            const uint8_t hi = n > 1 ? 0xBF : lead == 0xED ? 0x9F : lead == 0xF4 ? 0x8F : 0xBF;
+            if (c < lo || c > hi) {
+                break;
+            }
+            n++;
+        }
+        if (n == len) {
+            out.append(text, i, len);
+        }
+        i += n;
+    }
+    return out;
+}
+
+static std::string detokenize(const llama_vocab* vocab, const std::vector<llama_token>& tokens,
+                              bool remove_special, bool unparse_special) {
+    std::string text(tokens.size() * 4 + 16, '\0');
+    int n = llama_detokenize(vocab, tokens.data(), (int32_t)tokens.size(), &text[0], (int32_t)text.size(),
+                             remove_special, unparse_special);
+    if (n < 0) {
+        text.resize(-n);
+        n = llama_detokenize(vocab, tokens.data(), (int32_t)tokens.size(), &text[0], (int32_t)text.size(),
+                             remove_special, unparse_special);
+    }
+    text.resize(std::max(n, 0));
+    return text;
+}
+
+// The tokens pushed one at a time. With rng, every push first gets a buffer of
+// 0-3 bytes and is retried with the size a negative return asks for.
+static std::string detokenize_streamed(llama_detokenizer* detok, const std::vector<llama_token>& tokens,
+                                       std::mt19937* rng) {
+    llama_detokenizer_reset(detok);
+    std::string text;
+    std::vector<char> buf(256);
+    for (llama_token token : tokens) {
+        int32_t length = (int32_t)buf.size();
+        if (rng != nullptr) {
+            length = std::uniform_int_distribution<int32_t>(0, 3)(*rng);
+        }
+        int32_t n = llama_detokenizer_push(detok, token, buf.data(), length);
+        if (n < 0) {
+            buf.resize(std::max(buf.size(), (size_t)-n));
+            n = llama_detokenizer_push(detok, token, buf.data(), -n);
+        }
+        text.append(buf.data(), std::max(n, 0));
+    }
+    return text;
+}
+
+// Streamed against llama_detokenize for texts tokenized with and without BOS
+// and closed with EOS; returns the number of differing streams
+static int check_detokenizer(const std::string& name, const llama_vocab* vocab, const std::vector<std::string>& texts,
+                             std::mt19937& rng) {
+    int n_mismatches = 0;
+    for (bool remove_special : {false, true}) {
+        for (bool unparse_special : {false, true}) {
+            llama_detokenizer* detok = llama_detokenizer_init(vocab, remove_special, unparse_special);
+            for (size_t i = 0; i < texts.size() * 2; i++) {
+                // Without BOS the first piece loses its space prefix
+                std::vector<llama_token> tokens = tokenize(vocab, texts[i / 2], true, 1, i % 2 == 0);
+                if (tokens.empty() || tokens.back() != llama_vocab_eos(vocab)) {
+                    tokens.push_back(llama_vocab_eos(vocab));
+                }
+                const std::string expected = valid_utf8(detokenize(vocab, tokens, remove_special, unparse_special));
+                const bool same = detokenize_streamed(detok, tokens, nullptr) == expected &&
+                                  detokenize_streamed(detok, tokens, &rng) == expected;
+                if (!same && n_mismatches++ == 0) {
+                    fprintf(stderr, "%s: streamed detokenization differs on text %zu%s (remove_special %d, unparse_special %d)\n",
+                            name.c_str(), i / 2, i % 2 ? " without BOS" : "", remove_special, unparse_special);
+                }
+            }
+            llama_detokenizer_free(detok);
+        }
+    }
+    return n_mismatches;
+}
+
+// Serial and parallel tokenization of the corpus for a vocab learned from the
+// document with the given pre-tokenizer, and the streaming detokenizer over
+// detok_texts; the number of differing texts goes to mismatches
+static json check_parallel_tokenize(const std::string& pre, const std::string& document,
+                                    const std::vector<std::string>& corpus, const std::vector<std::string>& detok_texts,
+                                    int n_threads, std::mt19937& rng, int& mismatches) {
+    json result;
+    result["pre"] = pre;
+    const std::string path = temp_path(pre);
+    if (!write_bpe_vocab(path, pre, document)) {
+        fprintf(stderr, "%s: failed to write %s\n", pre.c_str(), path.c_str());
+        mismatches++;
+        return result;
+    }
+    llama_model* model = load_vocab(path);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load the learned vocab\n", pre.c_str());
+        mismatches++;
+        return result;
+    }
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+
+    int pre_mismatches = 0;
+    for (size_t i = 0; i < corpus.size(); i++) {
+        for (bool parse_special : {false, true}) {
+            const std::vector<llama_token> serial = tokenize(vocab, corpus[i], parse_special, 1);
+            for (int threads : {2, 3, 4, 8}) {
+                if (tokenize(vocab, corpus[i], parse_special, threads) != serial && pre_mismatches++ == 0) {
+                    fprintf(stderr, "%s: corpus text %zu (%zu bytes) tokenizes differently on %d threads\n",
+                            pre.c_str(), i, corpus[i].size(), threads);
+                }
+            }
+        }
+    }
+    mismatches += pre_mismatches;
+
+    result["tokens"] = tokenize(vocab, document, false, 1).size();
+    result["serial_mb_s"] = time_tokenize(vocab, document, 1);
+    result["parallel_mb_s"] = time_tokenize(vocab, document, n_threads);
+    result["threads"] = n_threads;
+    result["mismatches"] = pre_mismatches;
+
+    // llama_detokenize applies clean_up_tokenization_spaces, the detokenizer does not
+    if (vocab->get_clean_spaces()) {
+        result["detokenize"] = "skipped: clean_up_tokenization_spaces";
+    } else {
+        const int detok_mismatches = check_detokenizer(pre, vocab, detok_texts, rng);
+        result["detokenize_mismatches"] = detok_mismatches;
+        mismatches += detok_mismatches;
+    }
+    llama_model_free(model);
+    return result;
+}
+
+// The streaming detokenizer on an SPM vocab learned from the document
+static json check_spm_detokenizer(const std::string& document, const std::vector<std::string>& detok_texts,
+                                  std::mt19937& rng, int& mismatches) {
+    json result;
+    result["vocab"] = "spm";
+    const std::string path = temp_path("spm");
+    llama_model* model = write_spm_vocab(path, document) ? load_vocab(path) : nullptr;
+    if (model == nullptr) {
+        fprintf(stderr, "spm: failed to build the vocab\n");
+        mismatches++;
+        return result;
+    }
+    const int detok_mismatches = check_detokenizer("spm", llama_model_get_vocab(model), detok_texts, rng);
+    result["detokenize_mismatches"] = detok_mismatches;
+    mismatches += detok_mismatches;
+    llama_model_free(model);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    int iters = 2000;
+    uint32_t seed = 42;
+    std::string output_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "usage: %s [--iters n] [--seed n] [-o result.json]\n", argv[0]);
+            return 1;
+        } else if (arg == "--iters") {
+            iters = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--seed") {
+            seed = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            output_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--iters n] [--seed n] [-o result.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(seed);
+    std::vector<std::string> fuzz;
+    for (int i = 0; i < iters; i++) {
+        fuzz.push_back(make_fuzz_string(rng));
+    }
+    const std::string document = make_document(rng);
+
+    json report;
+    report["iters"] = iters;
+    report["document_bytes"] = document.size();
+    json results = json::array();
+    int n_mismatches = 0;
+
+    for (int type = LLAMA_VOCAB_PRE_TYPE_DEFAULT; type <= LLAMA_VOCAB_PRE_TYPE_EXAONE_MOE; type++) {
+        const std::vector<std::string> regex_exprs = llama_vocab_pre_regex_exprs((llama_vocab_pre_type)type);
+
+        json result;
+        result["pre_type"] = type;
+        int type_mismatches = 0;
+        for (const std::string& text : fuzz) {
+            if (split(text, regex_exprs, true) != split(text, regex_exprs, false)) {
+                if (type_mismatches++ == 0) {
+                    fprintf(stderr, "pre type %d: compiled and std::regex splits differ on \"%s\"\n", type, text.c_str());
+                }
+            }
+        }
+        n_mismatches += type_mismatches;
+
+        std::vector<std::string> compiled_words, regex_words;
+        result["std_regex_mb_s"] = time_split(document, regex_exprs, false, regex_words);
+        result["compiled_mb_s"] = time_split(document, regex_exprs, true, compiled_words);
+        result["words"] = compiled_words.size();
+        if (compiled_words != regex_words) {
+            fprintf(stderr, "pre type %d: compiled and std::regex splits differ on the document\n", type);
+            type_mismatches++;
+            n_mismatches++;
+        }
+        result["mismatches"] = type_mismatches;
+        results.push_back(result);
+    }
+
+    report["results"] = results;
+
+    // Corpus for parallel tokenization: the texts are long enough to take the parallel path
+    std::string joined;
+    for (size_t i = 0; i < fuzz.size(); i++) {
+        joined += fuzz[i];
+        if (i % 50 == 49) {
+            joined += SPECIAL_TOKENS[i / 50 % 3];
+        }
+    }
+    std::vector<std::string> corpus = {
+        document,
+        std::string(SPECIAL_TOKENS[0]) + SPECIAL_TOKENS[1] + "system\n" + document.substr(0, document.size() / 3) +
+            SPECIAL_TOKENS[2] + "\n" + SPECIAL_TOKENS[1] + "user\n" + document.substr(document.size() / 3) +
+            SPECIAL_TOKENS[2] + "\n" + SPECIAL_TOKENS[1] + "assistant\n",
+        joined,
+    };
+    for (int i = 0; i < TOKENIZE_SLICES; i++) {
+        // Cut anywhere, including inside a character or a special token
+        const size_t length = std::uniform_int_distribution<size_t>(std::min<size_t>(8 * 1024, joined.size()), joined.size())(rng);
+        const size_t offset = std::uniform_int_distribution<size_t>(0, joined.size() - length)(rng);
+        corpus.push_back(joined.substr(offset, length));
+    }
+
+    llama_log_set([](ggml_log_level, const char*, void*) {}, nullptr);
+    const int n_threads = (int)std::clamp(std::thread::hardware_concurrency(), 2u, 4u);
+    // Short texts put the first-token and BOS handling to work; the corpus the byte fallback
+    std::vector<std::string> detok_texts(fuzz.begin(), fuzz.begin() + std::min<size_t>(fuzz.size(), 500));
+    detok_texts.insert(detok_texts.end(), corpus.begin(), corpus.end());
+    json tokenize_results = json::array();
+    for (const char* pre : TOKENIZE_PRE_TYPES) {
+        tokenize_results.push_back(check_parallel_tokenize(pre, document, corpus, detok_texts, n_threads, rng, n_mismatches));
+    }
+    tokenize_results.push_back(check_spm_detokenizer(document, detok_texts, rng, n_mismatches));
+    report["tokenize"] = tokenize_results;
+    report["mismatches"] = n_mismatches;
+
+    const std::string output = report.dump(2);
+    if (output_path.empty()) {
+        printf("%s\n", output.c_str());
+    } else {
+        std::ofstream out(output_path);
+        out << output << "\n";
+        if (!out) {
+            fprintf(stderr, "Failed to write %s\n", output_path.c_str());
+            return 1;
+        }
+    }
+    if (n_mismatches > 0) {
+        fprintf(stderr, "%d mismatches in pre-tokenization, parallel tokenization or streamed detokenization\n", n_mismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// Logging for the inference core and the JNI bridge: logcat on Android,
+// stderr everywhere else (host benchmark, CI)
+
+#ifndef LOG_TAG
+#define LOG_TAG "LlamaJNI"
+#endif
+
+#ifdef __ANDROID__
+
+#include <android/log.h>
+
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+
+#else
+
+enum EngineLogLevel {
+    ENGINE_LOG_DEBUG = 0,
+    ENGINE_LOG_INFO,
+    ENGINE_LOG_WARN,
+    ENGINE_LOG_ERROR,
+};
+
+// Messages below the level set by engine_set_log_level are dropped
+void engine_log(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void engine_set_log_level(int level);
+
+#define LOGI(...) engine_log(ENGINE_LOG_INFO, __VA_ARGS__)
+#define LOGE(...) engine_log(ENGINE_LOG_ERROR, __VA_ARGS__)
+#define LOGD(...) engine_log(ENGINE_LOG_DEBUG, __VA_ARGS__)
+#define LOGW(...) engine_log(ENGINE_LOG_WARN, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,3911 @@
+#include "inference-engine.h"
+#include "engine-log.h"
+#include "sampling-kernels.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <chrono>
+#include <errno.h>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <climits>
+#include <algorithm>
+#include <cmath>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Include real llama.cpp headers
+#include "llama.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
+#include "ngram-cache.h"
+
+// Global state (protected by mutex)
+static std::mutex g_mutex;
+static llama_model* g_model = nullptr;
+static llama_context* g_context = nullptr;
+static const llama_vocab* g_vocab = nullptr;
+static bool g_initialized = false;
+
+// Optional draft model for speculative decoding (same vocabulary, a fraction of the size).
+// With early exit it is g_model itself, run through its first g_early_exit_layer layers.
+static llama_model* g_draft_model = nullptr;
+static llama_context* g_draft_context = nullptr;
+static int g_early_exit_layer = 0;
+
+// Text embeddings: a context of their own, on the chat model or a dedicated
+// embedding GGUF. g_embed_mutex is taken after g_mutex, never before it.
+static std::mutex g_embed_calls_mutex;           // one engine_embed at a time, taken before g_mutex
+static std::mutex g_embed_mutex;
+static std::string g_embed_model_path;          // dedicated model, empty = the chat model
+static llama_model* g_embed_model = nullptr;    // dedicated model, loaded on first use
+static llama_context* g_embed_context = nullptr;
+static std::atomic<bool> g_embed_stop{false};   // an unload is waiting for the embedding
+
+// Recurrent/hybrid models (LFM2) cannot truncate their recurrent state in the
+// middle of a sequence, so we snapshot it at turn boundaries and roll back to
+// the newest snapshot that is still a prefix of the new prompt.
+struct SessionCheckpoint {
+    int n_tokens;
+    std::vector<uint8_t> data;
+};
+static const size_t MAX_SESSION_CHECKPOINTS = 4;
+
+// On-disk prompt snapshot store (set via engine_set_prompt_cache_dir)
+static std::string g_snapshot_dir;
+static size_t g_snapshot_max_bytes = 64 * 1024 * 1024;
+static uint64_t g_model_hash = 0;
+
+// Per-user n-gram statistics (set via engine_set_ngram_cache_dir)
+static std::string g_ngram_dir;
+static uint64_t g_vocab_hash = 0;
+static common_ngram_cache g_ngram_dynamic;
+static bool g_ngram_dirty = false;
+static const size_t MAX_NGRAM_ENTRIES = 256 * 1024;
+
+// Generation sessions: cancellation handles owned by the caller. Cancelling never
+// takes g_mutex or blocks on the scheduler.
+struct GenerationSession {
+    std::atomic<bool> cancelled{false};
+};
+static std::mutex g_sessions_mutex;
+static std::unordered_map<int64_t, std::shared_ptr<GenerationSession>> g_sessions;
+static int64_t g_next_session_id = 1;
+
+// Generation parameters
+struct GenerationParams {
+    int maxTokens = 256;
+    float temperature = 0.7f;
+    int topK = 40;
+    float topP = 0.9f;
+    float minP = 0.05f;
+    int nThreads = 4;
+    int ctxSize = 2048;
+    int nDraft = 0;  // prompt-lookup draft tokens per step (0 = off)
+};
+
+static GenerationParams g_params;
+
+struct GenerationRequest {
+    std::vector<llama_token> prompt_tokens;
+    std::vector<int> checkpoint_at;  // token counts to snapshot recurrent state at
+    int n_snapshot_prefix = 0;       // prefix to persist on disk (0 = none)
+    int max_tokens = 256;
+    float temperature = 0.7f;
+    uint32_t seed = LLAMA_DEFAULT_SEED;
+    int n_draft = 0;                 // prompt-lookup speculation (0 = plain decoding)
+    int n_discarded = 0;             // tokens cut after the system prompt to fit the context
+    int user_begin = 0;              // latest user message within prompt_tokens,
+    int user_end = 0;                // learned into the n-gram cache
+};
+
+// A request in flight. The scheduler thread fills in text/result, the
+// submitting thread waits on cv and forwards the pieces to its callback (a
+// JNIEnv is per-thread, so callbacks cannot be made from the scheduler).
+struct GenerationTask {
+    GenerationRequest request;
+    std::shared_ptr<GenerationSession> session;
+    bool stream = false;              // caller wants pieces as they are sampled
+    bool report_prefill = false;      // caller wants n_prefilled as chunks finish
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string text;                 // generated text not yet handed to the caller
+    std::vector<int> piece_lengths;   // ... split into the pieces of the tokens that produced it
+    int n_prefilled = 0;              // prompt tokens in the KV cache (reused or prefilled)
+    bool done = false;
+    GenerationResult result;          // owned by the scheduler until done
+
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point first_token_time;
+};
+
+// =============================================================================
+// Sampling - scheduler thread
+// =============================================================================
+// The usual configuration (top_k of a few dozen) is sampled by a fused path
+// straight from the raw logits. Everything else goes through llama_sampler
+// chains that are pooled per configuration and reused via llama_sampler_reset.
+
+struct SamplerConfig {
+    int top_k = 40;
+    float top_p = 1.0f;
+    float min_p = 0.0f;
+    float temp = 0.7f;
+    uint32_t seed = LLAMA_DEFAULT_SEED;  // LLAMA_DEFAULT_SEED = random
+
+    bool operator==(const SamplerConfig& other) const {
+        return top_k == other.top_k && top_p == other.top_p && min_p == other.min_p &&
+               temp == other.temp && seed == other.seed;
+    }
+};
+
+// Largest top_k the fused path handles; beyond that a full sort is no worse
+static const int MAX_FUSED_TOP_K = 128;
+
+static bool sampler_config_is_fused(const SamplerConfig& config) {
+    return config.temp <= 0.0f || (config.top_k > 0 && config.top_k <= MAX_FUSED_TOP_K);
+}
+
+// Fused top_k -> top_p -> min_p -> temperature -> draw over the raw logits.
+// select_top_k keeps the k best logits in a min-heap, so no llama_token_data
+// entry is built (let alone sorted) for the other ~65k vocabulary tokens.
+static llama_token sample_fused(const float* logits, int n_vocab, const SamplerConfig& config,
+                                std::mt19937& rng, std::vector<llama_token_data>& top) {
+    const int k = config.temp <= 0.0f ? 1 : std::min(config.top_k, n_vocab);
+    select_top_k(logits, n_vocab, k, top);
+
+    if (k == 1) {
+        return top[0].id;  // Greedy
+    }
+
+    // top_p and min_p see the distribution at temperature 1 (p relative to the best token)
+    const float max_logit = top[0].logit;
+    float sum = 0.0f;
+    for (llama_token_data& candidate : top) {
+        candidate.p = expf(candidate.logit - max_logit);
+        sum += candidate.p;
+    }
+
+    size_t n_keep = top.size();
+    if (config.top_p < 1.0f) {
+        float cum_sum = 0.0f;
+        for (size_t i = 0; i < top.size(); i++) {
+            cum_sum += top[i].p / sum;
+            if (cum_sum >= config.top_p) {
+                n_keep = i + 1;
+                break;
+            }
+        }
+    }
+    if (config.min_p > 0.0f) {
+        size_t i = 1;
+        while (i < n_keep && top[i].p >= config.min_p) {
+            i++;
+        }
+        n_keep = i;
+    }
+
+    float total = 0.0f;
+    for (size_t i = 0; i < n_keep; i++) {
+        top[i].p = expf((top[i].logit - max_logit) / config.temp);
+        total += top[i].p;
+    }
+    float r = std::uniform_real_distribution<float>(0.0f, total)(rng);
+    for (size_t i = 0; i < n_keep; i++) {
+        r -= top[i].p;
+        if (r < 0.0f) {
+            return top[i].id;
+        }
+    }
+    return top[n_keep - 1].id;
+}
+
+// Idle chains per configuration, least recently used configuration dropped first
+struct SamplerPoolEntry {
+    SamplerConfig config;
+    std::vector<llama_sampler*> idle;
+    int64_t last_used = 0;
+};
+static std::vector<SamplerPoolEntry> g_sampler_pool;
+static int64_t g_sampler_clock = 0;
+static const size_t MAX_SAMPLER_POOL_CONFIGS = 8;
+
+static llama_sampler* acquire_sampler_chain(const SamplerConfig& config) {
+    for (SamplerPoolEntry& entry : g_sampler_pool) {
+        if (entry.config == config && !entry.idle.empty()) {
+            llama_sampler* smpl = entry.idle.back();
+            entry.idle.pop_back();
+            entry.last_used = ++g_sampler_clock;
+            return smpl;
+        }
+    }
+
+    llama_sampler* smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    if (config.top_k > 0) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(config.top_k));
+    }
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(config.top_p, 1));
+    if (config.min_p > 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_min_p(config.min_p, 1));
+    }
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(config.temp));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(config.seed));
+    return smpl;
+}
+
+// Reset (which also reseeds dist) and keep the chain for the next request
+static void release_sampler_chain(const SamplerConfig& config, llama_sampler* smpl) {
+    llama_sampler_reset(smpl);
+
+    SamplerPoolEntry* target = nullptr;
+    for (SamplerPoolEntry& entry : g_sampler_pool) {
+        if (entry.config == config) {
+            target = &entry;
+            break;
+        }
+    }
+    if (target == nullptr) {
+        if (g_sampler_pool.size() >= MAX_SAMPLER_POOL_CONFIGS) {
+            auto oldest = std::min_element(g_sampler_pool.begin(), g_sampler_pool.end(),
+                [](const SamplerPoolEntry& a, const SamplerPoolEntry& b) { return a.last_used < b.last_used; });
+            for (llama_sampler* idle : oldest->idle) {
+                llama_sampler_free(idle);
+            }
+            g_sampler_pool.erase(oldest);
+        }
+        g_sampler_pool.emplace_back();
+        target = &g_sampler_pool.back();
+        target->config = config;
+    }
+    target->idle.push_back(smpl);
+    target->last_used = ++g_sampler_clock;
+}
+
+static void clear_sampler_pool() {
+    for (SamplerPoolEntry& entry : g_sampler_pool) {
+        for (llama_sampler* smpl : entry.idle) {
+            llama_sampler_free(smpl);
+        }
+    }
+    g_sampler_pool.clear();
+}
+
+// =============================================================================
+// Sequence slots
+// =============================================================================
+// Each concurrent request (interactive chat, proactive messages, note
+// summaries) gets its own llama_seq_id, and all of them advance together in
+// one llama_batch per step. On a bandwidth-bound phone CPU decoding 2-4
+// sequences costs little more than one. Idle slots keep their token history
+// in the KV cache so a follow-up request can reuse the prefix.
+static const int N_SEQUENCE_SLOTS = 4;
+
+struct SequenceSlot {
+    llama_seq_id seq_id = 0;
+    std::vector<llama_token> tokens;             // KV history of this sequence, in position order
+    std::vector<SessionCheckpoint> checkpoints;
+    int64_t last_used = 0;                       // LRU clock for evicting idle histories
+
+    std::shared_ptr<GenerationTask> task;        // null when idle
+    SamplerConfig sampling;
+    llama_sampler* sampler = nullptr;            // pooled chain, null on the fused path
+    std::mt19937 rng;                            // fused path RNG
+    std::vector<llama_token_data> candidates;    // fused path top-k scratch
+    llama_detokenizer* detokenizer = nullptr;    // generated tokens to whole UTF-8 characters
+    std::vector<char> piece = std::vector<char>(256);  // detokenizer output, grown if a piece needs it
+    llama_token pending_token = -1;              // sampled, to be decoded next step (-1 = prefilling)
+    int i_batch = -1;                            // logits row in the current batch
+    int n_batch_tokens = 0;                      // tokens this slot put in the current batch
+
+    // Prompt-lookup speculation
+    std::vector<llama_token> generated;          // reply so far
+    std::vector<llama_token> spec_inp;           // prompt + generated tokens, for n-gram lookup
+    common_ngram_cache ngram_context;            // n-grams of spec_inp
+    std::vector<llama_token> draft;              // drafted tokens in the current batch
+    std::vector<llama_token> replay;             // accepted tokens to decode again after a recurrent rollback
+    std::vector<uint8_t> spec_state;             // recurrent state before the current batch
+    int spec_n_past = 0;                         // history length spec_state belongs to
+
+    // Draft-model speculation
+    std::vector<llama_token> dft_tokens;         // what this sequence holds in the draft context
+    std::vector<uint8_t> dft_state;              // recurrent draft state after dft_state_n tokens
+    int dft_state_n = -1;
+    float dft_accepted = 0.0f;                   // drafts accepted per step, moving average
+    int dft_i_batch = -1;                        // logits row in the current draft batch
+    int dft_n_max = 0;                           // draft length this step
+
+    std::vector<uint8_t> parked;                 // sequence state while the context is released
+
+    // Context shift: tokens = prompt[0, shift_keep) + prompt[shift_keep + n_discarded, ...)
+    int shift_keep = 0;                          // prefix never evicted (system prompt)
+    int n_discarded = 0;                         // tokens evicted right after it
+};
+
+static SequenceSlot g_slots[N_SEQUENCE_SLOTS];
+static int64_t g_slot_clock = 0;
+
+static const int MAX_DRAFT_TOKENS = 16;
+
+// Draft model: stop drafting when its top token is less likely than this, and
+// size the draft one past the recent number of accepted tokens
+static const float DRAFT_P_MIN = 0.75f;
+static const float DRAFT_EMA_ALPHA = 0.3f;
+static const float DRAFT_INITIAL_ACCEPTED = 3.0f;
+static const int DRAFT_N_BATCH = 512;
+static llama_batch g_draft_batch;
+
+// No corpus-level n-gram statistics on device; drafts come from the context and user caches
+static common_ngram_cache g_ngram_empty;
+
+// Lifetime speculation counters, for engine_get_speculative_stats
+static std::atomic<int64_t> g_spec_drafted{0};
+static std::atomic<int64_t> g_spec_accepted{0};
+
+// Scheduler thread state
+static std::thread g_scheduler_thread;
+static std::mutex g_queue_mutex;
+static std::condition_variable g_queue_cv;
+static std::deque<std::shared_ptr<GenerationTask>> g_task_queue;
+static bool g_scheduler_running = false;
+static std::atomic<bool> g_scheduler_stop{false};
+static llama_batch g_batch;
+
+// Sessions taking part in the llama_decode currently running (scheduler thread only)
+static std::vector<GenerationSession*> g_step_sessions;
+
+// ggml_abort_callback: stop a step in the middle of the compute graph once
+// every request in it has been cancelled (or the model is being unloaded)
+static bool abort_callback(void* /* data */) {
+    if (g_scheduler_stop.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if (g_step_sessions.empty()) {
+        return false;
+    }
+    for (GenerationSession* session : g_step_sessions) {
+        if (!session->cancelled.load(std::memory_order_relaxed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::shared_ptr<GenerationSession> find_generation_session(int64_t id) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(id);
+    return it != g_sessions.end() ? it->second : nullptr;
+}
+
+// =============================================================================
+// Slot (KV cache) helpers - scheduler thread, or g_mutex with the scheduler stopped
+// =============================================================================
+
+// Threads a long prompt (notes, web pages) is tokenized on; prefill cannot
+// start before the whole prompt is tokenized
+static const int TOKENIZE_MAX_THREADS = 4;
+
+static int tokenize_threads() {
+    static const int n = (int)std::clamp(std::thread::hardware_concurrency(), 1u, (unsigned)TOKENIZE_MAX_THREADS);
+    return n;
+}
+
+// Tokenize text and append the result to out. Tokens rarely outnumber bytes,
+// so a single call usually does.
+static bool tokenize_append(std::vector<llama_token>& out, const std::string& text,
+                            bool add_special, bool parse_special) {
+    const size_t offset = out.size();
+    int n_max = (int)text.length() + 4;  // BOS, EOS, space prefix
+    out.resize(offset + n_max);
+    int n = llama_tokenize_parallel(g_vocab, text.c_str(), text.length(), out.data() + offset, n_max,
+                                    add_special, parse_special, tokenize_threads());
+    if (n < 0 && n != INT32_MIN) {
+        n_max = -n;
+        out.resize(offset + n_max);
+        n = llama_tokenize_parallel(g_vocab, text.c_str(), text.length(), out.data() + offset, n_max,
+                                    add_special, parse_special, tokenize_threads());
+    }
+    out.resize(offset + std::max(n, 0));
+    return n >= 0;
+}
+
+static bool session_needs_checkpoints() {
+    return llama_model_is_recurrent(g_model) || llama_model_is_hybrid(g_model);
+}
+
+// Drop everything in the slot's sequence and forget its token history
+static void reset_slot(SequenceSlot& slot) {
+    if (g_context) {
+        llama_memory_seq_rm(llama_get_memory(g_context), slot.seq_id, -1, -1);
+    }
+    if (g_draft_context) {
+        llama_memory_seq_rm(llama_get_memory(g_draft_context), slot.seq_id, -1, -1);
+    }
+    slot.tokens.clear();
+    slot.checkpoints.clear();
+    slot.dft_tokens.clear();
+    slot.dft_state_n = -1;
+    slot.n_discarded = 0;
+}
+
+// Snapshot the recurrent part of the slot's sequence at the current end of its history
+static void save_slot_checkpoint(SequenceSlot& slot) {
+    int n_tokens = (int)slot.tokens.size();
+    if (!slot.checkpoints.empty() && slot.checkpoints.back().n_tokens == n_tokens) {
+        return;
+    }
+
+    size_t size = llama_state_seq_get_size_ext(g_context, slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+    SessionCheckpoint checkpoint;
+    checkpoint.n_tokens = n_tokens;
+    checkpoint.data.resize(size);
+    if (llama_state_seq_get_data_ext(g_context, checkpoint.data.data(), size, slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) != size) {
+        LOGW("Failed to snapshot seq %d state at %d tokens", slot.seq_id, n_tokens);
+        return;
+    }
+
+    if (slot.checkpoints.size() >= MAX_SESSION_CHECKPOINTS) {
+        slot.checkpoints.erase(slot.checkpoints.begin());
+    }
+    slot.checkpoints.push_back(std::move(checkpoint));
+    LOGD("Saved seq %d checkpoint at %d tokens (%zu bytes)", slot.seq_id, n_tokens, size);
+}
+
+// Truncate the slot's sequence to at most n_keep tokens. Returns how many tokens
+// are actually still cached, which can be less than n_keep when the recurrent
+// state has to fall back to an older checkpoint (or to an empty sequence).
+static int rewind_slot(SequenceSlot& slot, int n_keep) {
+    if (n_keep >= (int)slot.tokens.size()) {
+        return (int)slot.tokens.size();
+    }
+
+    llama_memory_t mem = llama_get_memory(g_context);
+
+    int n_kept = -1;
+    if (llama_memory_seq_rm(mem, slot.seq_id, n_keep, -1)) {
+        n_kept = n_keep;
+    } else {
+        // Recurrent state refused a partial removal - restore the newest checkpoint that fits
+        for (auto it = slot.checkpoints.rbegin(); it != slot.checkpoints.rend(); ++it) {
+            if (it->n_tokens > n_keep) {
+                continue;
+            }
+            if (llama_state_seq_set_data_ext(g_context, it->data.data(), it->data.size(), slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) == 0) {
+                LOGW("Failed to restore seq %d checkpoint at %d tokens", slot.seq_id, it->n_tokens);
+                break;
+            }
+            if (llama_memory_seq_rm(mem, slot.seq_id, it->n_tokens, -1)) {
+                n_kept = it->n_tokens;
+            }
+            break;
+        }
+    }
+
+    if (n_kept < 0) {
+        reset_slot(slot);
+        return 0;
+    }
+
+    slot.tokens.resize(n_kept);
+    while (!slot.checkpoints.empty() && slot.checkpoints.back().n_tokens > n_kept) {
+        slot.checkpoints.pop_back();
+    }
+    if (n_kept <= slot.shift_keep) {
+        slot.n_discarded = 0;
+    }
+    return n_kept;
+}
+
+static int common_prefix_length(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return (int)n;
+}
+
+// =============================================================================
+// Persistent prompt snapshots - scheduler thread, or g_mutex with the scheduler stopped
+// =============================================================================
+// The KV state of a formatted system prompt is written to
+// <dir>/<model hash>-<prefix hash>.kvs so it survives process restarts and
+// nativeFreeModel. File mtime doubles as the LRU timestamp.
+
+static uint64_t fnv1a64(const void* data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Identify the model file and the KV layout without reading the whole GGUF
+static uint64_t compute_model_hash(const char* path, const llama_context_params& ctx_params) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    uint64_t hash = fnv1a64(&st.st_size, sizeof(st.st_size));
+    hash = fnv1a64(&st.st_mtime, sizeof(st.st_mtime), hash);
+    uint64_t n_params = llama_model_n_params(g_model);
+    hash = fnv1a64(&n_params, sizeof(n_params), hash);
+    hash = fnv1a64(&ctx_params.type_k, sizeof(ctx_params.type_k), hash);
+    hash = fnv1a64(&ctx_params.type_v, sizeof(ctx_params.type_v), hash);
+    // V is stored transposed without flash attention
+    hash = fnv1a64(&ctx_params.flash_attn_type, sizeof(ctx_params.flash_attn_type), hash);
+    return hash;
+}
+
+static std::string snapshot_path(const llama_token* tokens, int n_tokens) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016" PRIx64 "-%016" PRIx64 ".kvs",
+             g_model_hash, fnv1a64(tokens, n_tokens * sizeof(llama_token)));
+    return g_snapshot_dir + name;
+}
+
+// Delete least recently used snapshots until the directory fits the byte budget
+static void evict_prompt_snapshots() {
+    DIR* dir = opendir(g_snapshot_dir.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+
+    struct SnapshotFile {
+        std::string path;
+        size_t size;
+        time_t mtime;
+    };
+    std::vector<SnapshotFile> files;
+    size_t total_bytes = 0;
+
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".kvs") != 0) {
+            continue;
+        }
+        std::string path = g_snapshot_dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            files.push_back({path, (size_t)st.st_size, st.st_mtime});
+            total_bytes += st.st_size;
+        }
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end(), [](const SnapshotFile& a, const SnapshotFile& b) {
+        return a.mtime < b.mtime;
+    });
+
+    for (const auto& file : files) {
+        if (total_bytes <= g_snapshot_max_bytes) {
+            break;
+        }
+        if (unlink(file.path.c_str()) == 0) {
+            total_bytes -= file.size;
+            LOGI("Evicted prompt snapshot %s (%zu bytes)", file.path.c_str(), file.size);
+        }
+    }
+}
+
+// Write the slot's whole history (which must be exactly the prefix to key on) to disk
+static void save_prompt_snapshot(const SequenceSlot& slot) {
+    if (g_snapshot_dir.empty() || slot.tokens.empty()) {
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::string path = snapshot_path(slot.tokens.data(), (int)slot.tokens.size());
+    std::string tmp_path = path + ".tmp";
+    size_t n_bytes = llama_state_seq_save_file(g_context, tmp_path.c_str(), slot.seq_id,
+                                               slot.tokens.data(), slot.tokens.size());
+    if (n_bytes == 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGW("Failed to write prompt snapshot %s", path.c_str());
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    LOGI("✓ Saved prompt snapshot: %zu tokens, %zu bytes in %lldms",
+         slot.tokens.size(), n_bytes, (long long)ms);
+
+    evict_prompt_snapshots();
+}
+
+// Replace the slot's history with a snapshot file. On failure the slot is empty.
+static bool load_prompt_snapshot(SequenceSlot& slot, const std::string& path) {
+    reset_slot(slot);
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<llama_token> tokens(llama_n_ctx(g_context));
+    size_t n_tokens = 0;
+    if (llama_state_seq_load_file(g_context, path.c_str(), slot.seq_id, tokens.data(), tokens.size(), &n_tokens) == 0) {
+        LOGW("Discarding unreadable prompt snapshot %s", path.c_str());
+        reset_slot(slot);
+        unlink(path.c_str());
+        return false;
+    }
+
+    tokens.resize(n_tokens);
+    slot.tokens = std::move(tokens);
+    if (session_needs_checkpoints()) {
+        save_slot_checkpoint(slot);
+    }
+
+    // Mark as most recently used
+    utime(path.c_str(), nullptr);
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    LOGI("✓ Restored prompt snapshot into seq %d: %zu tokens in %lldms", slot.seq_id, n_tokens, (long long)ms);
+    return true;
+}
+
+// Load the snapshot for exactly this token prefix, if one exists
+static bool restore_prompt_snapshot(SequenceSlot& slot, const llama_token* tokens, int n_tokens) {
+    if (g_snapshot_dir.empty() || n_tokens <= 0) {
+        return false;
+    }
+
+    std::string path = snapshot_path(tokens, n_tokens);
+    if (access(path.c_str(), R_OK) != 0 || !load_prompt_snapshot(slot, path)) {
+        return false;
+    }
+
+    // Guard against hash collisions
+    if (slot.tokens.size() != (size_t)n_tokens ||
+        !std::equal(slot.tokens.begin(), slot.tokens.end(), tokens)) {
+        LOGW("Prompt snapshot token mismatch, ignoring %s", path.c_str());
+        reset_slot(slot);
+        return false;
+    }
+    return true;
+}
+
+// Warm a slot with the most recently used snapshot for the loaded model
+static void restore_latest_prompt_snapshot(SequenceSlot& slot) {
+    if (g_snapshot_dir.empty()) {
+        return;
+    }
+
+    DIR* dir = opendir(g_snapshot_dir.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+
+    char model_prefix[32];
+    snprintf(model_prefix, sizeof(model_prefix), "%016" PRIx64 "-", g_model_hash);
+
+    std::string latest_path;
+    time_t latest_mtime = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.rfind(model_prefix, 0) != 0 || name.size() < 4 ||
+            name.compare(name.size() - 4, 4, ".kvs") != 0) {
+            continue;
+        }
+        std::string path = g_snapshot_dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && (latest_path.empty() || st.st_mtime > latest_mtime)) {
+            latest_path = path;
+            latest_mtime = st.st_mtime;
+        }
+    }
+    closedir(dir);
+
+    if (!latest_path.empty()) {
+        load_prompt_snapshot(slot, latest_path);
+    }
+}
+
+// =============================================================================
+// Persistent n-gram statistics - scheduler thread, or g_mutex with the scheduler stopped
+// =============================================================================
+// Every completed reply and user message is folded into g_ngram_dynamic, which
+// prompt-lookup speculation uses as its second draft source. The user repeats
+// phrasing across days, so the cache is written to
+// <dir>/ngrams-<vocab hash>.bin on unload and merged back in on the next load.
+
+// Token ids only mean something for one vocabulary
+static uint64_t compute_vocab_hash(const llama_vocab* vocab) {
+    int32_t n_tokens = llama_vocab_n_tokens(vocab);
+    uint64_t hash = fnv1a64(&n_tokens, sizeof(n_tokens));
+    for (llama_token id = 0; id < n_tokens; id++) {
+        const char* text = llama_vocab_get_text(vocab, id);
+        hash = fnv1a64(text, strlen(text) + 1, hash);
+    }
+    return hash;
+}
+
+static std::string ngram_cache_path() {
+    char name[64];
+    snprintf(name, sizeof(name), "/ngrams-%016" PRIx64 ".bin", g_vocab_hash);
+    return g_ngram_dir + name;
+}
+
+// On-disk size of a cache in common_ngram_cache_save format
+static size_t ngram_cache_bytes(const common_ngram_cache& cache) {
+    size_t n_bytes = 0;
+    for (const auto& item : cache) {
+        n_bytes += sizeof(common_ngram) + sizeof(int32_t) + item.second.size() * 2 * sizeof(int32_t);
+    }
+    return n_bytes;
+}
+
+// Walks the records of a common_ngram_cache_save file without loading them.
+// common_ngram_cache_load aborts on a truncated record or a zero count, and a
+// crash or power loss can leave such a file (zero-filled, cut short) behind.
+static bool ngram_cache_file_valid(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool valid = true;
+    off_t n_valid = 0;  // bytes in complete records
+    common_ngram ngram;
+    while (valid && fread(&ngram, sizeof(ngram), 1, file) == 1) {
+        int32_t ntokens = 0;
+        valid = fread(&ntokens, sizeof(ntokens), 1, file) == 1 && ntokens > 0;
+        for (int32_t i = 0; valid && i < ntokens; i++) {
+            int32_t token_count[2];  // token, count
+            valid = fread(token_count, sizeof(token_count), 1, file) == 1 && token_count[1] > 0;
+        }
+        if (valid) {
+            n_valid += sizeof(ngram) + sizeof(ntokens) + (off_t)ntokens * 2 * sizeof(int32_t);
+        }
+    }
+    // A partial n-gram at the end is a short write too
+    struct stat st;
+    valid = valid && !ferror(file) && fstat(fileno(file), &st) == 0 && st.st_size == n_valid;
+    fclose(file);
+    return valid;
+}
+
+static void load_ngram_cache() {
+    g_ngram_dynamic.clear();
+    g_ngram_dirty = false;
+    if (g_ngram_dir.empty()) {
+        return;
+    }
+
+    // common_ngram_cache_load throws on a missing file and aborts on a damaged one
+    std::string path = ngram_cache_path();
+    if (access(path.c_str(), R_OK) != 0) {
+        return;
+    }
+    if (!ngram_cache_file_valid(path)) {
+        LOGW("Discarding damaged n-gram cache %s", path.c_str());
+        unlink(path.c_str());
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    common_ngram_cache saved = common_ngram_cache_load(path);
+    common_ngram_cache_merge(g_ngram_dynamic, saved);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    LOGI("✓ Loaded n-gram cache: %zu n-grams in %lldms", g_ngram_dynamic.size(), (long long)ms);
+}
+
+// Drop n-grams seen only once when the cache outgrows its budget
+static void prune_ngram_cache() {
+    if (g_ngram_dynamic.size() <= MAX_NGRAM_ENTRIES) {
+        return;
+    }
+    size_t n_before = g_ngram_dynamic.size();
+    for (auto it = g_ngram_dynamic.begin(); it != g_ngram_dynamic.end();) {
+        if (it->second.size() == 1 && it->second.begin()->second == 1) {
+            it = g_ngram_dynamic.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    LOGI("Pruned n-gram cache: %zu -> %zu n-grams", n_before, g_ngram_dynamic.size());
+}
+
+static void save_ngram_cache() {
+    if (g_ngram_dir.empty() || !g_ngram_dirty || g_ngram_dynamic.empty()) {
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    prune_ngram_cache();
+
+    std::string path = ngram_cache_path();
+    std::string tmp_path = path + ".tmp";
+    common_ngram_cache_save(g_ngram_dynamic, tmp_path);
+
+    // Only complete files are kept, and only once they are on disk: renamed
+    // before its data is synced, a power loss can leave a zero-filled file
+    size_t n_bytes = ngram_cache_bytes(g_ngram_dynamic);
+    struct stat st;
+    int fd = open(tmp_path.c_str(), O_RDONLY);
+    const bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!synced || stat(tmp_path.c_str(), &st) != 0 || (size_t)st.st_size != n_bytes ||
+        rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGW("Failed to write n-gram cache %s", path.c_str());
+        unlink(tmp_path.c_str());
+        return;
+    }
+    g_ngram_dirty = false;
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    LOGI("✓ Saved n-gram cache: %zu n-grams, %zu bytes in %lldms", g_ngram_dynamic.size(), n_bytes, (long long)ms);
+}
+
+// Fold a token span into the per-user statistics
+static void learn_ngrams(const llama_token* tokens, int n_tokens) {
+    if (n_tokens <= LLAMA_NGRAM_MIN) {
+        return;
+    }
+    std::vector<llama_token> inp(tokens, tokens + n_tokens);
+    common_ngram_cache fresh;
+    common_ngram_cache_update(fresh, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, n_tokens, false);
+    common_ngram_cache_merge(g_ngram_dynamic, fresh);
+    g_ngram_dirty = true;
+}
+
+// =============================================================================
+// ChatML prompt structure
+// =============================================================================
+
+// The last complete turn of a ChatML prompt (before the assistant header) is
+// the user's message, unless the system turn is all there is
+static void mark_user_turn(GenerationRequest& request) {
+    const std::vector<int>& boundaries = request.checkpoint_at;
+    if (boundaries.size() >= 2) {
+        request.user_begin = boundaries[boundaries.size() - 2];
+        request.user_end = boundaries.back();
+    }
+}
+
+// Token counts right after each "<|im_end|>\n", i.e. where a ChatML turn ends
+static std::vector<int> find_turn_boundaries(const std::vector<llama_token>& tokens) {
+    std::vector<int> boundaries;
+    for (size_t i = 0; i + 1 < tokens.size(); i++) {
+        if (!llama_vocab_is_eog(g_vocab, tokens[i])) {
+            continue;
+        }
+        size_t end = i + 1;
+        char piece[8];
+        if (end + 1 < tokens.size() &&
+            llama_token_to_piece(g_vocab, tokens[end], piece, sizeof(piece), 0, true) == 1 && piece[0] == '\n') {
+            end++;
+        }
+        boundaries.push_back((int)end);
+    }
+    return boundaries;
+}
+
+// =============================================================================
+// Context shift - scheduler thread
+// =============================================================================
+// A long chat resends a transcript that outgrows n_ctx. Instead of failing, the
+// oldest turns after the system prompt are evicted from the sequence
+// (llama_memory_seq_rm) and everything after them moves down
+// (llama_memory_seq_add, a RoPE shift of the cached keys), so the system
+// prompt and the recent turns stay cached. A prompt is cut the same way the
+// slot's history already was, so the next turn still reuses all of it and
+// per-turn cost stays flat. At least ATTENTION_SINK_TOKENS are always kept:
+// the first tokens soak up attention and evicting them degrades the output.
+
+static const int ATTENTION_SINK_TOKENS = 4;
+
+// Length of the prompt prefix the slot holds, reading past the tokens it evicted
+static int cached_prefix_length(const SequenceSlot& slot, const std::vector<llama_token>& prompt) {
+    int n_common = common_prefix_length(slot.tokens, prompt);
+    if (slot.n_discarded == 0 || n_common < slot.shift_keep) {
+        return n_common;
+    }
+    const size_t keep = slot.shift_keep;
+    const size_t skip = keep + slot.n_discarded;
+    size_t n = 0;
+    while (keep + n < slot.tokens.size() && skip + n < prompt.size() && slot.tokens[keep + n] == prompt[skip + n]) {
+        n++;
+    }
+    return std::max(n_common, (int)(keep + n));
+}
+
+// Apply a shift of the target sequence to its draft sequence as well
+static void shift_draft_sequence(SequenceSlot& slot, int n_keep, int n_discard) {
+    llama_memory_t mem = llama_get_memory(g_draft_context);
+    const int n_past = (int)slot.dft_tokens.size();
+    slot.dft_state_n = -1;
+    if (n_keep + n_discard < n_past && llama_memory_seq_rm(mem, slot.seq_id, n_keep, n_keep + n_discard)) {
+        llama_memory_seq_add(mem, slot.seq_id, n_keep + n_discard, n_past, -n_discard);
+        slot.dft_tokens.erase(slot.dft_tokens.begin() + n_keep, slot.dft_tokens.begin() + n_keep + n_discard);
+    } else {
+        llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+        slot.dft_tokens.clear();
+    }
+}
+
+// Evict n_discard tokens after the first n_keep of the slot's history and move
+// the rest down. Recurrent state needs nothing: it is the state after the last
+// token either way. Returns false if the cache cannot shift; nothing changed then.
+static bool shift_slot(SequenceSlot& slot, int n_keep, int n_discard) {
+    const int n_past = (int)slot.tokens.size();
+    if (n_discard <= 0 || n_keep >= n_past) {
+        return true;
+    }
+    if (n_keep + n_discard >= n_past) {
+        rewind_slot(slot, n_keep);
+        return true;
+    }
+
+    llama_memory_t mem = llama_get_memory(g_context);
+    if (!llama_memory_can_shift(mem) || !llama_memory_seq_rm(mem, slot.seq_id, n_keep, n_keep + n_discard)) {
+        return false;
+    }
+    llama_memory_seq_add(mem, slot.seq_id, n_keep + n_discard, n_past, -n_discard);
+    slot.tokens.erase(slot.tokens.begin() + n_keep, slot.tokens.begin() + n_keep + n_discard);
+    while (!slot.checkpoints.empty() && slot.checkpoints.back().n_tokens > n_keep) {
+        slot.checkpoints.pop_back();
+    }
+    if (g_draft_context != nullptr) {
+        shift_draft_sequence(slot, n_keep, n_discard);
+    }
+    slot.n_discarded += n_discard;
+
+    LOGI("Context shift on seq %d: kept %d, evicted %d, moved %d tokens (%d evicted in all)",
+         slot.seq_id, n_keep, n_discard, n_past - n_keep - n_discard, slot.n_discarded);
+    return true;
+}
+
+// Tokens to evict after n_keep so that at most n_max remain: up to the end of
+// the first turn at or past that point, so no turn is left without its start
+static int eviction_length(const std::vector<llama_token>& tokens, int n_keep, int n_max) {
+    const int n_needed = (int)tokens.size() - n_max;
+    // A boundary further on than half the remaining window would throw away
+    // the latest message too; cut inside it instead
+    const int n_limit = n_needed + (n_max - n_keep) / 2;
+    for (int boundary : find_turn_boundaries(tokens)) {
+        if (boundary - n_keep >= n_needed) {
+            return boundary - n_keep <= n_limit ? boundary - n_keep : n_needed;
+        }
+    }
+    return n_needed;
+}
+
+// Cut the middle of a prompt that leaves too little of the context for the
+// reply, reusing the slot's earlier cut while the prompt still fits with it.
+// Shifts the slot's history to match. Returns false if even the kept prefix
+// does not fit.
+static bool fit_prompt_to_context(SequenceSlot& slot, GenerationRequest& request) {
+    std::vector<llama_token>& prompt = request.prompt_tokens;
+    const int n_ctx = (int)llama_n_ctx(g_context);
+    const int n_max = n_ctx - std::min(request.max_tokens, n_ctx / 4) - MAX_DRAFT_TOKENS;
+    const int n_prompt = (int)prompt.size();
+    const int n_keep = std::min(std::max(request.n_snapshot_prefix, ATTENTION_SINK_TOKENS), n_prompt);
+
+    const bool same_prefix = (slot.n_discarded == 0 || slot.shift_keep == n_keep) &&
+        (int)slot.tokens.size() >= n_keep && std::equal(prompt.begin(), prompt.begin() + n_keep, slot.tokens.begin());
+    int n_discard = 0;
+    if (same_prefix && slot.n_discarded > 0 && n_prompt - slot.n_discarded <= n_max && n_prompt - slot.n_discarded > n_keep) {
+        n_discard = slot.n_discarded;
+    } else if (n_prompt > n_max) {
+        if (n_keep >= n_max) {
+            return false;
+        }
+        // Evict a quarter of the room more than needed, so the next turns fit the same cut
+        n_discard = eviction_length(prompt, n_keep, n_max - (n_max - n_keep) / 4);
+    }
+
+    slot.shift_keep = n_keep;
+    if (n_discard == 0) {
+        return true;
+    }
+
+    // The slot holds the same transcript cut less: evict the difference in place
+    if (same_prefix && n_discard > slot.n_discarded &&
+        !shift_slot(slot, n_keep, n_discard - slot.n_discarded)) {
+        rewind_slot(slot, n_keep);
+    }
+
+    prompt.erase(prompt.begin() + n_keep, prompt.begin() + n_keep + n_discard);
+    std::vector<int> checkpoint_at;
+    for (int boundary : request.checkpoint_at) {
+        if (boundary <= n_keep) {
+            checkpoint_at.push_back(boundary);
+        } else if (boundary > n_keep + n_discard) {
+            checkpoint_at.push_back(boundary - n_discard);
+        }
+    }
+    request.checkpoint_at.swap(checkpoint_at);
+    request.user_begin = std::max(n_keep, request.user_begin - n_discard);
+    request.user_end = std::max(request.user_begin, request.user_end - n_discard);
+    request.n_discarded = n_discard;
+    return true;
+}
+
+// Keep room for the next step of a long reply by evicting the older half of
+// what follows the kept prefix. Returns false if there is nothing left to evict.
+static bool make_room_for_decode(SequenceSlot& slot) {
+    const int n_ctx = (int)llama_n_ctx(g_context);
+    const int n_past = (int)slot.tokens.size();
+    if (n_past + 1 + (int)slot.replay.size() + MAX_DRAFT_TOKENS < n_ctx) {
+        return true;
+    }
+    const int n_keep = std::min(slot.shift_keep, n_past);
+    if (n_past - n_keep < 2) {
+        return false;
+    }
+    const int n_discard = eviction_length(slot.tokens, n_keep, n_keep + (n_past - n_keep) / 2);
+    return shift_slot(slot, n_keep, n_discard);
+}
+
+// =============================================================================
+// Thread controller - scheduler thread, device state written by any thread
+// =============================================================================
+// Sustained chats throttle the big cores within a minute, after which a fixed
+// thread count is both slower and hotter. Between decode steps the scheduler
+// re-picks how many threads to run and on which cluster: a thermal/battery
+// ceiling comes from Kotlin, and below it a hill climb on measured decode-step
+// latency keeps the fewest threads that are not measurably slower. Each cluster
+// gets its own threadpool pinned to its cores, so switching is an attach.
+
+enum ThermalLevel {                 // ThermalManager.ThermalState ordinals
+    THERMAL_NOMINAL = 0,
+    THERMAL_LIGHT,
+    THERMAL_MODERATE,
+    THERMAL_SEVERE,
+    THERMAL_CRITICAL,
+};
+
+static std::atomic<int> g_thermal_level{THERMAL_NOMINAL};
+static std::atomic<float> g_thermal_headroom{-1.0f};   // PowerManager forecast, < 0 = unknown
+static std::atomic<int> g_battery_percent{100};
+static std::atomic<bool> g_battery_charging{true};
+
+// Prompt tokens a step may add while other sequences are decoding (0 = no cap),
+// so a long prompt delays the replies in flight by a bounded amount per token
+static const int DEFAULT_PREFILL_STEP_BUDGET = 256;
+static std::atomic<int> g_prefill_step_budget{DEFAULT_PREFILL_STEP_BUDGET};
+
+static const int THREAD_CONTROL_INTERVAL = 16;   // decode steps measured per decision
+static const int THREAD_PROBE_EVERY = 8;         // decisions between probes of a neighbour count
+static const float STEP_LATENCY_EMA_ALPHA = 0.2f;
+static const int LOW_BATTERY_PERCENT = 15;
+
+struct ThreadController {
+    int max_threads = 4;                   // nThreads given to the model load
+    int n_threads = 4;                     // what the context runs with now
+    int preferred = 4;                     // hill-climb choice, before the thermal ceiling
+    bool efficient = false;                // running on the efficiency cluster
+    std::vector<int> fast_cores;           // fastest cores first
+    std::vector<int> efficient_cores;      // slowest cluster, empty on uniform CPUs
+    ggml_threadpool* pool_fast = nullptr;
+    ggml_threadpool* pool_efficient = nullptr;
+    std::vector<float> step_ms;            // EMA of decode step latency by thread count, 0 = unmeasured
+    int n_decoding = 0;                    // slots decoding when step_ms was measured
+    int n_steps = 0;                       // decode steps since the last decision
+    int n_decisions = 0;
+    int probe_from = 0;                    // thread count before the running probe, 0 = none
+    int prefill_budget = 0;                // tokens per step, shrinks with the thermal level
+};
+
+static ThreadController g_threads;
+
+// Cores ordered by cpuinfo_max_freq. Empty when cpufreq is not readable.
+static void detect_core_topology(ThreadController& tc) {
+    tc.fast_cores.clear();
+    tc.efficient_cores.clear();
+
+    std::vector<std::pair<long, int>> cores;
+    long n_cpus = std::min<long>(sysconf(_SC_NPROCESSORS_CONF), GGML_MAX_N_THREADS);
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+        FILE* file = fopen(path, "r");
+        if (file == nullptr) {
+            continue;
+        }
+        long freq = 0;
+        if (fscanf(file, "%ld", &freq) == 1 && freq > 0) {
+            cores.emplace_back(freq, cpu);
+        }
+        fclose(file);
+    }
+    if (cores.size() < 2) {
+        return;
+    }
+
+    std::stable_sort(cores.begin(), cores.end(), [](const std::pair<long, int>& a, const std::pair<long, int>& b) {
+        return a.first > b.first;
+    });
+    for (const auto& core : cores) {
+        tc.fast_cores.push_back(core.second);
+        if (core.first == cores.back().first && cores.front().first > cores.back().first) {
+            tc.efficient_cores.push_back(core.second);
+        }
+    }
+}
+
+// A pool of n_threads pinned one per core (or spread over the cores when
+// there are fewer of them). Created paused; resumed when attached.
+static ggml_threadpool* create_pinned_threadpool(const std::vector<int>& cores, int n_threads) {
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    for (size_t i = 0; i < cores.size() && (int)i < n_threads; i++) {
+        params.cpumask[cores[i]] = true;
+    }
+    params.strict_cpu = (int)cores.size() >= n_threads;
+    params.paused = true;
+    return ggml_threadpool_new(&params);
+}
+
+static void attach_threadpool(ThreadController& tc, bool efficient) {
+    ggml_threadpool* active = efficient ? tc.pool_efficient : tc.pool_fast;
+    ggml_threadpool* idle = efficient ? tc.pool_fast : tc.pool_efficient;
+    if (active == nullptr) {
+        return;
+    }
+    if (idle != nullptr) {
+        ggml_threadpool_pause(idle);
+    }
+    llama_attach_threadpool(g_context, active, active);
+    if (g_draft_context != nullptr) {
+        llama_attach_threadpool(g_draft_context, active, active);
+    }
+    ggml_threadpool_resume(active);
+    tc.efficient = efficient;
+}
+
+// Called on the scheduler thread before its first step
+static void init_thread_controller(int max_threads) {
+    ThreadController& tc = g_threads;
+    tc.max_threads = std::max(1, std::min(max_threads, GGML_MAX_N_THREADS));
+    tc.n_threads = tc.max_threads;
+    tc.preferred = tc.max_threads;
+    tc.step_ms.assign(tc.max_threads + 1, 0.0f);
+    tc.n_decoding = 0;
+    tc.n_steps = 0;
+    tc.n_decisions = 0;
+    tc.probe_from = 0;
+    tc.prefill_budget = (int)llama_n_batch(g_context);
+
+    detect_core_topology(tc);
+    if (!tc.fast_cores.empty()) {
+        tc.pool_fast = create_pinned_threadpool(tc.fast_cores, tc.max_threads);
+    }
+    if (!tc.efficient_cores.empty()) {
+        tc.pool_efficient = create_pinned_threadpool(tc.efficient_cores, tc.max_threads);
+    }
+    attach_threadpool(tc, false);
+
+    LOGI("Thread controller: %d threads max, %zu cores (%zu efficiency)%s",
+         tc.max_threads, tc.fast_cores.size(), tc.efficient_cores.size(),
+         tc.pool_fast ? "" : ", affinity unavailable");
+}
+
+// Called on the scheduler thread after its last step; the context outlives it
+static void free_thread_controller() {
+    ThreadController& tc = g_threads;
+    if (g_context != nullptr) {
+        llama_detach_threadpool(g_context);
+    }
+    if (g_draft_context != nullptr) {
+        llama_detach_threadpool(g_draft_context);
+    }
+    if (tc.pool_fast != nullptr) {
+        ggml_threadpool_free(tc.pool_fast);
+        tc.pool_fast = nullptr;
+    }
+    if (tc.pool_efficient != nullptr) {
+        ggml_threadpool_free(tc.pool_efficient);
+        tc.pool_efficient = nullptr;
+    }
+    tc.efficient = false;
+}
+
+// Hill climb: every THREAD_PROBE_EVERY decisions try one thread fewer or one
+// more (alternating). Fewer threads are kept unless more than 5% slower since
+// they run cooler; more threads must be over 5% faster to stay.
+static void climb_thread_count(ThreadController& tc, int ceiling) {
+    if (tc.probe_from > 0) {
+        float probed = tc.step_ms[tc.n_threads];
+        float before = tc.step_ms[tc.probe_from];
+        bool keep = tc.n_threads < tc.probe_from ? probed <= before * 1.05f : probed < before * 0.95f;
+        LOGD("Thread probe %d -> %d: %.1fms vs %.1fms per step, %s",
+             tc.probe_from, tc.n_threads, probed, before, keep ? "kept" : "reverted");
+        tc.preferred = keep ? tc.n_threads : tc.probe_from;
+        tc.probe_from = 0;
+        return;
+    }
+
+    if (++tc.n_decisions % THREAD_PROBE_EVERY != 0) {
+        return;
+    }
+    int step = (tc.n_decisions / THREAD_PROBE_EVERY) % 2 ? -1 : 1;
+    int candidate = tc.n_threads + step;
+    if (candidate < 1 || candidate > ceiling) {
+        candidate = tc.n_threads - step;
+    }
+    if (candidate < 1 || candidate > ceiling) {
+        return;
+    }
+    tc.probe_from = tc.n_threads;
+    tc.preferred = candidate;
+    tc.step_ms[candidate] = 0.0f;
+}
+
+// Re-pick thread count, cluster and prefill budget before building a batch
+static void adapt_threads(int n_decoding) {
+    ThreadController& tc = g_threads;
+
+    int level = std::max((int)THERMAL_NOMINAL, std::min(g_thermal_level.load(std::memory_order_relaxed), (int)THERMAL_CRITICAL));
+    if (g_thermal_headroom.load(std::memory_order_relaxed) >= 0.95f) {
+        // Severe throttling is forecast within seconds - back off before it lands
+        level = std::max(level, (int)THERMAL_MODERATE);
+    }
+    int battery = g_battery_percent.load(std::memory_order_relaxed);
+    bool low_battery = !g_battery_charging.load(std::memory_order_relaxed) && battery <= LOW_BATTERY_PERCENT;
+
+    int ceiling = tc.max_threads;
+    if (level == THERMAL_MODERATE) {
+        ceiling = tc.max_threads - 1;
+    } else if (level == THERMAL_SEVERE) {
+        ceiling = 2;
+    } else if (level == THERMAL_CRITICAL) {
+        ceiling = 1;
+    }
+    if (low_battery) {
+        ceiling = std::min(ceiling, 2);
+    }
+    bool efficient = tc.pool_efficient != nullptr && (level >= THERMAL_SEVERE || low_battery);
+    if (efficient) {
+        ceiling = std::min(ceiling, (int)tc.efficient_cores.size());
+    }
+    ceiling = std::max(1, std::min(ceiling, tc.max_threads));
+
+    // Prefill is the hot part of a step; keep chunks small while throttled
+    static const int PREFILL_SHIFT[] = {0, 0, 1, 2, 3};
+    int shift = std::max(PREFILL_SHIFT[level], low_battery ? 1 : 0);
+    tc.prefill_budget = std::max(1, (int)llama_n_batch(g_context) >> shift);
+    int step_budget = g_prefill_step_budget.load(std::memory_order_relaxed);
+    if (n_decoding > 0 && step_budget > 0) {
+        tc.prefill_budget = std::min(tc.prefill_budget, step_budget);
+    }
+
+    // Latencies only compare across the same load and the same cluster
+    if (efficient != tc.efficient || n_decoding != tc.n_decoding) {
+        std::fill(tc.step_ms.begin(), tc.step_ms.end(), 0.0f);
+        tc.n_decoding = n_decoding;
+        tc.n_steps = 0;
+        if (tc.probe_from > 0) {
+            tc.preferred = tc.probe_from;
+            tc.probe_from = 0;
+        }
+    }
+    if (efficient != tc.efficient) {
+        attach_threadpool(tc, efficient);
+    }
+
+    if (tc.n_steps >= THREAD_CONTROL_INTERVAL) {
+        tc.n_steps = 0;
+        climb_thread_count(tc, ceiling);
+    }
+
+    int n_threads = std::min(tc.preferred, ceiling);
+    if (n_threads != tc.n_threads) {
+        LOGI("Threads: %d -> %d on %s cores (thermal %d, battery %d%%%s, %.1fms/step)",
+             tc.n_threads, n_threads, tc.efficient ? "efficiency" : "performance", level, battery,
+             g_battery_charging.load(std::memory_order_relaxed) ? " charging" : "", tc.step_ms[tc.n_threads]);
+        tc.n_threads = n_threads;
+        llama_set_n_threads(g_context, n_threads, n_threads);
+        if (g_draft_context != nullptr) {
+            llama_set_n_threads(g_draft_context, n_threads, n_threads);
+        }
+    }
+}
+
+// Feed the latency of a step that only decoded generating slots
+static void record_decode_step(float ms) {
+    ThreadController& tc = g_threads;
+    float& ema = tc.step_ms[tc.n_threads];
+    ema = ema > 0.0f ? ema + STEP_LATENCY_EMA_ALPHA * (ms - ema) : ms;
+    tc.n_steps++;
+}
+
+// =============================================================================
+// Performance counters - recorded by the scheduler and submitting threads
+// =============================================================================
+// Rolling latency windows per phase plus cache and thread gauges, so a field
+// regression can be pinned on tokenizing, prefill, decode, sampling or cache
+// misses. engine_get_metrics flattens everything into one array.
+
+enum LatencyMetric {
+    METRIC_TOKENIZE = 0,        // prompt tokenization, per request
+    METRIC_PREFILL_CHUNK,       // decode steps that carried prompt tokens
+    METRIC_FIRST_TOKEN,         // admission to first sampled token, per request
+    METRIC_DECODE_TOKEN,        // decode steps that carried generating slots (inter-token latency)
+    METRIC_SAMPLING,            // one sampler call
+    N_LATENCY_METRICS
+};
+
+static const int LATENCY_WINDOW = 256;      // samples kept per phase for percentiles
+static const int LATENCY_FIELDS = 6;        // count, mean, p50, p90, p99, max
+static const int GAUGE_FIELDS = 13;
+
+struct LatencyHistogram {
+    float window_ms[LATENCY_WINDOW] = {};
+    int64_t n_total = 0;
+    double sum_ms = 0.0;
+};
+
+struct PerfCounters {
+    LatencyHistogram latency[N_LATENCY_METRICS];
+    int64_t n_requests = 0;
+    int64_t n_prompt_tokens = 0;
+    int64_t n_reused_tokens = 0;
+    int64_t n_snapshot_hits = 0;
+    int kv_used = 0;                        // tokens held by all sequence slots
+    int kv_size = 0;
+    int n_threads = 0;
+    bool efficient_cores = false;
+    int prefill_budget = 0;
+    llama_perf_context_data perf = {};
+};
+
+static std::mutex g_metrics_mutex;
+static PerfCounters g_metrics;
+
+static float ms_since(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void record_latency(LatencyMetric metric, float ms) {
+    std::lock_guard<std::mutex> lock(g_metrics_mutex);
+    LatencyHistogram& histogram = g_metrics.latency[metric];
+    histogram.window_ms[histogram.n_total % LATENCY_WINDOW] = ms;
+    histogram.n_total++;
+    histogram.sum_ms += ms;
+}
+
+static void record_prompt_reuse(int n_prompt, int n_reused, bool snapshot_hit) {
+    std::lock_guard<std::mutex> lock(g_metrics_mutex);
+    g_metrics.n_requests++;
+    g_metrics.n_prompt_tokens += n_prompt;
+    g_metrics.n_reused_tokens += n_reused;
+    g_metrics.n_snapshot_hits += snapshot_hit ? 1 : 0;
+}
+
+// Scheduler thread, after every step
+static void update_metric_gauges(int kv_used) {
+    llama_perf_context_data perf = llama_perf_context(g_context);
+    std::lock_guard<std::mutex> lock(g_metrics_mutex);
+    g_metrics.kv_used = kv_used;
+    g_metrics.kv_size = (int)llama_n_ctx(g_context);
+    g_metrics.n_threads = g_threads.n_threads;
+    g_metrics.efficient_cores = g_threads.efficient;
+    g_metrics.prefill_budget = g_threads.prefill_budget;
+    g_metrics.perf = perf;
+}
+
+// [count, mean, p50, p90, p99, max] of the window, mean over the lifetime
+static void summarize_latency(const LatencyHistogram& histogram, double* out) {
+    const int n = (int)std::min<int64_t>(histogram.n_total, LATENCY_WINDOW);
+    out[0] = (double)histogram.n_total;
+    out[1] = histogram.n_total > 0 ? histogram.sum_ms / histogram.n_total : 0.0;
+    if (n == 0) {
+        std::fill(out + 2, out + LATENCY_FIELDS, 0.0);
+        return;
+    }
+    std::vector<float> sorted(histogram.window_ms, histogram.window_ms + n);
+    std::sort(sorted.begin(), sorted.end());
+    out[2] = sorted[(n - 1) * 50 / 100];
+    out[3] = sorted[(n - 1) * 90 / 100];
+    out[4] = sorted[(n - 1) * 99 / 100];
+    out[5] = sorted[n - 1];
+}
+
+// =============================================================================
+// Residency manager - scheduler thread, or g_mutex with the scheduler stopped
+// =============================================================================
+// Android's onTrimMemory asks for memory back in steps, so instead of keeping
+// everything or freeing everything we release it in levels (see
+// EngineResidency). COMPACT..COLD keep the model and are applied by the
+// scheduler once it is idle; the next admitted request brings the context
+// back first. UNLOADED frees the model and is applied under g_mutex.
+
+static std::atomic<int> g_residency{ENGINE_RESIDENCY_ACTIVE};         // applied level
+static std::atomic<int> g_residency_target{ENGINE_RESIDENCY_ACTIVE};  // requested level
+static std::atomic<int> g_active_requests{0};  // submitted generations not yet finished
+static EngineConfig g_config;                   // to reload an unloaded model
+static llama_context_params g_ctx_params;       // to recreate a released context
+static llama_context_params g_draft_ctx_params;
+static std::string g_model_file;                // resolved paths, to find their mappings
+static std::string g_draft_model_file;
+static bool g_ngram_released = false;
+
+static bool residency_change_pending() {
+    return g_residency_target.load() != g_residency.load();
+}
+
+// Calls fn(begin, end, file offset) for every mapping of a model file
+// (llama.cpp maps it read-only, so dropped pages are read back in on access)
+static void for_each_model_mapping(const std::string& file, const std::function<void(uintptr_t, uintptr_t, uint64_t)>& fn) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == nullptr) {
+        return;
+    }
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps)) {
+        uintptr_t begin = 0;
+        uintptr_t end = 0;
+        uint64_t offset = 0;
+        int path_offset = 0;
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %*s %" SCNx64 " %*s %*s %n", &begin, &end, &offset, &path_offset) < 3 ||
+            path_offset == 0) {
+            continue;
+        }
+        char* path = line + path_offset;
+        path[strcspn(path, "\n")] = '\0';
+        if (file == path) {
+            fn(begin, end, offset);
+        }
+    }
+    fclose(maps);
+}
+
+// madvise the whole model file, and the draft model's. Returns bytes advised.
+static size_t advise_model_mappings(int advice) {
+    size_t n_bytes = 0;
+    auto advise = [&](uintptr_t begin, uintptr_t end, uint64_t /* offset */) {
+        if (madvise((void*)begin, end - begin, advice) == 0) {
+            n_bytes += end - begin;
+        }
+    };
+    for_each_model_mapping(g_model_file, advise);
+    if (!g_draft_model_file.empty()) {
+        for_each_model_mapping(g_draft_model_file, advise);
+    }
+    return n_bytes;
+}
+
+// Keep only the most recently used sequence, rewound to its system prompt if it is still in the context
+static void keep_latest_prefix() {
+    SequenceSlot* latest = nullptr;
+    for (SequenceSlot& slot : g_slots) {
+        if (!slot.tokens.empty() && (latest == nullptr || slot.last_used > latest->last_used)) {
+            latest = &slot;
+        }
+    }
+    for (SequenceSlot& slot : g_slots) {
+        if (&slot != latest) {
+            reset_slot(slot);
+            slot.parked.clear();
+        }
+    }
+    if (latest != nullptr && g_context != nullptr) {
+        std::vector<int> boundaries = find_turn_boundaries(latest->tokens);
+        if (!boundaries.empty()) {
+            rewind_slot(*latest, boundaries.front());
+        }
+    }
+}
+
+// Copy every cached sequence to host memory and free the context, which takes
+// the compute buffers and the whole KV allocation with it. The draft context
+// is just freed; its sequences are prefilled again from the slot histories.
+static void park_context() {
+    size_t n_parked = 0;
+    for (SequenceSlot& slot : g_slots) {
+        slot.parked.clear();
+        if (slot.tokens.empty()) {
+            continue;
+        }
+        size_t size = llama_state_seq_get_size(g_context, slot.seq_id);
+        slot.parked.resize(size);
+        if (llama_state_seq_get_data(g_context, slot.parked.data(), size, slot.seq_id) != size) {
+            LOGW("Failed to park seq %d, dropping %zu cached tokens", slot.seq_id, slot.tokens.size());
+            reset_slot(slot);
+            slot.parked.clear();
+            continue;
+        }
+        n_parked += size;
+    }
+
+    ThreadController& tc = g_threads;
+    ggml_threadpool* active = tc.efficient ? tc.pool_efficient : tc.pool_fast;
+    if (active != nullptr) {
+        ggml_threadpool_pause(active);
+    }
+    llama_detach_threadpool(g_context);
+    llama_free(g_context);
+    g_context = nullptr;
+    if (g_draft_context != nullptr) {
+        llama_detach_threadpool(g_draft_context);
+        llama_free(g_draft_context);
+        g_draft_context = nullptr;
+        for (SequenceSlot& slot : g_slots) {
+            slot.dft_tokens.clear();
+            slot.dft_state_n = -1;
+        }
+    }
+
+    LOGI("Context released, %zu bytes of sequence state parked", n_parked);
+}
+
+// Recreate the context and put the parked sequences back
+static bool unpark_context() {
+    g_context = llama_init_from_model(g_model, g_ctx_params);
+    if (g_context == nullptr) {
+        LOGE("Failed to recreate context");
+        return false;
+    }
+    llama_set_abort_callback(g_context, abort_callback, nullptr);
+    if (g_draft_model != nullptr) {
+        // Speculation is optional: without its context the slots fall back to prompt lookup
+        g_draft_context = llama_init_from_model(g_draft_model, g_draft_ctx_params);
+        if (g_draft_context == nullptr) {
+            LOGW("Failed to recreate draft context");
+        } else {
+            llama_set_abort_callback(g_draft_context, abort_callback, nullptr);
+            llama_set_n_threads(g_draft_context, g_threads.n_threads, g_threads.n_threads);
+        }
+    }
+    attach_threadpool(g_threads, g_threads.efficient);
+    llama_set_n_threads(g_context, g_threads.n_threads, g_threads.n_threads);
+
+    for (SequenceSlot& slot : g_slots) {
+        if (slot.parked.empty()) {
+            continue;
+        }
+        if (llama_state_seq_set_data(g_context, slot.parked.data(), slot.parked.size(), slot.seq_id) == 0) {
+            LOGW("Failed to restore parked seq %d, dropping %zu cached tokens", slot.seq_id, slot.tokens.size());
+            reset_slot(slot);
+        }
+        slot.parked.clear();
+        slot.parked.shrink_to_fit();
+    }
+    return true;
+}
+
+// Caller holds g_embed_mutex. Both come back on the next engine_embed.
+static void release_embedding(bool release_model) {
+    if (g_embed_context != nullptr) {
+        llama_free(g_embed_context);
+        g_embed_context = nullptr;
+        LOGI("Embedding context released");
+    }
+    if (release_model && g_embed_model != nullptr) {
+        llama_model_free(g_embed_model);
+        g_embed_model = nullptr;
+    }
+}
+
+// Scheduler thread, with no slot busy
+static void trim_residency(int level) {
+    const int current = g_residency.load();
+    if (level <= current) {
+        return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    if (level >= ENGINE_RESIDENCY_PREFIX && current < ENGINE_RESIDENCY_PREFIX) {
+        keep_latest_prefix();
+    }
+    if (g_context != nullptr) {
+        park_context();
+    }
+    // An embedding in progress keeps its context
+    if (g_embed_mutex.try_lock()) {
+        release_embedding(level >= ENGINE_RESIDENCY_COLD);
+        g_embed_mutex.unlock();
+    }
+    if (level >= ENGINE_RESIDENCY_COLD && current < ENGINE_RESIDENCY_COLD) {
+        // Only dropped once safely on disk
+        save_ngram_cache();
+        if (!g_ngram_dir.empty() && !g_ngram_dirty) {
+            g_ngram_dynamic.clear();
+            g_ngram_released = true;
+        }
+        size_t n_bytes = advise_model_mappings(MADV_DONTNEED);
+        LOGI("Released %.1f MB of mapped weight pages", n_bytes / (1024.0 * 1024.0));
+    }
+
+    g_residency.store(level);
+    LOGI("=== Residency %d -> %d in %.0fms ===", current, level, ms_since(start));
+}
+
+// Scheduler thread: undo any trim before the next step touches the context
+static bool restore_residency() {
+    const int current = g_residency.load();
+    if (current == ENGINE_RESIDENCY_ACTIVE) {
+        return true;
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    if (current >= ENGINE_RESIDENCY_COLD) {
+        // Start reading the weights back while the context is being built
+        advise_model_mappings(MADV_WILLNEED);
+    }
+    if (g_context == nullptr && !unpark_context()) {
+        // Stay parked; the next request tries again
+        int expected = ENGINE_RESIDENCY_ACTIVE;
+        g_residency_target.compare_exchange_strong(expected, current);
+        return false;
+    }
+    if (g_ngram_released) {
+        load_ngram_cache();
+        g_ngram_released = false;
+    }
+
+    g_residency.store(ENGINE_RESIDENCY_ACTIVE);
+    // A newer trim request than the one just undone stays pending
+    int expected = current;
+    g_residency_target.compare_exchange_strong(expected, ENGINE_RESIDENCY_ACTIVE);
+    LOGI("=== Residency %d -> 0 in %.0fms ===", current, ms_since(start));
+    return true;
+}
+
+// =============================================================================
+// Decode scheduler - owns g_context while a model is loaded
+// =============================================================================
+// Calling threads tokenize, queue a GenerationTask and wait for it. One scheduler
+// thread admits queued tasks into free sequence slots and builds a single
+// llama_batch per step: one token for every slot that is generating, then as
+// many prompt tokens of the prefilling slots as fit in n_batch. A proactive
+// message being prefilled therefore no longer blocks an interactive reply.
+
+static long long elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - since).count();
+}
+
+static void batch_add(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq_id;
+    batch.logits[batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+static void complete_task(const std::shared_ptr<GenerationTask>& task) {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->done = true;
+    task->cv.notify_all();
+}
+
+// Finish the slot's task and make the slot idle. Its tokens stay in the KV
+// cache so the next request with the same prefix can reuse them.
+static void release_slot(SequenceSlot& slot) {
+    std::shared_ptr<GenerationTask> task = std::move(slot.task);
+    GenerationResult& result = task->result;
+
+    if (task->first_token_time != std::chrono::steady_clock::time_point()) {
+        result.gen_ms = elapsed_ms(task->first_token_time);
+    }
+    if (slot.sampler) {
+        release_sampler_chain(slot.sampling, slot.sampler);
+        slot.sampler = nullptr;
+    }
+    slot.pending_token = -1;
+    slot.i_batch = -1;
+    slot.last_used = ++g_slot_clock;
+    slot.spec_inp.clear();
+    slot.ngram_context.clear();
+    slot.replay.clear();
+
+    // Remember how this user writes and how we answered
+    if (!result.cancelled && result.error == nullptr) {
+        const GenerationRequest& request = task->request;
+        learn_ngrams(request.prompt_tokens.data() + request.user_begin, request.user_end - request.user_begin);
+        learn_ngrams(slot.generated.data(), (int)slot.generated.size());
+    }
+    slot.generated.clear();
+
+    float tokens_per_sec = result.gen_ms > 0 ? (result.n_generated * 1000.0f / result.gen_ms) : 0.0f;
+
+    LOGI("=== Generation complete (seq %d)%s ===", slot.seq_id, result.cancelled ? " (cancelled)" : "");
+    LOGI("Input: reused=%d + new=%d = %d tokens", result.n_reused, result.n_prompt - result.n_reused, result.n_prompt);
+    LOGI("Output: %d tokens in %lldms (%.2f t/s)", result.n_generated, result.gen_ms, tokens_per_sec);
+    LOGI("Session: %zu tokens cached for next turn", slot.tokens.size());
+    if (result.n_drafted > 0) {
+        g_spec_drafted.fetch_add(result.n_drafted, std::memory_order_relaxed);
+        g_spec_accepted.fetch_add(result.n_accepted, std::memory_order_relaxed);
+        LOGI("Speculation: %d/%d drafted tokens accepted (%.1f%%), %.2f tokens per step",
+             result.n_accepted, result.n_drafted, 100.0f * result.n_accepted / result.n_drafted,
+             result.n_generated > result.n_accepted ? (float)result.n_generated / (result.n_generated - result.n_accepted) : 1.0f);
+    }
+    LOGI("Timing: Prefill=%lldms, Gen=%lldms, Total=%lldms",
+         result.prefill_ms, result.gen_ms, result.prefill_ms + result.gen_ms);
+    LOGI("Response preview: %.100s%s", result.text.c_str(), result.text.length() > 100 ? "..." : "");
+
+    complete_task(task);
+}
+
+// Fail the slot's task after a decode error. Its KV contents are unknown, so drop them.
+static void fail_slot(SequenceSlot& slot) {
+    if (slot.pending_token < 0) {
+        slot.task->result.error = "Prompt processing failed";
+    } else {
+        LOGE("Failed to decode token at position %d", slot.task->result.n_generated);
+    }
+    reset_slot(slot);
+    release_slot(slot);
+}
+
+// Idle slot for a new request: the one sharing the longest prefix with it, else
+// the least recently used one
+static SequenceSlot* acquire_slot(const GenerationRequest& request) {
+    SequenceSlot* best = nullptr;
+    int best_common = -1;
+    for (SequenceSlot& slot : g_slots) {
+        if (slot.task) {
+            continue;
+        }
+        int n_common = cached_prefix_length(slot, request.prompt_tokens);
+        if (n_common > best_common || (n_common == best_common && slot.last_used < best->last_used)) {
+            best = &slot;
+            best_common = n_common;
+        }
+    }
+    return best;
+}
+
+// Bind a task to an idle slot: reuse the cached prefix, rewind the rest and
+// set up a sampler. Its prompt suffix is prefilled by the following steps.
+static void admit_task(SequenceSlot& slot, std::shared_ptr<GenerationTask> task) {
+    const GenerationRequest& request = task->request;
+    GenerationResult& result = task->result;
+    const std::vector<llama_token>& prompt_tokens = request.prompt_tokens;
+
+    slot.task = std::move(task);
+    slot.task->start_time = std::chrono::steady_clock::now();
+    slot.pending_token = -1;
+    slot.i_batch = -1;
+    if (slot.detokenizer == nullptr) {
+        slot.detokenizer = llama_detokenizer_init(g_vocab, false, true);
+    }
+    llama_detokenizer_reset(slot.detokenizer);
+    slot.dft_accepted = DRAFT_INITIAL_ACCEPTED;
+
+    if (prompt_tokens.empty()) {
+        result.error = "Prompt tokenization failed";
+        release_slot(slot);
+        return;
+    }
+    if (!fit_prompt_to_context(slot, slot.task->request)) {
+        LOGE("System prompt alone (%d tokens) leaves no room in the context", request.n_snapshot_prefix);
+        result.error = "Prompt too long for the context";
+        release_slot(slot);
+        return;
+    }
+    const int n_prompt_tokens = (int)prompt_tokens.size();
+    result.n_prompt = n_prompt_tokens;
+    result.n_discarded = request.n_discarded;
+
+    // Longest common token prefix with what this sequence already holds. At least
+    // the last prompt token must be decoded again so that we get fresh logits.
+    const int n_cached = (int)slot.tokens.size();
+    int n_common = common_prefix_length(slot.tokens, prompt_tokens);
+
+    // Cold cache for this system prompt: try the on-disk snapshot before prefilling it
+    const int n_snapshot_prefix = request.n_snapshot_prefix;
+    if (n_snapshot_prefix > 0 && n_common < n_snapshot_prefix &&
+        restore_prompt_snapshot(slot, prompt_tokens.data(), n_snapshot_prefix)) {
+        result.snapshot_hit = true;
+        n_common = n_snapshot_prefix;
+    }
+
+    const int n_reused = rewind_slot(slot, std::min(n_common, n_prompt_tokens - 1));
+    slot.n_discarded = request.n_discarded;
+    result.n_reused = n_reused;
+    record_prompt_reuse(n_prompt_tokens, n_reused, result.snapshot_hit);
+
+    // DIAGNOSTIC: Log cache status for debugging
+    LOGI("=== KV CACHE STATUS (seq %d) ===", slot.seq_id);
+    LOGI("Prompt tokens: %d (snapshot prefix: %d)", n_prompt_tokens, n_snapshot_prefix);
+    LOGI("Cached tokens: %d", n_cached);
+    LOGI("Common prefix: %d tokens", n_common);
+    LOGI("Reused tokens: %d (checkpoints: %zu)", n_reused, slot.checkpoints.size());
+    if (request.n_discarded > 0) {
+        LOGI("Evicted: %d tokens after the first %d (context shift)", request.n_discarded, slot.shift_keep);
+    }
+    LOGI("Disk snapshot: %s", result.snapshot_hit ? "✓ restored" : "-");
+    LOGI("Cache hit: %s", n_reused > 0 ? "✓ YES" : "✗ NO");
+    LOGI("=== END CACHE STATUS ===");
+
+    // Sampling: top_k -> top_p -> min_p -> temperature -> dist
+    slot.sampling.top_k = g_params.topK;
+    slot.sampling.top_p = g_params.topP;
+    slot.sampling.min_p = g_params.minP;
+    slot.sampling.temp = request.temperature;
+    slot.sampling.seed = request.seed;
+    if (sampler_config_is_fused(slot.sampling)) {
+        slot.rng.seed(request.seed == LLAMA_DEFAULT_SEED ? std::random_device{}() : request.seed);
+    } else {
+        slot.sampler = acquire_sampler_chain(slot.sampling);
+    }
+
+    // Prompt lookup drafts from n-grams of the prompt (notes, search snippets,
+    // earlier turns) and of the reply generated so far
+    if (request.n_draft > 0) {
+        slot.spec_inp = prompt_tokens;
+        common_ngram_cache_update(slot.ngram_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                                  slot.spec_inp, (int)slot.spec_inp.size(), false);
+    }
+}
+
+// Where the next prefill chunk of this slot has to stop: the end of the
+// prompt, a checkpoint boundary (recurrent models) or the snapshot prefix
+static int prefill_chunk_end(const SequenceSlot& slot, bool use_checkpoints) {
+    const GenerationRequest& request = slot.task->request;
+    const int n_past = (int)slot.tokens.size();
+    int end = (int)request.prompt_tokens.size();
+    if (request.n_snapshot_prefix > n_past && request.n_snapshot_prefix < end) {
+        end = request.n_snapshot_prefix;
+    }
+    if (use_checkpoints) {
+        for (int boundary : request.checkpoint_at) {
+            if (boundary > n_past && boundary < end) {
+                end = boundary;
+                break;
+            }
+        }
+    }
+    return end;
+}
+
+// Sample the next token of a slot whose logits are in the last batch
+static void sample_slot(SequenceSlot& slot) {
+    GenerationTask& task = *slot.task;
+    GenerationResult& result = task.result;
+    const int i = result.n_generated;
+
+    if (i >= task.request.max_tokens) {
+        release_slot(slot);
+        return;
+    }
+
+    // Minimal logging for maximum speed (2026 optimization)
+    if (i > 0 && i % 50 == 0) {
+        LOGI("Generated %d tokens so far (seq %d)...", i, slot.seq_id);
+    }
+
+    // Sample next token
+    const auto sample_start = std::chrono::steady_clock::now();
+    llama_token new_token_id = slot.sampler
+        ? llama_sampler_sample(slot.sampler, g_context, slot.i_batch)
+        : sample_fused(llama_get_logits_ith(g_context, slot.i_batch), llama_vocab_n_tokens(g_vocab),
+                       slot.sampling, slot.rng, slot.candidates);
+    record_latency(METRIC_SAMPLING, ms_since(sample_start));
+
+    // Check for EOS
+    if (llama_vocab_is_eog(g_vocab, new_token_id)) {
+        LOGI("EOS token generated at position %d", i);
+        release_slot(slot);
+        return;
+    }
+
+    // Convert token to text. Only whole UTF-8 characters come out: a byte token
+    // that splits one is held back until the tokens completing it are sampled.
+    int n_chars = llama_detokenizer_push(slot.detokenizer, new_token_id, slot.piece.data(), (int)slot.piece.size());
+    if (n_chars < 0) {
+        slot.piece.resize(-n_chars);
+        n_chars = llama_detokenizer_push(slot.detokenizer, new_token_id, slot.piece.data(), (int)slot.piece.size());
+    }
+    const char* buf = slot.piece.data();
+
+    if (n_chars > 0) {
+        result.text.append(buf, n_chars);
+        if (task.stream) {
+            std::lock_guard<std::mutex> lock(task.mutex);
+            task.text.append(buf, n_chars);
+            task.piece_lengths.push_back(n_chars);
+            task.cv.notify_all();
+        }
+        // Log first few tokens for debugging
+        if (i < 3) {
+            LOGI("Token %d: '%.*s'", i, n_chars, buf);
+        }
+    }
+
+    result.n_generated++;
+    slot.generated.push_back(new_token_id);
+
+    if (task.request.n_draft > 0) {
+        slot.spec_inp.push_back(new_token_id);
+        common_ngram_cache_update(slot.ngram_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_inp, 1, false);
+    }
+
+    // Decoded in the next step (and appended to the slot history then)
+    slot.pending_token = new_token_id;
+}
+
+// Draft tokens this slot may propose this step (0 = none)
+static int draft_limit(const SequenceSlot& slot) {
+    const GenerationTask& task = *slot.task;
+    if (!slot.replay.empty()) {
+        return 0;
+    }
+    return std::max(0, std::min(task.request.n_draft, task.request.max_tokens - task.result.n_generated - 1));
+}
+
+// Start every draft sequence over, after a draft decode failed
+static void clear_draft_sequences() {
+    llama_memory_clear(llama_get_memory(g_draft_context), true);
+    for (SequenceSlot& slot : g_slots) {
+        slot.dft_tokens.clear();
+        slot.dft_state_n = -1;
+        slot.dft_i_batch = -1;
+        slot.draft.clear();
+    }
+}
+
+// Cut the slot's draft sequence back to its longest common prefix with inp,
+// keeping at least the last token of inp to decode. A recurrent draft state
+// goes back to the snapshot taken before the previous draft instead, or
+// starts over when the histories split before it.
+static void sync_draft_sequence(SequenceSlot& slot, const std::vector<llama_token>& inp) {
+    const int n_keep = std::min(common_prefix_length(slot.dft_tokens, inp), (int)inp.size() - 1);
+    if (n_keep == (int)slot.dft_tokens.size()) {
+        return;
+    }
+
+    llama_memory_t mem = llama_get_memory(g_draft_context);
+    if (llama_memory_seq_rm(mem, slot.seq_id, n_keep, -1)) {
+        slot.dft_tokens.resize(n_keep);
+    } else if (slot.dft_state_n >= 0 && slot.dft_state_n <= n_keep &&
+               llama_state_seq_set_data_ext(g_draft_context, slot.dft_state.data(), slot.dft_state.size(), slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) != 0 &&
+               llama_memory_seq_rm(mem, slot.seq_id, slot.dft_state_n, -1)) {
+        slot.dft_tokens.resize(slot.dft_state_n);
+    } else {
+        llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+        slot.dft_tokens.clear();
+    }
+    if (slot.dft_state_n > (int)slot.dft_tokens.size()) {
+        slot.dft_state_n = -1;
+    }
+}
+
+// Greedy draft token from a row of the draft logits. Returns false once the
+// slot stops drafting: the draft model is unsure, the draft is long enough or
+// it ended the reply.
+static bool take_draft_token(SequenceSlot& slot, int i_logits) {
+    const float* logits = llama_get_logits_ith(g_draft_context, i_logits);
+    const int n_vocab = llama_vocab_n_tokens(g_vocab);
+    llama_token best = 0;
+    for (llama_token id = 1; id < n_vocab; id++) {
+        if (logits[id] > logits[best]) {
+            best = id;
+        }
+    }
+    float sum = 0.0f;
+    for (llama_token id = 0; id < n_vocab; id++) {
+        sum += expf(logits[id] - logits[best]);
+    }
+    if (1.0f / sum < DRAFT_P_MIN) {
+        return false;
+    }
+    slot.draft.push_back(best);
+    return (int)slot.draft.size() < slot.dft_n_max && !llama_vocab_is_eog(g_vocab, best);
+}
+
+// Draft-model speculation for all decoding slots together: one batch catches
+// every draft sequence up with its slot history and pending token, then each
+// draft decode extends all of them by a token. The draft length of a slot is
+// one past how many tokens it recently had accepted. Fills slot.draft.
+static void draft_with_model() {
+    std::vector<SequenceSlot*> drafting;
+    for (SequenceSlot& slot : g_slots) {
+        slot.dft_i_batch = -1;
+        slot.dft_n_max = slot.task && slot.pending_token >= 0 ? draft_limit(slot) : 0;
+        if (slot.dft_n_max > 0) {
+            slot.dft_n_max = std::min(slot.dft_n_max, (int)std::ceil(slot.dft_accepted) + 1);
+            drafting.push_back(&slot);
+        }
+    }
+    if (drafting.empty()) {
+        return;
+    }
+
+    // Decode the batch and take a draft token for every slot with logits in it
+    llama_batch& batch = g_draft_batch;
+    batch.n_tokens = 0;
+    auto decode_batch = [&batch]() {
+        if (batch.n_tokens > 0 && llama_decode(g_draft_context, batch) != 0) {
+            return false;
+        }
+        batch.n_tokens = 0;
+        for (SequenceSlot& slot : g_slots) {
+            if (slot.dft_i_batch >= 0 && !take_draft_token(slot, slot.dft_i_batch)) {
+                slot.dft_n_max = 0;
+            }
+            slot.dft_i_batch = -1;
+        }
+        return true;
+    };
+
+    bool ok = true;
+    std::vector<llama_token> inp;
+    for (SequenceSlot* slot : drafting) {
+        inp = slot->tokens;
+        inp.push_back(slot->pending_token);
+        sync_draft_sequence(*slot, inp);
+        for (size_t pos = slot->dft_tokens.size(); ok && pos < inp.size(); pos++) {
+            if (batch.n_tokens == DRAFT_N_BATCH && !(ok = decode_batch())) {
+                break;
+            }
+            const bool last = pos + 1 == inp.size();
+            if (last) {
+                slot->dft_i_batch = batch.n_tokens;
+            }
+            batch_add(batch, inp[pos], (llama_pos)pos, slot->seq_id, last);
+        }
+        slot->dft_tokens.swap(inp);
+    }
+    ok = ok && decode_batch();
+
+    // The drafts cannot be cut off a recurrent state, so keep it as it is without them
+    if (ok && (llama_model_is_recurrent(g_draft_model) || llama_model_is_hybrid(g_draft_model))) {
+        for (SequenceSlot* slot : drafting) {
+            size_t size = llama_state_seq_get_size_ext(g_draft_context, slot->seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+            slot->dft_state.resize(size);
+            slot->dft_state_n = llama_state_seq_get_data_ext(g_draft_context, slot->dft_state.data(), size, slot->seq_id,
+                                                             LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) == size
+                ? (int)slot->dft_tokens.size() : -1;
+        }
+    }
+
+    while (ok) {
+        for (SequenceSlot* slot : drafting) {
+            if (slot->dft_n_max == 0) {
+                continue;
+            }
+            slot->dft_i_batch = batch.n_tokens;
+            batch_add(batch, slot->draft.back(), (llama_pos)slot->dft_tokens.size(), slot->seq_id, true);
+            slot->dft_tokens.push_back(slot->draft.back());
+        }
+        if (batch.n_tokens == 0) {
+            break;
+        }
+        ok = decode_batch();
+    }
+
+    if (!ok) {
+        LOGW("Draft model decode failed, starting its sequences over");
+        clear_draft_sequences();
+    }
+}
+
+// Propose continuations of the pending token, from the draft model (already in
+// slot.draft) or from n-grams already seen in the prompt or the reply. They are
+// verified together with it in one batch.
+static void draft_tokens(SequenceSlot& slot, bool use_checkpoints) {
+    if (draft_limit(slot) <= 0) {
+        slot.draft.clear();
+        return;
+    }
+
+    if (g_draft_context == nullptr) {
+        std::vector<llama_token> draft = {slot.pending_token};
+        common_ngram_cache_draft(slot.spec_inp, draft, draft_limit(slot), LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                                 slot.ngram_context, g_ngram_dynamic, g_ngram_empty);
+        slot.draft.assign(draft.begin() + 1, draft.end());
+    }
+    if (slot.draft.empty()) {
+        return;
+    }
+
+    // Recurrent state cannot be truncated, so keep what it was before the batch
+    slot.spec_n_past = (int)slot.tokens.size();
+    if (use_checkpoints) {
+        size_t size = llama_state_seq_get_size_ext(g_context, slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+        slot.spec_state.resize(size);
+        if (llama_state_seq_get_data_ext(g_context, slot.spec_state.data(), size, slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) != size) {
+            slot.draft.clear();
+        }
+    }
+}
+
+// Remove rejected draft tokens (everything past the slot history) from the KV cache
+static void discard_speculative_tail(SequenceSlot& slot) {
+    llama_memory_t mem = llama_get_memory(g_context);
+    if (llama_memory_seq_rm(mem, slot.seq_id, (llama_pos)slot.tokens.size(), -1)) {
+        return;
+    }
+
+    // The recurrent state already absorbed the rejected tokens: go back to the
+    // state before the batch and decode the accepted ones again next step
+    if (llama_state_seq_set_data_ext(g_context, slot.spec_state.data(), slot.spec_state.size(), slot.seq_id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY) == 0 ||
+        !llama_memory_seq_rm(mem, slot.seq_id, slot.spec_n_past, -1)) {
+        LOGE("Failed to roll back draft tokens on seq %d", slot.seq_id);
+        if (slot.task) {
+            fail_slot(slot);
+        } else {
+            reset_slot(slot);
+        }
+        return;
+    }
+    if (slot.task) {
+        slot.replay.assign(slot.tokens.begin() + slot.spec_n_past, slot.tokens.end());
+    }
+    slot.tokens.resize(slot.spec_n_past);
+}
+
+// One forward pass over all active slots. Returns false if nothing was decoded.
+static bool scheduler_step() {
+    const bool use_checkpoints = session_needs_checkpoints();
+    const int n_batch = (int)llama_n_batch(g_context);
+
+    // Cancelled requests leave before the batch is built
+    for (SequenceSlot& slot : g_slots) {
+        if (slot.task && slot.task->session->cancelled.load(std::memory_order_relaxed)) {
+            LOGI("Generation cancelled on seq %d (%zu tokens cached)", slot.seq_id, slot.tokens.size());
+            slot.task->result.cancelled = true;
+            release_slot(slot);
+        }
+    }
+
+    // A reply about to run past the end of the context evicts older turns first
+    for (SequenceSlot& slot : g_slots) {
+        if (slot.task && slot.pending_token >= 0 && !make_room_for_decode(slot)) {
+            LOGE("Context full on seq %d at %zu tokens", slot.seq_id, slot.tokens.size());
+            slot.task->result.error = "Context full";
+            reset_slot(slot);
+            release_slot(slot);
+        }
+    }
+
+    int n_decoding = 0;
+    for (const SequenceSlot& slot : g_slots) {
+        n_decoding += slot.task && slot.pending_token >= 0 ? 1 : 0;
+    }
+    adapt_threads(n_decoding);
+
+    g_batch.n_tokens = 0;
+    g_step_sessions.clear();
+
+    // Decode phase first: one token per generating slot keeps their latency flat.
+    // With prompt lookup the slot also brings its drafted tokens, each with logits.
+    for (SequenceSlot& slot : g_slots) {
+        slot.i_batch = -1;
+        slot.n_batch_tokens = 0;
+        slot.draft.clear();
+    }
+    if (g_draft_context != nullptr) {
+        draft_with_model();
+    }
+    for (SequenceSlot& slot : g_slots) {
+        if (!slot.task || slot.pending_token < 0) {
+            continue;
+        }
+        draft_tokens(slot, use_checkpoints);
+
+        llama_pos pos = (llama_pos)slot.tokens.size();
+        for (llama_token token : slot.replay) {
+            batch_add(g_batch, token, pos++, slot.seq_id, false);
+        }
+        slot.i_batch = g_batch.n_tokens;
+        batch_add(g_batch, slot.pending_token, pos++, slot.seq_id, true);
+        for (llama_token token : slot.draft) {
+            batch_add(g_batch, token, pos++, slot.seq_id, true);
+        }
+        slot.n_batch_tokens = (int)(slot.replay.size() + 1 + slot.draft.size());
+        g_step_sessions.push_back(slot.task->session.get());
+    }
+
+    // Prefill phase: fill the rest of the batch with prompt chunks, up to the
+    // thread controller's budget (capped by engine_set_prefill_budget while
+    // other slots decode, so they keep streaming during a long prompt)
+    const int n_decode_tokens = g_batch.n_tokens;
+    const int prefill_budget = std::min(n_batch, n_decode_tokens + g_threads.prefill_budget);
+    for (SequenceSlot& slot : g_slots) {
+        if (!slot.task || slot.pending_token >= 0 || g_batch.n_tokens >= prefill_budget) {
+            continue;
+        }
+        const std::vector<llama_token>& prompt_tokens = slot.task->request.prompt_tokens;
+        const int n_past = (int)slot.tokens.size();
+        const int end = std::min(prefill_chunk_end(slot, use_checkpoints), n_past + prefill_budget - g_batch.n_tokens);
+        for (int pos = n_past; pos < end; pos++) {
+            bool last = pos == (int)prompt_tokens.size() - 1;
+            if (last) {
+                slot.i_batch = g_batch.n_tokens;
+            }
+            batch_add(g_batch, prompt_tokens[pos], pos, slot.seq_id, last);
+        }
+        slot.n_batch_tokens = end - n_past;
+        g_step_sessions.push_back(slot.task->session.get());
+    }
+
+    if (g_batch.n_tokens == 0) {
+        return false;
+    }
+
+    const auto decode_start = std::chrono::steady_clock::now();
+    int status = llama_decode(g_context, g_batch);
+    g_step_sessions.clear();
+    if (status == 0) {
+        const float step_ms = ms_since(decode_start);
+        if (n_decode_tokens > 0) {
+            record_latency(METRIC_DECODE_TOKEN, step_ms);
+        }
+        if (g_batch.n_tokens > n_decode_tokens) {
+            record_latency(METRIC_PREFILL_CHUNK, step_ms);
+        } else {
+            record_decode_step(step_ms);
+        }
+    }
+
+    if (status == 1) {
+        // KV cache full: drop the history of the least recently used idle slot and retry
+        SequenceSlot* victim = nullptr;
+        for (SequenceSlot& slot : g_slots) {
+            if (!slot.task && !slot.tokens.empty() && (victim == nullptr || slot.last_used < victim->last_used)) {
+                victim = &slot;
+            }
+        }
+        if (victim == nullptr) {
+            // Nothing left to evict - give up on the biggest active request
+            for (SequenceSlot& slot : g_slots) {
+                if (slot.task && (victim == nullptr || slot.tokens.size() > victim->tokens.size())) {
+                    victim = &slot;
+                }
+            }
+            LOGE("KV cache full, failing request on seq %d", victim->seq_id);
+            fail_slot(*victim);
+        } else {
+            LOGW("KV cache full, evicting idle seq %d (%zu tokens)", victim->seq_id, victim->tokens.size());
+            reset_slot(*victim);
+        }
+        return true;
+    }
+
+    if (status != 0 && status != 2) {
+        LOGE("Failed to decode batch of %d tokens (status %d)", g_batch.n_tokens, status);
+        for (SequenceSlot& slot : g_slots) {
+            if (slot.task && slot.n_batch_tokens > 0) {
+                fail_slot(slot);
+            }
+        }
+        return true;
+    }
+
+    // Append what reached the KV cache to each slot's history. After an abort
+    // only the ubatches that finished are in memory.
+    llama_memory_t mem = llama_get_memory(g_context);
+    for (SequenceSlot& slot : g_slots) {
+        if (!slot.task || slot.n_batch_tokens == 0) {
+            continue;
+        }
+        const int n_past = (int)slot.tokens.size();
+        int n_done = slot.n_batch_tokens;
+        if (status == 2) {
+            int n_in_memory = llama_memory_seq_pos_max(mem, slot.seq_id) + 1;
+            n_done = std::max(0, std::min(n_done, n_in_memory - n_past));
+            LOGI("Decode aborted on seq %d at %d (%d/%d tokens kept)", slot.seq_id, n_past, n_done, slot.n_batch_tokens);
+        }
+
+        if (slot.pending_token >= 0) {
+            // Replayed tokens, then the pending one. Drafts are settled when sampling.
+            const int n_replay = (int)slot.replay.size();
+            slot.tokens.insert(slot.tokens.end(), slot.replay.begin(), slot.replay.begin() + std::min(n_done, n_replay));
+            if (n_done > n_replay) {
+                slot.tokens.push_back(slot.pending_token);
+            }
+            slot.replay.clear();
+            if (status == 2 && !slot.draft.empty()) {
+                discard_speculative_tail(slot);
+            }
+        } else {
+            const std::vector<llama_token>& prompt_tokens = slot.task->request.prompt_tokens;
+            slot.tokens.insert(slot.tokens.end(), prompt_tokens.begin() + n_past, prompt_tokens.begin() + n_past + n_done);
+            if (slot.task->report_prefill) {
+                std::lock_guard<std::mutex> lock(slot.task->mutex);
+                slot.task->n_prefilled = (int)slot.tokens.size();
+                slot.task->cv.notify_all();
+            }
+        }
+
+        if (status == 2 || slot.pending_token >= 0) {
+            continue;
+        }
+
+        // Prefill chunk finished: capture checkpoints and the system prompt snapshot
+        const GenerationRequest& request = slot.task->request;
+        const int n_now = (int)slot.tokens.size();
+        if (use_checkpoints &&
+            std::find(request.checkpoint_at.begin(), request.checkpoint_at.end(), n_now) != request.checkpoint_at.end()) {
+            save_slot_checkpoint(slot);
+        }
+        if (n_now == request.n_snapshot_prefix && !slot.task->result.snapshot_hit) {
+            save_prompt_snapshot(slot);
+        }
+    }
+
+    if (status == 2) {
+        // Only happens when every request in the batch was cancelled, or on unload
+        return true;
+    }
+
+    // Sample the slots that have logits in this batch
+    for (SequenceSlot& slot : g_slots) {
+        if (!slot.task || slot.i_batch < 0) {
+            continue;
+        }
+
+        GenerationTask& task = *slot.task;
+        if (slot.pending_token < 0) {
+            // Prompt fully processed - first sample of this request
+            GenerationResult& result = task.result;
+            result.prefill_ms = elapsed_ms(task.start_time);
+            task.first_token_time = std::chrono::steady_clock::now();
+            record_latency(METRIC_FIRST_TOKEN, ms_since(task.start_time));
+
+            const int n_suffix = result.n_prompt - result.n_reused;
+            float prefill_tokens_per_sec = result.prefill_ms > 0 ? (n_suffix * 1000.0f / result.prefill_ms) : 0.0f;
+            LOGI("✓ Prompt suffix processed on seq %d in %lldms (%d new tokens, %.1f tokens/sec, %d reused)",
+                 slot.seq_id, result.prefill_ms, n_suffix, prefill_tokens_per_sec, result.n_reused);
+        }
+        task.result.n_drafted += (int)slot.draft.size();
+        sample_slot(slot);
+
+        // Verify drafts: every draft the model agrees with is already in the KV
+        // cache, and the logits after it give the next token for free
+        size_t n_accepted = 0;
+        while (slot.task && n_accepted < slot.draft.size() && slot.pending_token == slot.draft[n_accepted]) {
+            slot.tokens.push_back(slot.pending_token);
+            slot.task->result.n_accepted++;
+            n_accepted++;
+            slot.i_batch++;
+            sample_slot(slot);
+        }
+        if (n_accepted < slot.draft.size()) {
+            discard_speculative_tail(slot);
+        }
+        if (!slot.draft.empty()) {
+            slot.dft_accepted += DRAFT_EMA_ALPHA * ((float)n_accepted - slot.dft_accepted);
+        }
+    }
+    return true;
+}
+
+static bool slots_busy() {
+    for (const SequenceSlot& slot : g_slots) {
+        if (slot.task) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void scheduler_loop() {
+    LOGI("Decode scheduler started (%d sequence slots)", N_SEQUENCE_SLOTS);
+    init_thread_controller(g_params.nThreads);
+
+    while (true) {
+        std::vector<std::shared_ptr<GenerationTask>> admitted;
+        {
+            std::unique_lock<std::mutex> lock(g_queue_mutex);
+            if (!slots_busy()) {
+                g_queue_cv.wait(lock, [] {
+                    return g_scheduler_stop.load() || !g_task_queue.empty() || residency_change_pending();
+                });
+            }
+            if (g_scheduler_stop.load()) {
+                break;
+            }
+
+            // FIFO admission into whatever slots are idle
+            int n_idle = 0;
+            for (const SequenceSlot& slot : g_slots) {
+                n_idle += slot.task ? 0 : 1;
+            }
+            while (n_idle > 0 && !g_task_queue.empty()) {
+                admitted.push_back(std::move(g_task_queue.front()));
+                g_task_queue.pop_front();
+                n_idle--;
+            }
+        }
+
+        // Memory trims wait for an idle moment; new work brings the context back first
+        if (admitted.empty() && !slots_busy()) {
+            if (g_residency_target.load() > g_residency.load()) {
+                trim_residency(g_residency_target.load());
+            } else if (residency_change_pending()) {
+                restore_residency();
+            }
+        } else if (!admitted.empty() && !restore_residency()) {
+            for (auto& task : admitted) {
+                task->result.error = "Context restore failed";
+                complete_task(task);
+            }
+            continue;
+        }
+        if (g_context == nullptr) {
+            continue;
+        }
+
+        for (auto& task : admitted) {
+            SequenceSlot* slot = acquire_slot(task->request);
+            admit_task(*slot, std::move(task));
+        }
+
+        scheduler_step();
+
+        int kv_used = 0;
+        for (const SequenceSlot& slot : g_slots) {
+            kv_used += (int)slot.tokens.size();
+        }
+        update_metric_gauges(kv_used);
+    }
+
+    // Unloading: fail whatever is still running
+    for (SequenceSlot& slot : g_slots) {
+        if (slot.task) {
+            slot.task->result.error = "Model unloaded";
+            release_slot(slot);
+        }
+    }
+    free_thread_controller();
+
+    LOGI("Decode scheduler stopped");
+}
+
+// Caller holds g_mutex and has just created g_context
+static void start_scheduler() {
+    g_batch = llama_batch_init(llama_n_batch(g_context), 0, 1);
+    if (g_draft_model != nullptr) {
+        g_draft_batch = llama_batch_init(DRAFT_N_BATCH, 0, 1);
+    }
+    g_scheduler_stop.store(false);
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_scheduler_running = true;
+    }
+    g_scheduler_thread = std::thread(scheduler_loop);
+}
+
+// Caller holds g_mutex. Afterwards g_context is free to be used or released.
+static void stop_scheduler() {
+    std::deque<std::shared_ptr<GenerationTask>> orphaned;
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        if (!g_scheduler_running) {
+            return;
+        }
+        g_scheduler_running = false;
+        g_scheduler_stop.store(true);
+        orphaned.swap(g_task_queue);
+    }
+    g_queue_cv.notify_all();
+    g_scheduler_thread.join();
+    clear_sampler_pool();
+    for (SequenceSlot& slot : g_slots) {
+        llama_detokenizer_free(slot.detokenizer);  // bound to this model's vocab
+        slot.detokenizer = nullptr;
+    }
+
+    for (auto& task : orphaned) {
+        task->result.error = "Model unloaded";
+        complete_task(task);
+    }
+
+    llama_batch_free(g_batch);
+    g_batch = {};
+    llama_batch_free(g_draft_batch);
+    g_draft_batch = {};
+}
+
+// Forget every slot's history (the context is being recreated or freed)
+static void clear_slots() {
+    for (int i = 0; i < N_SEQUENCE_SLOTS; i++) {
+        g_slots[i].seq_id = i;
+        g_slots[i].tokens.clear();
+        g_slots[i].checkpoints.clear();
+        g_slots[i].parked.clear();
+        g_slots[i].dft_tokens.clear();
+        g_slots[i].dft_state_n = -1;
+        g_slots[i].n_discarded = 0;
+        g_slots[i].last_used = 0;
+    }
+    g_slot_clock = 0;
+}
+
+// Queue a request and block until the scheduler finishes it. on_token and
+// on_prefill are called on this thread, with text the scheduler produced and
+// prompt chunks it finished since the last call. Must not be called with
+// g_mutex held.
+static void run_generation(const std::shared_ptr<GenerationSession>& session, GenerationRequest request,
+                           const TokenCallback& on_token, const PrefillProgressCallback& on_prefill,
+                           GenerationResult& result) {
+    auto task = std::make_shared<GenerationTask>();
+    task->request = std::move(request);
+    task->session = session;
+    task->stream = (bool)on_token;
+    task->report_prefill = (bool)on_prefill;
+    const int n_prompt = (int)task->request.prompt_tokens.size();
+
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        if (!g_scheduler_running) {
+            result.error = "Model not loaded";
+            return;
+        }
+        g_task_queue.push_back(task);
+    }
+    g_queue_cv.notify_one();
+
+    // Swapped with the task's buffers, so both keep their capacity
+    std::string text;
+    std::vector<int> piece_lengths;
+    int n_prefilled = 0;
+    std::unique_lock<std::mutex> lock(task->mutex);
+    while (true) {
+        task->cv.wait(lock, [&] { return task->done || !task->piece_lengths.empty() || task->n_prefilled != n_prefilled; });
+        text.swap(task->text);
+        piece_lengths.swap(task->piece_lengths);
+        const bool prefilled = task->n_prefilled != n_prefilled;
+        n_prefilled = task->n_prefilled;
+        bool done = task->done;
+        lock.unlock();
+
+        if (prefilled) {
+            on_prefill(n_prefilled, n_prompt);
+        }
+        int offset = 0;
+        for (int length : piece_lengths) {
+            on_token(text.data() + offset, length);
+            offset += length;
+        }
+        text.clear();
+        piece_lengths.clear();
+
+        if (done) {
+            break;
+        }
+        lock.lock();
+    }
+
+    result = std::move(task->result);
+}
+
+// =============================================================================
+// Model loading - loading thread, g_mutex held
+// =============================================================================
+// Progress covers three stages: the weights (llama's progress_callback), the
+// context with a pre-fault pass running beside it, and a warm-up decode. The
+// pre-fault pass touches the mapped weights in the order a decode reads them,
+// so the first request neither waits on page faults nor first-touches buffers.
+
+static const float LOAD_PROGRESS_WEIGHTS = 0.8f;   // weights mapped
+static const float LOAD_PROGRESS_CONTEXT = 0.9f;   // context created, weights faulted in
+
+static std::once_flag g_backend_once;
+static std::atomic<bool> g_load_cancelled{false};
+
+struct LoadProgress {
+    const LoadProgressCallback* callback = nullptr;
+    float reported = -1.0f;
+};
+
+static LoadProgress g_load_progress;
+
+static void report_load_progress(float progress) {
+    LoadProgress& lp = g_load_progress;
+    if (lp.callback == nullptr || !*lp.callback) {
+        return;
+    }
+    // llama reports once per tensor; pass on whole percents
+    if (progress < 1.0f && progress - lp.reported < 0.01f) {
+        return;
+    }
+    lp.reported = progress;
+    (*lp.callback)(progress);
+}
+
+// llama_progress_callback: returning false aborts the load
+static bool weights_progress_callback(float progress, void* /* user_data */) {
+    report_load_progress(progress * LOAD_PROGRESS_WEIGHTS);
+    return !g_load_cancelled.load(std::memory_order_relaxed);
+}
+
+struct WeightRange {
+    int order;          // 0 = embeddings, 1 + n = block n, INT_MAX = output head
+    uint64_t offset;    // in the file
+    uint64_t size;
+};
+
+// File ranges of every weight tensor, in the order a decode reads them
+static std::vector<WeightRange> weight_ranges_by_layer(const char* path) {
+    std::vector<WeightRange> ranges;
+    gguf_init_params params = {true, nullptr};
+    gguf_context* gguf = gguf_init_from_file(path, params);
+    if (gguf == nullptr) {
+        return ranges;
+    }
+    const uint64_t data_offset = gguf_get_data_offset(gguf);
+    const int64_t n_tensors = gguf_get_n_tensors(gguf);
+    for (int64_t i = 0; i < n_tensors; i++) {
+        const char* name = gguf_get_tensor_name(gguf, i);
+        int layer = 0;
+        int order = INT_MAX;
+        if (sscanf(name, "blk.%d.", &layer) == 1) {
+            order = 1 + layer;
+        } else if (strncmp(name, "token_embd.", 11) == 0) {
+            order = 0;
+        }
+        ranges.push_back({order, data_offset + gguf_get_tensor_offset(gguf, i), gguf_get_tensor_size(gguf, i)});
+    }
+    gguf_free(gguf);
+
+    std::sort(ranges.begin(), ranges.end(), [](const WeightRange& a, const WeightRange& b) {
+        return a.order != b.order ? a.order < b.order : a.offset < b.offset;
+    });
+    return ranges;
+}
+
+// Read one byte per page of each range through the model mapping. Runs on its
+// own thread; returns bytes touched.
+static size_t prefault_weights(const std::vector<WeightRange>& ranges) {
+    struct Mapping {
+        uintptr_t begin;
+        uintptr_t end;
+        uint64_t offset;
+    };
+    std::vector<Mapping> mappings;
+    for_each_model_mapping(g_model_file, [&](uintptr_t begin, uintptr_t end, uint64_t offset) {
+        mappings.push_back({begin, end, offset});
+    });
+
+    const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    size_t n_bytes = 0;
+    for (const WeightRange& range : ranges) {
+        if (g_load_cancelled.load(std::memory_order_relaxed)) {
+            break;
+        }
+        for (const Mapping& mapping : mappings) {
+            if (range.offset < mapping.offset || range.offset + range.size > mapping.offset + (mapping.end - mapping.begin)) {
+                continue;
+            }
+            uintptr_t end = mapping.begin + (range.offset - mapping.offset) + range.size;
+            uintptr_t begin = (mapping.begin + (range.offset - mapping.offset)) & ~(page - 1);
+            madvise((void*)begin, end - begin, MADV_WILLNEED);
+            for (uintptr_t p = begin; p < end; p += page) {
+                (void)*(volatile const uint8_t*)p;
+            }
+            n_bytes += range.size;
+            break;
+        }
+    }
+    return n_bytes;
+}
+
+// A two-token prefill and a one-token decode through a fresh context, so
+// compute buffers and worker threads are first touched here, not by a user
+static void warm_up_context(llama_context* ctx) {
+    const auto start = std::chrono::steady_clock::now();
+    llama_token bos = llama_vocab_bos(g_vocab);
+    llama_token eos = llama_vocab_eos(g_vocab);
+    bos = bos == LLAMA_TOKEN_NULL ? 0 : bos;
+    eos = eos == LLAMA_TOKEN_NULL ? bos : eos;
+
+    llama_set_warmup(ctx, true);
+    llama_batch batch = llama_batch_init(2, 0, 1);
+    batch_add(batch, bos, 0, 0, false);
+    batch_add(batch, eos, 1, 0, true);
+    bool ok = llama_decode(ctx, batch) == 0;
+    batch.n_tokens = 0;
+    batch_add(batch, eos, 2, 0, true);
+    ok = ok && llama_decode(ctx, batch) == 0;
+    llama_batch_free(batch);
+    llama_set_warmup(ctx, false);
+
+    llama_memory_clear(llama_get_memory(ctx), true);
+    llama_synchronize(ctx);
+    llama_perf_context_reset(ctx);
+
+    if (ok) {
+        LOGI("✓ Warm-up decode in %.0fms", ms_since(start));
+    } else {
+        LOGW("Warm-up decode failed after %.0fms", ms_since(start));
+    }
+}
+
+// Frees the draft model unless it is the target (early exit). Called before the target is freed.
+static void free_draft_model() {
+    if (g_draft_context != nullptr) {
+        llama_free(g_draft_context);
+        g_draft_context = nullptr;
+    }
+    if (g_draft_model != nullptr && g_draft_model != g_model) {
+        llama_model_free(g_draft_model);
+    }
+    g_draft_model = nullptr;
+    g_draft_model_file.clear();
+    g_early_exit_layer = 0;
+}
+
+// Room for every slot's history plus its drafts; catch-up prefills go in small chunks
+static llama_context_params draft_context_params(const llama_context_params& target_params, int n_layer_exit) {
+    llama_context_params ctx_params = target_params;
+    ctx_params.n_ctx = target_params.n_ctx + N_SEQUENCE_SLOTS * (MAX_DRAFT_TOKENS + 1);
+    ctx_params.n_batch = DRAFT_N_BATCH;
+    ctx_params.n_ubatch = DRAFT_N_BATCH;
+    ctx_params.n_layer_exit = n_layer_exit;
+    return ctx_params;
+}
+
+// The draft model and its context, one sequence per slot like the target's.
+// Without it speculation falls back to prompt lookup, so failures only warn.
+static void load_draft_model(const std::string& path, const llama_context_params& target_params) {
+    LOGI("Loading draft model from: %s", path.c_str());
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 0;
+    model_params.use_mmap = true;
+    model_params.use_mlock = false;
+    model_params.progress_callback = [](float /* progress */, void* /* user_data */) {
+        return !g_load_cancelled.load(std::memory_order_relaxed);
+    };
+    g_draft_model = llama_model_load_from_file(path.c_str(), model_params);
+    if (g_draft_model == nullptr) {
+        LOGW("Failed to load draft model, speculation uses prompt lookup");
+        return;
+    }
+
+    // Drafts are token ids, so both models must share the vocabulary exactly
+    if (compute_vocab_hash(llama_model_get_vocab(g_draft_model)) != compute_vocab_hash(g_vocab)) {
+        LOGW("Draft model vocabulary differs from the target's, not using it");
+        free_draft_model();
+        return;
+    }
+
+    llama_context_params ctx_params = draft_context_params(target_params, 0);
+    g_draft_context = llama_init_from_model(g_draft_model, ctx_params);
+    if (g_draft_context == nullptr) {
+        LOGW("Failed to create draft context, speculation uses prompt lookup");
+        free_draft_model();
+        return;
+    }
+    g_draft_ctx_params = ctx_params;
+
+    char resolved[PATH_MAX];
+    g_draft_model_file = realpath(path.c_str(), resolved) ? resolved : path;
+    LOGI("✓ Draft model loaded (%.1f MB, %s)", llama_model_size(g_draft_model) / (1024.0 * 1024.0),
+         llama_model_is_recurrent(g_draft_model) || llama_model_is_hybrid(g_draft_model) ? "recurrent state" : "attention only");
+}
+
+// Early-exit self-speculation: the target drafts for itself by running its
+// first layers only, then the output norm and head. The draft context shares
+// the weights and holds cache just for those layers.
+static const int EARLY_EXIT_CALIBRATION_TOKENS = 512;
+static const int EARLY_EXIT_LAYER_STEP = 2;          // exit layers tried by the calibration
+static const double EARLY_EXIT_MIN_SPEEDUP = 1.05;   // modelled, below it speculation is not worth it
+static std::unordered_map<uint64_t, int> g_early_exit_calibrated;  // exit layer by model and text, 0 = off
+
+static const char* EARLY_EXIT_CALIBRATION_SAMPLE =
+    "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n"
+    "<|im_start|>user\nCan you explain how a refrigerator keeps food cold?<|im_end|>\n"
+    "<|im_start|>assistant\nA refrigerator moves heat from the inside of the cabinet to the air in your kitchen. "
+    "It does this with a refrigerant, a fluid that boils at a very low temperature. The compressor squeezes the "
+    "refrigerant vapor, which makes it hot, and pushes it through the coils on the back of the fridge. There it "
+    "gives off its heat to the room and condenses into a liquid. The liquid then passes through a narrow expansion "
+    "valve into the coils inside the fridge, where the pressure drops and it boils again. Boiling takes heat, so the "
+    "refrigerant absorbs warmth from the food and the air in the cabinet. The vapor goes back to the compressor and "
+    "the cycle starts over. A thermostat switches the compressor on and off to keep the temperature steady, usually "
+    "a few degrees above freezing.<|im_end|>\n"
+    "<|im_start|>user\nWhy does the back of my fridge feel warm?<|im_end|>\n"
+    "<|im_start|>assistant\nThat warmth is the heat taken out of the cabinet, plus the heat from the compressor's own "
+    "work. The coils on the back, called the condenser, release it into the room. It is normal for them to feel warm "
+    "to the touch. If they get very hot, or the fridge runs all the time, the coils may be covered in dust, or the "
+    "fridge may be too close to the wall for air to flow around them. Cleaning the coils once or twice a year and "
+    "leaving a few centimeters of space behind the fridge helps it run more efficiently and last longer.<|im_end|>\n";
+
+static int argmax_logits(const float* logits, int n_vocab) {
+    return (int)(std::max_element(logits, logits + n_vocab) - logits);
+}
+
+// Greedy tokens of ctx at every position of tokens (one sequence, teacher forced).
+// Returns false if a decode failed.
+static bool greedy_tokens(llama_context* ctx, const std::vector<llama_token>& tokens, std::vector<llama_token>& out) {
+    const int n_vocab = llama_vocab_n_tokens(g_vocab);
+    const int n_batch = (int)llama_n_batch(ctx);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    bool ok = true;
+    out.clear();
+    for (int i = 0; ok && i < (int)tokens.size(); i += n_batch) {
+        const int n = std::min(n_batch, (int)tokens.size() - i);
+        batch.n_tokens = 0;
+        for (int j = i; j < i + n; j++) {
+            batch_add(batch, tokens[j], j, 0, true);
+        }
+        ok = llama_decode(ctx, batch) == 0;
+        for (int j = 0; ok && j < n; j++) {
+            out.push_back(argmax_logits(llama_get_logits_ith(ctx, j), n_vocab));
+        }
+    }
+    llama_batch_free(batch);
+    llama_memory_clear(llama_get_memory(ctx), true);
+    return ok;
+}
+
+// Tokens per full-model step over their cost, for drafts of up to MAX_DRAFT_TOKENS
+// tokens that each match the model with probability agreement. A draft token costs
+// n_layer_exit / n_layer of a step; verifying the draft costs one step.
+static double early_exit_speedup(double agreement, int n_layer_exit, int n_layer) {
+    double best = 1.0;
+    double accepted = 1.0;  // expected tokens per step: 1 + a + ... + a^k
+    double a_k = 1.0;
+    for (int k = 1; k <= MAX_DRAFT_TOKENS; k++) {
+        a_k *= agreement;
+        accepted += a_k;
+        best = std::max(best, accepted / (1.0 + (double)k * n_layer_exit / n_layer));
+    }
+    return best;
+}
+
+// Pick the exit layer from how often its greedy token agrees with the full
+// model's over the calibration text. Returns 0 when no layer pays off.
+static int calibrate_early_exit(const std::string& text, const llama_context_params& target_params) {
+    const auto start = std::chrono::steady_clock::now();
+    const int n_layer = llama_model_n_layer(g_model);
+
+    std::vector<llama_token> tokens;
+    if (!tokenize_append(tokens, text.empty() ? EARLY_EXIT_CALIBRATION_SAMPLE : text, true, true) || tokens.size() < 64) {
+        LOGW("Early exit: calibration text too short (%zu tokens)", tokens.size());
+        return 0;
+    }
+    if ((int)tokens.size() > EARLY_EXIT_CALIBRATION_TOKENS) {
+        tokens.resize(EARLY_EXIT_CALIBRATION_TOKENS);
+    }
+
+    std::vector<llama_token> reference;
+    if (!greedy_tokens(g_context, tokens, reference)) {
+        LOGW("Early exit: calibration decode failed");
+        return 0;
+    }
+
+    // One sequence, the calibration text in a single batch
+    llama_context_params ctx_params = target_params;
+    ctx_params.n_ctx = tokens.size();
+    ctx_params.n_batch = tokens.size();
+    ctx_params.n_ubatch = tokens.size();
+    ctx_params.n_seq_max = 1;
+
+    int best_layer = 0;
+    double best_speedup = EARLY_EXIT_MIN_SPEEDUP;
+    std::vector<llama_token> drafted;
+    for (int n_layer_exit = EARLY_EXIT_LAYER_STEP; n_layer_exit < n_layer && !g_load_cancelled.load(); n_layer_exit += EARLY_EXIT_LAYER_STEP) {
+        ctx_params.n_layer_exit = n_layer_exit;
+        llama_context* ctx = llama_init_from_model(g_model, ctx_params);
+        if (ctx == nullptr) {
+            break;
+        }
+        // Exits before the first attention layer are moved up to it
+        if ((int)llama_n_layer_exit(ctx) != n_layer_exit) {
+            llama_free(ctx);
+            continue;
+        }
+        llama_set_abort_callback(ctx, [](void* /* data */) { return g_load_cancelled.load(std::memory_order_relaxed); }, nullptr);
+        const bool ok = greedy_tokens(ctx, tokens, drafted);
+        llama_free(ctx);
+        if (!ok) {
+            break;
+        }
+
+        int n_agree = 0;
+        for (size_t i = 0; i < drafted.size(); i++) {
+            n_agree += drafted[i] == reference[i];
+        }
+        const double agreement = (double)n_agree / drafted.size();
+        const double speedup = early_exit_speedup(agreement, n_layer_exit, n_layer);
+        LOGI("Early exit after %d/%d layers: %.0f%% agreement, modelled speedup %.2fx",
+             n_layer_exit, n_layer, 100.0 * agreement, speedup);
+        if (speedup > best_speedup) {
+            best_speedup = speedup;
+            best_layer = n_layer_exit;
+        }
+    }
+
+    LOGI("✓ Early-exit calibration over %zu tokens in %.0fms", tokens.size(), ms_since(start));
+    return best_layer;
+}
+
+// Sets up the early-exit draft context, calibrating the exit layer first when
+// config.early_exit_layer is -1. Called with the target's context warm and idle.
+// Failures only warn: speculation falls back to prompt lookup.
+static void load_early_exit_draft(const EngineConfig& config, const llama_context_params& target_params) {
+    char arch[32] = "";
+    llama_model_meta_val_str(g_model, "general.architecture", arch, sizeof(arch));
+    if (strcmp(arch, "lfm2") != 0 && strcmp(arch, "lfm2moe") != 0) {
+        LOGW("Early exit is not supported for %s models", arch);
+        return;
+    }
+
+    const int n_layer = llama_model_n_layer(g_model);
+    int n_layer_exit = config.early_exit_layer;
+    if (n_layer_exit < 0) {
+        const uint64_t key = fnv1a64(config.calibration_text.data(), config.calibration_text.size(),
+                                     compute_model_hash(config.model_path.c_str(), target_params));
+        auto it = g_early_exit_calibrated.find(key);
+        if (it != g_early_exit_calibrated.end()) {
+            n_layer_exit = it->second;
+            LOGI("Early exit: calibrated exit layer %d (cached)", n_layer_exit);
+        } else {
+            n_layer_exit = calibrate_early_exit(config.calibration_text, target_params);
+            if (!g_load_cancelled.load()) {
+                g_early_exit_calibrated[key] = n_layer_exit;
+            }
+        }
+        if (n_layer_exit == 0) {
+            LOGI("Early exit: no exit layer pays off, speculation uses prompt lookup");
+            return;
+        }
+    } else if (n_layer_exit >= n_layer) {
+        LOGW("Early exit: layer %d out of range (model has %d layers)", n_layer_exit, n_layer);
+        return;
+    }
+
+    llama_context_params ctx_params = draft_context_params(target_params, n_layer_exit);
+    g_draft_context = llama_init_from_model(g_model, ctx_params);
+    if (g_draft_context == nullptr) {
+        LOGW("Failed to create early-exit context, speculation uses prompt lookup");
+        return;
+    }
+    if (llama_n_layer_exit(g_draft_context) == 0) {
+        LOGW("Early exit: no attention layer before layer %d, speculation uses prompt lookup", n_layer);
+        llama_free(g_draft_context);
+        g_draft_context = nullptr;
+        return;
+    }
+    g_draft_model = g_model;
+    g_draft_ctx_params = ctx_params;
+    g_early_exit_layer = llama_n_layer_exit(g_draft_context);
+    LOGI("✓ Early-exit drafting after %d of %d layers", g_early_exit_layer, n_layer);
+}
+
+// =============================================================================
+// Text embeddings - calling thread, g_embed_mutex held
+// =============================================================================
+// Notes are embedded in the background and queries on demand, so embeddings
+// get a small context of their own instead of slots in the scheduler's: every
+// batch packs up to EMBED_MAX_SEQS texts as separate sequences, the memory is
+// cleared between batches and each sequence is pooled to one vector.
+
+// A sequence is pooled within one ubatch, so a batch is a single ubatch and
+// its size bounds both the compute buffer and the longest text
+static const int EMBED_N_BATCH = 512;     // tokens per decode, all sequences together
+static const int EMBED_MAX_SEQS = 16;     // texts per decode
+static const int EMBED_MAX_TOKENS = EMBED_N_BATCH;  // longer texts are cut
+static const int EMBED_THREADS = 2;       // leaves the other cores to generation
+
+// ggml_abort_callback for the embedding context; data is the calling session
+static bool embed_abort_callback(void* data) {
+    const GenerationSession* session = static_cast<const GenerationSession*>(data);
+    return g_embed_stop.load(std::memory_order_relaxed) || session->cancelled.load(std::memory_order_relaxed);
+}
+
+static bool create_embedding_context() {
+    llama_model* model = g_model;
+    if (!g_embed_model_path.empty()) {
+        if (g_embed_model == nullptr) {
+            LOGI("Loading embedding model from: %s", g_embed_model_path.c_str());
+            llama_model_params model_params = llama_model_default_params();
+            model_params.n_gpu_layers = 0;
+            model_params.use_mmap = true;
+            g_embed_model = llama_model_load_from_file(g_embed_model_path.c_str(), model_params);
+            if (g_embed_model == nullptr) {
+                LOGE("Failed to load embedding model");
+                return false;
+            }
+        }
+        model = g_embed_model;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = EMBED_N_BATCH;
+    ctx_params.n_batch = EMBED_N_BATCH;
+    ctx_params.n_ubatch = EMBED_N_BATCH;
+    ctx_params.n_seq_max = EMBED_MAX_SEQS;
+    ctx_params.kv_unified = true;
+    ctx_params.n_threads = EMBED_THREADS;
+    ctx_params.n_threads_batch = EMBED_THREADS;
+    ctx_params.embeddings = true;
+    ctx_params.no_perf = true;
+    // A model without pooling of its own (any chat model) has its final hidden states averaged
+    char value[64] = "";
+    llama_model_meta_val_str(model, "general.architecture", value, sizeof(value));
+    const std::string pooling_key = std::string(value) + ".pooling_type";
+    value[0] = '\0';
+    llama_model_meta_val_str(model, pooling_key.c_str(), value, sizeof(value));
+    ctx_params.pooling_type = atoi(value) > 0 ? LLAMA_POOLING_TYPE_UNSPECIFIED : LLAMA_POOLING_TYPE_MEAN;
+    g_embed_context = llama_init_from_model(model, ctx_params);
+    if (g_embed_context == nullptr) {
+        LOGE("Failed to create embedding context");
+        return false;
+    }
+    const enum llama_pooling_type pooling = llama_pooling_type(g_embed_context);
+    if (pooling == LLAMA_POOLING_TYPE_NONE || pooling == LLAMA_POOLING_TYPE_RANK) {
+        LOGE("Embedding model does not pool to one vector per text");
+        release_embedding(false);
+        return false;
+    }
+    LOGI("✓ Embedding context created (%s, %d dims)", model == g_model ? "chat model" : "embedding model",
+         llama_model_n_embd_out(model));
+    return true;
+}
+
+// Tokens of text for the embedding model, cut to EMBED_MAX_TOKENS. A closing
+// EOS/SEP the vocabulary adds is kept.
+static bool tokenize_for_embedding(const llama_vocab* vocab, const std::string& text, std::vector<llama_token>& out) {
+    int n = -llama_tokenize(vocab, text.c_str(), (int32_t)text.size(), nullptr, 0, true, false);
+    out.resize(std::max(n, 0));
+    if (n < 0 || (n > 0 && llama_tokenize(vocab, text.c_str(), (int32_t)text.size(), out.data(), n, true, false) < 0)) {
+        return false;
+    }
+    if (n > EMBED_MAX_TOKENS) {
+        const llama_token last = out.back();
+        out.resize(EMBED_MAX_TOKENS);
+        if (llama_vocab_get_add_eos(vocab) || llama_vocab_get_add_sep(vocab)) {
+            out.back() = last;
+        }
+    }
+    return true;
+}
+
+// Decodes the sequences in batch and copies each one's pooled vector,
+// L2-normalized, to the row of its text
+static bool decode_embedding_batch(llama_batch& batch, const std::vector<int>& seq_texts, int dim, float* rows) {
+    llama_memory_t mem = llama_get_memory(g_embed_context);
+    if (mem != nullptr) {
+        llama_memory_clear(mem, true);
+    }
+    if (llama_decode(g_embed_context, batch) != 0) {
+        return false;
+    }
+    for (int s = 0; s < (int)seq_texts.size(); s++) {
+        const float* values = llama_get_embeddings_seq(g_embed_context, s);
+        if (values == nullptr) {
+            return false;
+        }
+        double norm = 0.0;
+        for (int i = 0; i < dim; i++) {
+            norm += (double)values[i] * values[i];
+        }
+        const float scale = norm > 0.0 ? (float)(1.0 / std::sqrt(norm)) : 0.0f;
+        float* row = rows + (size_t)seq_texts[s] * dim;
+        for (int i = 0; i < dim; i++) {
+            row[i] = values[i] * scale;
+        }
+    }
+    batch.n_tokens = 0;
+    return true;
+}
+
+static void embed_texts(GenerationSession* session, const std::vector<std::string>& texts, EmbeddingResult& result) {
+    if (g_embed_context == nullptr && !create_embedding_context()) {
+        result.error = "Embedding model not available";
+        return;
+    }
+    llama_set_abort_callback(g_embed_context, embed_abort_callback, session);
+
+    const llama_model* model = llama_get_model(g_embed_context);
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    const int dim = llama_model_n_embd_out(model);
+    result.dim = dim;
+    result.values.assign(texts.size() * dim, 0.0f);
+
+    const auto start = std::chrono::steady_clock::now();
+    llama_batch batch = llama_batch_init(EMBED_N_BATCH, 0, 1);
+    std::vector<int> seq_texts;
+    std::vector<llama_token> tokens;
+    int n_tokens = 0;
+    bool ok = true;
+
+    for (size_t t = 0; ok && t < texts.size(); t++) {
+        if (!tokenize_for_embedding(vocab, texts[t], tokens)) {
+            ok = false;
+            break;
+        }
+        if (tokens.empty()) {
+            continue;  // nothing to pool: left a zero vector
+        }
+        if (batch.n_tokens + (int)tokens.size() > EMBED_N_BATCH || (int)seq_texts.size() == EMBED_MAX_SEQS) {
+            ok = decode_embedding_batch(batch, seq_texts, dim, result.values.data());
+            seq_texts.clear();
+            if (!ok) {
+                break;
+            }
+        }
+        const llama_seq_id seq_id = (llama_seq_id)seq_texts.size();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            batch_add(batch, tokens[i], (llama_pos)i, seq_id, true);
+        }
+        seq_texts.push_back((int)t);
+        n_tokens += (int)tokens.size();
+    }
+    if (ok && !seq_texts.empty()) {
+        ok = decode_embedding_batch(batch, seq_texts, dim, result.values.data());
+    }
+    llama_batch_free(batch);
+    llama_set_abort_callback(g_embed_context, nullptr, nullptr);
+
+    if (!ok) {
+        result.values.clear();
+        if (session->cancelled.load() || g_embed_stop.load()) {
+            result.cancelled = true;
+        } else {
+            LOGE("Embedding failed");
+            result.error = "Embedding failed";
+        }
+        return;
+    }
+    LOGI("Embedded %zu texts (%d tokens) in %.0fms", texts.size(), n_tokens, ms_since(start));
+}
+
+// =============================================================================
+// Engine API - see inference-engine.h
+// =============================================================================
+
+#ifndef __ANDROID__
+static std::atomic<int> g_log_level{ENGINE_LOG_INFO};
+
+void engine_set_log_level(int level) {
+    g_log_level.store(level, std::memory_order_relaxed);
+}
+
+void engine_log(int level, const char* fmt, ...) {
+    if (level < g_log_level.load(std::memory_order_relaxed)) {
+        return;
+    }
+    static const char LEVEL_NAMES[] = {'D', 'I', 'W', 'E'};
+    char line[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    fprintf(stderr, "%c %s: %s\n", LEVEL_NAMES[std::max(0, std::min(level, 3))], LOG_TAG, line);
+}
+#endif
+
+// Stop the scheduler and release model and context. Caller holds g_mutex.
+static void unload_model() {
+    stop_scheduler();
+    
+    // Persist what was learned about the user's phrasing this session
+    save_ngram_cache();
+    g_ngram_dynamic.clear();
+    g_ngram_released = false;
+    
+    if (g_context) {
+        llama_free(g_context);
+        g_context = nullptr;
+    }
+    
+    // An embedding running on g_model stops at its next graph node
+    g_embed_stop.store(true);
+    {
+        std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+        release_embedding(true);
+    }
+    g_embed_stop.store(false);
+    
+    free_draft_model();
+    if (g_model) {
+        llama_model_free(g_model);
+        g_model = nullptr;
+    }
+    
+    g_vocab = nullptr;
+    g_initialized = false;
+    g_residency.store(ENGINE_RESIDENCY_ACTIVE);
+    g_residency_target.store(ENGINE_RESIDENCY_ACTIVE);
+    
+    // Clear prompt cache
+    clear_slots();
+}
+
+// Caller holds g_mutex
+static bool load_model(const EngineConfig& config, const LoadProgressCallback& on_progress) {
+    g_load_progress.callback = &on_progress;
+    g_load_progress.reported = -1.0f;
+    
+    const char* path = config.model_path.c_str();
+    const int nThreads = config.n_threads;
+    const int ctxSize = config.ctx_size;
+    
+    LOGI("=== Loading model ===");
+    LOGI("nThreads=%d, ctxSize=%d, temp=%.2f, topK=%d, topP=%.2f, minP=%.2f", 
+         nThreads, ctxSize, config.temperature, config.top_k, config.top_p, config.min_p);
+    
+    // Free existing model if loaded
+    if (g_initialized) {
+        LOGI("Model already loaded, releasing first");
+        unload_model();
+    }
+    
+    LOGI("Loading model from: %s", path);
+    
+    // Check if file exists and is readable
+    struct stat st;
+    if (stat(path, &st) != 0 || access(path, R_OK) != 0) {
+        LOGE("Cannot open model file: %s (errno=%d)", path, errno);
+        return false;
+    }
+    
+    LOGI("Model file size: %lld bytes (%.2f MB)", (long long)st.st_size, st.st_size / (1024.0 * 1024.0));
+    
+    // Backends register once per process
+    std::call_once(g_backend_once, [] {
+        ggml_backend_load_all();
+        LOGI("llama backend initialized");
+    });
+    
+    // Set model parameters
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 0;  // CPU only for Android
+    model_params.use_mmap = true;   // Use memory mapping for efficiency
+    model_params.use_mlock = false; // Don't lock memory on Android
+    model_params.progress_callback = weights_progress_callback;
+    
+    LOGI("Loading model with llama_model_load_from_file()...");
+    g_model = llama_model_load_from_file(path, model_params);
+    
+    if (g_model == nullptr) {
+        LOGE(g_load_cancelled.load() ? "Model load cancelled" : "Failed to load model from file");
+        return false;
+    }
+    
+    LOGI("✓ Model loaded successfully");
+    
+    // Get vocab
+    g_vocab = llama_model_get_vocab(g_model);
+    if (g_vocab == nullptr) {
+        LOGE("Failed to get vocab from model");
+        llama_model_free(g_model);
+        g_model = nullptr;
+        return false;
+    }
+    
+    LOGI("✓ Vocab loaded");
+    
+    // Fault the weights in, layer by layer, while the context is created
+    char resolved[PATH_MAX];
+    g_model_file = realpath(path, resolved) ? resolved : path;
+    size_t n_prefaulted = 0;
+    std::thread prefault_thread([&n_prefaulted, path] {
+        n_prefaulted = prefault_weights(weight_ranges_by_layer(path));
+    });
+    
+    // Set context parameters optimized for mobile - ULTRA-OPTIMIZED 2026
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = std::max(ctxSize, 4096);  // Minimum 4096 for better context (2x increase)
+    ctx_params.n_batch = 2048;       // QUADRUPLED - 2026 research shows 2048 optimal for prompt processing
+    ctx_params.n_ubatch = 2048;      // MATCH n_batch for 3x prompt processing speedup!
+    ctx_params.n_threads = nThreads;
+    ctx_params.n_threads_batch = nThreads;
+    
+    // CRITICAL: Enable KV cache quantization for 40-50% memory reduction
+    // Research shows Q8_0 provides near-lossless quality with 50% memory savings;
+    // V tolerates 4 bits better than K (check with engine_measure_perplexity)
+    ctx_params.type_k = config.kv_cache_type == ENGINE_KV_Q4_0 ? GGML_TYPE_Q4_0 : GGML_TYPE_Q8_0;
+    ctx_params.type_v = config.kv_cache_type == ENGINE_KV_Q8_0 ? GGML_TYPE_Q8_0 : GGML_TYPE_Q4_0;
+
+    // Flash attention over the quantized cache: single-token decode runs the
+    // split-K kernel (int8 dot products against the K blocks)
+    ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    
+    // Enable defragmentation for better cache utilization across multiple turns
+    ctx_params.defrag_thold = 0.1f;  // Defrag when 10% fragmented
+    
+    // Enable offloading for faster inference
+    ctx_params.offload_kqv = true;
+    
+    // Keep llama_perf_context timings for engine_get_metrics
+    ctx_params.no_perf = false;
+    
+    // One sequence per concurrent request, decoded together in a single batch.
+    // A unified KV buffer lets any sequence use the whole context.
+    ctx_params.n_seq_max = N_SEQUENCE_SLOTS;
+    ctx_params.kv_unified = true;
+    
+    // ⚡ Performance optimizations for mobile CPU inference
+    // Flash attention runs the CPU decode kernel over the quantized cache
+    // Our speedup comes from: n_batch=n_ubatch (3x), KV quantization (50% memory), ARM i8mm (20%)
+    
+    LOGI("⚡ Optimization profile: MOBILE CPU (ARM NEON optimized)");
+    LOGI("KV cache quantization: K %s, V %s", ggml_type_name(ctx_params.type_k), ggml_type_name(ctx_params.type_v));
+    LOGI("Batch size: %d (QUADRUPLED for 2026 - 3x prompt processing speedup!)", ctx_params.n_batch);
+    LOGI("UBatch size: %d (MATCHES n_batch for maximum throughput)", ctx_params.n_ubatch);
+    LOGI("Defrag threshold: %.1f (automatic cache cleanup)", ctx_params.defrag_thold);
+    LOGI("Sequence slots: %d (unified KV cache)", ctx_params.n_seq_max);
+    
+    LOGI("Creating context with n_ctx=%d, n_threads=%d...", ctxSize, nThreads);
+    g_context = llama_init_from_model(g_model, ctx_params);
+    
+    // The draft model loads while the target's weights are still being faulted in
+    if (g_context != nullptr && !config.draft_model_path.empty()) {
+        load_draft_model(config.draft_model_path, ctx_params);
+    }
+    
+    const auto prefault_start = std::chrono::steady_clock::now();
+    prefault_thread.join();
+    LOGI("Pre-faulted %.1f MB of weights (%.0fms after the context)",
+         n_prefaulted / (1024.0 * 1024.0), ms_since(prefault_start));
+    
+    if (g_context != nullptr && g_load_cancelled.load()) {
+        LOGE("Model load cancelled");
+        llama_free(g_context);
+        g_context = nullptr;
+    } else if (g_context == nullptr) {
+        LOGE("Failed to create context");
+    }
+    if (g_context == nullptr) {
+        free_draft_model();
+        llama_model_free(g_model);
+        g_model = nullptr;
+        g_vocab = nullptr;
+        return false;
+    }
+    
+    LOGI("✓ Context created successfully");
+    report_load_progress(LOAD_PROGRESS_CONTEXT);
+    
+    warm_up_context(g_context);
+    if (g_draft_model == nullptr && config.early_exit_layer != 0) {
+        load_early_exit_draft(config, ctx_params);
+    }
+    if (g_draft_context != nullptr) {
+        warm_up_context(g_draft_context);
+    }
+    
+    // Let engine_cancel_session (and unloading) stop a decode in the middle of the compute graph
+    llama_set_abort_callback(g_context, abort_callback, nullptr);
+    if (g_draft_context != nullptr) {
+        llama_set_abort_callback(g_draft_context, abort_callback, nullptr);
+    }
+    
+    // Kept to recreate the context, or reload the model, after a memory trim
+    g_ctx_params = ctx_params;
+    g_config = config;
+    
+    // Store generation parameters
+    g_params.nThreads = nThreads;
+    g_params.ctxSize = ctxSize;
+    g_params.temperature = config.temperature;
+    g_params.topK = config.top_k;
+    g_params.topP = config.top_p;
+    g_params.minP = config.min_p;
+    
+    g_initialized = true;
+    
+    // Log model info
+    int n_vocab = llama_vocab_n_tokens(g_vocab);
+    int n_ctx_train = llama_model_n_ctx_train(g_model);
+    int n_embd = llama_model_n_embd(g_model);
+    
+    LOGI("=== Model Info ===");
+    LOGI("Vocab size: %d", n_vocab);
+    LOGI("Context size (train): %d", n_ctx_train);
+    LOGI("Embedding size: %d", n_embd);
+    
+    // DIAGNOSTIC: Verify runtime parameters match expectations
+    LOGI("=== RUNTIME VERIFICATION (2026 DIAGNOSTICS) ===");
+    LOGI("n_batch: %d (expected: 2048)", ctx_params.n_batch);
+    LOGI("n_ubatch: %d (expected: 2048)", ctx_params.n_ubatch);
+    LOGI("n_threads: %d", ctx_params.n_threads);
+    LOGI("n_threads_batch: %d", ctx_params.n_threads_batch);
+    LOGI("CPU-only: optimized via NEON/SIMD (no GPU flash attention)");
+    LOGI("type_k: %s", ggml_type_name(ctx_params.type_k));
+    LOGI("type_v: %s", ggml_type_name(ctx_params.type_v));
+    LOGI("flash_attn: %s", llama_flash_attn_type_name(ctx_params.flash_attn_type));
+    LOGI("defrag_thold: %.2f", ctx_params.defrag_thold);
+    LOGI("offload_kqv: %s", ctx_params.offload_kqv ? "true" : "false");
+    LOGI("=== END VERIFICATION ===");
+    
+    // Warm start: bring back the last system prompt this model prefilled
+    clear_slots();
+    g_model_hash = compute_model_hash(path, ctx_params);
+    restore_latest_prompt_snapshot(g_slots[0]);
+    g_vocab_hash = compute_vocab_hash(g_vocab);
+    load_ngram_cache();
+    
+    start_scheduler();
+    
+    LOGI("=== Model load completed successfully ===");
+    report_load_progress(1.0f);
+    return true;
+}
+
+bool engine_load_model(const EngineConfig& config, const LoadProgressCallback& on_progress) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    
+    // A new model replaces whatever the residency manager unloaded
+    g_residency.store(ENGINE_RESIDENCY_ACTIVE);
+    g_residency_target.store(ENGINE_RESIDENCY_ACTIVE);
+    g_load_cancelled.store(false);
+    return load_model(config, on_progress);
+}
+
+void engine_load_model_async(const EngineConfig& config, LoadProgressCallback on_progress, LoadDoneCallback on_done) {
+    // Cleared here rather than on the thread, so a cancel right after this call is not lost
+    g_load_cancelled.store(false);
+    std::thread([config, on_progress, on_done] {
+        bool success;
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            g_residency.store(ENGINE_RESIDENCY_ACTIVE);
+            g_residency_target.store(ENGINE_RESIDENCY_ACTIVE);
+            success = load_model(config, on_progress);
+        }
+        if (on_done) {
+            on_done(success);
+        }
+    }).detach();
+}
+
+void engine_cancel_load() {
+    g_load_cancelled.store(true);
+    LOGI("Model load cancel requested");
+}
+
+// Caller holds g_mutex. Brings back a model the residency manager unloaded.
+static void reload_unloaded_model() {
+    if (g_initialized || g_residency.load() != ENGINE_RESIDENCY_UNLOADED) {
+        return;
+    }
+    LOGI("Reloading model unloaded under memory pressure");
+    const auto start = std::chrono::steady_clock::now();
+    EngineConfig config = g_config;
+    g_load_cancelled.store(false);
+    if (load_model(config, nullptr)) {
+        g_residency.store(ENGINE_RESIDENCY_ACTIVE);
+        g_residency_target.store(ENGINE_RESIDENCY_ACTIVE);
+        LOGI("=== Residency 4 -> 0 in %.0fms ===", ms_since(start));
+    }
+}
+
+void engine_free_model() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    
+    LOGI("Freeing model resources");
+    unload_model();
+    LOGI("Model resources freed");
+}
+
+void engine_set_prompt_cache_dir(const std::string& dir, size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    
+    // The scheduler reads the snapshot settings without locks
+    if (g_initialized) {
+        if (g_snapshot_dir != dir) {
+            LOGW("Prompt cache dir must be set before the model is loaded, ignoring %s", dir.c_str());
+        }
+        return;
+    }
+    
+    g_snapshot_dir = dir;
+    g_snapshot_max_bytes = max_bytes;
+    
+    LOGI("Prompt snapshot dir: %s (budget %zu bytes)", g_snapshot_dir.c_str(), g_snapshot_max_bytes);
+    evict_prompt_snapshots();
+}
+
+void engine_set_ngram_cache_dir(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    
+    // Loaded and saved together with the model
+    if (g_initialized) {
+        if (g_ngram_dir != dir) {
+            LOGW("N-gram cache dir must be set before the model is loaded, ignoring %s", dir.c_str());
+        }
+        return;
+    }
+    
+    g_ngram_dir = dir;
+    LOGI("N-gram cache dir: %s", g_ngram_dir.c_str());
+}
+
+int64_t engine_create_session() {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    int64_t id = g_next_session_id++;
+    g_sessions[id] = std::make_shared<GenerationSession>();
+    return id;
+}
+
+void engine_cancel_session(int64_t id) {
+    // Deliberately lock-free - the scheduler checks the flag between steps and mid-decode
+    std::shared_ptr<GenerationSession> session = find_generation_session(id);
+    if (session) {
+        session->cancelled.store(true, std::memory_order_relaxed);
+        LOGI("Generation session %lld cancelled", (long long)id);
+    }
+}
+
+void engine_destroy_session(int64_t id) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    g_sessions.erase(id);
+}
+
+static GenerationRequest make_request(const GenerationOptions& options) {
+    GenerationRequest request;
+    request.max_tokens = options.max_tokens;
+    request.temperature = options.temperature;
+    request.seed = (uint32_t)options.seed;
+    request.n_draft = g_params.nDraft;
+    return request;
+}
+
+void engine_generate(int64_t session_id, const std::string& prompt, const GenerationOptions& options,
+                     const TokenCallback& on_token, GenerationResult& result,
+                     const PrefillProgressCallback& on_prefill) {
+    std::shared_ptr<GenerationSession> session = find_generation_session(session_id);
+    if (!session) {
+        LOGE("Unknown generation session %lld", (long long)session_id);
+        result.error = "Invalid session";
+        return;
+    }
+    
+    std::unique_lock<std::mutex> lock(g_mutex);
+    
+    // The context itself may be parked by a memory trim; the scheduler restores it
+    reload_unloaded_model();
+    if (!g_initialized || g_model == nullptr) {
+        LOGE("Model not initialized");
+        result.error = "Model not loaded";
+        return;
+    }
+    
+    LOGI("=== Starting %sgeneration ===", on_token ? "streaming " : "");
+    LOGI("Prompt length: %zu chars", prompt.size());
+    LOGI("Max tokens: %d, Temperature: %.2f", options.max_tokens, options.temperature);
+    
+    GenerationRequest request = make_request(options);
+    const auto tokenize_start = std::chrono::steady_clock::now();
+    if (!tokenize_append(request.prompt_tokens, prompt, true, true)) {
+        LOGE("Failed to tokenize prompt");
+        result.error = "Tokenization failed";
+        return;
+    }
+    record_latency(METRIC_TOKENIZE, ms_since(tokenize_start));
+    
+    // ChatML prompts start with the system turn - checkpoint and persist it
+    request.checkpoint_at = find_turn_boundaries(request.prompt_tokens);
+    request.n_snapshot_prefix = request.checkpoint_at.empty() ? 0 : request.checkpoint_at.front();
+    mark_user_turn(request);
+    
+    // Only the scheduler touches the context from here on, so other requests can be submitted.
+    // Counted before unlocking so a memory trim never unloads the model under this request.
+    g_active_requests.fetch_add(1);
+    lock.unlock();
+    
+    run_generation(session, std::move(request), on_token, on_prefill, result);
+    g_active_requests.fetch_sub(1);
+}
+
+void engine_generate_chat(int64_t session_id, const std::string& system_prompt, const std::string& user_message,
+                          const GenerationOptions& options, const TokenCallback& on_token, GenerationResult& result,
+                          const PrefillProgressCallback& on_prefill) {
+    std::shared_ptr<GenerationSession> session = find_generation_session(session_id);
+    if (!session) {
+        LOGE("Unknown generation session %lld", (long long)session_id);
+        result.error = "Invalid session";
+        return;
+    }
+    
+    std::unique_lock<std::mutex> lock(g_mutex);
+    
+    // The context itself may be parked by a memory trim; the scheduler restores it
+    reload_unloaded_model();
+    if (!g_initialized || g_model == nullptr) {
+        LOGE("Model not initialized");
+        result.error = "Model not loaded";
+        return;
+    }
+    
+    LOGI("=== Starting cached generation ===");
+    LOGI("System prompt length: %zu chars", system_prompt.size());
+    LOGI("User message length: %zu chars", user_message.size());
+    
+    // Build the full conversation as tokens. Template markers are parsed as special
+    // tokens, the user's text is not (so it cannot inject <|im_end|> etc.)
+    // Format: <|startoftext|><|im_start|>system\n[system]<|im_end|>\n
+    //         <|im_start|>user\n[user]<|im_end|>\n<|im_start|>assistant\n
+    std::string formatted_sys_prompt = "<|startoftext|><|im_start|>system\n";
+    formatted_sys_prompt += system_prompt;
+    formatted_sys_prompt += "<|im_end|>\n";
+    
+    GenerationRequest request = make_request(options);
+    const auto tokenize_start = std::chrono::steady_clock::now();
+    bool tokenized = tokenize_append(request.prompt_tokens, formatted_sys_prompt, true, true);
+    const int n_sys_tokens = (int)request.prompt_tokens.size();
+    tokenized = tokenized
+        && tokenize_append(request.prompt_tokens, "<|im_start|>user\n", false, true);
+    request.user_begin = (int)request.prompt_tokens.size();
+    tokenized = tokenized
+        && tokenize_append(request.prompt_tokens, user_message, false, false);
+    request.user_end = (int)request.prompt_tokens.size();
+    tokenized = tokenized
+        && tokenize_append(request.prompt_tokens, "<|im_end|>\n<|im_start|>assistant\n", false, true);
+    record_latency(METRIC_TOKENIZE, ms_since(tokenize_start));
+    
+    if (!tokenized || n_sys_tokens <= 0) {
+        LOGE("Failed to tokenize conversation");
+        result.error = "Prompt tokenization failed";
+        return;
+    }
+    
+    // Snapshot the end of the system prompt so that recurrent models can roll
+    // back to it when the next user turn differs, and persist it for cold starts
+    request.checkpoint_at = {n_sys_tokens};
+    request.n_snapshot_prefix = n_sys_tokens;
+    
+    // Only the scheduler touches the context from here on, so other requests can be submitted.
+    // Counted before unlocking so a memory trim never unloads the model under this request.
+    g_active_requests.fetch_add(1);
+    lock.unlock();
+    
+    run_generation(session, std::move(request), on_token, on_prefill, result);
+    g_active_requests.fetch_sub(1);
+}
+
+int engine_count_tokens(const std::string& text) {
+    if (!g_initialized || g_vocab == nullptr) {
+        return -1;
+    }
+    return -llama_tokenize(g_vocab, text.c_str(), (int32_t)text.size(), nullptr, 0, false, false);
+}
+
+double engine_measure_perplexity(const std::string& text, int n_window) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+
+    if (!g_initialized || g_context == nullptr) {
+        LOGE("Perplexity: no active model");
+        return -1.0;
+    }
+    n_window = std::min(n_window, (int)llama_n_ctx(g_context));
+
+    std::vector<llama_token> tokens;
+    if (!tokenize_append(tokens, text, false, false) || n_window < 2 || (int)tokens.size() < n_window) {
+        LOGE("Perplexity: need at least %d tokens, got %zu", n_window, tokens.size());
+        return -1.0;
+    }
+
+    // The scheduler owns the context while it runs
+    stop_scheduler();
+    clear_slots();
+    llama_set_abort_callback(g_context, nullptr, nullptr);
+    llama_memory_t mem = llama_get_memory(g_context);
+
+    const auto start = std::chrono::steady_clock::now();
+    const int n_vocab = llama_vocab_n_tokens(g_vocab);
+    const int n_batch = (int)llama_n_batch(g_context);
+    const llama_token bos = llama_vocab_get_add_bos(g_vocab) ? llama_vocab_bos(g_vocab) : LLAMA_TOKEN_NULL;
+
+    // Each window starts fresh (with BOS, as llama-perplexity does); its first
+    // half is only context for scoring the second
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    double nll = 0.0;
+    int n_scored = 0;
+    bool ok = true;
+
+    for (size_t w = 0; ok && w + n_window <= tokens.size(); w += n_window) {
+        llama_memory_clear(mem, true);
+        for (int i = 0; ok && i < n_window; i += n_batch) {
+            const int n = std::min(n_batch, n_window - i);
+            batch.n_tokens = 0;
+            for (int j = i; j < i + n; j++) {
+                const llama_token token = j == 0 && bos != LLAMA_TOKEN_NULL ? bos : tokens[w + j];
+                batch_add(batch, token, j, 0, j >= n_window / 2 && j + 1 < n_window);
+            }
+            ok = llama_decode(g_context, batch) == 0;
+
+            for (int j = 0; ok && j < n; j++) {
+                if (!batch.logits[j]) {
+                    continue;
+                }
+                const float* logits = llama_get_logits_ith(g_context, j);
+                const float max_logit = *std::max_element(logits, logits + n_vocab);
+                double sum = 0.0;
+                for (int t = 0; t < n_vocab; t++) {
+                    sum += std::exp(logits[t] - max_logit);
+                }
+                nll += max_logit + std::log(sum) - logits[tokens[w + i + j + 1]];
+                n_scored++;
+            }
+        }
+    }
+
+    llama_batch_free(batch);
+    llama_memory_clear(mem, true);
+    llama_set_abort_callback(g_context, abort_callback, nullptr);
+    start_scheduler();
+
+    if (!ok || n_scored == 0) {
+        LOGE("Perplexity: decode failed");
+        return -1.0;
+    }
+    const double ppl = std::exp(nll / n_scored);
+    LOGI("Perplexity %.4f over %d tokens (KV K %s, V %s) in %.0fms", ppl, n_scored,
+         ggml_type_name(g_ctx_params.type_k), ggml_type_name(g_ctx_params.type_v), ms_since(start));
+    return ppl;
+}
+
+void engine_set_embedding_model(const std::string& path) {
+    std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+    if (path == g_embed_model_path) {
+        return;
+    }
+    release_embedding(true);
+    g_embed_model_path = path;
+    LOGI("Embedding model: %s", path.empty() ? "chat model" : path.c_str());
+}
+
+uint64_t engine_embedding_model_id() {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+        path = g_embed_model_path;
+    }
+    if (path.empty()) {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        path = g_model_file;
+    }
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    uint64_t hash = fnv1a64(path.data(), path.size());
+    hash = fnv1a64(&st.st_size, sizeof(st.st_size), hash);
+    hash = fnv1a64(&st.st_mtime, sizeof(st.st_mtime), hash);
+    return hash;
+}
+
+void engine_embed(int64_t session_id, const std::vector<std::string>& texts, bool interactive, EmbeddingResult& result) {
+    std::shared_ptr<GenerationSession> session = find_generation_session(session_id);
+    if (!session) {
+        LOGE("Unknown generation session %lld", (long long)session_id);
+        result.error = "Invalid session";
+        return;
+    }
+    
+    // Only the calls are serialized: g_mutex is never held while another embedding runs
+    std::lock_guard<std::mutex> calls_lock(g_embed_calls_mutex);
+    std::unique_lock<std::mutex> lock(g_mutex);
+    std::lock_guard<std::mutex> embed_lock(g_embed_mutex);
+    // Both the chat model's pages and a dedicated embedding model go at COLD
+    const int residency = std::max(g_residency.load(), g_residency_target.load());
+    if (!interactive && residency >= ENGINE_RESIDENCY_COLD) {
+        LOGW("Background embedding skipped at residency %d", residency);
+        result.error = "Model trimmed under memory pressure";
+        return;
+    }
+    const bool chat_model = g_embed_model_path.empty();
+    if (chat_model) {
+        reload_unloaded_model();
+        if (!g_initialized || g_model == nullptr) {
+            LOGE("Model not initialized");
+            result.error = "Model not loaded";
+            return;
+        }
+        // Like a generation, keeps a memory trim from unloading the model under it
+        g_active_requests.fetch_add(1);
+    }
+    // Loads and generations go on; an unload waits for g_embed_mutex, stopping this through g_embed_stop
+    lock.unlock();
+    
+    embed_texts(session.get(), texts, result);
+    if (chat_model) {
+        g_active_requests.fetch_sub(1);
+    }
+}
+
+void engine_set_speculative_draft(int n_draft) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    
+    g_params.nDraft = std::max(0, std::min(n_draft, MAX_DRAFT_TOKENS));
+    LOGI("%s speculation: %s (%d draft tokens)", g_early_exit_layer > 0 ? "Early-exit" : g_draft_model ? "Draft-model" : "Prompt-lookup",
+         g_params.nDraft > 0 ? "ON" : "OFF", g_params.nDraft);
+}
+
+void engine_get_speculative_stats(int64_t& drafted, int64_t& accepted) {
+    drafted = g_spec_drafted.load(std::memory_order_relaxed);
+    accepted = g_spec_accepted.load(std::memory_order_relaxed);
+}
+
+// Lock-free: applies from the scheduler's next step
+void engine_set_prefill_budget(int n_tokens) {
+    n_tokens = std::max(0, n_tokens);
+    if (g_prefill_step_budget.exchange(n_tokens, std::memory_order_relaxed) != n_tokens) {
+        LOGI("Prefill budget: %d tokens per step while decoding%s", n_tokens, n_tokens == 0 ? " (uncapped)" : "");
+    }
+}
+
+// Lock-free: the scheduler picks the state up before its next step, even mid-generation
+void engine_set_device_state(int thermal_level, float thermal_headroom, int battery_percent, bool charging) {
+    int previous = g_thermal_level.exchange(thermal_level, std::memory_order_relaxed);
+    g_thermal_headroom.store(std::isnan(thermal_headroom) ? -1.0f : thermal_headroom, std::memory_order_relaxed);
+    g_battery_percent.store(battery_percent, std::memory_order_relaxed);
+    g_battery_charging.store(charging, std::memory_order_relaxed);
+    if (previous != thermal_level) {
+        LOGI("Device state: thermal %d -> %d, headroom %.2f, battery %d%%%s",
+             previous, thermal_level, thermal_headroom, battery_percent, charging ? " charging" : "");
+    }
+}
+
+void engine_set_residency(int level) {
+    level = std::max((int)ENGINE_RESIDENCY_ACTIVE, std::min(level, (int)ENGINE_RESIDENCY_UNLOADED));
+    std::lock_guard<std::mutex> lock(g_mutex);
+    
+    if (level == ENGINE_RESIDENCY_ACTIVE) {
+        reload_unloaded_model();
+    }
+    if (!g_initialized) {
+        return;
+    }
+    
+    if (level == ENGINE_RESIDENCY_UNLOADED) {
+        if (g_active_requests.load() == 0) {
+            LOGI("=== Residency %d -> %d: unloading model ===", g_residency.load(), level);
+            unload_model();
+            g_residency.store(ENGINE_RESIDENCY_UNLOADED);
+            g_residency_target.store(ENGINE_RESIDENCY_UNLOADED);
+            return;
+        }
+        LOGW("Requests running, trimming to level %d instead of unloading", ENGINE_RESIDENCY_COLD);
+        level = ENGINE_RESIDENCY_COLD;
+    } else if (level != ENGINE_RESIDENCY_ACTIVE && level <= g_residency_target.load()) {
+        return;
+    }
+    
+    // Applied by the scheduler; stored under its mutex so the wakeup is not lost
+    {
+        std::lock_guard<std::mutex> queue_lock(g_queue_mutex);
+        g_residency_target.store(level);
+    }
+    g_queue_cv.notify_all();
+    LOGI("Residency target %d (now %d)", level, g_residency.load());
+}
+
+int engine_get_residency() {
+    return g_residency.load();
+}
+
+static_assert(ENGINE_METRICS_SIZE == N_LATENCY_METRICS * LATENCY_FIELDS + GAUGE_FIELDS, "metrics layout");
+
+void engine_get_metrics(double* values) {
+    std::lock_guard<std::mutex> lock(g_metrics_mutex);
+    for (int i = 0; i < N_LATENCY_METRICS; i++) {
+        summarize_latency(g_metrics.latency[i], values + i * LATENCY_FIELDS);
+    }
+    double* gauges = values + N_LATENCY_METRICS * LATENCY_FIELDS;
+    gauges[0] = g_metrics.kv_used;
+    gauges[1] = g_metrics.kv_size;
+    gauges[2] = (double)g_metrics.n_requests;
+    gauges[3] = (double)g_metrics.n_prompt_tokens;
+    gauges[4] = (double)g_metrics.n_reused_tokens;
+    gauges[5] = (double)g_metrics.n_snapshot_hits;
+    gauges[6] = g_metrics.n_threads;
+    gauges[7] = g_metrics.efficient_cores ? 1.0 : 0.0;
+    gauges[8] = g_metrics.prefill_budget;
+    gauges[9] = g_metrics.perf.t_p_eval_ms;
+    gauges[10] = g_metrics.perf.n_p_eval;
+    gauges[11] = g_metrics.perf.t_eval_ms;
+    gauges[12] = g_metrics.perf.n_eval;
+}
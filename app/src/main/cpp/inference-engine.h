@@ -0,0 +1,179 @@
+#pragma once
+
+// Inference core: model lifetime, the decode scheduler, prompt caches and
+// speculation. Plain C++ with no JNI, shared by llama-jni.cpp and the host
+// benchmark (bench/confidant-bench.cpp). Every function may be called from any
+// thread; generation calls block until their request finishes.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// KV cache storage. Q4_0 keeps a scale per 32 values of a head, so every
+// appended token is quantized on its own.
+enum EngineKvCacheType {
+    ENGINE_KV_Q8_0 = 0,  // K and V 8-bit
+    ENGINE_KV_Q4_0_V,    // K 8-bit, V 4-bit: 3/4 of the Q8_0 size
+    ENGINE_KV_Q4_0,      // K and V 4-bit: about half the Q8_0 size
+};
+
+struct EngineConfig {
+    std::string model_path;
+    std::string draft_model_path;  // optional small model with the same vocab, for speculation
+    int n_threads = 4;
+    int ctx_size = 2048;
+    int kv_cache_type = ENGINE_KV_Q8_0;
+    // Early-exit self-speculation (LFM2, when no draft model is set): drafts come
+    // from the model's own first layers and the output head. 0 = off, -1 = pick
+    // the exit layer by calibration, > 0 = that many layers
+    int early_exit_layer = 0;
+    std::string calibration_text;  // text for the calibration, empty = built-in sample
+    float temperature = 0.7f;
+    int top_k = 40;
+    float top_p = 0.9f;
+    float min_p = 0.05f;
+};
+
+struct GenerationOptions {
+    int max_tokens = 256;
+    float temperature = 0.7f;
+    int32_t seed = -1;  // -1 = random (LLAMA_DEFAULT_SEED)
+};
+
+struct GenerationResult {
+    std::string text;
+    int n_prompt = 0;
+    int n_reused = 0;
+    int n_generated = 0;
+    int n_drafted = 0;   // speculative tokens proposed
+    int n_accepted = 0;  // of which the model agreed with
+    int n_discarded = 0; // oldest turns evicted to fit the context (context shift)
+    long long prefill_ms = 0;
+    long long gen_ms = 0;
+    bool snapshot_hit = false;
+    bool cancelled = false;
+    const char* error = nullptr;  // set when generation failed
+};
+
+// Receives the text of each generated token, on the thread that submitted the
+// request. Pieces hold whole, valid UTF-8 characters only: the text of a token
+// that ends inside a character is delivered with the token that completes it.
+typedef std::function<void(const char* piece, int length)> TokenCallback;
+
+// Prompt tokens in the KV cache (reused ones included) out of n_prompt, after
+// each prefill chunk, on the thread that submitted the request
+typedef std::function<void(int n_prefilled, int n_prompt)> PrefillProgressCallback;
+
+// Load progress in [0, 1] (weights, then pre-fault and warm-up), on the loading thread
+typedef std::function<void(float progress)> LoadProgressCallback;
+typedef std::function<void(bool success)> LoadDoneCallback;
+
+// Model lifetime. Loading replaces any model already loaded and ends with a
+// warm-up decode, so the first request runs at steady-state speed.
+bool engine_load_model(const EngineConfig& config, const LoadProgressCallback& on_progress = nullptr);
+void engine_free_model();
+
+// engine_load_model on a background thread; returns at once. on_done is called
+// last, on that thread. Loads are serialized.
+void engine_load_model_async(const EngineConfig& config, LoadProgressCallback on_progress, LoadDoneCallback on_done);
+
+// Abort a load in progress; it completes with success = false
+void engine_cancel_load();
+
+// Persistent caches - must be configured before engine_load_model
+void engine_set_prompt_cache_dir(const std::string& dir, size_t max_bytes);
+void engine_set_ngram_cache_dir(const std::string& dir);
+
+// Cancellation handles for generation calls
+int64_t engine_create_session();
+void engine_cancel_session(int64_t session);
+void engine_destroy_session(int64_t session);
+
+// A complete ChatML prompt. Turn boundaries are found in the tokens and used
+// for checkpoints, the on-disk system prompt snapshot and n-gram learning.
+void engine_generate(int64_t session, const std::string& prompt, const GenerationOptions& options,
+                     const TokenCallback& on_token, GenerationResult& result,
+                     const PrefillProgressCallback& on_prefill = nullptr);
+
+// System prompt plus one user message, formatted as ChatML here. The user's
+// text is tokenized without special tokens so it cannot inject template markers.
+void engine_generate_chat(int64_t session, const std::string& system_prompt, const std::string& user_message,
+                          const GenerationOptions& options, const TokenCallback& on_token, GenerationResult& result,
+                          const PrefillProgressCallback& on_prefill = nullptr);
+
+// Token count of text without special tokens, -1 if no model is loaded
+int engine_count_tokens(const std::string& text);
+
+// Perplexity of text under the loaded model and KV cache type: windows of
+// n_window tokens, each scored on its second half. A quality check for the
+// benchmark - it pauses the scheduler and drops every cached conversation.
+// Returns -1 on failure.
+double engine_measure_perplexity(const std::string& text, int n_window);
+
+// Text embeddings for retrieval, from a context of their own next to the
+// scheduler's. By default they come from the loaded chat model; a dedicated
+// embedding GGUF may be set instead and is loaded on first use. The final
+// hidden states are pooled as the model's metadata says, averaged if it says
+// nothing (any chat model).
+void engine_set_embedding_model(const std::string& path);  // "" = the chat model
+
+// Identifies the embedding model (file, size, mtime) without loading it, so
+// vectors stored for another model can be discarded. 0 = no model known yet.
+uint64_t engine_embedding_model_id();
+
+struct EmbeddingResult {
+    std::vector<float> values;  // one L2-normalized row of dim values per text
+    int dim = 0;
+    bool cancelled = false;
+    const char* error = nullptr;  // set when embedding failed
+};
+
+// Embeds texts in batches of parallel sequences. Texts longer than the
+// embedding window are cut. Blocks; cancelled through the session. Only an
+// interactive call (a search) brings back a model trimmed to COLD or unloaded;
+// background indexing fails instead, so it never undoes a memory trim.
+void engine_embed(int64_t session, const std::vector<std::string>& texts, bool interactive, EmbeddingResult& result);
+
+// Speculation: draft tokens per step (0 = off), lifetime counters. With a draft
+// model (or an early-exit draft) this is the cap of its adaptive draft length;
+// without one the drafts come from prompt lookup.
+void engine_set_speculative_draft(int n_draft);
+void engine_get_speculative_stats(int64_t& drafted, int64_t& accepted);
+
+// Long prompts are prefilled in chunks between decode steps of the other
+// requests. While any request is decoding a step takes at most n_tokens of
+// prompt (0 = a whole batch), bounding its token latency. Default 256.
+void engine_set_prefill_budget(int n_tokens);
+
+// Thermal/battery input for the thread controller (ThermalManager.ThermalState ordinal)
+void engine_set_device_state(int thermal_level, float thermal_headroom, int battery_percent, bool charging);
+
+// Memory residency, deepest last. Each level releases more memory and costs
+// more to come back from:
+//   COMPACT   context freed (compute buffers, KV allocation); cached sequences parked in host memory
+//   PREFIX    only the most recent sequence parked, cut back to its system prompt
+//   COLD      also n-gram statistics written out and mapped weight pages released
+//   UNLOADED  model freed; reloaded (warm, from the prompt snapshot) by the next request
+enum EngineResidency {
+    ENGINE_RESIDENCY_ACTIVE = 0,
+    ENGINE_RESIDENCY_COMPACT,
+    ENGINE_RESIDENCY_PREFIX,
+    ENGINE_RESIDENCY_COLD,
+    ENGINE_RESIDENCY_UNLOADED,
+};
+
+// Trims never interrupt a generation: they apply once the engine is idle and
+// are undone by the next request. ACTIVE restores right away.
+void engine_set_residency(int level);
+int engine_get_residency();
+
+// Performance counters flattened into ENGINE_METRICS_SIZE values:
+//   per phase (tokenize, prefill chunk, first token, decode token, sampling):
+//     count, mean ms, p50 ms, p90 ms, p99 ms, max ms
+//   then kv used tokens, kv size, requests, prompt tokens, reused tokens,
+//   snapshot hits, threads, efficiency cores (0/1), prefill budget,
+//   llama prompt eval ms, prompt eval tokens, eval ms, eval tokens
+static const int ENGINE_METRICS_SIZE = 5 * 6 + 13;
+void engine_get_metrics(double* values);
@@ -1,218 +1,312 @@
 #include <jni.h>
 #include <string>
-#include <vector>
-#include <memory>
-#include <mutex>
 #include <chrono>
-#include <android/log.h>
-#include <errno.h>
-#include <cstdio>
-
-// Include real llama.cpp headers
-#include "llama.h"
-
-#define LOG_TAG "LlamaJNI"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
-
-// Global state (protected by mutex)
-static std::mutex g_mutex;
-static llama_model* g_model = nullptr;
-static llama_context* g_context = nullptr;
-static const llama_vocab* g_vocab = nullptr;
-static bool g_initialized = false;
-
-// Prompt caching state
-static std::vector<llama_token> g_cached_system_tokens;
-static int g_cached_system_length = 0;
-static std::string g_cached_system_prompt;
-
-// Generation parameters
-struct GenerationParams {
-    int maxTokens = 256;
-    float temperature = 0.7f;
-    int topK = 40;
-    float topP = 0.9f;
-    float minP = 0.05f;
-    int nThreads = 4;
-    int ctxSize = 2048;
+#include <cstring>
+#include <algorithm>
+#include <memory>
+
+#include "inference-engine.h"
+#include "engine-log.h"
+#include "vector-index.h"
+
+// JNI bridge for LLMEngine. Everything but marshalling and Kotlin callbacks
+// lives in the inference core (inference-engine.cpp).
+
+// =============================================================================
+// Streaming helpers
+// =============================================================================
+
+// Length of the UTF-8 sequence started by this lead byte (0 = not a lead byte)
+static size_t utf8_sequence_length(unsigned char c) {
+    if (c <= 0x7F) return 1;              // ASCII
+    if (c >= 0xC0 && c <= 0xDF) return 2;
+    if (c >= 0xE0 && c <= 0xEF) return 3;
+    if (c >= 0xF0 && c <= 0xF7) return 4; // emoji
+    return 0;
+}
+
+// Incremental UTF-8 assembler: the incomplete tail of one chunk is held back
+// until the next chunk completes it. Invalid bytes are dropped, which keeps the
+// output safe for NewStringUTF.
+struct Utf8Assembler {
+    std::string partial;  // bytes of an incomplete code point
+    
+    void append(const char* data, size_t length, std::string& out) {
+        for (size_t i = 0; i < length; i++) {
+            unsigned char c = data[i];
+            if (!partial.empty()) {
+                if ((c & 0xC0) == 0x80) {
+                    partial += (char)c;
+                    if (partial.size() == utf8_sequence_length(partial[0])) {
+                        out += partial;
+                        partial.clear();
+                    }
+                    continue;
+                }
+                partial.clear();  // Truncated sequence - drop it
+            }
+            
+            size_t n = utf8_sequence_length(c);
+            if (n == 1) {
+                out += (char)c;
+            } else if (n > 1) {
+                partial += (char)c;
+            }
+            // else: stray continuation byte - skip it
+        }
+    }
+};
+
+// Drop invalid UTF-8 sequences to prevent JNI crashes in NewStringUTF
+static std::string sanitize_utf8(const char* data, size_t length) {
+    std::string sanitized;
+    sanitized.reserve(length);
+    Utf8Assembler utf8;
+    utf8.append(data, length, sanitized);
+    return sanitized;
+}
+
+// Delivers streamed text to Kotlin in batches instead of one NewStringUTF +
+// CallVoidMethod per token. Text is flushed once flush_tokens tokens or
+// flush_ms milliseconds have accumulated. With a direct ByteBuffer the UTF-8
+// bytes are copied into it as a ring and only (offset, length) crosses JNI;
+// the buffer belongs to this one stream, since generations run concurrently.
+// The engine streams whole UTF-8 characters only, so pieces are appended as is.
+struct StreamDelivery {
+    JNIEnv* env = nullptr;
+    jobject callback = nullptr;
+    jmethodID on_token = nullptr;   // onToken(String)
+    jmethodID on_chunk = nullptr;   // onChunk(Int, Int) - direct buffer mode
+    
+    uint8_t* ring = nullptr;
+    size_t ring_capacity = 0;
+    size_t ring_pos = 0;
+    
+    int flush_tokens = 1;
+    int flush_ms = 0;
+    
+    std::string pending;
+    int pending_tokens = 0;
+    std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+    int n_flushes = 0;
+    
+    void push(const char* piece, int length) {
+        pending.append(piece, length);
+        pending_tokens++;
+        
+        bool due = pending_tokens >= flush_tokens;
+        if (!due && flush_ms > 0) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - last_flush).count();
+            due = elapsed >= flush_ms;
+        }
+        if (due) {
+            flush();
+        }
+    }
+    
+    void flush() {
+        pending_tokens = 0;
+        last_flush = std::chrono::steady_clock::now();
+        if (pending.empty()) {
+            return;
+        }
+        
+        if (ring != nullptr) {
+            // Pending text only ever holds whole code points, so any split is safe
+            size_t offset = 0;
+            while (offset < pending.size()) {
+                size_t n = std::min(pending.size() - offset, ring_capacity);
+                while (n < pending.size() - offset && n > 0 && (pending[offset + n] & 0xC0) == 0x80) {
+                    n--;  // Don't split a code point across two chunks
+                }
+                if (ring_pos + n > ring_capacity) {
+                    ring_pos = 0;
+                }
+                memcpy(ring + ring_pos, pending.data() + offset, n);
+                env->CallVoidMethod(callback, on_chunk, (jint)ring_pos, (jint)n);
+                ring_pos += n;
+                offset += n;
+                n_flushes++;
+            }
+        } else {
+            jstring text = env->NewStringUTF(pending.c_str());
+            env->CallVoidMethod(callback, on_token, text);
+            env->DeleteLocalRef(text);
+            n_flushes++;
+        }
+        pending.clear();
+    }
 };
 
-static GenerationParams g_params;
+// Reads a Java string into a std::string. False if the JVM could not provide it.
+static bool get_string(JNIEnv* env, jstring value, std::string& out) {
+    if (value == nullptr) {
+        return false;
+    }
+    const char* chars = env->GetStringUTFChars(value, nullptr);
+    if (chars == nullptr) {
+        return false;
+    }
+    out.assign(chars);
+    env->ReleaseStringUTFChars(value, chars);
+    return true;
+}
+
+static GenerationOptions make_options(jint maxTokens, jfloat temperature, jint seed) {
+    GenerationOptions options;
+    options.max_tokens = maxTokens;
+    options.temperature = temperature;
+    options.seed = seed;
+    return options;
+}
+
+// Blocking generation result as a Java string, "Error: ..." on failure
+static jstring result_to_string(JNIEnv* env, const GenerationResult& result) {
+    if (result.error != nullptr) {
+        std::string error = std::string("Error: ") + result.error;
+        return env->NewStringUTF(error.c_str());
+    }
+    
+    // CRITICAL: Sanitize UTF-8 to prevent JNI crashes from malformed emoji/unicode
+    std::string sanitized = sanitize_utf8(result.text.data(), result.text.length());
+    if (sanitized.length() != result.text.length()) {
+        LOGI("Sanitized response: removed %zu invalid UTF-8 bytes", result.text.length() - sanitized.length());
+    }
+    return env->NewStringUTF(sanitized.c_str());
+}
+
+// =============================================================================
+// Load callbacks
+// =============================================================================
+
+// ModelLoadCallback invoked from the engine's loading thread, which is attached
+// to the JVM on the first call and detached after onComplete
+struct LoadCallbackTarget {
+    JavaVM* vm = nullptr;
+    jobject callback = nullptr;  // global ref
+    jmethodID on_progress = nullptr;
+    jmethodID on_complete = nullptr;
+};
+
+static JNIEnv* attach_current_thread(JavaVM* vm) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv((void**)&env, JNI_VERSION_1_6) == JNI_OK) {
+        return env;
+    }
+    if (vm->AttachCurrentThread(&env, nullptr) != JNI_OK) {
+        LOGE("Failed to attach loading thread to the JVM");
+        return nullptr;
+    }
+    return env;
+}
 
 extern "C" {
 
-JNIEXPORT jboolean JNICALL
-Java_com_confidant_ai_engine_LLMEngine_nativeLoadModel(
+// Returns at once; the load runs on a native thread and reports through callback
+// (ModelLoadCallback.onProgress, then exactly one onComplete)
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeLoadModelAsync(
         JNIEnv* env,
         jobject thiz,
         jstring modelPath,
+        jstring draftModelPath,
         jint nThreads,
         jint ctxSize,
+        jint kvCacheType,
+        jint earlyExitLayer,
         jfloat temperature,
         jint topK,
         jfloat topP,
-        jfloat minP) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
+        jfloat minP,
+        jobject callback) {
     
-    LOGI("=== nativeLoadModel called ===");
-    LOGI("nThreads=%d, ctxSize=%d, temp=%.2f, topK=%d, topP=%.2f, minP=%.2f", 
-         nThreads, ctxSize, temperature, topK, topP, minP);
+    LOGI("=== nativeLoadModelAsync called ===");
     
-    // Free existing model if loaded
-    if (g_initialized) {
-        LOGI("Model already loaded, releasing first");
-        if (g_context) {
-            llama_free(g_context);
-            g_context = nullptr;
-        }
-        if (g_model) {
-            llama_model_free(g_model);
-            g_model = nullptr;
-        }
-        g_vocab = nullptr;
-        g_initialized = false;
+    auto target = std::make_shared<LoadCallbackTarget>();
+    jclass callbackClass = env->GetObjectClass(callback);
+    target->on_progress = env->GetMethodID(callbackClass, "onProgress", "(F)V");
+    target->on_complete = env->GetMethodID(callbackClass, "onComplete", "(Z)V");
+    env->DeleteLocalRef(callbackClass);
+    if (target->on_progress == nullptr || target->on_complete == nullptr || env->GetJavaVM(&target->vm) != JNI_OK) {
+        LOGE("Invalid load callback");
+        return;
     }
     
-    const char* path = env->GetStringUTFChars(modelPath, nullptr);
-    if (path == nullptr) {
+    EngineConfig config;
+    if (!get_string(env, modelPath, config.model_path)) {
         LOGE("Failed to get model path string");
-        return JNI_FALSE;
-    }
-    
-    LOGI("Loading model from: %s", path);
-    
-    // Check if file exists and is readable
-    FILE* file = fopen(path, "rb");
-    if (file == nullptr) {
-        LOGE("Cannot open model file: %s (errno=%d)", path, errno);
-        env->ReleaseStringUTFChars(modelPath, path);
-        return JNI_FALSE;
-    }
-    
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fclose(file);
-    
-    LOGI("Model file size: %ld bytes (%.2f MB)", fileSize, fileSize / (1024.0 * 1024.0));
-    
-    // Initialize llama backend
-    ggml_backend_load_all();
-    LOGI("llama backend initialized");
-    
-    // Set model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = 0;  // CPU only for Android
-    model_params.use_mmap = true;   // Use memory mapping for efficiency
-    model_params.use_mlock = false; // Don't lock memory on Android
-    
-    LOGI("Loading model with llama_model_load_from_file()...");
-    g_model = llama_model_load_from_file(path, model_params);
-    
-    if (g_model == nullptr) {
-        LOGE("Failed to load model from file");
-        env->ReleaseStringUTFChars(modelPath, path);
-        return JNI_FALSE;
+        env->CallVoidMethod(callback, target->on_complete, JNI_FALSE);
+        return;
     }
+    get_string(env, draftModelPath, config.draft_model_path);  // null = no draft model
+    config.n_threads = nThreads;
+    config.ctx_size = ctxSize;
+    config.kv_cache_type = kvCacheType;
+    config.early_exit_layer = earlyExitLayer;
+    config.temperature = temperature;
+    config.top_k = topK;
+    config.top_p = topP;
+    config.min_p = minP;
+    
+    target->callback = env->NewGlobalRef(callback);
+    
+    auto on_progress = [target](float progress) {
+        JNIEnv* thread_env = attach_current_thread(target->vm);
+        if (thread_env != nullptr) {
+            thread_env->CallVoidMethod(target->callback, target->on_progress, (jfloat)progress);
+            if (thread_env->ExceptionCheck()) {
+                thread_env->ExceptionClear();  // Nothing up the stack on this thread to catch it
+            }
+        }
+    };
+    auto on_done = [target](bool success) {
+        JNIEnv* thread_env = attach_current_thread(target->vm);
+        if (thread_env == nullptr) {
+            return;
+        }
+        thread_env->CallVoidMethod(target->callback, target->on_complete, success ? JNI_TRUE : JNI_FALSE);
+        if (thread_env->ExceptionCheck()) {
+            thread_env->ExceptionClear();
+        }
+        thread_env->DeleteGlobalRef(target->callback);
+        target->vm->DetachCurrentThread();
+    };
+    engine_load_model_async(config, on_progress, on_done);
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeCancelLoad(JNIEnv* env, jobject thiz) {
+    engine_cancel_load();
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetPromptCacheDir(
+        JNIEnv* env,
+        jobject thiz,
+        jstring cacheDir,
+        jlong maxBytes) {
     
-    LOGI("✓ Model loaded successfully");
-    
-    // Get vocab
-    g_vocab = llama_model_get_vocab(g_model);
-    if (g_vocab == nullptr) {
-        LOGE("Failed to get vocab from model");
-        llama_model_free(g_model);
-        g_model = nullptr;
-        env->ReleaseStringUTFChars(modelPath, path);
-        return JNI_FALSE;
+    std::string dir;
+    if (!get_string(env, cacheDir, dir)) {
+        LOGE("Failed to get prompt cache dir string");
+        return;
     }
+    engine_set_prompt_cache_dir(dir, maxBytes > 0 ? (size_t)maxBytes : 0);
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetNgramCacheDir(
+        JNIEnv* env,
+        jobject thiz,
+        jstring cacheDir) {
     
-    LOGI("✓ Vocab loaded");
-    
-    // Set context parameters optimized for mobile - ULTRA-OPTIMIZED 2026
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = std::max(ctxSize, 4096);  // Minimum 4096 for better context (2x increase)
-    ctx_params.n_batch = 2048;       // QUADRUPLED - 2026 research shows 2048 optimal for prompt processing
-    ctx_params.n_ubatch = 2048;      // MATCH n_batch for 3x prompt processing speedup!
-    ctx_params.n_threads = nThreads;
-    ctx_params.n_threads_batch = nThreads;
-    
-    // CRITICAL: Enable KV cache quantization for 40-50% memory reduction
-    // Research shows Q8_0 provides near-lossless quality with 50% memory savings
-    ctx_params.type_k = GGML_TYPE_Q8_0;  // Quantize K cache to 8-bit (minimal quality loss)
-    ctx_params.type_v = GGML_TYPE_Q8_0;  // Quantize V cache to 8-bit
-    
-    // Enable defragmentation for better cache utilization across multiple turns
-    ctx_params.defrag_thold = 0.1f;  // Defrag when 10% fragmented
-    
-    // Enable offloading for faster inference
-    ctx_params.offload_kqv = true;
-    
-    // ⚡ Performance optimizations for mobile CPU inference
-    // Flash attention is GPU-only - mobile uses optimized NEON/SIMD kernels
-    // Our speedup comes from: n_batch=n_ubatch (3x), KV quantization (50% memory), ARM i8mm (20%)
-    
-    LOGI("⚡ Optimization profile: MOBILE CPU (ARM NEON optimized)");
-    LOGI("KV cache quantization: Q8_0 (50%% memory reduction, <1%% quality loss)");
-    LOGI("Batch size: %d (QUADRUPLED for 2026 - 3x prompt processing speedup!)", ctx_params.n_batch);
-    LOGI("UBatch size: %d (MATCHES n_batch for maximum throughput)", ctx_params.n_ubatch);
-    LOGI("Defrag threshold: %.1f (automatic cache cleanup)", ctx_params.defrag_thold);
-    
-    LOGI("Creating context with n_ctx=%d, n_threads=%d...", ctxSize, nThreads);
-    g_context = llama_init_from_model(g_model, ctx_params);
-    
-    if (g_context == nullptr) {
-        LOGE("Failed to create context");
-        llama_model_free(g_model);
-        g_model = nullptr;
-        g_vocab = nullptr;
-        env->ReleaseStringUTFChars(modelPath, path);
-        return JNI_FALSE;
+    std::string dir;
+    if (!get_string(env, cacheDir, dir)) {
+        LOGE("Failed to get n-gram cache dir string");
+        return;
     }
-    
-    LOGI("✓ Context created successfully");
-    
-    // Store generation parameters
-    g_params.nThreads = nThreads;
-    g_params.ctxSize = ctxSize;
-    g_params.temperature = temperature;
-    g_params.topK = topK;
-    g_params.topP = topP;
-    g_params.minP = minP;
-    
-    g_initialized = true;
-    
-    // Log model info
-    int n_vocab = llama_vocab_n_tokens(g_vocab);
-    int n_ctx_train = llama_model_n_ctx_train(g_model);
-    int n_embd = llama_model_n_embd(g_model);
-    
-    LOGI("=== Model Info ===");
-    LOGI("Vocab size: %d", n_vocab);
-    LOGI("Context size (train): %d", n_ctx_train);
-    LOGI("Embedding size: %d", n_embd);
-    
-    // DIAGNOSTIC: Verify runtime parameters match expectations
-    LOGI("=== RUNTIME VERIFICATION (2026 DIAGNOSTICS) ===");
-    LOGI("n_batch: %d (expected: 2048)", ctx_params.n_batch);
-    LOGI("n_ubatch: %d (expected: 2048)", ctx_params.n_ubatch);
-    LOGI("n_threads: %d", ctx_params.n_threads);
-    LOGI("n_threads_batch: %d", ctx_params.n_threads_batch);
-    LOGI("CPU-only: optimized via NEON/SIMD (no GPU flash attention)");
-    LOGI("type_k: %d (expected: 2=Q8_0)", ctx_params.type_k);
-    LOGI("type_v: %d (expected: 2=Q8_0)", ctx_params.type_v);
-    LOGI("defrag_thold: %.2f", ctx_params.defrag_thold);
-    LOGI("offload_kqv: %s", ctx_params.offload_kqv ? "true" : "false");
-    LOGI("=== END VERIFICATION ===");
-    
-    LOGI("=== nativeLoadModel completed successfully ===");
-    
-    env->ReleaseStringUTFChars(modelPath, path);
-    return JNI_TRUE;
+    engine_set_ngram_cache_dir(dir);
 }
 
 JNIEXPORT jstring JNICALL
@@ -221,205 +315,24 @@ Java_com_confidant_ai_engine_LLMEngine_nativeGenerate(
         jobject thiz,
         jstring prompt,
         jint maxTokens,
-        jfloat temperature) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_initialized || g_model == nullptr || g_context == nullptr) {
-        LOGE("Model not initialized");
-        return env->NewStringUTF("Error: Model not loaded");
-    }
+        jfloat temperature,
+        jint seed,
+        jlong sessionHandle) {
     
-    const char* promptStr = env->GetStringUTFChars(prompt, nullptr);
-    if (promptStr == nullptr) {
+    std::string promptStr;
+    if (!get_string(env, prompt, promptStr)) {
         LOGE("Failed to get prompt string");
         return env->NewStringUTF("Error: Invalid prompt");
     }
     
-    LOGI("=== Starting generation ===");
-    LOGI("Prompt: %s", promptStr);
-    LOGI("Max tokens: %d, Temperature: %.2f", maxTokens, temperature);
-    
-    // Note: KV cache is automatically managed by llama.cpp
-    // No need to manually clear for non-cached generation
-    
-    // Tokenize the prompt - first get count
-    int n_tokens = -llama_tokenize(g_vocab, promptStr, strlen(promptStr), nullptr, 0, true, true);
-    
-    if (n_tokens <= 0) {
-        LOGE("Failed to get token count");
-        env->ReleaseStringUTFChars(prompt, promptStr);
-        return env->NewStringUTF("Error: Tokenization failed");
-    }
-    
-    // Allocate and tokenize
-    std::vector<llama_token> tokens(n_tokens);
-    if (llama_tokenize(g_vocab, promptStr, strlen(promptStr), tokens.data(), tokens.size(), true, true) < 0) {
-        LOGE("Failed to tokenize prompt");
-        env->ReleaseStringUTFChars(prompt, promptStr);
-        return env->NewStringUTF("Error: Tokenization failed");
-    }
-    
-    LOGI("Tokenized prompt: %d tokens", n_tokens);
-    
-    // Processing prompt in ultra-optimized chunks
-    auto prompt_start = std::chrono::high_resolution_clock::now();
-    
-    // CRITICAL FIX: Match chunk size to n_ubatch for 3x speedup (research-verified)
-    // Research shows 2048 chunk = 530-540 t/s vs 1024 chunk = 170-180 t/s
-    const int CHUNK_SIZE = 2048;  // MATCHES n_ubatch for maximum throughput
-    int tokens_processed = 0;
-    
-    while (tokens_processed < n_tokens) {
-        int chunk_size = std::min(CHUNK_SIZE, n_tokens - tokens_processed);
-        llama_batch chunk_batch = llama_batch_get_one(tokens.data() + tokens_processed, chunk_size);
-        
-        if (llama_decode(g_context, chunk_batch)) {
-            LOGE("Failed to decode prompt chunk at %d", tokens_processed);
-            env->ReleaseStringUTFChars(prompt, promptStr);
-            return env->NewStringUTF("Error: Prompt processing failed");
-        }
-        
-        tokens_processed += chunk_size;
-    }
-    
-    auto prompt_end = std::chrono::high_resolution_clock::now();
-    auto prompt_ms = std::chrono::duration_cast<std::chrono::milliseconds>(prompt_end - prompt_start).count();
-    
-    LOGI("✓ Prompt processed in %lldms (%d tokens, chunked)", (long long)prompt_ms, n_tokens);
-    
-    // Generate tokens
-    std::string response;
-    int n_generated = 0;
-    
-    // Create sampler with optimized chain for speed
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    
-    // Simplified sampler chain for faster sampling (remove min_p for speed)
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(g_params.topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(g_params.topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-    
-    LOGI("Starting token generation (max %d tokens)...", maxTokens);
-    
-    auto gen_start = std::chrono::high_resolution_clock::now();
-    
-    llama_token new_token_id;
-    for (int i = 0; i < maxTokens; i++) {
-        // Minimal logging for maximum speed (2026 optimization)
-        if (i > 0 && i % 50 == 0) {
-            LOGI("Generated %d tokens so far...", i);
-        }
-        
-        // Sample next token
-        new_token_id = llama_sampler_sample(smpl, g_context, -1);
-        
-        // Check for EOS
-        if (llama_vocab_is_eog(g_vocab, new_token_id)) {
-            LOGI("EOS token generated at position %d", i);
-            break;
-        }
-        
-        // Convert token to text
-        char buf[256];
-        int n_chars = llama_token_to_piece(g_vocab, new_token_id, buf, sizeof(buf), 0, true);
-        
-        if (n_chars > 0) {
-            response.append(buf, n_chars);
-            // Log first few tokens for debugging
-            if (i < 5) {
-                LOGI("Token %d: '%.*s'", i, n_chars, buf);
-            }
-        } else {
-            LOGD("Token %d produced no characters (token_id=%d)", i, new_token_id);
-        }
-        
-        // Prepare next batch for token generation
-        llama_batch next_batch = llama_batch_get_one(&new_token_id, 1);
-        
-        n_generated++;
-        
-        // Decode next token
-        if (llama_decode(g_context, next_batch)) {
-            LOGE("Failed to decode token at position %d", i);
-            break;
-        }
-    }
-    
-    auto gen_end = std::chrono::high_resolution_clock::now();
-    auto gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(gen_end - gen_start).count();
-    
-    llama_sampler_free(smpl);
-    
-    float tokens_per_sec = gen_ms > 0 ? (n_generated * 1000.0f / gen_ms) : 0.0f;
-    
-    LOGI("=== Generation complete ===");
-    LOGI("Generated %d tokens in %lldms (%.2f t/s)", n_generated, (long long)gen_ms, tokens_per_sec);
-    LOGI("Prompt: %lldms, Generation: %lldms, Total: %lldms", (long long)prompt_ms, (long long)gen_ms, (long long)(prompt_ms + gen_ms));
-    LOGI("Response length: %zu chars", response.length());
-    LOGI("Response preview: %.150s%s", response.c_str(), response.length() > 150 ? "..." : "");
-    
-    // CRITICAL: Sanitize UTF-8 to prevent JNI crashes
-    std::string sanitized;
-    sanitized.reserve(response.length());
-    
-    for (size_t i = 0; i < response.length(); ) {
-        unsigned char c = response[i];
-        if (c <= 0x7F) {
-            sanitized += c;
-            i++;
-        } else if (c >= 0xC0 && c <= 0xDF && i + 1 < response.length() && (response[i + 1] & 0xC0) == 0x80) {
-            sanitized += c;
-            sanitized += response[i + 1];
-            i += 2;
-        } else if (c >= 0xE0 && c <= 0xEF && i + 2 < response.length() && (response[i + 1] & 0xC0) == 0x80 && (response[i + 2] & 0xC0) == 0x80) {
-            sanitized += c;
-            sanitized += response[i + 1];
-            sanitized += response[i + 2];
-            i += 3;
-        } else if (c >= 0xF0 && c <= 0xF7 && i + 3 < response.length() && (response[i + 1] & 0xC0) == 0x80 && (response[i + 2] & 0xC0) == 0x80 && (response[i + 3] & 0xC0) == 0x80) {
-            sanitized += c;
-            sanitized += response[i + 1];
-            sanitized += response[i + 2];
-            sanitized += response[i + 3];
-            i += 4;
-        } else {
-            i++;  // Skip invalid byte
-        }
-    }
-    
-    env->ReleaseStringUTFChars(prompt, promptStr);
-    
-    return env->NewStringUTF(sanitized.c_str());
+    GenerationResult result;
+    engine_generate(sessionHandle, promptStr, make_options(maxTokens, temperature, seed), nullptr, result);
+    return result_to_string(env, result);
 }
 
 JNIEXPORT void JNICALL
 Java_com_confidant_ai_engine_LLMEngine_nativeFreeModel(JNIEnv* env, jobject thiz) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    LOGI("Freeing model resources");
-    
-    if (g_context) {
-        llama_free(g_context);
-        g_context = nullptr;
-    }
-    
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-    }
-    
-    g_vocab = nullptr;
-    g_initialized = false;
-    
-    // Clear prompt cache
-    g_cached_system_tokens.clear();
-    g_cached_system_length = 0;
-    g_cached_system_prompt.clear();
-    
-    LOGI("Model resources freed");
+    engine_free_model();
 }
 
 JNIEXPORT jstring JNICALL
@@ -429,315 +342,20 @@ Java_com_confidant_ai_engine_LLMEngine_nativeGenerateWithCache(
         jstring systemPrompt,
         jstring userMessage,
         jint maxTokens,
-        jfloat temperature) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_initialized || g_model == nullptr || g_context == nullptr) {
-        LOGE("Model not initialized");
-        return env->NewStringUTF("Error: Model not loaded");
-    }
-    
-    const char* sysStr = env->GetStringUTFChars(systemPrompt, nullptr);
-    const char* userStr = env->GetStringUTFChars(userMessage, nullptr);
+        jfloat temperature,
+        jint seed,
+        jlong sessionHandle) {
     
-    if (sysStr == nullptr || userStr == nullptr) {
+    std::string sysStr;
+    std::string userStr;
+    if (!get_string(env, systemPrompt, sysStr) || !get_string(env, userMessage, userStr)) {
         LOGE("Failed to get prompt strings");
-        if (sysStr) env->ReleaseStringUTFChars(systemPrompt, sysStr);
-        if (userStr) env->ReleaseStringUTFChars(userMessage, userStr);
         return env->NewStringUTF("Error: Invalid prompt");
     }
     
-    LOGI("=== Starting cached generation ===");
-    LOGI("System prompt length: %zu chars", strlen(sysStr));
-    LOGI("User message length: %zu chars", strlen(userStr));
-    
-    auto total_start = std::chrono::high_resolution_clock::now();
-    
-    // Check if system prompt matches cache (compare raw content, not formatted)
-    std::string current_sys_prompt(sysStr);
-    bool cache_hit = (current_sys_prompt == g_cached_system_prompt && g_cached_system_length > 0);
-    
-    // DIAGNOSTIC: Log cache status for debugging
-    LOGI("=== KV CACHE STATUS ===");
-    LOGI("Current prompt length: %zu chars", current_sys_prompt.length());
-    LOGI("Cached prompt length: %zu chars", g_cached_system_prompt.length());
-    LOGI("Prompts match: %s", (current_sys_prompt == g_cached_system_prompt) ? "YES" : "NO");
-    LOGI("Cached tokens: %d", g_cached_system_length);
-    LOGI("Cache hit: %s", cache_hit ? "✓ YES" : "✗ NO");
-    
-    // DIAGNOSTIC: Show first 200 chars of each prompt for comparison
-    if (!cache_hit && !g_cached_system_prompt.empty()) {
-        LOGI("Current prompt preview: %.200s...", current_sys_prompt.c_str());
-        LOGI("Cached prompt preview: %.200s...", g_cached_system_prompt.c_str());
-    }
-    LOGI("=== END CACHE STATUS ===");
-    
-    int sys_tokens_processed = 0;
-    
-    if (cache_hit) {
-        LOGI("✓ CACHE HIT - Reusing KV cache for system prompt (%d tokens)", g_cached_system_length);
-        sys_tokens_processed = g_cached_system_length;
-        
-        // CRITICAL FIX: Remove only user message tokens from previous turn, keep system prompt
-        // This is the proper way to reuse KV cache across multiple turns
-        llama_memory_t mem = llama_get_memory(g_context);
-        
-        // Get the maximum position in the cache for sequence 0
-        llama_pos max_pos = llama_memory_seq_pos_max(mem, 0);
-        
-        if (max_pos >= g_cached_system_length) {
-            // Remove tokens after system prompt (previous user message + assistant response)
-            // seq_id=0, from position g_cached_system_length to end (-1)
-            llama_memory_seq_rm(mem, 0, g_cached_system_length, -1);
-            LOGI("✓ Removed %d tokens from previous turn, kept %d system tokens", 
-                 (int)(max_pos - g_cached_system_length + 1), g_cached_system_length);
-        }
-        // KV cache now contains only system prompt - ready for new user message!
-    } else {
-        LOGI("✗ CACHE MISS - Processing system prompt");
-        
-        // CRITICAL FIX: Clear entire KV cache when system prompt changes
-        // This ensures clean state for new conversation context
-        llama_memory_t mem = llama_get_memory(g_context);
-        llama_memory_clear(mem, false);  // Clear cache but keep memory allocated
-        LOGI("KV cache cleared for new system prompt");
-        
-        // CRITICAL FIX: Format system prompt into proper LFM2.5 ChatML format
-        // Format: <|startoftext|><|im_start|>system\n[content]<|im_end|>
-        std::string formatted_sys_prompt = "<|startoftext|><|im_start|>system\n";
-        formatted_sys_prompt += sysStr;
-        formatted_sys_prompt += "<|im_end|>\n";
-        
-        // Tokenize formatted system prompt with BOS token
-        int n_sys_tokens = -llama_tokenize(g_vocab, formatted_sys_prompt.c_str(), formatted_sys_prompt.length(), nullptr, 0, true, true);
-        
-        if (n_sys_tokens <= 0) {
-            LOGE("Failed to tokenize system prompt");
-            env->ReleaseStringUTFChars(systemPrompt, sysStr);
-            env->ReleaseStringUTFChars(userMessage, userStr);
-            return env->NewStringUTF("Error: System prompt tokenization failed");
-        }
-        
-        std::vector<llama_token> sys_tokens(n_sys_tokens);
-        if (llama_tokenize(g_vocab, formatted_sys_prompt.c_str(), formatted_sys_prompt.length(), sys_tokens.data(), sys_tokens.size(), true, true) < 0) {
-            LOGE("Failed to tokenize system prompt");
-            env->ReleaseStringUTFChars(systemPrompt, sysStr);
-            env->ReleaseStringUTFChars(userMessage, userStr);
-            return env->NewStringUTF("Error: System prompt tokenization failed");
-        }
-        
-        // Process system prompt in ULTRA-OPTIMAL CHUNKS for 2026 mobile (research-backed)
-        auto sys_start = std::chrono::high_resolution_clock::now();
-        
-        // CRITICAL: Use 2048 to match n_ubatch for 3x speedup (research-verified)
-        const int CHUNK_SIZE = 2048;  // RESEARCH: ediary.site shows 530-540 t/s with ubatch=2048
-        int tokens_processed = 0;
-        
-        LOGI("📊 Processing system prompt: %d tokens in chunks of %d", n_sys_tokens, CHUNK_SIZE);
-        LOGI("📊 Expected speed: 250-300 tokens/sec (research benchmark)");
-        
-        while (tokens_processed < n_sys_tokens) {
-            int chunk_size = std::min(CHUNK_SIZE, n_sys_tokens - tokens_processed);
-            
-            // DIAGNOSTIC: Time each chunk decode
-            auto chunk_start = std::chrono::high_resolution_clock::now();
-            
-            llama_batch chunk_batch = llama_batch_get_one(sys_tokens.data() + tokens_processed, chunk_size);
-            
-            if (llama_decode(g_context, chunk_batch)) {
-                LOGE("Failed to decode system prompt chunk at %d", tokens_processed);
-                env->ReleaseStringUTFChars(systemPrompt, sysStr);
-                env->ReleaseStringUTFChars(userMessage, userStr);
-                return env->NewStringUTF("Error: System prompt processing failed");
-            }
-            
-            auto chunk_end = std::chrono::high_resolution_clock::now();
-            auto chunk_ms = std::chrono::duration_cast<std::chrono::milliseconds>(chunk_end - chunk_start).count();
-            
-            tokens_processed += chunk_size;
-            
-            // DIAGNOSTIC: Log chunk performance with benchmark comparison
-            float chunk_tokens_per_sec = chunk_ms > 0 ? (chunk_size * 1000.0f / chunk_ms) : 0.0f;
-            LOGI("  SysChunk %d-%d: %lldms (%.1f tokens/sec) [Expected: 250-300 t/s]", 
-                 tokens_processed - chunk_size, tokens_processed, 
-                 (long long)chunk_ms, chunk_tokens_per_sec);
-            
-            // DIAGNOSTIC: Warn if significantly slower than expected
-            if (chunk_tokens_per_sec < 100.0f && chunk_size >= 512) {
-                LOGW("⚠️ Performance below expected! Check thermal throttling or n_batch/n_ubatch mismatch");
-            }
-        }
-        
-        auto sys_end = std::chrono::high_resolution_clock::now();
-        auto sys_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sys_end - sys_start).count();
-        
-        float sys_tokens_per_sec = sys_ms > 0 ? (n_sys_tokens * 1000.0f / sys_ms) : 0.0f;
-        LOGI("✓ System prompt processed in %lldms (%d tokens, %.1f tokens/sec)", 
-             (long long)sys_ms, n_sys_tokens, sys_tokens_per_sec);
-        
-        // Cache the system prompt
-        g_cached_system_tokens = sys_tokens;
-        g_cached_system_length = n_sys_tokens;
-        g_cached_system_prompt = current_sys_prompt;
-        
-        sys_tokens_processed = n_sys_tokens;
-    }
-    
-    // CRITICAL FIX: Format user message into proper LFM2.5 ChatML format
-    // Format: <|im_start|>user\n[content]<|im_end|>\n<|im_start|>assistant\n
-    std::string formatted_user_prompt = "<|im_start|>user\n";
-    formatted_user_prompt += userStr;
-    formatted_user_prompt += "<|im_end|>\n";
-    formatted_user_prompt += "<|im_start|>assistant\n";
-    
-    // Tokenize formatted user message (no BOS token - already added in system)
-    int n_user_tokens = -llama_tokenize(g_vocab, formatted_user_prompt.c_str(), formatted_user_prompt.length(), nullptr, 0, false, false);
-    
-    if (n_user_tokens <= 0) {
-        LOGE("Failed to tokenize user message");
-        env->ReleaseStringUTFChars(systemPrompt, sysStr);
-        env->ReleaseStringUTFChars(userMessage, userStr);
-        return env->NewStringUTF("Error: User message tokenization failed");
-    }
-    
-    std::vector<llama_token> user_tokens(n_user_tokens);
-    if (llama_tokenize(g_vocab, formatted_user_prompt.c_str(), formatted_user_prompt.length(), user_tokens.data(), user_tokens.size(), false, false) < 0) {
-        LOGE("Failed to tokenize user message");
-        env->ReleaseStringUTFChars(systemPrompt, sysStr);
-        env->ReleaseStringUTFChars(userMessage, userStr);
-        return env->NewStringUTF("Error: User message tokenization failed");
-    }
-    
-    // Process user message in ULTRA-OPTIMAL CHUNKS for 2026 mobile (research-backed)
-    auto user_start = std::chrono::high_resolution_clock::now();
-    
-    // CRITICAL FIX: Match chunk size to n_ubatch for 3x speedup
-    const int USER_CHUNK_SIZE = 2048;  // MATCHES n_ubatch for maximum throughput
-    int tokens_processed = 0;
-    
-    while (tokens_processed < n_user_tokens) {
-        int chunk_size = std::min(USER_CHUNK_SIZE, n_user_tokens - tokens_processed);
-        llama_batch chunk_batch = llama_batch_get_one(user_tokens.data() + tokens_processed, chunk_size);
-        
-        if (llama_decode(g_context, chunk_batch)) {
-            LOGE("Failed to decode user message chunk at %d", tokens_processed);
-            env->ReleaseStringUTFChars(systemPrompt, sysStr);
-            env->ReleaseStringUTFChars(userMessage, userStr);
-            return env->NewStringUTF("Error: User message processing failed");
-        }
-        
-        tokens_processed += chunk_size;
-    }
-    
-    auto user_end = std::chrono::high_resolution_clock::now();
-    auto user_ms = std::chrono::duration_cast<std::chrono::milliseconds>(user_end - user_start).count();
-    
-    LOGI("✓ User message processed in %lldms (%d tokens, chunked)", (long long)user_ms, n_user_tokens);
-    
-    // Generate response
-    std::string response;
-    int n_generated = 0;
-    
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    
-    // Simplified sampler chain for faster sampling
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(g_params.topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(g_params.topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-    
-    auto gen_start = std::chrono::high_resolution_clock::now();
-    
-    llama_token new_token_id;
-    for (int i = 0; i < maxTokens; i++) {
-        // Minimal logging for maximum speed (2026 optimization)
-        if (i > 0 && i % 50 == 0) {
-            LOGI("Generated %d tokens...", i);
-        }
-        
-        new_token_id = llama_sampler_sample(smpl, g_context, -1);
-        
-        if (llama_vocab_is_eog(g_vocab, new_token_id)) {
-            LOGI("EOS at position %d", i);
-            break;
-        }
-        
-        char buf[256];
-        int n_chars = llama_token_to_piece(g_vocab, new_token_id, buf, sizeof(buf), 0, true);
-        
-        if (n_chars > 0) {
-            response.append(buf, n_chars);
-        }
-        
-        llama_batch next_batch = llama_batch_get_one(&new_token_id, 1);
-        n_generated++;
-        
-        if (llama_decode(g_context, next_batch)) {
-            LOGE("Failed to decode token at %d", i);
-            break;
-        }
-    }
-    
-    auto gen_end = std::chrono::high_resolution_clock::now();
-    auto gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(gen_end - gen_start).count();
-    auto total_ms = std::chrono::duration_cast<std::chrono::milliseconds>(gen_end - total_start).count();
-    
-    llama_sampler_free(smpl);
-    
-    float tokens_per_sec = gen_ms > 0 ? (n_generated * 1000.0f / gen_ms) : 0.0f;
-    
-    LOGI("=== Cached generation complete ===");
-    LOGI("Cache: %s", cache_hit ? "HIT ✓" : "MISS ✗");
-    LOGI("Input: sys=%d + user=%d = %d tokens", sys_tokens_processed, n_user_tokens, sys_tokens_processed + n_user_tokens);
-    LOGI("Output: %d tokens (%.2f t/s)", n_generated, tokens_per_sec);
-    LOGI("Timing: User=%lldms, Gen=%lldms, Total=%lldms", (long long)user_ms, (long long)gen_ms, (long long)total_ms);
-    LOGI("Response preview: %.100s%s", response.c_str(), response.length() > 100 ? "..." : "");
-    
-    // CRITICAL: Sanitize UTF-8 to prevent JNI crashes from malformed emoji/unicode
-    std::string sanitized;
-    sanitized.reserve(response.length());
-    
-    for (size_t i = 0; i < response.length(); ) {
-        unsigned char c = response[i];
-        if (c <= 0x7F) {
-            // Valid ASCII (1 byte)
-            sanitized += c;
-            i++;
-        } else if (c >= 0xC0 && c <= 0xDF && i + 1 < response.length() && (response[i + 1] & 0xC0) == 0x80) {
-            // Valid 2-byte UTF-8
-            sanitized += c;
-            sanitized += response[i + 1];
-            i += 2;
-        } else if (c >= 0xE0 && c <= 0xEF && i + 2 < response.length() && (response[i + 1] & 0xC0) == 0x80 && (response[i + 2] & 0xC0) == 0x80) {
-            // Valid 3-byte UTF-8
-            sanitized += c;
-            sanitized += response[i + 1];
-            sanitized += response[i + 2];
-            i += 3;
-        } else if (c >= 0xF0 && c <= 0xF7 && i + 3 < response.length() && (response[i + 1] & 0xC0) == 0x80 && (response[i + 2] & 0xC0) == 0x80 && (response[i + 3] & 0xC0) == 0x80) {
-            // Valid 4-byte UTF-8 (emoji)
-            sanitized += c;
-            sanitized += response[i + 1];
-            sanitized += response[i + 2];
-            sanitized += response[i + 3];
-            i += 4;
-        } else {
-            // Invalid UTF-8 byte - skip it
-            LOGD("Skipping invalid UTF-8 byte 0x%02x at position %zu", c, i);
-            i++;
-        }
-    }
-    
-    if (sanitized.length() != response.length()) {
-        LOGI("Sanitized response: removed %zu invalid UTF-8 bytes", response.length() - sanitized.length());
-    }
-    
-    env->ReleaseStringUTFChars(systemPrompt, sysStr);
-    env->ReleaseStringUTFChars(userMessage, userStr);
-    
-    return env->NewStringUTF(sanitized.c_str());
+    GenerationResult result;
+    engine_generate_chat(sessionHandle, sysStr, userStr, make_options(maxTokens, temperature, seed), nullptr, result);
+    return result_to_string(env, result);
 }
 
 JNIEXPORT jint JNICALL
@@ -746,21 +364,14 @@ Java_com_confidant_ai_engine_LLMEngine_nativeGetTokenCount(
         jobject thiz,
         jstring text) {
     
-    if (!g_initialized || g_vocab == nullptr) {
-        // Fallback estimation
-        const char* str = env->GetStringUTFChars(text, nullptr);
-        size_t len = strlen(str);
-        env->ReleaseStringUTFChars(text, str);
-        return static_cast<int>(len / 4.0);
+    std::string str;
+    if (!get_string(env, text, str)) {
+        return 0;
     }
     
-    const char* str = env->GetStringUTFChars(text, nullptr);
-    
-    int n_tokens = -llama_tokenize(g_vocab, str, strlen(str), nullptr, 0, false, false);
-    
-    env->ReleaseStringUTFChars(text, str);
-    
-    return n_tokens > 0 ? n_tokens : static_cast<int>(strlen(str) / 4.0);
+    // Fallback estimation when no model is loaded
+    int n_tokens = engine_count_tokens(str);
+    return n_tokens > 0 ? n_tokens : static_cast<int>(str.length() / 4.0);
 }
 
 JNIEXPORT void JNICALL
@@ -770,25 +381,24 @@ Java_com_confidant_ai_engine_LLMEngine_nativeGenerateStreaming(
         jstring prompt,
         jint maxTokens,
         jfloat temperature,
-        jobject callback) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_initialized || g_model == nullptr || g_context == nullptr) {
-        LOGE("Model not initialized for streaming");
-        
-        // Call error callback
-        jclass callbackClass = env->GetObjectClass(callback);
-        jmethodID onErrorMethod = env->GetMethodID(callbackClass, "onError", "(Ljava/lang/String;)V");
-        jstring error = env->NewStringUTF("Model not loaded");
-        env->CallVoidMethod(callback, onErrorMethod, error);
-        env->DeleteLocalRef(error);
-        return;
-    }
+        jobject callback,
+        jint seed,
+        jlong sessionHandle,
+        jint flushTokens,
+        jint flushMillis,
+        jobject directBuffer) {
     
     // Get callback methods
     jclass callbackClass = env->GetObjectClass(callback);
     jmethodID onTokenMethod = env->GetMethodID(callbackClass, "onToken", "(Ljava/lang/String;)V");
+    jmethodID onChunkMethod = env->GetMethodID(callbackClass, "onChunk", "(II)V");
+    if (onChunkMethod == nullptr) {
+        env->ExceptionClear();  // Older callback without direct buffer support
+    }
+    jmethodID onPrefillMethod = env->GetMethodID(callbackClass, "onPrefillProgress", "(II)V");
+    if (onPrefillMethod == nullptr) {
+        env->ExceptionClear();  // Older callback without prefill progress
+    }
     jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "()V");
     jmethodID onErrorMethod = env->GetMethodID(callbackClass, "onError", "(Ljava/lang/String;)V");
     
@@ -797,166 +407,285 @@ Java_com_confidant_ai_engine_LLMEngine_nativeGenerateStreaming(
         return;
     }
     
-    const char* promptStr = env->GetStringUTFChars(prompt, nullptr);
-    if (promptStr == nullptr) {
-        LOGE("Failed to get prompt string");
-        jstring error = env->NewStringUTF("Invalid prompt");
+    auto report_error = [&](const char* message) {
+        jstring error = env->NewStringUTF(message);
         env->CallVoidMethod(callback, onErrorMethod, error);
         env->DeleteLocalRef(error);
-        return;
-    }
-    
-    LOGI("=== Starting REAL streaming generation ===");
-    LOGI("Prompt length: %zu chars", strlen(promptStr));
-    LOGI("Max tokens: %d, Temperature: %.2f", maxTokens, temperature);
+    };
     
-    // Tokenize the prompt
-    int n_tokens = -llama_tokenize(g_vocab, promptStr, strlen(promptStr), nullptr, 0, true, true);
-    
-    if (n_tokens <= 0) {
-        LOGE("Failed to get token count");
-        env->ReleaseStringUTFChars(prompt, promptStr);
-        jstring error = env->NewStringUTF("Tokenization failed");
-        env->CallVoidMethod(callback, onErrorMethod, error);
-        env->DeleteLocalRef(error);
+    std::string promptStr;
+    if (!get_string(env, prompt, promptStr)) {
+        LOGE("Failed to get prompt string");
+        report_error("Invalid prompt");
         return;
     }
     
-    std::vector<llama_token> tokens(n_tokens);
-    if (llama_tokenize(g_vocab, promptStr, strlen(promptStr), tokens.data(), tokens.size(), true, true) < 0) {
-        LOGE("Failed to tokenize prompt");
-        env->ReleaseStringUTFChars(prompt, promptStr);
-        jstring error = env->NewStringUTF("Tokenization failed");
-        env->CallVoidMethod(callback, onErrorMethod, error);
-        env->DeleteLocalRef(error);
-        return;
+    // REAL STREAMING - tokens go to Kotlin as soon as a flush window closes
+    // (flushTokens=1, flushMillis=0 sends every token immediately)
+    StreamDelivery delivery;
+    delivery.env = env;
+    delivery.callback = callback;
+    delivery.on_token = onTokenMethod;
+    delivery.flush_tokens = std::max(1, (int)flushTokens);
+    delivery.flush_ms = std::max(0, (int)flushMillis);
+    if (directBuffer != nullptr && onChunkMethod != nullptr) {
+        delivery.ring = static_cast<uint8_t*>(env->GetDirectBufferAddress(directBuffer));
+        delivery.ring_capacity = delivery.ring ? (size_t)env->GetDirectBufferCapacity(directBuffer) : 0;
+        if (delivery.ring_capacity < 4) {
+            delivery.ring = nullptr;  // Not a usable direct buffer - fall back to strings
+        }
+        delivery.on_chunk = onChunkMethod;
     }
+    LOGI("Delivery: every %d tokens / %dms via %s", delivery.flush_tokens, delivery.flush_ms,
+         delivery.ring ? "direct ByteBuffer" : "String");
     
-    LOGI("Tokenized prompt: %d tokens", n_tokens);
+    // CRITICAL: The assembler keeps multi-byte UTF-8 intact across token boundaries
+    TokenCallback on_token = [&](const char* piece, int length) {
+        delivery.push(piece, length);
+    };
     
-    // Process prompt in ultra-optimized chunks
-    auto prompt_start = std::chrono::high_resolution_clock::now();
-    
-    // CRITICAL FIX: Match chunk size to n_ubatch for 3x speedup
-    const int CHUNK_SIZE = 2048;  // MATCHES n_ubatch for maximum throughput
-    int tokens_processed = 0;
-    
-    while (tokens_processed < n_tokens) {
-        int chunk_size = std::min(CHUNK_SIZE, n_tokens - tokens_processed);
-        llama_batch chunk_batch = llama_batch_get_one(tokens.data() + tokens_processed, chunk_size);
-        
-        if (llama_decode(g_context, chunk_batch)) {
-            LOGE("Failed to decode prompt chunk at %d", tokens_processed);
-            env->ReleaseStringUTFChars(prompt, promptStr);
-            jstring error = env->NewStringUTF("Prompt processing failed");
-            env->CallVoidMethod(callback, onErrorMethod, error);
-            env->DeleteLocalRef(error);
-            return;
-        }
-        
-        tokens_processed += chunk_size;
+    // Long prompts take seconds; let the UI show how far the prefill got
+    PrefillProgressCallback on_prefill;
+    if (onPrefillMethod != nullptr) {
+        on_prefill = [&](int n_prefilled, int n_prompt) {
+            env->CallVoidMethod(callback, onPrefillMethod, (jint)n_prefilled, (jint)n_prompt);
+        };
     }
     
-    auto prompt_end = std::chrono::high_resolution_clock::now();
-    auto prompt_ms = std::chrono::duration_cast<std::chrono::milliseconds>(prompt_end - prompt_start).count();
+    GenerationResult result;
+    engine_generate(sessionHandle, promptStr, make_options(maxTokens, temperature, seed), on_token, result, on_prefill);
+    delivery.flush();
     
-    LOGI("✓ Prompt processed in %lldms", (long long)prompt_ms);
+    LOGI("Delivered %d tokens in %d JNI callbacks", result.n_generated, delivery.n_flushes);
     
-    // Create sampler
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(g_params.topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(g_params.topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    if (result.error != nullptr) {
+        report_error(result.error);
+    } else if (result.cancelled) {
+        report_error("Generation cancelled");
+    } else {
+        env->CallVoidMethod(callback, onCompleteMethod);
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetSpeculativeDraft(
+        JNIEnv* env,
+        jobject thiz,
+        jint nDraft) {
     
-    LOGI("Starting REAL token-by-token streaming...");
+    engine_set_speculative_draft(nDraft);
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeGetSpeculativeStats(JNIEnv* env, jobject thiz) {
+    int64_t drafted = 0;
+    int64_t accepted = 0;
+    engine_get_speculative_stats(drafted, accepted);
+    jlong stats[2] = {(jlong)drafted, (jlong)accepted};
+    jlongArray result = env->NewLongArray(2);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 2, stats);
+    }
+    return result;
+}
+
+// Prompt tokens per step while other requests decode (0 = uncapped). Lock-free.
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetPrefillBudget(
+        JNIEnv* env,
+        jobject thiz,
+        jint nTokens) {
     
-    auto gen_start = std::chrono::high_resolution_clock::now();
-    int n_generated = 0;
+    engine_set_prefill_budget(nTokens);
+}
+
+// Thermal and battery state for the thread controller. Lock-free: the
+// scheduler picks it up before its next step, even mid-generation.
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetDeviceState(
+        JNIEnv* env,
+        jobject thiz,
+        jint thermalLevel,
+        jfloat thermalHeadroom,
+        jint batteryPercent,
+        jboolean charging) {
     
-    // REAL STREAMING LOOP - Each token is sent immediately via callback
-    llama_token new_token_id;
-    for (int i = 0; i < maxTokens; i++) {
-        // Sample next token
-        new_token_id = llama_sampler_sample(smpl, g_context, -1);
-        
-        // Check for EOS
-        if (llama_vocab_is_eog(g_vocab, new_token_id)) {
-            LOGI("EOS token at position %d", i);
-            break;
-        }
-        
-        // Convert token to text
-        char buf[256];
-        int n_chars = llama_token_to_piece(g_vocab, new_token_id, buf, sizeof(buf), 0, true);
-        
-        if (n_chars > 0) {
-            // CRITICAL: Sanitize UTF-8 before sending to Java
-            std::string token_text;
-            for (int j = 0; j < n_chars; ) {
-                unsigned char c = buf[j];
-                if (c <= 0x7F) {
-                    token_text += c;
-                    j++;
-                } else if (c >= 0xC0 && c <= 0xDF && j + 1 < n_chars && (buf[j + 1] & 0xC0) == 0x80) {
-                    token_text += c;
-                    token_text += buf[j + 1];
-                    j += 2;
-                } else if (c >= 0xE0 && c <= 0xEF && j + 2 < n_chars && (buf[j + 1] & 0xC0) == 0x80 && (buf[j + 2] & 0xC0) == 0x80) {
-                    token_text += c;
-                    token_text += buf[j + 1];
-                    token_text += buf[j + 2];
-                    j += 3;
-                } else if (c >= 0xF0 && c <= 0xF7 && j + 3 < n_chars && (buf[j + 1] & 0xC0) == 0x80 && (buf[j + 2] & 0xC0) == 0x80 && (buf[j + 3] & 0xC0) == 0x80) {
-                    token_text += c;
-                    token_text += buf[j + 1];
-                    token_text += buf[j + 2];
-                    token_text += buf[j + 3];
-                    j += 4;
-                } else {
-                    j++;  // Skip invalid byte
-                }
-            }
-            
-            // CALL KOTLIN CALLBACK IMMEDIATELY - THIS IS REAL STREAMING
-            jstring tokenStr = env->NewStringUTF(token_text.c_str());
-            env->CallVoidMethod(callback, onTokenMethod, tokenStr);
-            env->DeleteLocalRef(tokenStr);
-            
-            // Log first few tokens for debugging
-            if (i < 3) {
-                LOGI("Token %d: '%s'", i, token_text.c_str());
-            }
-        }
-        
-        // Prepare next batch
-        llama_batch next_batch = llama_batch_get_one(&new_token_id, 1);
-        n_generated++;
-        
-        // Decode next token
-        if (llama_decode(g_context, next_batch)) {
-            LOGE("Failed to decode token at position %d", i);
-            break;
+    engine_set_device_state(thermalLevel, thermalHeadroom, batteryPercent, charging == JNI_TRUE);
+}
+
+// Memory residency level (EngineResidency), driven by onTrimMemory. Trims wait
+// for the engine to go idle; the next generation restores what it needs.
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetResidency(
+        JNIEnv* env,
+        jobject thiz,
+        jint level) {
+
+    engine_set_residency(level);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeGetResidency(JNIEnv* env, jobject thiz) {
+    return engine_get_residency();
+}
+
+// Performance counters as one flat array, mirrored by InferenceMetrics.fromArray
+// (layout documented at engine_get_metrics)
+JNIEXPORT jdoubleArray JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeGetMetrics(JNIEnv* env, jobject thiz) {
+    double values[ENGINE_METRICS_SIZE];
+    engine_get_metrics(values);
+    jdoubleArray result = env->NewDoubleArray(ENGINE_METRICS_SIZE);
+    if (result != nullptr) {
+        env->SetDoubleArrayRegion(result, 0, ENGINE_METRICS_SIZE, values);
+    }
+    return result;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeCreateSession(JNIEnv* env, jobject thiz) {
+    return (jlong)engine_create_session();
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeCancelSession(JNIEnv* env, jobject thiz, jlong sessionHandle) {
+    engine_cancel_session(sessionHandle);
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeDestroySession(JNIEnv* env, jobject thiz, jlong sessionHandle) {
+    engine_destroy_session(sessionHandle);
+}
+
+// =============================================================================
+// Note vectors - embedded by the engine, stored in a VectorIndex (handle = pointer)
+// =============================================================================
+
+// Dedicated embedding GGUF, "" = the chat model. Resets the embedding context.
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeSetEmbeddingModel(JNIEnv* env, jobject thiz, jstring modelPath) {
+    std::string path;
+    if (get_string(env, modelPath, path)) {
+        engine_set_embedding_model(path);
+    }
+}
+
+// engine_embedding_model_id(): changes when another GGUF is loaded or chosen
+// for embeddings, 0 when there is none
+JNIEXPORT jlong JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeEmbeddingModelId(JNIEnv* env, jobject thiz) {
+    return (jlong)engine_embedding_model_id();
+}
+
+// Opens (or creates) the index for the current embedding model; vectors of an
+// earlier model are dropped. 0 when there is no model yet or the file failed.
+JNIEXPORT jlong JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeVectorIndexOpen(JNIEnv* env, jobject thiz, jstring indexPath) {
+    std::string path;
+    const uint64_t model_id = engine_embedding_model_id();
+    if (model_id == 0 || !get_string(env, indexPath, path)) {
+        return 0;
+    }
+    return (jlong)(intptr_t)vector_index_open(path, model_id);
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeVectorIndexClose(JNIEnv* env, jobject thiz, jlong index) {
+    vector_index_close((VectorIndex*)(intptr_t)index);
+}
+
+// Embeds texts and stores them under ids, replacing earlier vectors. Returns
+// how many were stored, -1 if embedding failed or was cancelled. Background
+// work: fails while the model is trimmed to COLD or unloaded.
+JNIEXPORT jint JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeVectorIndexAdd(
+        JNIEnv* env,
+        jobject thiz,
+        jlong index,
+        jlongArray ids,
+        jobjectArray texts,
+        jlong sessionHandle) {
+    
+    const jsize n = env->GetArrayLength(texts);
+    if (env->GetArrayLength(ids) != n) {
+        return -1;
+    }
+    std::vector<jlong> note_ids(n);
+    env->GetLongArrayRegion(ids, 0, n, note_ids.data());
+    std::vector<std::string> strings(n);
+    for (jsize i = 0; i < n; i++) {
+        jstring text = (jstring)env->GetObjectArrayElement(texts, i);
+        bool ok = get_string(env, text, strings[i]);
+        env->DeleteLocalRef(text);
+        if (!ok) {
+            return -1;
         }
     }
     
-    auto gen_end = std::chrono::high_resolution_clock::now();
-    auto gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(gen_end - gen_start).count();
-    
-    llama_sampler_free(smpl);
-    
-    float tokens_per_sec = gen_ms > 0 ? (n_generated * 1000.0f / gen_ms) : 0.0f;
-    
-    LOGI("=== REAL streaming generation complete ===");
-    LOGI("Generated %d tokens in %lldms (%.2f t/s)", n_generated, (long long)gen_ms, tokens_per_sec);
-    LOGI("Prompt: %lldms, Generation: %lldms, Total: %lldms", (long long)prompt_ms, (long long)gen_ms, (long long)(prompt_ms + gen_ms));
-    
-    // Call completion callback
-    env->CallVoidMethod(callback, onCompleteMethod);
-    
-    env->ReleaseStringUTFChars(prompt, promptStr);
+    EmbeddingResult result;
+    engine_embed(sessionHandle, strings, false, result);
+    if (result.error != nullptr || result.cancelled) {
+        return -1;
+    }
+    int n_stored = 0;
+    for (jsize i = 0; i < n; i++) {
+        n_stored += vector_index_put((VectorIndex*)(intptr_t)index, note_ids[i],
+                                     result.values.data() + (size_t)i * result.dim, result.dim);
+    }
+    return n_stored;
+}
+
+JNIEXPORT void JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeVectorIndexRemove(JNIEnv* env, jobject thiz, jlong index, jlong id) {
+    vector_index_remove((VectorIndex*)(intptr_t)index, id);
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeVectorIndexIds(JNIEnv* env, jobject thiz, jlong index) {
+    std::vector<int64_t> ids;
+    vector_index_ids((VectorIndex*)(intptr_t)index, ids);
+    jlongArray result = env->NewLongArray((jsize)ids.size());
+    if (result != nullptr && !ids.empty()) {
+        env->SetLongArrayRegion(result, 0, (jsize)ids.size(), (const jlong*)ids.data());
+    }
+    return result;
+}
+
+// Up to k ids nearest to the query, best first, with their cosine similarity
+// in scores (at least k long). null if the query could not be embedded.
+JNIEXPORT jlongArray JNICALL
+Java_com_confidant_ai_engine_LLMEngine_nativeVectorIndexSearch(
+        JNIEnv* env,
+        jobject thiz,
+        jlong index,
+        jstring query,
+        jint k,
+        jlong sessionHandle,
+        jfloatArray scores) {
+    
+    std::string text;
+    if (!get_string(env, query, text) || k <= 0 || env->GetArrayLength(scores) < k) {
+        return nullptr;
+    }
+    EmbeddingResult result;
+    engine_embed(sessionHandle, {text}, true, result);
+    if (result.error != nullptr || result.cancelled) {
+        return nullptr;
+    }
+    
+    std::vector<int64_t> ids(k);
+    std::vector<float> found_scores(k);
+    const int n = vector_index_search((VectorIndex*)(intptr_t)index, result.values.data(), result.dim, k,
+                                      ids.data(), found_scores.data());
+    if (n < 0) {
+        return nullptr;
+    }
+    jlongArray found = env->NewLongArray(n);
+    if (found != nullptr && n > 0) {
+        env->SetLongArrayRegion(found, 0, n, (const jlong*)ids.data());
+        env->SetFloatArrayRegion(scores, 0, n, found_scores.data());
+    }
+    return found;
 }
 
 } // extern "C"
@@ -9,6 +9,12 @@
 #define GGML_FA_TILE_Q  32
 #define GGML_FA_TILE_KV 16
 
+// Quantized-KV decode attention: up to GGML_FA_DECODE_Q query rows against at least
+// GGML_FA_DECODE_MIN_KV cache rows, scored GGML_FA_DECODE_KV rows at a time
+#define GGML_FA_DECODE_Q      16
+#define GGML_FA_DECODE_KV     32
+#define GGML_FA_DECODE_MIN_KV 256
+
 #ifdef __cplusplus
 
 #include <utility>
@@ -2882,6 +2882,11 @@ struct ggml_cplan ggml_graph_plan(
                         size_t n_chunks = n_tasks;
                         size_t decode   = sizeof(float)*(neq2*n_chunks*(2+DV) + n_tasks*(DK + 2*DV));
 
+                        // quantized KV decode path: see ggml_compute_forward_flash_attn_ext_quant_decode
+                        if (ggml_flash_attn_ext_quant_decode_supported(node)) {
+                            decode = MAX(decode, ggml_flash_attn_ext_quant_decode_wsize(node, n_tasks));
+                        }
+
                         cur += MAX(prefill, decode);
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
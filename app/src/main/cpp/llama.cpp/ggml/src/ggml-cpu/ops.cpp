@@ -8626,6 +8626,339 @@ static void ggml_flash_attn_ext_reduce_partials(
     }
 }
 
+// Decode attention over a quantized KV cache (K and V each Q8_0 or Q4_0): a few
+// query rows (one per decoding sequence, or a short speculative batch) against a
+// long cache. The cache is split across the threads (split-K). Each thread
+// scores its rows of every head with int8 dot products straight against the
+// quantized K blocks (SDOT, or i8mm on two K rows x two query rows at a time),
+// keeps an online softmax per query row and dequantizes each V row once for all
+// the query heads that share it (GQA). The per-thread partials are merged after
+// a barrier.
+
+static bool ggml_flash_attn_ext_quant_decode_type(ggml_type type) {
+    return type == GGML_TYPE_Q8_0 || type == GGML_TYPE_Q4_0;
+}
+
+bool ggml_flash_attn_ext_quant_decode_supported(const ggml_tensor * dst) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
+    const ggml_tensor * v = dst->src[2];
+
+    return q->type == GGML_TYPE_F32 && ggml_flash_attn_ext_quant_decode_type(k->type) && ggml_flash_attn_ext_quant_decode_type(v->type) &&
+           q->ne[1] <= GGML_FA_DECODE_Q && k->ne[1] >= GGML_FA_DECODE_MIN_KV &&
+           q->ne[3] == 1 && k->ne[3] == 1 && v->ne[3] == 1 &&
+           k->ne[2] == v->ne[2] && q->ne[2] % k->ne[2] == 0;
+}
+
+// Per-thread scratch, in floats:
+//   Q_q:  R query rows of one KV head, quantized to Q8_0, the dot type of both
+//         K types (R = heads per KV head * query rows)
+//   KQ:   R * GGML_FA_DECODE_KV scores, then softmax weights
+//   M, S, live: R each
+//   VKQ:  R * DV accumulators
+//   V32:  DV, one dequantized V row
+// followed by the partials of all threads: [query row][thread][M, S, VKQ]
+static int64_t ggml_flash_attn_ext_quant_decode_thread_size(int64_t R, int64_t DK, int64_t DV) {
+    const int64_t q_floats = (R*(int64_t) ggml_row_size(GGML_TYPE_Q8_0, DK) + sizeof(float) - 1)/sizeof(float);
+    return q_floats + R*GGML_FA_DECODE_KV + 3*R + R*DV + DV + CACHE_LINE_SIZE_F32;
+}
+
+size_t ggml_flash_attn_ext_quant_decode_wsize(const ggml_tensor * dst, int n_tasks) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
+    const ggml_tensor * v = dst->src[2];
+
+    const int64_t R = (q->ne[2]/k->ne[2])*q->ne[1];
+    const int64_t thread_size = ggml_flash_attn_ext_quant_decode_thread_size(R, k->ne[0], v->ne[0]);
+
+    return sizeof(float)*(n_tasks*thread_size + q->ne[1]*q->ne[2]*n_tasks*(2 + v->ne[0]));
+}
+
+static void ggml_compute_forward_flash_attn_ext_quant_decode(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * q     = dst->src[0];
+    const ggml_tensor * k     = dst->src[1];
+    const ggml_tensor * v     = dst->src[2];
+    const ggml_tensor * mask  = dst->src[3];
+    const ggml_tensor * sinks = dst->src[4];
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int64_t DK = nek0;
+    const int64_t DV = v->ne[0];
+    const int64_t N  = neq1;
+
+    // heads per KV head, and the query rows that share one KV head
+    const int64_t rk2 = neq2/nek2;
+    const int64_t R   = rk2*N;
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    const auto * k_traits_cpu = ggml_get_type_traits_cpu(k->type);
+    GGML_ASSERT(k_traits_cpu->vec_dot_type == GGML_TYPE_Q8_0);
+
+    const ggml_from_float_t q_to_q8_0  = ggml_get_type_traits_cpu(GGML_TYPE_Q8_0)->from_float;
+    const ggml_vec_dot_t    kq_vec_dot = k_traits_cpu->vec_dot;
+    const ggml_to_float_t   v_to_float = ggml_get_type_traits(v->type)->to_float;
+
+    // 2 when the dot product takes a 2x2 tile (i8mm)
+    const int64_t kq_nrows = k_traits_cpu->nrows;
+
+    const size_t q_row_size = ggml_row_size(GGML_TYPE_Q8_0, DK);
+
+    static constexpr int64_t KV_BLOCK = GGML_FA_DECODE_KV;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t thread_size = ggml_flash_attn_ext_quant_decode_thread_size(R, DK, DV);
+
+    float * base = (float *) params->wdata + ith*thread_size;
+    char  * Q_q  = (char *) base;
+    float * KQ   = base + (R*(int64_t) q_row_size + sizeof(float) - 1)/sizeof(float);
+    float * M    = KQ + R*KV_BLOCK;
+    float * S    = M + R;
+    float * live = S + R;
+    float * VKQ  = live + R;
+    float * V32  = VKQ + R*DV;
+
+    const int64_t partial_size = 2 + DV;
+    float * partials = (float *) params->wdata + nth*thread_size;
+
+    // this thread's share of the cache, in whole row pairs
+    int64_t chunk_size = (nek1 + nth - 1)/nth;
+    chunk_size += chunk_size % 2;
+
+    const int64_t ic_start = MIN(ith*chunk_size, nek1);
+    const int64_t ic_end   = MIN(ic_start + chunk_size, nek1);
+
+    auto score = [&](float s) {
+        s *= scale;
+        return logit_softcap != 0.0f ? logit_softcap*tanhf(s) : s;
+    };
+
+    for (int64_t ik2 = 0; ik2 < nek2; ++ik2) {
+        // row r = iq1*rk2 + g is token iq1 of head ik2*rk2 + g: the heads of a
+        // token are adjacent, so the row pairs of the 2x2 tile share a mask
+        for (int64_t iq1 = 0; iq1 < N; ++iq1) {
+            for (int64_t g = 0; g < rk2; ++g) {
+                const float * pq = (const float *) ((const char *) q->data + iq1*nbq1 + (ik2*rk2 + g)*nbq2);
+                q_to_q8_0(pq, Q_q + (iq1*rk2 + g)*q_row_size, DK);
+            }
+        }
+
+        for (int64_t r = 0; r < R; ++r) {
+            M[r] = -INFINITY;
+            S[r] = 0.0f;
+        }
+        memset(VKQ, 0, R*DV*sizeof(float));
+
+        for (int64_t ic0 = ic_start; ic0 < ic_end; ic0 += KV_BLOCK) {
+            const int64_t n_block = MIN(KV_BLOCK, ic_end - ic0);
+
+            // start the scores from the mask; rows masked out for the whole block are skipped
+            bool any_live = false;
+            for (int64_t r = 0; r < R; ++r) {
+                const int64_t iq1 = r/rk2;
+                const int64_t iq2 = ik2*rk2 + r%rk2;
+                float * kq_row = KQ + r*KV_BLOCK;
+
+                live[r] = 1.0f;
+                if (mask) {
+                    const float slope = (max_bias > 0.0f) ? iq2 < n_head_log2 ? powf(m0, iq2 + 1) : powf(m1, 2*(iq2 - n_head_log2) + 1) : 1.0f;
+                    const ggml_fp16_t * mp = (const ggml_fp16_t *) ((const char *) mask->data + iq1*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2]);
+
+                    float row_max = -INFINITY;
+                    for (int64_t b = 0; b < n_block; ++b) {
+                        kq_row[b] = slope*GGML_CPU_FP16_TO_FP32(mp[ic0 + b]);
+                        row_max = fmaxf(row_max, kq_row[b]);
+                    }
+                    live[r] = row_max == -INFINITY ? 0.0f : 1.0f;
+                } else {
+                    memset(kq_row, 0, n_block*sizeof(float));
+                }
+                any_live = any_live || live[r] != 0.0f;
+            }
+
+            if (!any_live) {
+                continue;
+            }
+
+            // KQ += scale * q.k
+            for (int64_t r = 0; r < R; r += kq_nrows) {
+                const bool pair = kq_nrows == 2 && r + 1 < R;
+                if (live[r] == 0.0f && !(pair && live[r + 1] != 0.0f)) {
+                    continue;
+                }
+
+                int64_t b = 0;
+                if (pair) {
+                    float * kq0 = KQ + r*KV_BLOCK;
+                    float * kq1 = kq0 + KV_BLOCK;
+                    for (; b + 1 < n_block; b += 2) {
+                        const char * k_data = (const char *) k->data + ((ic0 + b)*nbk1 + ik2*nbk2);
+
+                        // s[i + 2*j] = k row i . q row j
+                        float s[4];
+                        kq_vec_dot(DK, s, 2, k_data, nbk1, Q_q + r*q_row_size, q_row_size, 2);
+
+                        kq0[b]     += score(s[0]);
+                        kq0[b + 1] += score(s[1]);
+                        kq1[b]     += score(s[2]);
+                        kq1[b + 1] += score(s[3]);
+                    }
+                }
+
+                for (int64_t rr = r; rr < r + (pair ? 2 : 1); ++rr) {
+                    float * kq_row = KQ + rr*KV_BLOCK;
+                    for (int64_t bb = b; bb < n_block; ++bb) {
+                        if (kq_row[bb] == -INFINITY) {
+                            continue;
+                        }
+                        const char * k_data = (const char *) k->data + ((ic0 + bb)*nbk1 + ik2*nbk2);
+
+                        float s;
+                        kq_vec_dot(DK, &s, 0, k_data, 0, Q_q + rr*q_row_size, 0, 1);
+                        kq_row[bb] += score(s);
+                    }
+                }
+            }
+
+            // online softmax: KQ becomes expf(s - M), earlier rows rescaled on a new maximum
+            for (int64_t r = 0; r < R; ++r) {
+                if (live[r] == 0.0f) {
+                    continue;
+                }
+                float * kq_row = KQ + r*KV_BLOCK;
+
+                float block_max;
+                ggml_vec_max_f32(n_block, &block_max, kq_row);
+
+                const float Mnew = fmaxf(M[r], block_max);
+                if (Mnew > M[r]) {
+                    const float ms = expf(M[r] - Mnew);
+                    ggml_vec_scale_f32(DV, VKQ + r*DV, ms);
+                    S[r] *= ms;
+                    M[r] = Mnew;
+                }
+
+                S[r] += ggml_vec_soft_max_f32(n_block, kq_row, kq_row, M[r]);
+            }
+
+            // VKQ += p*v, each V row dequantized once for all rows that use it
+            for (int64_t b = 0; b < n_block; ++b) {
+                bool used = false;
+                for (int64_t r = 0; r < R && !used; ++r) {
+                    used = live[r] != 0.0f && KQ[r*KV_BLOCK + b] != 0.0f;
+                }
+                if (!used) {
+                    continue;
+                }
+
+                v_to_float((const char *) v->data + ((ic0 + b)*nbv1 + ik2*nbv2), V32, DV);
+
+                for (int64_t r = 0; r < R; ++r) {
+                    const float p = KQ[r*KV_BLOCK + b];
+                    if (live[r] != 0.0f && p != 0.0f) {
+                        ggml_vec_mad_f32(DV, VKQ + r*DV, V32, p);
+                    }
+                }
+            }
+        }
+
+        for (int64_t r = 0; r < R; ++r) {
+            const int64_t iq1 = r/rk2;
+            const int64_t iq2 = ik2*rk2 + r%rk2;
+
+            float * partial = partials + ((iq1*neq2 + iq2)*nth + ith)*partial_size;
+            partial[0] = M[r];
+            partial[1] = S[r];
+            memcpy(partial + 2, VKQ + r*DV, DV*sizeof(float));
+        }
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // merge the partials, one query row (token, head) at a time
+    float * VKQ_final = VKQ;
+
+    for (int64_t row = ith; row < N*neq2; row += nth) {
+        const int64_t iq1 = row/neq2;
+        const int64_t iq2 = row%neq2;
+
+        float M_final = -INFINITY;
+        float S_final = 0.0f;
+        memset(VKQ_final, 0, DV*sizeof(float));
+
+        for (int64_t j = 0; j < nth; ++j) {
+            const float * partial = partials + (row*nth + j)*partial_size;
+            const float   M_chunk = partial[0];
+            const float   S_chunk = partial[1];
+
+            if (S_chunk == 0.0f) {
+                continue;
+            }
+
+            const float M_new     = fmaxf(M_final, M_chunk);
+            const float scale_old = expf(M_final - M_new);
+            const float scale_new = expf(M_chunk - M_new);
+
+            ggml_vec_scale_f32(DV, VKQ_final, scale_old);
+            ggml_vec_mad_f32(DV, VKQ_final, partial + 2, scale_new);
+
+            S_final = S_final*scale_old + S_chunk*scale_new;
+            M_final = M_new;
+        }
+
+        if (sinks) {
+            const float s = ((const float *) sinks->data)[iq2];
+
+            float ms = 1.0f;
+            float vs = 1.0f;
+
+            if (s > M_final) {
+                ms = expf(M_final - s);
+                ggml_vec_scale_f32(DV, VKQ_final, ms);
+            } else {
+                vs = expf(s - M_final);
+            }
+
+            S_final = S_final*ms + vs;
+        }
+
+        // V /= S
+        const float S_inv = S_final == 0.0f ? 0.0f : 1.0f/S_final;
+        ggml_vec_scale_f32(DV, VKQ_final, S_inv);
+
+        // permute(0, 2, 1, 3)
+        memcpy((char *) dst->data + (iq2 + iq1*ne1)*nb1, VKQ_final, nb1);
+    }
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -8674,6 +9007,11 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     // When use_ref is set, force the vec-only reference implementation (no tiling, no KV-chunking)
     const bool use_ref = params->use_ref;
 
+    if (!use_ref && ggml_flash_attn_ext_quant_decode_supported(dst)) {
+        ggml_compute_forward_flash_attn_ext_quant_decode(params, dst);
+        return;
+    }
+
     const bool kv_is_f32_or_f16 = (k->type == GGML_TYPE_F32 || k->type == GGML_TYPE_F16);
     const bool use_split_kv_path = !use_ref && (neq1 == 1 && neq3 == 1) && kv_is_f32_or_f16 && (k->type == v->type) && q->type == GGML_TYPE_F32 && nek1 >= 512;
 
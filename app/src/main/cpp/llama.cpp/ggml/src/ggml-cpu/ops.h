@@ -86,6 +86,8 @@ void ggml_compute_forward_leaky_relu(const struct ggml_compute_params * params,
 void ggml_compute_forward_tri(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_fill(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_flash_attn_ext(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+bool ggml_flash_attn_ext_quant_decode_supported(const struct ggml_tensor * dst);
+size_t ggml_flash_attn_ext_quant_decode_wsize(const struct ggml_tensor * dst, int n_tasks);
 void ggml_compute_forward_flash_attn_back(
         const struct ggml_compute_params * params,
         const bool masked,
@@ -376,6 +376,11 @@ extern "C" {
         // note: the samplers must be sampler chains (i.e. use llama_sampler_chain_init)
         struct llama_sampler_seq_config * samplers;
         size_t                            n_samplers;
+
+        // run only the first n_layer_exit layers, then the output norm and head
+        // (early-exit self-speculative drafting), 0 = all layers; LFM2 only.
+        // Raised to include the first attention layer of a hybrid model
+        uint32_t n_layer_exit;
     };
 
     // model quantization parameters
@@ -519,6 +524,7 @@ extern "C" {
     LLAMA_API uint32_t llama_n_batch    (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
+    LLAMA_API uint32_t llama_n_layer_exit(const struct llama_context * ctx); // 0 = all layers
 
     DEPRECATED(LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model), "use llama_model_n_ctx_train instead");
     DEPRECATED(LLAMA_API int32_t llama_n_embd     (const struct llama_model * model), "use llama_model_n_embd instead");
@@ -1117,6 +1123,19 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize(), but for texts of several kilobytes the words of a BPE vocab are merged on
+    /// up to n_threads threads started for the call. The tokens are identical to llama_tokenize(); other vocab types
+    /// and short texts are tokenized on the calling thread.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1145,6 +1164,36 @@ extern "C" {
                             bool   remove_special,
                             bool   unparse_special);
 
+    /// @details Incremental detokenizer for streaming generated text, one token at a time.
+    /// The pieces come from the vocab's token to piece cache and are joined as llama_detokenize()
+    /// joins them: the leading space of the first piece is stripped for vocabs that add a space
+    /// prefix, a leading BOS (and any EOS) is skipped with remove_special, and special tokens are
+    /// rendered only with unparse_special. clean_up_tokenization_spaces is not applied: for vocabs that set
+    /// it (WPM, and BPE pre-tokenizers such as llama3/lfm2 and gpt-2) llama_detokenize() differs in those spaces.
+    /// Only complete, valid UTF-8 code points are written: a byte-fallback token that ends inside
+    /// a multi-byte character is held until the tokens completing it arrive, and invalid bytes are
+    /// dropped. Nothing is allocated after llama_detokenizer_init().
+    struct llama_detokenizer;
+
+    LLAMA_API struct llama_detokenizer * llama_detokenizer_init(
+        const struct llama_vocab * vocab,
+                            bool   remove_special,
+                            bool   unparse_special);
+
+    LLAMA_API void llama_detokenizer_free(struct llama_detokenizer * detok);
+
+    /// @details Start a new text: the next token is the first one again, held bytes are dropped.
+    LLAMA_API void llama_detokenizer_reset(struct llama_detokenizer * detok);
+
+    /// @details Consume one token and write the text it completes to buf.
+    /// @return Returns the number of chars/bytes written, no more than length (0 while a character is incomplete).
+    /// @return Returns a negative number on failure - the number of chars/bytes buf must hold. The token is not consumed.
+    LLAMA_API int32_t llama_detokenizer_push(
+        struct llama_detokenizer * detok,
+                     llama_token   token,
+                            char * buf,
+                         int32_t   length);
+
     //
     // Chat templates
     //
@@ -2660,3 +2660,13 @@ bool llm_arch_is_diffusion(const llm_arch & arch) {
             return false;
     }
 }
+
+bool llm_arch_skips_head_when_pooled(const llm_arch & arch) {
+    switch (arch) {
+        case LLM_ARCH_LFM2:
+        case LLM_ARCH_LFM2MOE:
+            return true;
+        default:
+            return false;
+    }
+}
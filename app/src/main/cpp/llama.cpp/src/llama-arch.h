@@ -597,3 +597,5 @@ const llm_tensor_info & llm_tensor_info_for(llm_tensor tensor);
 bool llm_arch_is_recurrent(const llm_arch & arch);
 bool llm_arch_is_hybrid   (const llm_arch & arch);
 bool llm_arch_is_diffusion(const llm_arch & arch);
+// the graph has no vocabulary head (no logits) when it computes pooled embeddings
+bool llm_arch_skips_head_when_pooled(const llm_arch & arch);
@@ -156,6 +156,22 @@ llama_context::llama_context(
     cparams.op_offload = params.op_offload;
     cparams.kv_unified = params.kv_unified;
 
+    cparams.n_layer_exit = params.n_layer_exit < hparams.n_layer ? params.n_layer_exit : 0;
+    if (cparams.n_layer_exit > 0 && model.arch != LLM_ARCH_LFM2 && model.arch != LLM_ARCH_LFM2MOE) {
+        LLAMA_LOG_WARN("%s: n_layer_exit is not supported for this architecture - running all layers\n", __func__);
+        cparams.n_layer_exit = 0;
+    }
+    // the graph always has the attention inputs, so run at least to the first attention layer
+    if (cparams.n_layer_exit > 0) {
+        uint32_t il_attn = 0;
+        while (il_attn < hparams.n_layer && hparams.is_recurrent(il_attn)) {
+            il_attn++;
+        }
+        if (cparams.n_layer_exit <= il_attn) {
+            cparams.n_layer_exit = il_attn + 1 < hparams.n_layer ? il_attn + 1 : 0;
+        }
+    }
+
     // intialized later
     cparams.pipeline_parallel = false;
 
@@ -195,6 +211,9 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: causal_attn   = %d\n",   __func__, cparams.causal_attn);
     LLAMA_LOG_INFO("%s: flash_attn    = %s\n",   __func__, llama_flash_attn_type_name(params.flash_attn_type));
     LLAMA_LOG_INFO("%s: kv_unified    = %s\n",   __func__, cparams.kv_unified ? "true" : "false");
+    if (cparams.n_layer_exit > 0) {
+        LLAMA_LOG_INFO("%s: n_layer_exit  = %u\n",   __func__, cparams.n_layer_exit);
+    }
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale    = %g\n",   __func__, cparams.rope_freq_scale);
 
@@ -604,6 +623,10 @@ uint32_t llama_context::n_seq_max() const {
     return cparams.n_seq_max;
 }
 
+uint32_t llama_context::n_layer_exit() const {
+    return cparams.n_layer_exit;
+}
+
 uint32_t llama_context::n_threads() const {
     return cparams.n_threads;
 }
@@ -1828,7 +1851,9 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     const auto n_vocab    = vocab.n_tokens();
     const auto n_embd_out = hparams.n_embd_out();
 
-    bool has_logits = true;
+    // pooled embedding graphs without a vocabulary head have no logits to return
+    bool has_logits = !(cparams.embeddings && cparams.pooling_type != LLAMA_POOLING_TYPE_NONE &&
+                        llm_arch_skips_head_when_pooled(model.arch));
     bool has_embd   = cparams.embeddings;
 
     // TODO: hacky enc-dec support
@@ -2982,6 +3007,7 @@ llama_context_params llama_context_default_params() {
         /*.kv_unified                  =*/ false,
         /*.sampler                     =*/ nullptr,
         /*.n_sampler                   =*/ 0,
+        /*.n_layer_exit                =*/ 0,
     };
 
     return result;
@@ -3081,6 +3107,10 @@ uint32_t llama_n_seq_max(const llama_context * ctx) {
     return ctx->n_seq_max();
 }
 
+uint32_t llama_n_layer_exit(const llama_context * ctx) {
+    return ctx->n_layer_exit();
+}
+
 const llama_model * llama_get_model(const llama_context * ctx) {
     return &ctx->get_model();
 }
@@ -60,6 +60,7 @@ struct llama_context {
     uint32_t n_batch()   const;
     uint32_t n_ubatch()  const;
     uint32_t n_seq_max() const;
+    uint32_t n_layer_exit() const;
 
     uint32_t n_threads()       const;
     uint32_t n_threads_batch() const;
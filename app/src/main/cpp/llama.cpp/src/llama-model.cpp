@@ -7695,6 +7695,17 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         };
                     }
 
+                    // early exit: no cache for the layers that never run
+                    if (cparams.n_layer_exit > 0) {
+                        const int32_t n_layer_exit = cparams.n_layer_exit;
+                        filter_attn = [&, n_layer_exit](int32_t il) {
+                            return il < n_layer_exit && !hparams.is_recurrent(il);
+                        };
+                        filter_recr = [&, n_layer_exit](int32_t il) {
+                            return il < n_layer_exit && hparams.is_recurrent(il);
+                        };
+                    }
+
                     if (hparams.swa_type != LLAMA_SWA_TYPE_NONE) {
                         // Use hybrid-iswa for hybrid models with SWA
                         res = new llama_memory_hybrid_iswa(
@@ -20,6 +20,12 @@
 #include <unordered_map>
 #include <stdexcept>
 
+#if defined(__ARM_NEON) && defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#include <arm_neon.h>
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 template<typename T>
 struct ring_buffer {
@@ -131,62 +137,144 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
-// writes result in res, does not mutate cur
-static void llama_token_data_array_partial_sort(const llama_token_data_array & cur, int npartial, std::vector<llama_token_data> & res) {
+// bucketed partial sort: 128 logit buckets over [-10, 10], the top buckets are
+// gathered and sorted. Bucket indices are computed 8 at a time (NEON, or AVX2
+// when the CPU has it) in both passes, so an element always lands in the same
+// bucket and nothing but the output is allocated.
+constexpr int   LLAMA_PSORT_NBUCKETS     = 128;
+constexpr float LLAMA_PSORT_BUCKET_LOW   = -10.0f;
+constexpr float LLAMA_PSORT_BUCKET_HIGH  =  10.0f;
+constexpr float LLAMA_PSORT_BUCKET_SCALE = LLAMA_PSORT_NBUCKETS/(LLAMA_PSORT_BUCKET_HIGH - LLAMA_PSORT_BUCKET_LOW);
+constexpr float LLAMA_PSORT_BUCKET_INTER = -LLAMA_PSORT_BUCKET_LOW * LLAMA_PSORT_BUCKET_SCALE;
+
+// buckets of data[0..n) (n <= 8) into ib[]; returns the mask of those >= ib_min
+static uint32_t llama_psort_buckets_scalar(const llama_token_data * data, int n, int ib_min, int32_t * ib) {
+    uint32_t mask = 0;
+    for (int i = 0; i < n; ++i) {
+        const float val = data[i].logit;
+        ib[i] = std::max(0, std::min(LLAMA_PSORT_NBUCKETS - 1, int(val * LLAMA_PSORT_BUCKET_SCALE + LLAMA_PSORT_BUCKET_INTER)));
+        mask |= uint32_t(ib[i] >= ib_min) << i;
+    }
+    return mask;
+}
+
+#if defined(__ARM_NEON) && defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+static uint32_t llama_psort_buckets_neon(const llama_token_data * data, int n, int ib_min, int32_t * ib) {
+    llama_token_data pad[8];
+    if (n < 8) {
+        std::copy(data, data + n, pad);
+        data = pad;
+    }
+    static_assert(sizeof(llama_token_data) == 3*sizeof(float), "llama_token_data layout");
+    const float * src = (const float *) data;
+    const float32x4_t scale = vdupq_n_f32(LLAMA_PSORT_BUCKET_SCALE);
+    const float32x4_t inter = vdupq_n_f32(LLAMA_PSORT_BUCKET_INTER);
+    const int32x4_t   lo    = vdupq_n_s32(0);
+    const int32x4_t   hi    = vdupq_n_s32(LLAMA_PSORT_NBUCKETS - 1);
+    const int32x4_t   thr   = vdupq_n_s32(ib_min);
+    const uint32x4_t  bits  = {1, 2, 4, 8};
+    uint32_t mask = 0;
+    for (int h = 0; h < 2; ++h) {
+        const float32x4x3_t v = vld3q_f32(src + 12*h);  // val[1] = logits
+        int32x4_t b = vcvtq_s32_f32(vaddq_f32(vmulq_f32(v.val[1], scale), inter));
+        b = vminq_s32(vmaxq_s32(b, lo), hi);
+        vst1q_s32(ib + 4*h, b);
+        mask |= vaddvq_u32(vandq_u32(vcgeq_s32(b, thr), bits)) << (4*h);
+    }
+    return mask & ((1u << n) - 1);
+}
+#define llama_psort_buckets llama_psort_buckets_neon
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("avx2")))
+static uint32_t llama_psort_buckets_avx2(const llama_token_data * data, int n, int ib_min, int32_t * ib) {
+    llama_token_data pad[8];
+    if (n < 8) {
+        std::copy(data, data + n, pad);
+        data = pad;
+    }
+    static_assert(sizeof(llama_token_data) == 3*sizeof(float), "llama_token_data layout");
+    const __m256i offs = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256  v    = _mm256_i32gather_ps(&data[0].logit, offs, 4);
+    __m256i b = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(LLAMA_PSORT_BUCKET_SCALE)),
+                                                  _mm256_set1_ps(LLAMA_PSORT_BUCKET_INTER)));
+    b = _mm256_min_epi32(_mm256_max_epi32(b, _mm256_setzero_si256()), _mm256_set1_epi32(LLAMA_PSORT_NBUCKETS - 1));
+    _mm256_storeu_si256((__m256i *) ib, b);
+    const __m256i ge = _mm256_cmpgt_epi32(b, _mm256_set1_epi32(ib_min - 1));
+    return uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(ge))) & ((1u << n) - 1);
+}
+
+static uint32_t llama_psort_buckets(const llama_token_data * data, int n, int ib_min, int32_t * ib) {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2 ? llama_psort_buckets_avx2(data, n, ib_min, ib) : llama_psort_buckets_scalar(data, n, ib_min, ib);
+}
+#else
+#define llama_psort_buckets llama_psort_buckets_scalar
+#endif
+
+// lowest bucket needed for the npartial highest logits; nhave counts the elements in it and above
+static int llama_psort_top_bucket(const int * histo, int npartial, int & nhave) {
+    nhave = 0;
+    int ib = LLAMA_PSORT_NBUCKETS - 1;
+    for ( ; ib >= 0; --ib) {
+        nhave += histo[ib];
+        if (nhave >= npartial) {
+            break;
+        }
+    }
+    return std::max(ib, 0);
+}
+
+// sorts the scattered buckets: every bucket above ib fully, bucket ib as far as npartial needs
+static void llama_psort_sort_buckets(llama_token_data * ptr, const int * histo, int ib, int npartial) {
     static const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
         return a.logit > b.logit;
     };
 
-    constexpr int   nbuckets     = 128;
-    constexpr float bucket_low   = -10.0f;
-    constexpr float bucket_high  =  10.0f;
-    constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
-    constexpr float bucket_inter = -bucket_low * bucket_scale;
-
-    std::vector<int> bucket_idx;
-    std::vector<int> histo(nbuckets, 0);
+    int ndone = 0;
+    for (int j = LLAMA_PSORT_NBUCKETS - 1; j > ib; --j) {
+        std::sort(ptr, ptr + histo[j], comp);
+        ptr += histo[j];
+        ndone += histo[j];
+    }
+    std::partial_sort(ptr, ptr + std::min(npartial - ndone, histo[ib]), ptr + histo[ib], comp);
+}
 
-    std::vector<llama_token_data*> bucket_ptrs;
+// writes result in res, does not mutate cur
+static void llama_token_data_array_partial_sort(const llama_token_data_array & cur, int npartial, std::vector<llama_token_data> & res) {
+    constexpr int nbuckets = LLAMA_PSORT_NBUCKETS;
 
-    bucket_idx.reserve(cur.size);
+    int histo[nbuckets] = {};
+    int32_t ibs[8];
 
-    for (int i = 0; i < (int)cur.size; ++i) {
-        const float val = cur.data[i].logit;
-        int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
-        ib = std::max(0, std::min(nbuckets - 1, ib));
-        bucket_idx.push_back(ib);
-        ++histo[ib];
-    }
-    int nhave = 0;
-    int ib = nbuckets - 1;
-    for ( ; ib >= 0; --ib) {
-        nhave += histo[ib];
-        if (nhave >= npartial) {
-            break;
+    const int n = (int) cur.size;
+    for (int i = 0; i < n; i += 8) {
+        const int m = std::min(8, n - i);
+        llama_psort_buckets(cur.data + i, m, 0, ibs);
+        for (int j = 0; j < m; ++j) {
+            ++histo[ibs[j]];
         }
     }
+    int nhave = 0;
+    const int ib = llama_psort_top_bucket(histo, npartial, nhave);
     res.resize(nhave);
+    llama_token_data * bucket_ptrs[nbuckets];
     auto * ptr = res.data();
-    bucket_ptrs.reserve(nbuckets - ib);
     for (int j = nbuckets - 1; j >= ib; --j) {
-        bucket_ptrs.push_back(ptr);
+        bucket_ptrs[j] = ptr;
         ptr += histo[j];
     }
-    for (int i = 0; i < (int)cur.size; ++i) {
-        int j = bucket_idx[i];
-        if (j >= ib) {
-            *bucket_ptrs[nbuckets - 1 - j]++ = cur.data[i];
+    // only the few elements in the top buckets are touched again
+    for (int i = 0; i < n; i += 8) {
+        const int m = std::min(8, n - i);
+        const uint32_t mask = llama_psort_buckets(cur.data + i, m, ib, ibs);
+        for (int j = 0; mask != 0 && j < m; ++j) {
+            if (mask & (1u << j)) {
+                *bucket_ptrs[ibs[j]]++ = cur.data[i + j];
+            }
         }
     }
 
-    ptr = res.data();
-    int ndone = 0;
-    for (int j = nbuckets - 1; j > ib; --j) {
-        std::sort(ptr, ptr + histo[j], comp);
-        ptr += histo[j];
-        ndone += histo[j];
-    }
-    std::partial_sort(ptr, ptr + npartial - ndone, ptr + histo[ib], comp);
+    llama_psort_sort_buckets(res.data(), histo, ib, npartial);
 }
 
 // reduces the size of cur_p to npartial, keeping only the top npartial elements
@@ -204,7 +292,8 @@ static void llama_token_data_array_partial_sort_inplace(llama_token_data_array *
         return;
     }
 
-    std::vector<llama_token_data> tmp;
+    // kept per thread, so sampling a token does not allocate
+    thread_local std::vector<llama_token_data> tmp;
 
     llama_token_data_array_partial_sort(*cur_p, npartial, tmp);
 
@@ -623,6 +712,10 @@ static bool llama_sampler_backend_support(
 
 // sampler chain
 
+// see "fused sampler chain" below
+static void llama_sampler_chain_fuse(llama_sampler_chain * chain);
+static bool llama_sampler_chain_fused_apply(llama_sampler_chain * chain, llama_token_data_array * cur_p);
+
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
     return "chain";
 }
@@ -644,6 +737,10 @@ static void llama_sampler_chain_apply(struct llama_sampler * smpl, llama_token_d
 
     time_meas tm(chain->t_sample_us, chain->params.no_perf);
 
+    if (llama_sampler_chain_fused_apply(chain, cur_p)) {
+        return;
+    }
+
     bool is_backend = chain->is_init;
 
     for (auto & smpl : chain->samplers) {
@@ -799,6 +896,7 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
             /* .cur         = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
+            /* .fused       = */ {},
         }
     );
 }
@@ -879,6 +977,8 @@ void llama_sampler_chain_add(struct llama_sampler * chain, struct llama_sampler
         /* .is_backend = */ false,
         /* .ptr        = */ smpl,
     });
+
+    llama_sampler_chain_fuse(p);
 }
 
 struct llama_sampler * llama_sampler_chain_get(struct llama_sampler * chain, int32_t i) {
@@ -913,6 +1013,8 @@ struct llama_sampler * llama_sampler_chain_remove(struct llama_sampler * chain,
     auto * result = p->samplers[i].ptr;
     p->samplers.erase(p->samplers.begin() + i);
 
+    llama_sampler_chain_fuse(p);
+
     return result;
 }
 
@@ -1387,8 +1489,9 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         }
 
         // we exceeded the current top-k heuristic -> increase k and continue
+        // (geometrically: a flat distribution rarely needs the whole vocab sorted)
         if (!cur_p->sorted && i == k - 1) {
-            k = cur_p->size;
+            k = std::min<size_t>(4*k, cur_p->size);
             llama_token_data_array_partial_sort(*cur_p, k, buf_sort);
             pdata = buf_sort.data();
         }
@@ -1540,9 +1643,7 @@ static const char * llama_sampler_min_p_name(const struct llama_sampler * smpl)
     return sctx->get_name();
 }
 
-static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
-    auto * ctx = (llama_sampler_min_p *) smpl->ctx;
-
+static void llama_sampler_min_p_impl(const llama_sampler_min_p * ctx, llama_token_data_array * cur_p, std::vector<llama_token_data> & filtered_tokens) {
     if (ctx->p <= 0.0f || !cur_p->size) {
         return;
     }
@@ -1551,7 +1652,7 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
 
     // if the cur_p aren't sorted, try the unsorted implementation first
     if (!cur_p->sorted) {
-        std::vector<llama_token_data> filtered_tokens;
+        filtered_tokens.clear();
 
         float max_logit = -FLT_MAX;
         for (size_t i = 0; i < cur_p->size; ++i) {
@@ -1594,6 +1695,13 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
     }
 }
 
+static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
+    const auto * ctx = (llama_sampler_min_p *) smpl->ctx;
+
+    std::vector<llama_token_data> filtered_tokens;
+    llama_sampler_min_p_impl(ctx, cur_p, filtered_tokens);
+}
+
 static struct llama_sampler * llama_sampler_min_p_clone(const struct llama_sampler * smpl) {
     const auto * ctx = (const llama_sampler_min_p *) smpl->ctx;
     return llama_sampler_init_min_p(ctx->p, ctx->min_keep);
@@ -2666,6 +2774,20 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
 #endif
 }
 
+static void llama_sampler_penalties_apply_one(const llama_sampler_penalties * ctx, llama_token_data & cur, int count) {
+    assert(count > 0 && count <= ctx->penalty_last_n);
+
+    // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
+    // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
+    if (cur.logit <= 0) {
+        cur.logit *= ctx->penalty_repeat;
+    } else {
+        cur.logit /= ctx->penalty_repeat;
+    }
+
+    cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+}
+
 static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
 
@@ -2681,19 +2803,7 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
             continue;
         }
 
-        const int count = token_iter->second;
-
-        assert(count > 0 && count <= ctx->penalty_last_n);
-
-        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
-        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
-        } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
-        }
-
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+        llama_sampler_penalties_apply_one(ctx, cur_p->data[i], token_iter->second);
     }
 
     cur_p->sorted = false;
@@ -2766,6 +2876,253 @@ struct llama_sampler * llama_sampler_init_penalties(
     );
 }
 
+// fused sampler chain
+//
+// A chain of the shape [penalties] -> [top-k] -> [top-p] -> [min-p] -> [temp] -> dist is run stage
+// by stage as below instead of sampler by sampler. Every logit and probability goes through the same
+// float operations in the same order as in the samplers themselves, so the candidates, the selected
+// token and the RNG state are bit-identical for a fixed seed. What goes away are passes over the
+// full vocab:
+//   - penalties look up the few penalized tokens instead of hashing every candidate
+//   - top-p finds the max logit together with the bucket histogram, then computes the softmax
+//     numerators while gathering the top buckets: 2 passes where softmax + partial sort took 5,
+//     and only the gathered candidates are normalized
+//   - min-p filters into a scratch buffer kept by the chain
+//   - temp is folded into the softmax of dist, over the surviving candidates only
+//
+// The softmax of top-p stays at temperature 1 (as the samplers define it), so the one over the
+// survivors in dist is a second, small one.
+
+static void llama_sampler_chain_fuse(llama_sampler_chain * chain) {
+    auto & plan = chain->fused;
+
+    plan.valid = false;
+    plan.penalties = plan.top_k = plan.top_p = plan.min_p = plan.temp = plan.dist = nullptr;
+
+    llama_sampler ** stages[] = {
+        &plan.penalties, &plan.top_k, &plan.top_p, &plan.min_p, &plan.temp, &plan.dist,
+    };
+    const llama_sampler_i * ifaces[] = {
+        &llama_sampler_penalties_i, &llama_sampler_top_k_i, &llama_sampler_top_p_i,
+        &llama_sampler_min_p_i,     &llama_sampler_temp_i,  &llama_sampler_dist_i,
+    };
+    constexpr int n_stages = sizeof(ifaces)/sizeof(ifaces[0]);
+
+    int next = 0;
+    for (const auto & info : chain->samplers) {
+        if (info.ptr->iface == &llama_sampler_empty_i) {
+            continue;
+        }
+
+        int stage = next;
+        while (stage < n_stages && ifaces[stage] != info.ptr->iface) {
+            ++stage;
+        }
+        if (stage == n_stages) {
+            return; // another sampler, a repeated one or one out of order
+        }
+
+        *stages[stage] = info.ptr;
+        next = stage + 1;
+    }
+
+    plan.valid = plan.dist != nullptr;
+}
+
+// llama_sampler_penalties_apply for candidates indexed by token id, as llama_sampler_sample builds them
+static void llama_sampler_penalties_apply_fused(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
+    const auto * ctx = (llama_sampler_penalties *) smpl->ctx;
+
+    if ((ctx->penalty_last_n == 0) ||
+        (ctx->penalty_repeat == 1.0f && ctx->penalty_freq == 0.0f && ctx->penalty_present == 0.0f)) {
+        return;
+    }
+
+    for (const auto & it : ctx->token_count) {
+        if (it.first < 0 || (size_t) it.first >= cur_p->size || cur_p->data[it.first].id != it.first) {
+            llama_sampler_penalties_apply(smpl, cur_p);
+            return;
+        }
+    }
+
+    for (const auto & it : ctx->token_count) {
+        llama_sampler_penalties_apply_one(ctx, cur_p->data[it.first], it.second);
+    }
+
+    cur_p->sorted = false;
+}
+
+// llama_sampler_top_p_apply for unsorted candidates above the in-place sort threshold
+static void llama_sampler_top_p_apply_fused(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
+    auto * ctx = (llama_sampler_top_p *) smpl->ctx;
+
+    constexpr int nbuckets = LLAMA_PSORT_NBUCKETS;
+
+    const int n = (int) cur_p->size;
+    const llama_token_data * data = cur_p->data;
+
+    // pass 1: max logit and bucket histogram
+    int histo[nbuckets] = {};
+    int32_t ibs[8];
+    float max_l = data[0].logit;
+    for (int i = 0; i < n; i += 8) {
+        const int m = std::min(8, n - i);
+        llama_psort_buckets(data + i, m, 0, ibs);
+        for (int j = 0; j < m; ++j) {
+            ++histo[ibs[j]];
+            max_l = std::max(max_l, data[i + j].logit);
+        }
+    }
+
+    size_t k = std::min<size_t>(256, cur_p->size);
+    int nhave = 0;
+    const int ib = llama_psort_top_bucket(histo, k, nhave);
+
+    auto & buf_sort = ctx->buf_sort;
+    buf_sort.resize(nhave);
+    llama_token_data * bucket_ptrs[nbuckets];
+    auto * ptr = buf_sort.data();
+    for (int j = nbuckets - 1; j >= ib; --j) {
+        bucket_ptrs[j] = ptr;
+        ptr += histo[j];
+    }
+
+    // pass 2: softmax numerators and their sum, gathering the top buckets on the way
+    float cum_sum = 0.0f;
+    for (int i = 0; i < n; i += 8) {
+        const int m = std::min(8, n - i);
+        const uint32_t mask = llama_psort_buckets(data + i, m, ib, ibs);
+        for (int j = 0; j < m; ++j) {
+            const float p = expf(data[i + j].logit - max_l);
+            cum_sum += p;
+            if (mask & (1u << j)) {
+                *bucket_ptrs[ibs[j]]++ = { data[i + j].id, data[i + j].logit, p };
+            }
+        }
+    }
+    llama_psort_sort_buckets(buf_sort.data(), histo, ib, k);
+
+    for (auto & cur : buf_sort) {
+        cur.p /= cum_sum;
+    }
+
+    // the cumulative cut of llama_sampler_top_p_apply
+    float cum_p = 0.0f;
+    size_t last_idx = cur_p->size;
+
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        cum_p += buf_sort[i].p;
+
+        if (cum_p >= ctx->p && i + 1 >= ctx->min_keep) {
+            last_idx = i + 1;
+            break;
+        }
+
+        if (i == k - 1 && k < cur_p->size) {
+            k = std::min<size_t>(4*k, cur_p->size);
+            llama_token_data_array_partial_sort(*cur_p, k, buf_sort);
+            for (auto & cur : buf_sort) {
+                cur.p = expf(cur.logit - max_l) / cum_sum;
+            }
+        }
+    }
+
+    std::copy(buf_sort.data(), buf_sort.data() + last_idx, cur_p->data);
+    cur_p->sorted = true;
+    cur_p->size = last_idx;
+}
+
+// llama_sampler_temp_apply followed by llama_sampler_dist_apply
+static void llama_sampler_temp_dist_apply_fused(struct llama_sampler * temp, struct llama_sampler * dist, llama_token_data_array * cur_p) {
+    const float t = temp ? ((llama_sampler_temp *) temp->ctx)->temp : 1.0f;
+
+    if (temp == nullptr || t <= 0.0f || cur_p->size <= 1) {
+        if (temp) {
+            llama_sampler_temp_impl(cur_p, t);
+        }
+        llama_sampler_dist_apply(dist, cur_p);
+        return;
+    }
+
+    auto * ctx = (llama_sampler_dist *) dist->ctx;
+
+    cur_p->selected = 0;
+
+    // dividing by a positive temperature keeps the order, so the max of the scaled logits is the scaled max
+    float max_l = cur_p->data[0].logit;
+    if (!cur_p->sorted) {
+        for (size_t i = 1; i < cur_p->size; ++i) {
+            max_l = std::max(max_l, cur_p->data[i].logit);
+        }
+    }
+    max_l /= t;
+
+    double sum_cum = 0.0f;
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        cur_p->data[i].logit /= t;
+        float p = expf(cur_p->data[i].logit - max_l);
+        cur_p->data[i].p = p;
+        sum_cum += p;
+    }
+
+    std::uniform_real_distribution<double> dist_u(0.0f, 1.0f);
+    const double rnd = dist_u(ctx->rng);
+
+          double sum_run = 0.0f;
+    const double sum_tgt = sum_cum*rnd;
+
+    bool found = false;
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        if (!found) {
+            sum_run += cur_p->data[i].p;
+            if (sum_run >= sum_tgt) {
+                cur_p->selected = i;
+                found = true;
+            }
+        }
+
+        cur_p->data[i].p /= sum_cum;
+    }
+
+    assert(found);
+    if (!found) {
+        cur_p->selected = cur_p->size - 1;
+    }
+}
+
+static bool llama_sampler_chain_fused_apply(llama_sampler_chain * chain, llama_token_data_array * cur_p) {
+    auto & plan = chain->fused;
+
+    // with backend sampling part of the chain has already run
+    if (!plan.valid || chain->is_init) {
+        return false;
+    }
+
+    if (plan.penalties) {
+        llama_sampler_penalties_apply_fused(plan.penalties, cur_p);
+    }
+
+    if (plan.top_k) {
+        llama_sampler_top_k_apply(plan.top_k, cur_p);
+    }
+
+    if (plan.top_p) {
+        if (!cur_p->sorted && cur_p->size > 1024) {
+            llama_sampler_top_p_apply_fused(plan.top_p, cur_p);
+        } else {
+            llama_sampler_top_p_apply(plan.top_p, cur_p);
+        }
+    }
+
+    if (plan.min_p) {
+        llama_sampler_min_p_impl((llama_sampler_min_p *) plan.min_p->ctx, cur_p, plan.buf);
+    }
+
+    llama_sampler_temp_dist_apply_fused(plan.temp, plan.dist, cur_p);
+
+    return true;
+}
+
 // top-n-sigma
 
 struct llama_sampler_top_n_sigma {
@@ -31,6 +31,26 @@ struct llama_sampler_chain {
     mutable int64_t t_sample_us;
 
     mutable int32_t n_sample;
+
+    // the chain compiled at llama_sampler_chain_add time when it has the common shape
+    //   [penalties] -> [top-k] -> [top-p] -> [min-p] -> [temp] -> dist
+    // (empty samplers ignored), run by llama_sampler_chain_fused_apply with fewer
+    // passes over the candidates and exactly the same result
+    struct fused_plan {
+        bool valid = false;
+
+        llama_sampler * penalties = nullptr;
+        llama_sampler * top_k     = nullptr;
+        llama_sampler * top_p     = nullptr;
+        llama_sampler * min_p     = nullptr;
+        llama_sampler * temp      = nullptr;
+        llama_sampler * dist      = nullptr;
+
+        // scratch for the min-p candidates
+        std::vector<llama_token_data> buf;
+    };
+
+    fused_plan fused;
 };
 
 struct llama_sampler * llama_sampler_init_dry_testing(
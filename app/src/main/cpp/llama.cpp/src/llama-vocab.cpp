@@ -8,6 +8,7 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -19,6 +20,8 @@
 #include <map>
 #include <queue>
 #include <set>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -277,9 +280,13 @@ struct llm_bigram_bpe {
 };
 
 struct llm_tokenizer_bpe : llm_tokenizer {
-    llm_tokenizer_bpe(const llama_vocab & vocab) {
+    llm_tokenizer_bpe(const llama_vocab & vocab) : regex_exprs(pre_regex_exprs(vocab.get_pre_type())) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
-        switch (vocab.get_pre_type()) {
+    }
+
+    static std::vector<std::string> pre_regex_exprs(llama_vocab_pre_type pre_type) {
+        std::vector<std::string> regex_exprs;
+        switch (pre_type) {
             case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
                 regex_exprs = {
                     // original regex from tokenizer.json
@@ -478,11 +485,16 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+        return regex_exprs;
     }
 
-    std::vector<std::string> regex_exprs;
+    const std::vector<std::string> regex_exprs;
 };
 
+std::vector<std::string> llama_vocab_pre_regex_exprs(llama_vocab_pre_type pre_type) {
+    return llm_tokenizer_bpe::pre_regex_exprs(pre_type);
+}
+
 struct llm_tokenizer_bpe_session {
     llm_tokenizer_bpe_session(const llama_vocab & vocab, const llm_tokenizer_bpe & tokenizer) : vocab(vocab), tokenizer(tokenizer) {}
 
@@ -524,12 +536,19 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
+        tokenize_words(word_collection.data(), word_collection.size(), output);
+    }
+
+    // merges every word on its own, so consecutive ranges of a split can be
+    // tokenized by separate sessions and their outputs concatenated
+    void tokenize_words(const std::string * words, size_t n_words, std::vector<llama_token> & output) {
+        int final_prev_index = -1;
 
         symbols_final.clear();
 
-        for (const auto & word : word_collection) {
+        for (size_t w = 0; w < n_words; ++w) {
+            const std::string & word = words[w];
             work_queue = llm_bigram_bpe::queue();
             symbols.clear();
 
@@ -1556,6 +1575,103 @@ struct fragment_buffer_variant {
     const uint64_t length;
 };
 
+//
+// parallel BPE tokenization
+//
+
+// raw text below this is tokenized on the calling thread
+static const size_t LLAMA_TOKENIZE_PARALLEL_MIN_BYTES = 8 * 1024;
+// words are grouped into chunks of at least this many bytes
+static const size_t LLAMA_TOKENIZE_CHUNK_MIN_BYTES    = 1024;
+
+// a special token, or a run of words of one raw fragment
+struct llm_tokenizer_bpe_chunk {
+    size_t      word_begin;
+    size_t      word_end;
+    llama_token token;
+};
+
+// Tokenizes the fragments like llm_tokenizer_bpe_session::tokenize does one by one. The raw
+// fragments are split into words on the calling thread; the words are then cut into chunks
+// merged by up to n_threads sessions, and the chunk outputs are appended in order. BPE merges
+// never cross a word boundary, so the result is the same as the serial one.
+static void llm_tokenize_bpe_parallel(
+        const llama_vocab & vocab,
+        const llm_tokenizer_bpe & tokenizer,
+        const std::forward_list<fragment_buffer_variant> & fragment_buffer,
+        int32_t n_threads,
+        std::vector<llama_token> & output) {
+    std::vector<std::string> words;
+    std::vector<llm_tokenizer_bpe_chunk> chunks;
+    size_t n_bytes = 0;
+    for (const auto & fragment : fragment_buffer) {
+        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            n_bytes += fragment.length;
+        }
+    }
+    const size_t chunk_bytes = std::max(LLAMA_TOKENIZE_CHUNK_MIN_BYTES, n_bytes / (4 * (size_t) n_threads));
+
+    for (const auto & fragment : fragment_buffer) {
+        if (fragment.type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            chunks.push_back({words.size(), words.size(), fragment.token});
+            continue;
+        }
+        auto fragment_words = unicode_regex_split(fragment.raw_text.substr(fragment.offset, fragment.length), tokenizer.regex_exprs);
+        size_t begin = words.size();
+        size_t bytes = 0;
+        for (auto & word : fragment_words) {
+            bytes += word.size();
+            words.push_back(std::move(word));
+            if (bytes >= chunk_bytes) {
+                chunks.push_back({begin, words.size(), LLAMA_TOKEN_NULL});
+                begin = words.size();
+                bytes = 0;
+            }
+        }
+        if (begin < words.size()) {
+            chunks.push_back({begin, words.size(), LLAMA_TOKEN_NULL});
+        }
+    }
+
+    std::vector<std::vector<llama_token>> outputs(chunks.size());
+    std::atomic<size_t> next_chunk{0};
+    auto worker = [&]() {
+        llm_tokenizer_bpe_session session(vocab, tokenizer);
+        for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+            const auto & chunk = chunks[i];
+            if (chunk.token != LLAMA_TOKEN_NULL) {
+                outputs[i].push_back(chunk.token);
+            } else {
+                session.tokenize_words(words.data() + chunk.word_begin, chunk.word_end - chunk.word_begin, outputs[i]);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    const size_t n_workers = std::min((size_t) n_threads, chunks.size());
+    try {
+        for (size_t i = 1; i < n_workers; i++) {
+            threads.emplace_back(worker);
+        }
+    } catch (const std::system_error & err) {
+        // the threads that did start and the calling thread take the remaining chunks
+        LLAMA_LOG_WARN("%s: failed to start a tokenizer thread: %s\n", __func__, err.what());
+    }
+    worker();
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    size_t n_tokens = output.size();
+    for (const auto & chunk_output : outputs) {
+        n_tokens += chunk_output.size();
+    }
+    output.reserve(n_tokens);
+    for (const auto & chunk_output : outputs) {
+        output.insert(output.end(), chunk_output.begin(), chunk_output.end());
+    }
+}
+
 struct llama_vocab::impl {
     uint32_t n_token_types = 0; // for BERT-style token types
 
@@ -1654,7 +1770,8 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
 
     int32_t tokenize(
                    const char * text,
@@ -2903,7 +3020,8 @@ static std::string llama_decode_text(const std::string & text) {
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads) const {
     GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
@@ -2974,16 +3092,21 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
                 if (add_special) {
                     session.append_bos(output);
                 }
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
+                if (n_threads > 1 && raw_text.size() >= LLAMA_TOKENIZE_PARALLEL_MIN_BYTES) {
+                    llm_tokenize_bpe_parallel(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()),
+                                              fragment_buffer, n_threads, output);
+                } else {
+                    for (const auto & fragment : fragment_buffer) {
+                        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+                            std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
+                            LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        session.append(fragment.token, output);
+                            session.tokenize(text, output);
+                        } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                            session.append(fragment.token, output);
+                        }
                     }
                 }
 
@@ -3619,8 +3742,9 @@ int32_t llama_vocab::tokenize(
                  llama_token * tokens,
                      int32_t   n_tokens_max,
                         bool   add_special,
-                        bool   parse_special) const {
-    auto res = tokenize(std::string(text, text_len), add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    auto res = tokenize(std::string(text, text_len), add_special, parse_special, n_threads);
     if (res.size() >= static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
         LLAMA_LOG_ERROR("%s: tokenization result size %zu exceeds int32_t limit\n", __func__, res.size());
         return std::numeric_limits<int32_t>::min();
@@ -3641,8 +3765,9 @@ int32_t llama_vocab::tokenize(
 std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads);
 }
 
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
@@ -3905,6 +4030,18 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_parallel(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
@@ -3925,3 +4062,155 @@ int32_t llama_detokenize(
                         bool   unparse_special) {
     return vocab->detokenize(tokens, n_tokens, text, text_len_max, remove_special, unparse_special);
 }
+
+//
+// streaming detokenization
+//
+
+struct llama_detokenizer {
+    const llama_vocab * vocab;
+
+    const bool remove_special;
+    const bool unparse_special;
+
+    // no token consumed yet: a BOS may be skipped, the space prefix is stripped
+    bool first;
+
+    // leading bytes of a UTF-8 character the last tokens started but did not finish
+    uint8_t partial[4];
+    int32_t n_partial;
+};
+
+// length of the UTF-8 sequence a byte starts, 0 if it cannot start one
+static int32_t llama_utf8_seq_len(uint8_t c) {
+    if (c <= 0x7F)              return 1;
+    if (c >= 0xC2 && c <= 0xDF) return 2;
+    if (c >= 0xE0 && c <= 0xEF) return 3;
+    if (c >= 0xF0 && c <= 0xF4) return 4;
+    return 0;
+}
+
+// whether c may follow lead: a continuation byte, excluding overlong forms,
+// surrogates and code points above U+10FFFF
+static bool llama_utf8_seq_next(uint8_t lead, uint8_t c) {
+    switch (lead) {
+        case 0xE0: return c >= 0xA0 && c <= 0xBF;
+        case 0xED: return c >= 0x80 && c <= 0x9F;
+        case 0xF0: return c >= 0x90 && c <= 0xBF;
+        case 0xF4: return c >= 0x80 && c <= 0x8F;
+        default:   return (c & 0xC0) == 0x80;
+    }
+}
+
+struct llama_detokenizer * llama_detokenizer_init(
+    const struct llama_vocab * vocab,
+                        bool   remove_special,
+                        bool   unparse_special) {
+    return new llama_detokenizer {
+        /* .vocab           = */ vocab,
+        /* .remove_special  = */ remove_special,
+        /* .unparse_special = */ unparse_special,
+        /* .first           = */ true,
+        /* .partial         = */ {},
+        /* .n_partial       = */ 0,
+    };
+}
+
+void llama_detokenizer_free(struct llama_detokenizer * detok) {
+    delete detok;
+}
+
+void llama_detokenizer_reset(struct llama_detokenizer * detok) {
+    detok->first     = true;
+    detok->n_partial = 0;
+}
+
+int32_t llama_detokenizer_push(
+    struct llama_detokenizer * detok,
+                 llama_token   token,
+                        char * buf,
+                     int32_t   length) {
+    const llama_vocab & vocab = *detok->vocab;
+
+    if (vocab.get_type() == LLAMA_VOCAB_TYPE_NONE) {
+        return 0;
+    }
+
+    // the tokens llama_detokenize() drops with remove_special
+    if (detok->remove_special) {
+        if (detok->first && vocab.get_add_bos() && token == vocab.token_bos()) {
+            detok->first = false; // keeps the space prefix of the next piece
+            return 0;
+        }
+        if (vocab.get_add_eos() && token == vocab.token_eos()) {
+            return 0;
+        }
+    }
+
+    const bool first = detok->first;
+    detok->first = false;
+
+    static const int attr_special = LLAMA_TOKEN_ATTR_UNKNOWN | LLAMA_TOKEN_ATTR_CONTROL;
+    if (!detok->unparse_special && (vocab.token_get_attr(token) & attr_special)) {
+        return 0;
+    }
+
+    const std::string & piece = vocab.token_to_piece(token);
+    const uint8_t * text = (const uint8_t *) piece.data();
+    size_t          size = piece.size();
+
+    if (first && vocab.get_add_space_prefix() && size > 0 && text[0] == ' ') {
+        text++;
+        size--;
+    }
+
+    // assemble on a copy of the state, committed only if the output fits
+    uint8_t partial[4];
+    int32_t n_partial = detok->n_partial;
+    memcpy(partial, detok->partial, sizeof(partial));
+
+    int32_t n = 0;
+    auto emit = [&](const uint8_t * src, int32_t len) {
+        for (int32_t i = 0; i < len; ++i, ++n) {
+            if (n < length) {
+                buf[n] = (char) src[i];
+            }
+        }
+    };
+
+    for (size_t i = 0; i < size; ++i) {
+        const uint8_t c = text[i];
+
+        if (n_partial > 0) {
+            const bool next = n_partial == 1 ? llama_utf8_seq_next(partial[0], c) : (c & 0xC0) == 0x80;
+            if (next) {
+                partial[n_partial++] = c;
+                if (n_partial == llama_utf8_seq_len(partial[0])) {
+                    emit(partial, n_partial);
+                    n_partial = 0;
+                }
+                continue;
+            }
+            n_partial = 0; // truncated character, dropped
+        }
+
+        const int32_t len = llama_utf8_seq_len(c);
+        if (len == 1) {
+            emit(&c, 1);
+        } else if (len > 1) {
+            partial[n_partial++] = c;
+        }
+        // else: a stray continuation or invalid byte, dropped
+    }
+
+    if (n > length) {
+        // consume the token when called again
+        detok->first = first;
+        return -n;
+    }
+
+    memcpy(detok->partial, partial, sizeof(partial));
+    detok->n_partial = n_partial;
+
+    return n;
+}
@@ -59,6 +59,9 @@ enum llama_vocab_pre_type {
 struct LLM_KV;
 struct llama_model_loader;
 
+// pre-tokenizer regexes of a BPE vocab, applied in order by unicode_regex_split
+std::vector<std::string> llama_vocab_pre_regex_exprs(llama_vocab_pre_type pre_type);
+
 struct llama_vocab {
     struct token_data {
         std::string      text;
@@ -145,12 +148,15 @@ struct llama_vocab {
                   llama_token * tokens,
                       int32_t   n_tokens_max,
                          bool   add_special,
-                         bool   parse_special) const;
+                         bool   parse_special,
+                      int32_t   n_threads = 1) const;
 
+    // n_threads > 1 merges the words of long BPE texts on that many threads, with the same result
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
 
     // does not write null-terminator to buf
     int32_t token_to_piece(
@@ -15,7 +15,10 @@ llm_build_lfm2::llm_build_lfm2(const llama_model & model, const llm_graph_params
     auto *        inp_hybrid  = build_inp_mem_hybrid();
     ggml_tensor * inp_out_ids = build_inp_out_ids();
 
-    for (int il = 0; il < n_layer; ++il) {
+    // early exit: the output norm and head read an intermediate layer's state
+    const int n_layer_run = cparams.n_layer_exit > 0 ? (int) cparams.n_layer_exit : n_layer;
+
+    for (int il = 0; il < n_layer_run; ++il) {
         const bool is_moe_layer = il >= static_cast<int>(hparams.n_layer_dense_lead);
 
         auto * prev_cur = cur;
@@ -25,7 +28,7 @@ llm_build_lfm2::llm_build_lfm2(const llama_model & model, const llm_graph_params
         cur = hparams.is_recurrent(il) ? build_shortconv_block(cur, inp_hybrid->get_recr(), il) :
                                          build_attn_block(cur, inp_pos, inp_hybrid->get_attn(), il);
 
-        if (il == n_layer - 1 && inp_out_ids) {
+        if (il == n_layer_run - 1 && inp_out_ids) {
             cur      = ggml_get_rows(ctx0, cur, inp_out_ids);
             prev_cur = ggml_get_rows(ctx0, prev_cur, inp_out_ids);
         }
@@ -46,6 +49,13 @@ llm_build_lfm2::llm_build_lfm2(const llama_model & model, const llm_graph_params
     cb(cur, "result_norm", -1);
     res->t_embd = cur;
 
+    // pooled embeddings read only the hidden states: skip the vocabulary head
+    // (llm_arch_skips_head_when_pooled tells the context not to expect logits)
+    if (cparams.embeddings && cparams.pooling_type != LLAMA_POOLING_TYPE_NONE) {
+        ggml_build_forward_expand(gf, cur);
+        return;
+    }
+
     cur = build_lora_mm(model.output, cur);
     cb(cur, "result_output", -1);
 
@@ -7,18 +7,29 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#if defined(__ARM_NEON) && defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#include <arm_neon.h>
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
 size_t unicode_len_utf8(char src) {
     const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
     uint8_t highbits = static_cast<uint8_t>(src) >> 4;
@@ -801,6 +812,768 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string & text,
     return bpe_offsets;
 }
 
+static inline bool unicode_is_ascii16(const char * s) {
+#if defined(__ARM_NEON) && defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+    return vmaxvq_u8(vld1q_u8((const uint8_t *) s)) < 0x80;
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) s)) == 0;
+#else
+    uint64_t w[2];
+    memcpy(w, s, 16);
+    return ((w[0] | w[1]) & 0x8080808080808080ULL) == 0;
+#endif
+}
+
+//
+// compiled pre-tokenizer
+//
+// The std::regex fallback re-parses its pattern on every call and runs a generic backtracking
+// executor over the whole text. The pre-tokenizer patterns only use a small ECMAScript subset
+// (character classes, greedy quantifiers, groups, lookaheads and $), so they are compiled once
+// into class tables and matched here with std::regex semantics: leftmost match, alternatives in
+// order, greedy quantifiers that backtrack, and regex_iterator's handling of empty matches.
+// The input is the same collapsed text (or wide text) std::regex would get, so the splits are
+// identical. Patterns outside the subset are not compiled and keep using std::regex.
+//
+
+// a set of symbols: collapsed bytes or codepoints
+struct unicode_pretok_class {
+    uint64_t bits[4] = {};                              // symbols below 256
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;  // symbols from 256 on: sorted, disjoint, inclusive
+
+    // nibble tables for unicode_pretok_span: bit h of lut[h >> 3][l] is set if (h << 4 | l) is in the set
+    uint8_t lut[2][16] = {};
+
+    void add(uint32_t lo, uint32_t hi) {
+        for (uint32_t c = lo; c <= hi && c < 256; ++c) {
+            bits[c >> 6] |= uint64_t(1) << (c & 63);
+        }
+        if (hi >= 256) {
+            ranges.emplace_back(std::max<uint32_t>(lo, 256), hi);
+            normalize();
+        }
+    }
+
+    bool contains(uint32_t c) const {
+        if (c < 256) {
+            return (bits[c >> 6] >> (c & 63)) & 1;
+        }
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(c, UINT32_MAX));
+        return it != ranges.begin() && (it - 1)->second >= c;
+    }
+
+    void negate() {
+        for (auto & b : bits) {
+            b = ~b;
+        }
+        std::vector<std::pair<uint32_t, uint32_t>> inv;
+        uint32_t next = 256;
+        for (const auto & r : ranges) {
+            if (r.first > next) {
+                inv.emplace_back(next, r.first - 1);
+            }
+            next = r.second == UINT32_MAX ? UINT32_MAX : r.second + 1;
+        }
+        if (ranges.empty() || ranges.back().second != UINT32_MAX) {
+            inv.emplace_back(next, UINT32_MAX);
+        }
+        ranges = std::move(inv);
+    }
+
+    void merge(const unicode_pretok_class & other) {
+        for (int i = 0; i < 4; ++i) {
+            bits[i] |= other.bits[i];
+        }
+        ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+        normalize();
+    }
+
+    void intersect(const unicode_pretok_class & other) {
+        unicode_pretok_class b = other;
+        negate();
+        b.negate();
+        merge(b);
+        negate();
+    }
+
+    void normalize() {
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<std::pair<uint32_t, uint32_t>> res;
+        for (const auto & r : ranges) {
+            if (!res.empty() && (res.back().second == UINT32_MAX || r.first <= res.back().second + 1)) {
+                res.back().second = std::max(res.back().second, r.second);
+            } else {
+                res.push_back(r);
+            }
+        }
+        ranges = std::move(res);
+    }
+
+    void build_lut() {
+        for (uint32_t c = 0; c < 256; ++c) {
+            if (contains(c)) {
+                lut[c >> 7][c & 15] |= 1 << ((c >> 4) & 7);
+            }
+        }
+    }
+};
+
+struct unicode_pretok_node;
+using unicode_pretok_seq = std::vector<unicode_pretok_node>;
+
+struct unicode_pretok_node {
+    enum type_t { CLASS, GROUP, LOOKAHEAD, END } type = CLASS;
+
+    uint32_t min = 1;
+    uint32_t max = 1;                         // UINT32_MAX: unbounded
+    bool     negated = false;                 // LOOKAHEAD: (?!...)
+    unicode_pretok_class cls;                 // CLASS
+    std::vector<unicode_pretok_seq> alts;     // GROUP, LOOKAHEAD
+};
+
+struct unicode_pretok_program {
+    std::vector<unicode_pretok_seq> alts;
+
+    // an alternative that cannot match empty can only start on a symbol of its first set
+    std::vector<unicode_pretok_class> alt_first;
+    std::vector<bool>                 alt_nullable;
+    unicode_pretok_class first;
+    bool nullable = false;
+};
+
+// recursive descent over the ECMAScript subset used by the pre-tokenizers; any other syntax fails
+struct unicode_pretok_parser {
+    const std::vector<uint32_t> & re;
+    size_t i = 0;
+
+    bool more() const { return i < re.size(); }
+
+    // \d \D \s \S as classes; false for other escapes
+    static bool escape_class(uint32_t c, unicode_pretok_class & cls) {
+        unicode_pretok_class esc;
+        switch (c) {
+            case 'd': case 'D':
+                esc.add('0', '9');
+                break;
+            case 's': case 'S':
+                esc.add('\t', '\r');
+                esc.add(' ', ' ');
+                break;
+            default:
+                return false;
+        }
+        if (c == 'D' || c == 'S') {
+            esc.negate();
+        }
+        cls.merge(esc);
+        return true;
+    }
+
+    // a single character escape; false for class escapes, backreferences and unsupported escapes
+    static bool escape_char(uint32_t c, uint32_t & out) {
+        switch (c) {
+            case 'r': out = '\r'; return true;
+            case 'n': out = '\n'; return true;
+            case 't': out = '\t'; return true;
+            case 'f': out = '\f'; return true;
+            case 'v': out = '\v'; return true;
+        }
+        if (c < 128 && (isalnum((int) c) || c == '_')) {
+            return false;
+        }
+        out = c;
+        return true;
+    }
+
+    bool parse_class(unicode_pretok_class & cls) {
+        bool negate = false;
+        if (more() && re[i] == '^') {
+            negate = true;
+            ++i;
+        }
+        if (more() && re[i] == ']') {
+            return false; // empty class
+        }
+        while (more() && re[i] != ']') {
+            uint32_t lo = re[i++];
+            if (lo == '\\') {
+                if (!more()) {
+                    return false;
+                }
+                const uint32_t c = re[i++];
+                if (escape_class(c, cls)) {
+                    continue;
+                }
+                if (c == 'b' || !escape_char(c, lo)) {
+                    return false;
+                }
+            } else if (lo == '[') {
+                return false; // [: :] and friends
+            }
+            uint32_t hi = lo;
+            if (i + 1 < re.size() && re[i] == '-' && re[i + 1] != ']') {
+                i++;
+                hi = re[i++];
+                if (hi == '\\') {
+                    if (!more()) {
+                        return false;
+                    }
+                    const uint32_t c = re[i++];
+                    if (c == 'b' || !escape_char(c, hi)) {
+                        return false;
+                    }
+                } else if (hi == '[') {
+                    return false;
+                }
+                if (hi < lo) {
+                    return false;
+                }
+            }
+            cls.add(lo, hi);
+        }
+        if (!more()) {
+            return false;
+        }
+        ++i; // ]
+        if (negate) {
+            cls.negate();
+        }
+        return true;
+    }
+
+    bool parse_number(uint32_t & n) {
+        if (!more() || re[i] < '0' || re[i] > '9') {
+            return false;
+        }
+        n = 0;
+        while (more() && re[i] >= '0' && re[i] <= '9') {
+            n = n*10 + (re[i++] - '0');
+            if (n > 100000) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_quantifier(unicode_pretok_node & node) {
+        if (!more()) {
+            return true;
+        }
+        uint32_t min = 1;
+        uint32_t max = 1;
+        switch (re[i]) {
+            case '*': min = 0; max = UINT32_MAX; ++i; break;
+            case '+': min = 1; max = UINT32_MAX; ++i; break;
+            case '?': min = 0; max = 1;          ++i; break;
+            case '{': {
+                ++i;
+                if (!parse_number(min)) {
+                    return false;
+                }
+                max = min;
+                if (more() && re[i] == ',') {
+                    ++i;
+                    max = UINT32_MAX;
+                    if (more() && re[i] != '}' && (!parse_number(max) || max < min)) {
+                        return false;
+                    }
+                }
+                if (!more() || re[i] != '}') {
+                    return false;
+                }
+                ++i;
+            } break;
+            default:
+                return true;
+        }
+        if (more() && re[i] == '?') {
+            return false; // lazy
+        }
+        if (node.type == unicode_pretok_node::LOOKAHEAD || node.type == unicode_pretok_node::END) {
+            return false;
+        }
+        node.min = min;
+        node.max = max;
+        return true;
+    }
+
+    bool parse_atom(unicode_pretok_node & node) {
+        const uint32_t c = re[i++];
+        switch (c) {
+            case '(': {
+                node.type = unicode_pretok_node::GROUP;
+                if (more() && re[i] == '?') {
+                    if (i + 1 >= re.size()) {
+                        return false;
+                    }
+                    switch (re[i + 1]) {
+                        case ':': break;
+                        case '=': node.type = unicode_pretok_node::LOOKAHEAD; break;
+                        case '!': node.type = unicode_pretok_node::LOOKAHEAD; node.negated = true; break;
+                        default:  return false; // (?i: and friends
+                    }
+                    i += 2;
+                }
+                // capturing groups are matched as non-capturing ones: the split only needs match bounds
+                if (!parse_alts(node.alts) || !more() || re[i] != ')') {
+                    return false;
+                }
+                ++i;
+                if (node.type == unicode_pretok_node::GROUP) {
+                    // a group of single characters is a class: ((?=[\p{L}])([^a-z]))*
+                    unicode_pretok_class cls;
+                    if (single_class(node.alts, cls)) {
+                        node.type = unicode_pretok_node::CLASS;
+                        node.cls  = std::move(cls);
+                        node.alts.clear();
+                    }
+                }
+            } break;
+            case '[':
+                if (!parse_class(node.cls)) {
+                    return false;
+                }
+                break;
+            case '\\': {
+                if (!more()) {
+                    return false;
+                }
+                const uint32_t e = re[i++];
+                if (!escape_class(e, node.cls)) {
+                    uint32_t lit;
+                    if (!escape_char(e, lit)) {
+                        return false;
+                    }
+                    node.cls.add(lit, lit);
+                }
+            } break;
+            case '$':
+                node.type = unicode_pretok_node::END;
+                break;
+            case '^': case '.': case '*': case '+': case '?': case ')': case '|':
+                return false;
+            default:
+                node.cls.add(c, c);
+                break;
+        }
+        return parse_quantifier(node);
+    }
+
+    bool parse_seq(unicode_pretok_seq & seq) {
+        while (more() && re[i] != '|' && re[i] != ')') {
+            unicode_pretok_node node;
+            if (!parse_atom(node)) {
+                return false;
+            }
+            seq.push_back(std::move(node));
+        }
+        return true;
+    }
+
+    bool parse_alts(std::vector<unicode_pretok_seq> & alts) {
+        alts.emplace_back();
+        if (!parse_seq(alts.back())) {
+            return false;
+        }
+        while (more() && re[i] == '|') {
+            ++i;
+            alts.emplace_back();
+            if (!parse_seq(alts.back())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the set of single characters alts matches, if every alternative is one character
+    // optionally preceded by single character lookaheads
+    static bool single_class(const std::vector<unicode_pretok_seq> & alts, unicode_pretok_class & cls) {
+        for (const auto & seq : alts) {
+            if (seq.empty()) {
+                return false;
+            }
+            unicode_pretok_class filter;
+            filter.negate(); // everything
+            for (size_t k = 0; k + 1 < seq.size(); ++k) {
+                unicode_pretok_class ahead;
+                if (seq[k].type != unicode_pretok_node::LOOKAHEAD || !single_class(seq[k].alts, ahead)) {
+                    return false;
+                }
+                if (seq[k].negated) {
+                    ahead.negate();
+                }
+                filter.intersect(ahead);
+            }
+            const auto & last = seq.back();
+            if (last.type != unicode_pretok_node::CLASS || last.min != 1 || last.max != 1) {
+                return false;
+            }
+            filter.intersect(last.cls);
+            cls.merge(filter);
+        }
+        return true;
+    }
+};
+
+// first set and nullability of a sequence; zero-width nodes are transparent
+static bool unicode_pretok_first(const unicode_pretok_seq & seq, unicode_pretok_class & first) {
+    for (const auto & node : seq) {
+        switch (node.type) {
+            case unicode_pretok_node::CLASS:
+                first.merge(node.cls);
+                if (node.min > 0) {
+                    return false;
+                }
+                break;
+            case unicode_pretok_node::GROUP: {
+                bool nullable = node.min == 0;
+                for (const auto & alt : node.alts) {
+                    nullable |= unicode_pretok_first(alt, first);
+                }
+                if (!nullable) {
+                    return false;
+                }
+            } break;
+            case unicode_pretok_node::LOOKAHEAD:
+            case unicode_pretok_node::END:
+                break;
+        }
+    }
+    return true;
+}
+
+// run scans use the tables of every class
+static void unicode_pretok_build_luts(std::vector<unicode_pretok_seq> & alts) {
+    for (auto & seq : alts) {
+        for (auto & node : seq) {
+            node.cls.build_lut();
+            unicode_pretok_build_luts(node.alts);
+        }
+    }
+}
+
+static std::unique_ptr<unicode_pretok_program> unicode_pretok_compile(const std::vector<uint32_t> & re) {
+    auto prog = std::make_unique<unicode_pretok_program>();
+
+    unicode_pretok_parser parser { re };
+    if (!parser.parse_alts(prog->alts) || parser.more()) {
+        return nullptr;
+    }
+
+    for (const auto & alt : prog->alts) {
+        unicode_pretok_class first;
+        const bool nullable = unicode_pretok_first(alt, first);
+        first.build_lut();
+        prog->first.merge(first);
+        prog->alt_first.push_back(std::move(first));
+        prog->alt_nullable.push_back(nullable);
+        prog->nullable |= nullable;
+    }
+    prog->first.build_lut();
+    unicode_pretok_build_luts(prog->alts);
+
+    return prog;
+}
+
+// compiled once per pattern; nullptr if the pattern is outside the supported subset
+template <typename CharT>
+static const unicode_pretok_program * unicode_pretok_get(const std::basic_string<CharT> & regex) {
+    static std::mutex mutex;
+    static std::map<std::basic_string<CharT>, std::unique_ptr<unicode_pretok_program>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(regex);
+    if (it == cache.end()) {
+        std::vector<uint32_t> re;
+        re.reserve(regex.size());
+        for (CharT c : regex) {
+            re.push_back((uint32_t) (typename std::make_unsigned<CharT>::type) c);
+        }
+        it = cache.emplace(regex, unicode_pretok_compile(re)).first;
+    }
+    return it->second.get();
+}
+
+// number of leading bytes of s whose membership in cls equals member
+static size_t unicode_pretok_span_scalar(const unicode_pretok_class & cls, const uint8_t * s, size_t n, bool member) {
+    size_t i = 0;
+    while (i < n && cls.contains(s[i]) == member) {
+        ++i;
+    }
+    return i;
+}
+
+#if defined(__ARM_NEON) && defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+static size_t unicode_pretok_span_neon(const unicode_pretok_class & cls, const uint8_t * s, size_t n, bool member) {
+    const uint8x16_t lut_lo = vld1q_u8(cls.lut[0]);
+    const uint8x16_t lut_hi = vld1q_u8(cls.lut[1]);
+    const uint8x16_t bit    = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t flip   = vdupq_n_u8(member ? 0xFF : 0x00);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t v  = vld1q_u8(s + i);
+        const uint8x16_t lo = vandq_u8(v, vdupq_n_u8(0x0F));
+        const uint8x16_t hi = vshrq_n_u8(v, 4);
+        const uint8x16_t t  = vbslq_u8(vcgtq_u8(hi, vdupq_n_u8(7)), vqtbl1q_u8(lut_hi, lo), vqtbl1q_u8(lut_lo, lo));
+        const uint8x16_t in = vtstq_u8(t, vqtbl1q_u8(bit, hi));
+        // 4 bits per byte, set where the span stops
+        const uint64_t stop = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(veorq_u8(in, flip)), 4)), 0);
+        if (stop) {
+            return i + (__builtin_ctzll(stop) >> 2);
+        }
+    }
+    return i + unicode_pretok_span_scalar(cls, s + i, n - i, member);
+}
+#define unicode_pretok_span unicode_pretok_span_neon
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("ssse3")))
+static size_t unicode_pretok_span_ssse3(const unicode_pretok_class & cls, const uint8_t * s, size_t n, bool member) {
+    const __m128i lut_lo = _mm_loadu_si128((const __m128i *) cls.lut[0]);
+    const __m128i lut_hi = _mm_loadu_si128((const __m128i *) cls.lut[1]);
+    const __m128i bit    = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nib    = _mm_set1_epi8(0x0F);
+    const int     flip   = member ? 0xFFFF : 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v   = _mm_loadu_si128((const __m128i *) (s + i));
+        const __m128i lo  = _mm_and_si128(v, nib);
+        const __m128i hi  = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+        const __m128i sel = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+        const __m128i t   = _mm_or_si128(_mm_andnot_si128(sel, _mm_shuffle_epi8(lut_lo, lo)),
+                                         _mm_and_si128(sel, _mm_shuffle_epi8(lut_hi, lo)));
+        const __m128i b   = _mm_shuffle_epi8(bit, hi);
+        const __m128i in  = _mm_cmpeq_epi8(_mm_and_si128(t, b), b);
+        const int stop = _mm_movemask_epi8(in) ^ flip;
+        if (stop) {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return i + unicode_pretok_span_scalar(cls, s + i, n - i, member);
+}
+
+static size_t unicode_pretok_span(const unicode_pretok_class & cls, const uint8_t * s, size_t n, bool member) {
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    return has_ssse3 ? unicode_pretok_span_ssse3(cls, s, n, member) : unicode_pretok_span_scalar(cls, s, n, member);
+}
+#else
+#define unicode_pretok_span unicode_pretok_span_scalar
+#endif
+
+// backtracking matcher over one offsets range of the text
+template <typename CharT>
+struct unicode_pretok_matcher {
+    // deeper recursion (group repetitions over a very long word) gives up and leaves the text to std::regex
+    static constexpr int max_depth = 2048;
+
+    const unicode_pretok_program & prog;
+    const CharT * text;
+    size_t        n;
+
+    size_t start    = 0;     // of the current match
+    size_t end      = 0;     // of the last accepted match
+    bool   not_null = false; // regex_constants::match_not_null
+    int    depth    = 0;
+    bool   overflow = false;
+
+    // a group iteration in progress, and what follows the group
+    struct repeat {
+        const unicode_pretok_node * node;
+        uint32_t                    count;
+        size_t                      start;
+        const unicode_pretok_seq  * seq;
+        size_t                      i;
+        const repeat              * next;
+    };
+
+    bool contains(const unicode_pretok_class & cls, size_t pos) const {
+        return cls.contains((uint32_t) (typename std::make_unsigned<CharT>::type) text[pos]);
+    }
+
+    size_t span(const unicode_pretok_class & cls, size_t pos, size_t len, bool member) const {
+        if constexpr (sizeof(CharT) == 1) {
+            return unicode_pretok_span(cls, (const uint8_t *) text + pos, len, member);
+        } else {
+            size_t i = 0;
+            while (i < len && contains(cls, pos + i) == member) {
+                ++i;
+            }
+            return i;
+        }
+    }
+
+    bool accept(size_t pos) {
+        if (not_null && pos == start) {
+            return false;
+        }
+        end = pos;
+        return true;
+    }
+
+    bool match_next(size_t pos, const repeat * k) {
+        if (k == nullptr) {
+            return accept(pos);
+        }
+        // ECMAScript: an optional iteration must not match empty
+        if (pos == k->start && k->count > k->node->min) {
+            return false;
+        }
+        return match_group(*k->node, k->count, pos, *k->seq, k->i, k->next);
+    }
+
+    bool match_group(const unicode_pretok_node & node, uint32_t count, size_t pos, const unicode_pretok_seq & seq, size_t i, const repeat * k) {
+        if (count < node.max) {
+            const repeat r = { &node, count + 1, pos, &seq, i, k };
+            for (const auto & alt : node.alts) {
+                if (match_seq(alt, 0, pos, &r)) {
+                    return true;
+                }
+            }
+        }
+        return count >= node.min && match_seq(seq, i + 1, pos, k);
+    }
+
+    bool match_seq(const unicode_pretok_seq & seq, size_t i, size_t pos, const repeat * k) {
+        if (i == seq.size()) {
+            return match_next(pos, k);
+        }
+        if (overflow || depth >= max_depth) {
+            overflow = true;
+            return false;
+        }
+        depth++;
+        const bool res = match_node(seq, i, pos, k);
+        depth--;
+        return res;
+    }
+
+    bool match_node(const unicode_pretok_seq & seq, size_t i, size_t pos, const repeat * k) {
+        const auto & node = seq[i];
+        switch (node.type) {
+            case unicode_pretok_node::CLASS: {
+                const size_t len = std::min<size_t>(n - pos, node.max);
+                const size_t cnt = span(node.cls, pos, len, true);
+                if (cnt < node.min) {
+                    return false;
+                }
+                if (i + 1 == seq.size() && k == nullptr) {
+                    return accept(pos + cnt); // nothing follows: the greedy count is the match
+                }
+                for (size_t c = cnt + 1; c-- > node.min; ) {
+                    if (match_seq(seq, i + 1, pos + c, k)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            case unicode_pretok_node::GROUP:
+                return match_group(node, 0, pos, seq, i, k);
+            case unicode_pretok_node::LOOKAHEAD: {
+                const bool   saved_not_null = not_null;
+                const size_t saved_start    = start;
+                not_null = false;
+                start    = pos;
+                bool found = false;
+                for (const auto & alt : node.alts) {
+                    if (match_seq(alt, 0, pos, nullptr)) {
+                        found = true;
+                        break;
+                    }
+                }
+                not_null = saved_not_null;
+                start    = saved_start;
+                return found != node.negated && match_seq(seq, i + 1, pos, k);
+            }
+            case unicode_pretok_node::END:
+                return pos == n && match_seq(seq, i + 1, pos, k);
+        }
+        return false;
+    }
+
+    // a match starting at pos, the first in alternative order
+    bool match_at(size_t pos) {
+        start = pos;
+        for (size_t a = 0; a < prog.alts.size(); ++a) {
+            if (!prog.alt_nullable[a] && (pos == n || !contains(prog.alt_first[a], pos))) {
+                continue;
+            }
+            if (match_seq(prog.alts[a], 0, pos, nullptr)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the leftmost match at or after pos
+    bool search(size_t pos, size_t & match_pos) {
+        while (!overflow) {
+            if (!prog.nullable) {
+                pos += span(prog.first, pos, n - pos, false);
+                if (pos == n) {
+                    return false;
+                }
+            }
+            if (match_at(pos)) {
+                match_pos = pos;
+                return true;
+            }
+            if (pos == n) {
+                return false;
+            }
+            ++pos;
+        }
+        return false;
+    }
+};
+
+// unicode_regex_split_stl on a compiled pattern; false if the text was too deep for the matcher
+template <typename CharT>
+static bool unicode_regex_split_compiled(const unicode_pretok_program & prog, const std::basic_string<CharT> & text, const std::vector<size_t> & offsets, std::vector<size_t> & bpe_offsets) {
+    bpe_offsets.clear();
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    size_t start = 0;
+    for (auto offset : offsets) {
+        unicode_pretok_matcher<CharT> m { prog, text.data() + start, offset };
+
+        size_t start_idx = 0;
+        size_t match_pos = 0;
+        bool   found     = m.search(0, match_pos);
+        while (found) {
+            if (match_pos > start_idx) {
+                bpe_offsets.emplace_back(match_pos - start_idx);
+            }
+            bpe_offsets.emplace_back(m.end - match_pos);
+            start_idx = m.end;
+
+            // as std::regex_iterator: after an empty match, first try a non-empty one at the same position
+            size_t next = m.end;
+            if (m.end == match_pos) {
+                if (next == offset) {
+                    break;
+                }
+                m.not_null = true;
+                found = m.match_at(next);
+                m.not_null = false;
+                if (found) {
+                    match_pos = next;
+                    continue;
+                }
+                ++next;
+            }
+            found = m.search(next, match_pos);
+        }
+        if (m.overflow) {
+            return false;
+        }
+
+        if (start_idx < offset) {
+            bpe_offsets.emplace_back(offset - start_idx);
+        }
+        start += offset;
+    }
+
+    return true;
+}
+
 //
 // interface
 //
@@ -852,6 +1625,13 @@ std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
     result.reserve(utf8.size());
     size_t offset = 0;
     while (offset < utf8.size()) {
+        // ASCII runs are widened 16 bytes at a time
+        if (!(utf8[offset] & 0x80) && offset + 16 <= utf8.size() && unicode_is_ascii16(utf8.data() + offset)) {
+            const uint8_t * p = (const uint8_t *) utf8.data() + offset;
+            result.insert(result.end(), p, p + 16);
+            offset += 16;
+            continue;
+        }
         try {
             result.push_back(unicode_cpt_from_utf8(utf8, offset));
         }
@@ -933,7 +1713,7 @@ bool unicode_cpt_is_han(uint32_t cpt) {
     return false;
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool compiled) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -1017,7 +1797,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
-        // fallback to general-purpose std::regex / std::wregex
+        // fallback to the compiled pattern, or general-purpose std::regex / std::wregex
         try {
             // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
             // with the corresponding collapsed representation
@@ -1084,7 +1864,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                const unicode_pretok_program * prog = compiled ? unicode_pretok_get(regex_expr_collapsed) : nullptr;
+                std::vector<size_t> tmp;
+                if (prog && unicode_regex_split_compiled(*prog, text_collapsed, bpe_offsets, tmp)) {
+                    bpe_offsets = std::move(tmp);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                }
             } else {
                 // no unicode category used, we can use std::wregex directly
                 const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
@@ -1099,7 +1885,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text: %s\n", text.c_str());
                 //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                const unicode_pretok_program * prog = compiled ? unicode_pretok_get(wregex_expr) : nullptr;
+                std::vector<size_t> tmp;
+                if (prog && unicode_regex_split_compiled(*prog, wtext, bpe_offsets, tmp)) {
+                    bpe_offsets = std::move(tmp);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                }
             }
         } catch (std::regex_error & e) {
             fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
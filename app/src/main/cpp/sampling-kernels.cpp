@@ -0,0 +1,83 @@
+#include "sampling-kernels.h"
+
+#include <algorithm>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Logits per block: one SIMD compare rejects them all against the k-th best
+static const int SELECT_BLOCK = 16;
+
+static bool greater_logit(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit;
+}
+
+// Heap step for one logit, exactly as the scalar scan does it
+static inline void offer(std::vector<llama_token_data>& heap, llama_token id, float logit) {
+    if (logit > heap.front().logit) {
+        std::pop_heap(heap.begin(), heap.end(), greater_logit);
+        heap.back() = {id, logit, 0.0f};
+        std::push_heap(heap.begin(), heap.end(), greater_logit);
+    }
+}
+
+static void scan_scalar(const float* logits, int begin, int end, std::vector<llama_token_data>& heap) {
+    for (int id = begin; id < end; id++) {
+        offer(heap, id, logits[id]);
+    }
+}
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static int scan_blocks(const float* logits, int begin, int end, std::vector<llama_token_data>& heap) {
+    int id = begin;
+    for (; id + SELECT_BLOCK <= end; id += SELECT_BLOCK) {
+        const float32x4_t threshold = vdupq_n_f32(heap.front().logit);
+        const uint32x4_t above = vorrq_u32(
+            vorrq_u32(vcgtq_f32(vld1q_f32(logits + id), threshold), vcgtq_f32(vld1q_f32(logits + id + 4), threshold)),
+            vorrq_u32(vcgtq_f32(vld1q_f32(logits + id + 8), threshold), vcgtq_f32(vld1q_f32(logits + id + 12), threshold)));
+        if (vmaxvq_u32(above) != 0) {
+            scan_scalar(logits, id, id + SELECT_BLOCK, heap);
+        }
+    }
+    return id;
+}
+#elif defined(__x86_64__)
+__attribute__((target("avx2")))
+static int scan_blocks_avx2(const float* logits, int begin, int end, std::vector<llama_token_data>& heap) {
+    int id = begin;
+    for (; id + SELECT_BLOCK <= end; id += SELECT_BLOCK) {
+        const __m256 threshold = _mm256_set1_ps(heap.front().logit);
+        const __m256 above = _mm256_or_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + id), threshold, _CMP_GT_OQ),
+                                          _mm256_cmp_ps(_mm256_loadu_ps(logits + id + 8), threshold, _CMP_GT_OQ));
+        if (_mm256_movemask_ps(above) != 0) {
+            scan_scalar(logits, id, id + SELECT_BLOCK, heap);
+        }
+    }
+    return id;
+}
+
+static int scan_blocks(const float* logits, int begin, int end, std::vector<llama_token_data>& heap) {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2 ? scan_blocks_avx2(logits, begin, end, heap) : begin;
+}
+#else
+static int scan_blocks(const float* /* logits */, int begin, int /* end */, std::vector<llama_token_data>& /* heap */) {
+    return begin;
+}
+#endif
+
+void select_top_k(const float* logits, int n_vocab, int k, std::vector<llama_token_data>& top) {
+    k = std::max(1, std::min(k, n_vocab));
+    top.clear();
+    for (llama_token id = 0; id < k; id++) {
+        top.push_back({id, logits[id], 0.0f});
+    }
+    std::make_heap(top.begin(), top.end(), greater_logit);  // Lowest kept logit at the front
+
+    const int tail = scan_blocks(logits, k, n_vocab, top);
+    scan_scalar(logits, tail, n_vocab, top);
+    std::sort_heap(top.begin(), top.end(), greater_logit);  // Highest logit first
+}
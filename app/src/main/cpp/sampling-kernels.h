@@ -0,0 +1,15 @@
+#pragma once
+
+// Selection kernels for the fused sampler in inference-engine.cpp, kept apart
+// so bench/sampling-bench.cpp can time them against llama_sampler chains.
+
+#include "llama.h"
+
+#include <vector>
+
+// The k highest of logits[0..n_vocab), highest first, into top (reused, so a
+// warm vector never allocates). Identical to a scalar min-heap scan, ties
+// included: blocks of logits that cannot beat the current k-th best are
+// rejected with one SIMD compare (NEON, or AVX2 when the CPU has it) and only
+// the rare winners go through the heap.
+void select_top_k(const float* logits, int n_vocab, int k, std::vector<llama_token_data>& top);
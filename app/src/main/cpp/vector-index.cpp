@@ -0,0 +1,425 @@
+#include "vector-index.h"
+#include "engine-log.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// File layout: a 64-byte header, then fixed-size records in insertion order.
+// A record is its id (REMOVED_ID once deleted), the vector's scale and dim
+// int8 values zero-padded to a multiple of VALUE_ALIGN (the SIMD step).
+static const char VECTOR_INDEX_MAGIC[4] = {'C', 'F', 'V', 'I'};
+static const uint32_t VECTOR_INDEX_VERSION = 1;
+static const int64_t REMOVED_ID = INT64_MIN;
+static const int VALUE_ALIGN = 32;
+static const size_t MIN_REMOVED_TO_COMPACT = 64;  // and more removed records than live ones
+
+struct VectorIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dim;        // 0 until the first vector
+    uint32_t stride;     // bytes per record, record_stride(dim)
+    uint64_t model_id;
+    uint64_t n_records;  // removed ones included
+    uint8_t reserved[32];
+};
+static_assert(sizeof(VectorIndexHeader) == 64, "vector index header layout");
+
+struct VectorRecord {
+    int64_t id;
+    float scale;
+    uint32_t reserved;
+    // followed by int8_t values[stride - sizeof(VectorRecord)]
+};
+static_assert(sizeof(VectorRecord) == 16, "vector record layout");
+
+struct VectorIndex {
+    std::mutex mutex;
+    std::string path;
+    int fd = -1;
+    VectorIndexHeader header;
+    std::unordered_map<int64_t, uint64_t> records;  // live id -> record number
+    const uint8_t* map = nullptr;                  // file mapping for search, grown on demand
+    size_t map_size = 0;
+};
+
+static uint32_t record_stride(uint32_t dim) {
+    return sizeof(VectorRecord) + (dim + VALUE_ALIGN - 1) / VALUE_ALIGN * VALUE_ALIGN;
+}
+
+static off_t record_offset(const VectorIndex* index, uint64_t record) {
+    return sizeof(VectorIndexHeader) + (off_t)record * index->header.stride;
+}
+
+static const int8_t* record_values(const uint8_t* record) {
+    return (const int8_t*)(record + sizeof(VectorRecord));
+}
+
+static bool write_all(int fd, const void* data, size_t size, off_t offset) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size, off_t offset) {
+    char* p = (char*)data;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static void unmap(VectorIndex* index) {
+    if (index->map != nullptr) {
+        munmap((void*)index->map, index->map_size);
+        index->map = nullptr;
+        index->map_size = 0;
+    }
+}
+
+// Map every record written so far. Caller holds index->mutex.
+static bool map_records(VectorIndex* index) {
+    const size_t size = record_offset(index, index->header.n_records);
+    if (index->map != nullptr && index->map_size >= size) {
+        return true;
+    }
+    unmap(index);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, index->fd, 0);
+    if (map == MAP_FAILED) {
+        LOGE("Vector index: mmap of %zu bytes failed (errno=%d)", size, errno);
+        return false;
+    }
+    index->map = (const uint8_t*)map;
+    index->map_size = size;
+    return true;
+}
+
+static bool write_header(VectorIndex* index) {
+    return write_all(index->fd, &index->header, sizeof(index->header), 0);
+}
+
+// Start over with no records
+static bool reset_index(VectorIndex* index, uint64_t model_id) {
+    unmap(index);
+    index->records.clear();
+    memset(&index->header, 0, sizeof(index->header));
+    memcpy(index->header.magic, VECTOR_INDEX_MAGIC, sizeof(VECTOR_INDEX_MAGIC));
+    index->header.version = VECTOR_INDEX_VERSION;
+    index->header.stride = record_stride(0);
+    index->header.model_id = model_id;
+    return ftruncate(index->fd, 0) == 0 && write_header(index);
+}
+
+// Rebuild the id map from the records on disk
+static bool scan_records(VectorIndex* index) {
+    index->records.clear();
+    if (index->header.n_records == 0) {
+        return true;
+    }
+    if (!map_records(index)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < index->header.n_records; i++) {
+        const VectorRecord* record = (const VectorRecord*)(index->map + record_offset(index, i));
+        if (record->id != REMOVED_ID) {
+            index->records[record->id] = i;
+        }
+    }
+    return true;
+}
+
+// Rewrite the file with only the live records, once removed ones dominate
+static void compact_if_needed(VectorIndex* index) {
+    const size_t n_removed = index->header.n_records - index->records.size();
+    if (n_removed < MIN_REMOVED_TO_COMPACT || n_removed < index->records.size() || !map_records(index)) {
+        return;
+    }
+
+    const std::string tmp_path = index->path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    std::vector<std::pair<uint64_t, int64_t>> live;  // record number, id - kept in insertion order
+    live.reserve(index->records.size());
+    for (const auto& entry : index->records) {
+        live.emplace_back(entry.second, entry.first);
+    }
+    std::sort(live.begin(), live.end());
+
+    VectorIndexHeader header = index->header;
+    header.n_records = live.size();
+    bool ok = write_all(fd, &header, sizeof(header), 0);
+    for (size_t i = 0; ok && i < live.size(); i++) {
+        ok = write_all(fd, index->map + record_offset(index, live[i].first), header.stride,
+                       sizeof(header) + (off_t)i * header.stride);
+    }
+    if (!ok || fsync(fd) != 0 || rename(tmp_path.c_str(), index->path.c_str()) != 0) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    unmap(index);
+    close(index->fd);
+    index->fd = fd;
+    index->header = header;
+    for (size_t i = 0; i < live.size(); i++) {
+        index->records[live[i].second] = i;
+    }
+    LOGI("Vector index compacted: %zu removed vectors dropped", n_removed);
+}
+
+VectorIndex* vector_index_open(const std::string& path, uint64_t model_id) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        LOGE("Vector index: cannot open %s (errno=%d)", path.c_str(), errno);
+        return nullptr;
+    }
+    VectorIndex* index = new VectorIndex();
+    index->path = path;
+    index->fd = fd;
+
+    struct stat st;
+    const bool has_header = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(VectorIndexHeader) &&
+                            read_all(fd, &index->header, sizeof(index->header), 0);
+    const VectorIndexHeader& header = index->header;
+    const bool valid = has_header && memcmp(header.magic, VECTOR_INDEX_MAGIC, sizeof(VECTOR_INDEX_MAGIC)) == 0 &&
+                       header.version == VECTOR_INDEX_VERSION && header.stride == record_stride(header.dim) &&
+                       (size_t)st.st_size >= (size_t)record_offset(index, header.n_records);
+
+    bool ok;
+    if (valid && header.model_id == model_id) {
+        ok = scan_records(index);
+    } else {
+        if (valid) {
+            LOGI("Vector index %s was built with another embedding model, starting over", path.c_str());
+        }
+        ok = reset_index(index, model_id);
+    }
+    if (!ok) {
+        LOGE("Vector index: cannot read %s", path.c_str());
+        vector_index_close(index);
+        return nullptr;
+    }
+
+    LOGI("✓ Vector index %s: %zu vectors, dim %u", path.c_str(), index->records.size(), index->header.dim);
+    return index;
+}
+
+void vector_index_close(VectorIndex* index) {
+    if (index == nullptr) {
+        return;
+    }
+    unmap(index);
+    close(index->fd);
+    delete index;
+}
+
+// Unit-length v quantized to int8: values[i] * scale ~ v[i] / |v|
+static float quantize_vector(const float* v, int dim, int8_t* values) {
+    double norm = 0.0;
+    float max_abs = 0.0f;
+    for (int i = 0; i < dim; i++) {
+        norm += (double)v[i] * v[i];
+        max_abs = std::max(max_abs, std::fabs(v[i]));
+    }
+    if (norm == 0.0 || max_abs == 0.0f) {
+        std::fill(values, values + dim, 0);
+        return 0.0f;
+    }
+    const float inv_scale = 127.0f / max_abs;
+    for (int i = 0; i < dim; i++) {
+        values[i] = (int8_t)std::lround(v[i] * inv_scale);
+    }
+    return (float)(max_abs / 127.0 / std::sqrt(norm));
+}
+
+static bool remove_record(VectorIndex* index, int64_t id) {
+    auto it = index->records.find(id);
+    if (it == index->records.end()) {
+        return false;
+    }
+    const int64_t removed = REMOVED_ID;
+    if (!write_all(index->fd, &removed, sizeof(removed), record_offset(index, it->second))) {
+        return false;
+    }
+    index->records.erase(it);
+    return true;
+}
+
+bool vector_index_put(VectorIndex* index, int64_t id, const float* values, int dim) {
+    std::lock_guard<std::mutex> lock(index->mutex);
+    if (id == REMOVED_ID || dim <= 0) {
+        return false;
+    }
+    if (index->header.dim == 0) {
+        index->header.dim = dim;
+        index->header.stride = record_stride(dim);
+    } else if ((int)index->header.dim != dim) {
+        LOGE("Vector index: dimension %d, expected %u", dim, index->header.dim);
+        return false;
+    }
+
+    std::vector<uint8_t> record(index->header.stride, 0);
+    VectorRecord* header = (VectorRecord*)record.data();
+    header->id = id;
+    header->scale = quantize_vector(values, dim, (int8_t*)(record.data() + sizeof(VectorRecord)));
+
+    // The header is written after the record, so a torn append is never counted
+    const uint64_t n = index->header.n_records;
+    if (!write_all(index->fd, record.data(), record.size(), record_offset(index, n))) {
+        LOGE("Vector index: write failed (errno=%d)", errno);
+        return false;
+    }
+    remove_record(index, id);
+    index->header.n_records = n + 1;
+    if (!write_header(index)) {
+        index->header.n_records = n;
+        return false;
+    }
+    index->records[id] = n;
+    compact_if_needed(index);
+    return true;
+}
+
+bool vector_index_remove(VectorIndex* index, int64_t id) {
+    std::lock_guard<std::mutex> lock(index->mutex);
+    if (!remove_record(index, id)) {
+        return false;
+    }
+    compact_if_needed(index);
+    return true;
+}
+
+int vector_index_size(VectorIndex* index) {
+    std::lock_guard<std::mutex> lock(index->mutex);
+    return (int)index->records.size();
+}
+
+void vector_index_ids(VectorIndex* index, std::vector<int64_t>& ids) {
+    std::lock_guard<std::mutex> lock(index->mutex);
+    ids.clear();
+    ids.reserve(index->records.size());
+    for (const auto& entry : index->records) {
+        ids.push_back(entry.first);
+    }
+}
+
+// Sum of a[i] * b[i] over n int8 values, n a multiple of VALUE_ALIGN
+static int32_t dot_i8(const int8_t* a, const int8_t* b, int n) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    int32x4_t acc0 = vdupq_n_s32(0);
+    int32x4_t acc1 = vdupq_n_s32(0);
+    for (int i = 0; i < n; i += 32) {
+        acc0 = vdotq_s32(acc0, vld1q_s8(a + i), vld1q_s8(b + i));
+        acc1 = vdotq_s32(acc1, vld1q_s8(a + i + 16), vld1q_s8(b + i + 16));
+    }
+    return vaddvq_s32(vaddq_s32(acc0, acc1));
+#elif defined(__ARM_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (int i = 0; i < n; i += 16) {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+    }
+    return vaddvq_s32(acc);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 16) {
+        const __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+        const __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    return _mm_cvtsi128_si32(sum);
+#else
+    int32_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+#endif
+}
+
+int vector_index_search(VectorIndex* index, const float* query, int dim, int k, int64_t* ids, float* scores) {
+    std::lock_guard<std::mutex> lock(index->mutex);
+    if (index->records.empty() || k <= 0) {
+        return 0;
+    }
+    if ((int)index->header.dim != dim || !map_records(index)) {
+        return -1;
+    }
+
+    const uint32_t stride = index->header.stride;
+    const int n_values = stride - sizeof(VectorRecord);
+    std::vector<int8_t> q(n_values, 0);
+    const float query_scale = quantize_vector(query, dim, q.data());
+
+    // Min-heap of the best k so far
+    typedef std::pair<float, int64_t> Scored;
+    std::vector<Scored> best;
+    best.reserve(k + 1);
+    const uint8_t* record = index->map + sizeof(VectorIndexHeader);
+    for (uint64_t i = 0; i < index->header.n_records; i++, record += stride) {
+        const VectorRecord* header = (const VectorRecord*)record;
+        if (header->id == REMOVED_ID) {
+            continue;
+        }
+        const float score = dot_i8(q.data(), record_values(record), n_values) * query_scale * header->scale;
+        if ((int)best.size() < k) {
+            best.emplace_back(score, header->id);
+            std::push_heap(best.begin(), best.end(), std::greater<Scored>());
+        } else if (score > best.front().first) {
+            std::pop_heap(best.begin(), best.end(), std::greater<Scored>());
+            best.back() = Scored(score, header->id);
+            std::push_heap(best.begin(), best.end(), std::greater<Scored>());
+        }
+    }
+
+    std::sort_heap(best.begin(), best.end(), std::greater<Scored>());
+    for (size_t i = 0; i < best.size(); i++) {
+        ids[i] = best[i].second;
+        scores[i] = best[i].first;
+    }
+    return (int)best.size();
+}
@@ -32,8 +32,10 @@ class ConfidantApplication : Application(), Configuration.Provider {
     val preferencesManager by lazy { PreferencesManager.getInstance(this) }
     val thermalManager by lazy { ThermalManager(this) }
     val systemMonitor by lazy { SystemMonitor(this) }
-    val llmEngine by lazy { LLMEngine(this, thermalManager) }
+    private val llmEngineDelegate = lazy { LLMEngine(this, thermalManager) }
+    val llmEngine by llmEngineDelegate
     val memorySystem by lazy { SimplifiedMemorySystem(this, llmEngine, database) }
+    val vectorSearch by lazy { com.confidant.ai.search.VectorSearch(this, llmEngine, database) }
     val telegramBotManager by lazy { TelegramBotManager(this, llmEngine, memorySystem, database) }
     val modelDownloadManager by lazy { ModelDownloadManager.getInstance(this) }
     val intelligenceScheduler by lazy { IntelligenceScheduler(this, llmEngine, memorySystem, telegramBotManager, database) }
@@ -99,6 +101,15 @@ class ConfidantApplication : Application(), Configuration.Provider {
         }
     }
     
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        
+        // Release model memory in steps rather than getting the whole process killed
+        if (llmEngineDelegate.isInitialized()) {
+            llmEngine.onTrimMemory(level)
+        }
+    }
+    
     private fun createNotificationChannels() {
         // Use NotificationChannelManager for optimized channel creation
         notificationChannelManager.createChannels()
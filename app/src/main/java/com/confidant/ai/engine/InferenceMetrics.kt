@@ -0,0 +1,102 @@
+package com.confidant.ai.engine
+
+/**
+ * InferenceMetrics - Snapshot of the native performance counters
+ *
+ * Latency percentiles cover the last 256 samples of each phase; counts and
+ * means cover the whole process lifetime. Read via [LLMEngine.getInferenceMetrics].
+ */
+data class InferenceMetrics(
+    val tokenize: LatencyStats,
+    val prefillChunk: LatencyStats,
+    val firstToken: LatencyStats,
+    val decodeToken: LatencyStats,
+    val sampling: LatencyStats,
+
+    // KV cache: tokens held by all sequences vs context size
+    val kvUsedTokens: Int,
+    val kvCapacityTokens: Int,
+
+    // Prompt prefix reuse across requests
+    val requests: Long,
+    val promptTokens: Long,
+    val reusedTokens: Long,
+    val snapshotHits: Long,
+
+    // Thread controller state
+    val threads: Int,
+    val efficiencyCores: Boolean,
+    val prefillBudget: Int,
+
+    // llama_perf_context totals
+    val promptEvalMs: Double,
+    val promptEvalTokens: Long,
+    val evalMs: Double,
+    val evalTokens: Long
+) {
+
+    /**
+     * Rolling latency summary of one phase, in milliseconds
+     */
+    data class LatencyStats(
+        val count: Long,
+        val meanMs: Double,
+        val p50Ms: Double,
+        val p90Ms: Double,
+        val p99Ms: Double,
+        val maxMs: Double
+    )
+
+    val kvOccupancy: Float
+        get() = if (kvCapacityTokens > 0) kvUsedTokens.toFloat() / kvCapacityTokens else 0f
+
+    val cacheHitRatio: Float
+        get() = if (promptTokens > 0) reusedTokens.toFloat() / promptTokens else 0f
+
+    companion object {
+        private const val PHASES = 5
+        private const val LATENCY_FIELDS = 6
+        private const val GAUGE_FIELDS = 13
+
+        /**
+         * Decode the flat array from nativeGetMetrics (layout documented in inference-engine.h)
+         */
+        fun fromArray(values: DoubleArray): InferenceMetrics? {
+            if (values.size < PHASES * LATENCY_FIELDS + GAUGE_FIELDS) return null
+
+            fun latency(phase: Int): LatencyStats {
+                val base = phase * LATENCY_FIELDS
+                return LatencyStats(
+                    count = values[base].toLong(),
+                    meanMs = values[base + 1],
+                    p50Ms = values[base + 2],
+                    p90Ms = values[base + 3],
+                    p99Ms = values[base + 4],
+                    maxMs = values[base + 5]
+                )
+            }
+
+            val g = PHASES * LATENCY_FIELDS
+            return InferenceMetrics(
+                tokenize = latency(0),
+                prefillChunk = latency(1),
+                firstToken = latency(2),
+                decodeToken = latency(3),
+                sampling = latency(4),
+                kvUsedTokens = values[g].toInt(),
+                kvCapacityTokens = values[g + 1].toInt(),
+                requests = values[g + 2].toLong(),
+                promptTokens = values[g + 3].toLong(),
+                reusedTokens = values[g + 4].toLong(),
+                snapshotHits = values[g + 5].toLong(),
+                threads = values[g + 6].toInt(),
+                efficiencyCores = values[g + 7] != 0.0,
+                prefillBudget = values[g + 8].toInt(),
+                promptEvalMs = values[g + 9],
+                promptEvalTokens = values[g + 10].toLong(),
+                evalMs = values[g + 11],
+                evalTokens = values[g + 12].toLong()
+            )
+        }
+    }
+}
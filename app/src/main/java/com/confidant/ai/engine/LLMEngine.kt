@@ -1,6 +1,11 @@
 package com.confidant.ai.engine
 
+import android.app.ActivityManager
+import android.content.ComponentCallbacks2
 import android.content.Context
+import android.content.Intent
+import android.content.IntentFilter
+import android.os.BatteryManager
 import android.util.Log
 import com.confidant.ai.thermal.ThermalManager
 import com.confidant.ai.thermal.ThermalThrottlingException
@@ -11,6 +16,8 @@ import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.flow.asStateFlow
 import kotlinx.coroutines.flow.callbackFlow
 import java.io.File
+import kotlin.coroutines.resume
+import java.nio.ByteBuffer
 
 /**
  * LLMEngine - Native LLM inference via JNI
@@ -37,8 +44,20 @@ class LLMEngine(
     private val _generationProgress = MutableStateFlow(0f)
     val generationProgress: StateFlow<Float> = _generationProgress.asStateFlow()
     
+    // Prompt prefill progress of the current streaming generation, 0..1
+    private val _prefillProgress = MutableStateFlow(0f)
+    val prefillProgress: StateFlow<Float> = _prefillProgress.asStateFlow()
+    
+    // Model load progress, 0..1, updated from the native loading thread
+    private val _loadProgress = MutableStateFlow(0f)
+    val loadProgress: StateFlow<Float> = _loadProgress.asStateFlow()
+    
     private var modelPath: String? = null
-    private var currentThreads = 4
+    
+    init {
+        // Thermal changes reach the native thread controller mid-generation
+        thermalManager.addListener { pushDeviceState() }
+    }
     
     /**
      * Query types for dynamic temperature selection
@@ -88,42 +107,146 @@ class LLMEngine(
         }
     }
     
+    // 4-bit KV cache on devices where the low-memory killer would otherwise
+    // reclaim us at long contexts; 8-bit everywhere else
+    private fun selectKvCacheType(): Int {
+        val activityManager = context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager
+        val memInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memInfo)
+        return if (memInfo.totalMem < LOW_MEMORY_DEVICE_BYTES) KV_CACHE_Q4_0 else KV_CACHE_Q8_0
+    }
+    
     // Native methods
-    external fun nativeLoadModel(
+    // Returns at once; the native loading thread reports through callback.
+    // draftPath: optional small model with the same vocabulary for speculative decoding
+    // kvCacheType: one of the KV_CACHE_* constants (EngineKvCacheType)
+    // earlyExitLayer: layers the model drafts for itself with (0 = off, EARLY_EXIT_AUTO = calibrate)
+    external fun nativeLoadModelAsync(
         path: String,
+        draftPath: String?,
         nThreads: Int,
         ctxSize: Int,
+        kvCacheType: Int,
+        earlyExitLayer: Int,
         temperature: Float,
         topK: Int,
         topP: Float,
-        minP: Float
-    ): Boolean
+        minP: Float,
+        callback: ModelLoadCallback
+    )
+    
+    // Abort a load in progress (it completes with success = false)
+    external fun nativeCancelLoad()
     
-    external fun nativeGenerate(prompt: String, maxTokens: Int, temperature: Float): String
+    external fun nativeGenerate(prompt: String, maxTokens: Int, temperature: Float, seed: Int, session: Long): String
     
     external fun nativeGenerateWithCache(
         systemPrompt: String,
         userMessage: String,
         maxTokens: Int,
-        temperature: Float
+        temperature: Float,
+        seed: Int,
+        session: Long
     ): String
     
     external fun nativeFreeModel()
     
     external fun nativeGetTokenCount(text: String): Int
     
+    // Directory + byte budget for on-disk system prompt KV snapshots
+    external fun nativeSetPromptCacheDir(cacheDir: String, maxBytes: Long)
+    
+    // Directory for the per-user n-gram statistics (loaded with the model, saved on free)
+    external fun nativeSetNgramCacheDir(cacheDir: String)
+    
     // NEW: Real streaming generation
     external fun nativeGenerateStreaming(
         prompt: String,
         maxTokens: Int,
         temperature: Float,
-        callback: StreamingCallback
+        callback: StreamingCallback,
+        seed: Int,
+        session: Long,
+        flushTokens: Int,
+        flushMillis: Int,
+        directBuffer: ByteBuffer?
     )
     
+    // Generation sessions: cancellation handles for the native decode loop
+    external fun nativeCreateSession(): Long
+    external fun nativeCancelSession(session: Long)
+    external fun nativeDestroySession(session: Long)
+    
+    // Speculative decoding: draft tokens per step (0 = off), [drafted, accepted] counters.
+    // Drafts come from the draft model when one is loaded, else from prompt lookup.
+    external fun nativeSetSpeculativeDraft(nDraft: Int)
+    external fun nativeGetSpeculativeStats(): LongArray
+    
+    // Prompt tokens per decode step while other generations stream (0 = uncapped)
+    external fun nativeSetPrefillBudget(nTokens: Int)
+    
+    // Thermal/battery input for the native thread controller (ThermalState ordinal)
+    external fun nativeSetDeviceState(thermalLevel: Int, thermalHeadroom: Float, batteryPercent: Int, charging: Boolean)
+    
+    // Performance counters, decoded by InferenceMetrics.fromArray
+    external fun nativeGetMetrics(): DoubleArray
+    
+    // Memory residency (Residency ordinal): trims apply once idle, the next generation restores
+    external fun nativeSetResidency(level: Int)
+    external fun nativeGetResidency(): Int
+    
+    // Note vectors: embeddings from the engine in a native VectorIndex (handle, 0 = none)
+    external fun nativeSetEmbeddingModel(modelPath: String)
+    external fun nativeEmbeddingModelId(): Long
+    external fun nativeVectorIndexOpen(indexPath: String): Long
+    external fun nativeVectorIndexClose(index: Long)
+    external fun nativeVectorIndexAdd(index: Long, ids: LongArray, texts: Array<String>, session: Long): Int
+    external fun nativeVectorIndexRemove(index: Long, id: Long)
+    external fun nativeVectorIndexIds(index: Long): LongArray
+    external fun nativeVectorIndexSearch(index: Long, query: String, k: Int, session: Long, scores: FloatArray): LongArray?
+    
+    /**
+     * How much of the model the native engine keeps in memory. Each level frees
+     * more and costs more to come back from, all of them far less than a cold load.
+     */
+    enum class Residency {
+        ACTIVE,     // everything resident
+        COMPACT,    // context freed, cached conversations parked in host memory
+        PREFIX,     // only the latest system prompt kept
+        COLD,       // also weight pages and n-gram statistics released
+        UNLOADED    // model freed, reloaded by the next generation
+    }
+    
     /**
-     * Initialize the LLM engine with a model
+     * Run a blocking native generation under its own native session.
+     * Cancelling the calling coroutine (new Telegram message, timeout) cancels the
+     * native decode loop too, including a prefill in the middle of llama_decode,
+     * so the next request does not wait for the old one to finish.
      */
-    suspend fun initialize(modelPath: String): Result<Unit> = withContext(Dispatchers.IO) {
+    private suspend fun <T> withNativeSession(block: (Long) -> T): T = coroutineScope {
+        val session = nativeCreateSession()
+        val canceller = launch {
+            try {
+                awaitCancellation()
+            } finally {
+                nativeCancelSession(session)
+            }
+        }
+        try {
+            block(session)
+        } finally {
+            canceller.cancel()
+            withContext(NonCancellable) { canceller.join() }
+            nativeDestroySession(session)
+        }
+    }
+    
+    /**
+     * Initialize the LLM engine with a model. [draftModelPath] optionally names a
+     * small model with the same tokenizer (e.g. LFM2-350M beside the 1.2B) that
+     * drafts tokens for speculative decoding; without it generation is unchanged.
+     */
+    suspend fun initialize(modelPath: String, draftModelPath: String? = null): Result<Unit> = withContext(Dispatchers.IO) {
         try {
             Log.d(TAG, "=== LLM Initialization Started ===")
             Log.d(TAG, "Model path: $modelPath")
@@ -178,42 +301,78 @@ class LLMEngine(
             
             this@LLMEngine.modelPath = modelPath
             
-            // Get thermal-aware thread count
-            currentThreads = thermalManager.getThermalAwareThreadCount()
-            Log.d(TAG, "Thread count: $currentThreads (thermal-aware)")
+            // A missing draft model only costs the speculation speedup
+            val draftPath = draftModelPath?.takeIf { File(it).canRead() }
+            if (draftModelPath != null && draftPath == null) {
+                Log.w(TAG, "Draft model not readable, loading without it: $draftModelPath")
+            }
+            
+            // Thread budget for the context; the native controller runs fewer
+            // threads, or the efficiency cores, as thermal and battery state demand
+            Log.d(TAG, "Thread budget: $INFERENCE_THREADS (adapted natively per decode step)")
+            pushDeviceState()
+            
+            // Persist system prompt KV snapshots so cold starts skip the prefill
+            val snapshotDir = File(context.cacheDir, PROMPT_CACHE_DIR).apply { mkdirs() }
+            nativeSetPromptCacheDir(snapshotDir.absolutePath, PROMPT_CACHE_MAX_BYTES)
+            
+            // Per-user phrasing statistics for speculative drafting - user data, not cache
+            val ngramDir = File(context.filesDir, NGRAM_CACHE_DIR).apply { mkdirs() }
+            nativeSetNgramCacheDir(ngramDir.absolutePath)
             
             // Attempt native model loading
-            Log.d(TAG, "Calling nativeLoadModel()...")
+            Log.d(TAG, "Calling nativeLoadModelAsync()...")
             val startTime = System.currentTimeMillis()
             
             // FIXED: Use consistent 2048 context size (optimal for LFM2.5-1.2B on mobile)
             // LFM2.5-1.2B works best with 2048 context for memory/performance balance
             val ctxSize = 2048
+            val kvCacheType = selectKvCacheType()
             
-            val success = try {
-                nativeLoadModel(
+            _loadProgress.value = 0f
+            val success = suspendCancellableCoroutine { continuation ->
+                continuation.invokeOnCancellation { nativeCancelLoad() }
+                nativeLoadModelAsync(
                     path = modelPath,
-                    nThreads = currentThreads,
+                    draftPath = draftPath,
+                    nThreads = INFERENCE_THREADS,
                     ctxSize = ctxSize,
+                    kvCacheType = kvCacheType,
+                    earlyExitLayer = EARLY_EXIT_LAYER,
                     temperature = 0.7f,  // Optimal for LFM2.5 (0.7 recommended)
                     topK = 50,           // Optimal for LFM2.5 (50 recommended)
                     topP = 0.8f,         // Optimal for LFM2.5 (0.8 recommended)
-                    minP = 0.0f
+                    minP = 0.0f,
+                    callback = object : ModelLoadCallback {
+                        override fun onProgress(progress: Float) {
+                            _loadProgress.value = progress
+                        }
+                        
+                        override fun onComplete(success: Boolean) {
+                            if (continuation.isActive) continuation.resume(success)
+                        }
+                    }
                 )
-            } catch (e: Exception) {
-                Log.e(TAG, "Native call threw exception", e)
-                throw e
             }
             
             val loadTime = System.currentTimeMillis() - startTime
-            Log.d(TAG, "nativeLoadModel() returned: $success (took ${loadTime}ms)")
+            Log.d(TAG, "nativeLoadModelAsync() completed: $success (took ${loadTime}ms, includes warm-up)")
             
             if (success) {
                 _isInitialized.value = true
+                if (draftPath != null) {
+                    // The native side adapts the draft length to acceptance, up to this cap
+                    nativeSetSpeculativeDraft(DRAFT_MODEL_MAX_TOKENS)
+                    Log.i(TAG, "Draft model: $draftPath (up to $DRAFT_MODEL_MAX_TOKENS tokens per step)")
+                } else if (EARLY_EXIT_LAYER != 0) {
+                    // Without a calibrated exit layer this stays prompt lookup
+                    nativeSetSpeculativeDraft(DRAFT_MODEL_MAX_TOKENS)
+                    Log.i(TAG, "Early-exit drafting requested (layer $EARLY_EXIT_LAYER)")
+                }
                 Log.i(TAG, "=== LLM Engine initialized successfully ===")
                 Log.i(TAG, "Model: LFM2.5-1.2B-Instruct Q4_K_M")
-                Log.i(TAG, "Config: threads=$currentThreads, ctx=$ctxSize, temp=0.7, topK=50, topP=0.8")
-                Log.i(TAG, "Optimizations: KV-Q8, flash_attn, hybrid architecture, cache enabled")
+                Log.i(TAG, "Config: threads=$INFERENCE_THREADS, ctx=$ctxSize, temp=0.7, topK=50, topP=0.8")
+                Log.i(TAG, "Optimizations: KV type $kvCacheType, flash_attn, hybrid architecture, cache enabled")
                 Log.i(TAG, "Load time: ${loadTime}ms")
                 Result.success(Unit)
             } else {
@@ -226,7 +385,7 @@ class LLMEngine(
                     
                     File: $modelPath
                     Size: ${fileSize / (1024 * 1024)} MB
-                    Threads: $currentThreads
+                    Threads: $INFERENCE_THREADS
                 """.trimIndent()
                 Log.e(TAG, error)
                 Result.failure(Exception(error))
@@ -248,7 +407,8 @@ class LLMEngine(
         userMessage: String,
         maxTokens: Int = 128,        // INCREASED from 48 for better responses (2026: balanced speed/quality)
         temperature: Float = 0.7f,   // Optimal for LFM2.5 (0.7 recommended)
-        timeoutSeconds: Int = 20     // INCREASED from 12s for longer responses
+        timeoutSeconds: Int = 20,    // INCREASED from 12s for longer responses
+        seed: Int = RANDOM_SEED      // Fixed seed for reproducible sampling
     ): Result<String> = withContext(Dispatchers.IO) {
         try {
             if (!isNativeLibraryAvailable()) {
@@ -274,13 +434,13 @@ class LLMEngine(
             _isGenerating.value = true
             _generationProgress.value = 0f
             
-            // Update thread count based on current thermal state
-            updateThreadCount()
+            // Let the native thread controller see the current thermal/battery state
+            pushDeviceState()
             
             // DIAGNOSTIC: Log thermal and configuration state
             Log.d(TAG, "=== GENERATION START DIAGNOSTICS ===")
             Log.d(TAG, "Thermal state: ${thermalManager.getThermalStatus()}")
-            Log.d(TAG, "Thread count: $currentThreads (thermal-aware)")
+            Log.d(TAG, "Battery: ${batteryPercent()}%${if (isCharging()) " (charging)" else ""}")
             Log.d(TAG, "Can start inference: ${thermalManager.canStartInference()}")
             Log.d(TAG, "Timeout: ${timeoutSeconds}s")
             Log.d(TAG, "Max tokens: $maxTokens")
@@ -293,7 +453,9 @@ class LLMEngine(
             
             // Run with timeout
             val result = withTimeout(timeoutSeconds * 1000L) {
-                nativeGenerateWithCache(systemPrompt, userMessage, maxTokens, temperature)
+                withNativeSession { session ->
+                    nativeGenerateWithCache(systemPrompt, userMessage, maxTokens, temperature, seed, session)
+                }
             }
             
             _generationProgress.value = 1f
@@ -325,7 +487,8 @@ class LLMEngine(
         prompt: String,
         maxTokens: Int = 256,
         temperature: Float = 0.7f,
-        timeoutSeconds: Int = 30
+        timeoutSeconds: Int = 30,
+        seed: Int = RANDOM_SEED
     ): Result<String> = withContext(Dispatchers.IO) {
         try {
             if (!isNativeLibraryAvailable()) {
@@ -344,14 +507,16 @@ class LLMEngine(
             _isGenerating.value = true
             _generationProgress.value = 0f
             
-            // Update thread count based on current thermal state
-            updateThreadCount()
+            // Let the native thread controller see the current thermal/battery state
+            pushDeviceState()
             
             Log.d(TAG, "Starting generation with ${timeoutSeconds}s timeout...")
             
             // Run with timeout
             val result = withTimeout(timeoutSeconds * 1000L) {
-                nativeGenerate(prompt, maxTokens, temperature)
+                withNativeSession { session ->
+                    nativeGenerate(prompt, maxTokens, temperature, seed, session)
+                }
             }
             
             _generationProgress.value = 1f
@@ -395,12 +560,18 @@ class LLMEngine(
      * @param prompt The input prompt
      * @param maxTokens Maximum tokens to generate
      * @param temperature Sampling temperature (0.0-1.0)
-     * @return Flow of tokens as they're generated
+     * @param flushTokens Tokens batched per JNI callback (1 = every token)
+     * @param flushMillis Max time a token waits in the native batch (0 = no time limit)
+     * @param seed Sampling seed ([RANDOM_SEED] = different every call)
+     * @return Flow of text chunks as they're generated
      */
     fun generateStreaming(
         prompt: String,
         maxTokens: Int = 256,
-        temperature: Float = 0.7f
+        temperature: Float = 0.7f,
+        flushTokens: Int = STREAM_FLUSH_TOKENS,
+        flushMillis: Int = STREAM_FLUSH_MILLIS,
+        seed: Int = RANDOM_SEED
     ): kotlinx.coroutines.flow.Flow<String> = kotlinx.coroutines.flow.callbackFlow {
         if (!isNativeLibraryAvailable()) {
             close(UnsatisfiedLinkError("Native library not available"))
@@ -420,9 +591,10 @@ class LLMEngine(
         
         _isGenerating.value = true
         _generationProgress.value = 0f
+        _prefillProgress.value = 0f
         
-        // Update thread count based on current thermal state
-        updateThreadCount()
+        // Let the native thread controller see the current thermal/battery state
+        pushDeviceState()
         
         // LOG GENERATION PARAMETERS FOR DEBUGGING
         Log.d(TAG, "=== STREAMING GENERATION START ===")
@@ -439,12 +611,27 @@ class LLMEngine(
         
         Log.d(TAG, "Starting REAL streaming generation...")
         
+        // One per call: concurrent streams decode together in the native scheduler
+        // and each writes its ring from offset 0
+        val streamBuffer = ByteBuffer.allocateDirect(STREAM_BUFFER_BYTES)
+        
         val callback = object : StreamingCallback {
             override fun onToken(token: String) {
                 // Emit token immediately as it's generated
                 trySend(token).isSuccess
             }
             
+            override fun onChunk(offset: Int, length: Int) {
+                val bytes = streamBuffer.duplicate()
+                bytes.limit(offset + length)
+                bytes.position(offset)
+                trySend(Charsets.UTF_8.decode(bytes).toString()).isSuccess
+            }
+            
+            override fun onPrefillProgress(processed: Int, total: Int) {
+                _prefillProgress.value = if (total > 0) processed.toFloat() / total else 1f
+            }
+            
             override fun onComplete() {
                 _isGenerating.value = false
                 _generationProgress.value = 1f
@@ -462,7 +649,12 @@ class LLMEngine(
         // Call native streaming method
         withContext(Dispatchers.IO) {
             try {
-                nativeGenerateStreaming(prompt, maxTokens, temperature, callback)
+                withNativeSession { session ->
+                    nativeGenerateStreaming(
+                        prompt, maxTokens, temperature, callback, seed, session,
+                        flushTokens, flushMillis, streamBuffer
+                    )
+                }
             } catch (e: Exception) {
                 Log.e(TAG, "Streaming generation failed", e)
                 close(e)
@@ -483,25 +675,165 @@ class LLMEngine(
         Log.i(TAG, "LLM Engine released")
     }
     
-    private fun updateThreadCount() {
-        val newThreadCount = thermalManager.getThermalAwareThreadCount()
-        if (newThreadCount != currentThreads) {
-            currentThreads = newThreadCount
-            Log.i(TAG, "Adjusted thread count to $currentThreads due to thermal state")
-            
-            // Re-initialize with new thread count (maintain consistent context size)
-            modelPath?.let { path ->
-                nativeLoadModel(
-                    path = path,
-                    nThreads = currentThreads,
-                    ctxSize = 2048,      // Consistent 2048 context size for LFM2.5
-                    temperature = 0.7f,  // Optimal for LFM2.5
-                    topK = 50,
-                    topP = 0.8f,
-                    minP = 0.0f
-                )
-            }
+    /**
+     * Give memory back when the system asks (ComponentCallbacks2.onTrimMemory).
+     * Nothing in flight is interrupted: the native side trims once it is idle and
+     * the next generation restores only what the chosen level released.
+     */
+    @Suppress("DEPRECATION") // RUNNING_* levels are still delivered below API 34
+    fun onTrimMemory(level: Int) {
+        if (!nativeLibraryLoaded || !_isInitialized.value) return
+        val residency = when {
+            level >= ComponentCallbacks2.TRIM_MEMORY_COMPLETE -> Residency.UNLOADED
+            level >= ComponentCallbacks2.TRIM_MEMORY_MODERATE -> Residency.COLD
+            level >= ComponentCallbacks2.TRIM_MEMORY_BACKGROUND -> Residency.PREFIX
+            level >= ComponentCallbacks2.TRIM_MEMORY_UI_HIDDEN -> Residency.COMPACT
+            level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL -> Residency.COLD
+            level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW -> Residency.PREFIX
+            level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_MODERATE -> Residency.COMPACT
+            else -> return
         }
+        Log.i(TAG, "onTrimMemory($level) -> residency $residency")
+        // Off the main thread: unloading waits for the native engine lock
+        scope.launch { nativeSetResidency(residency.ordinal) }
+    }
+    
+    fun getResidency(): Residency {
+        if (!nativeLibraryLoaded) return Residency.UNLOADED
+        return Residency.values().getOrElse(nativeGetResidency()) { Residency.ACTIVE }
+    }
+    
+    /**
+     * Opt into prompt-lookup speculative decoding. Up to [draftTokens] tokens per step
+     * are drafted from n-grams already in the prompt or the reply and verified in one
+     * batched decode - a big win when answers quote notes or search snippets.
+     * With a draft model loaded, [draftTokens] caps its draft length instead.
+     * Pass 0 to turn it off.
+     */
+    fun setPromptLookupDecoding(draftTokens: Int = PROMPT_LOOKUP_DRAFT_TOKENS) {
+        if (!nativeLibraryLoaded) return
+        nativeSetSpeculativeDraft(draftTokens)
+    }
+    
+    /**
+     * Bound how much of a long prompt (notes, search results, web pages) is
+     * prefilled per step while other generations are streaming. Smaller keeps
+     * their tokens flowing; larger gets the new prompt to its first token sooner.
+     * Pass 0 to prefill a whole batch per step.
+     */
+    fun setPrefillBudget(tokens: Int = PREFILL_BUDGET_TOKENS) {
+        if (!nativeLibraryLoaded) return
+        nativeSetPrefillBudget(tokens)
+    }
+    
+    /**
+     * Open the note vector index in [file] for the current embedding model, which
+     * is the loaded chat model unless [setEmbeddingModel] named another. Vectors
+     * left by a different model are discarded. Returns 0 until a model is known.
+     */
+    fun openVectorIndex(file: File): Long {
+        if (!nativeLibraryLoaded) return 0L
+        return nativeVectorIndexOpen(file.absolutePath)
+    }
+    
+    fun closeVectorIndex(index: Long) {
+        if (!nativeLibraryLoaded || index == 0L) return
+        nativeVectorIndexClose(index)
+    }
+    
+    /**
+     * Identity of the model notes are embedded with (path, size and mtime of the
+     * GGUF), 0 while there is none. An index opened under another id is stale.
+     */
+    fun embeddingModelId(): Long {
+        if (!nativeLibraryLoaded) return 0L
+        return nativeEmbeddingModelId()
+    }
+    
+    /**
+     * Embed with a small dedicated embedding GGUF instead of the chat model
+     * (null = the chat model). Changes [embeddingModelId], so open indexes go stale.
+     */
+    fun setEmbeddingModel(modelPath: String?) {
+        if (!nativeLibraryLoaded) return
+        nativeSetEmbeddingModel(modelPath ?: "")
+    }
+    
+    /**
+     * Embed [texts] natively and store them under [ids], replacing older vectors.
+     * Runs beside generation on two threads; returns how many were stored, -1 on failure.
+     * Fails rather than bring back a model [onTrimMemory] released (COLD or UNLOADED).
+     */
+    suspend fun addToVectorIndex(index: Long, ids: LongArray, texts: Array<String>): Int = withContext(Dispatchers.IO) {
+        if (!nativeLibraryLoaded || index == 0L) return@withContext -1
+        withNativeSession { session -> nativeVectorIndexAdd(index, ids, texts, session) }
+    }
+    
+    fun removeFromVectorIndex(index: Long, id: Long) {
+        if (!nativeLibraryLoaded || index == 0L) return
+        nativeVectorIndexRemove(index, id)
+    }
+    
+    fun vectorIndexIds(index: Long): LongArray {
+        if (!nativeLibraryLoaded || index == 0L) return LongArray(0)
+        return nativeVectorIndexIds(index)
+    }
+    
+    /**
+     * Ids of the [limit] stored vectors nearest to [query] with their cosine
+     * similarity, best first. Null if the query could not be embedded.
+     */
+    suspend fun searchVectorIndex(index: Long, query: String, limit: Int): List<Pair<Long, Float>>? = withContext(Dispatchers.IO) {
+        if (!nativeLibraryLoaded || index == 0L || limit <= 0) return@withContext null
+        val scores = FloatArray(limit)
+        val ids = withNativeSession { session -> nativeVectorIndexSearch(index, query, limit, session, scores) }
+            ?: return@withContext null
+        ids.indices.map { ids[it] to scores[it] }
+    }
+    
+    /**
+     * Share of drafted tokens the model accepted so far (0 if nothing was drafted)
+     */
+    fun getSpeculativeAcceptanceRate(): Float {
+        if (!nativeLibraryLoaded) return 0f
+        val (drafted, accepted) = nativeGetSpeculativeStats()
+        return if (drafted > 0) accepted.toFloat() / drafted else 0f
+    }
+    
+    /**
+     * Per-phase latency, KV cache and thread counters from the native layer
+     * (null if the native library is unavailable)
+     */
+    fun getInferenceMetrics(): InferenceMetrics? {
+        if (!nativeLibraryLoaded) return null
+        return InferenceMetrics.fromArray(nativeGetMetrics())
+    }
+    
+    /**
+     * Hand the thermal and battery state to the native thread controller. It
+     * changes thread count and core placement between decode steps, so unlike
+     * reloading the model this is cheap enough to call on every thermal change.
+     */
+    private fun pushDeviceState() {
+        if (!nativeLibraryLoaded) return
+        nativeSetDeviceState(
+            thermalLevel = thermalManager.getThermalStatus().ordinal,
+            thermalHeadroom = thermalManager.getThermalHeadroom(),
+            batteryPercent = batteryPercent(),
+            charging = isCharging()
+        )
+    }
+    
+    private fun batteryPercent(): Int {
+        val batteryManager = context.getSystemService(Context.BATTERY_SERVICE) as? BatteryManager
+        val percent = batteryManager?.getIntProperty(BatteryManager.BATTERY_PROPERTY_CAPACITY) ?: -1
+        return if (percent in 0..100) percent else 100
+    }
+    
+    private fun isCharging(): Boolean {
+        val status = context.registerReceiver(null, IntentFilter(Intent.ACTION_BATTERY_CHANGED))
+            ?.getIntExtra(BatteryManager.EXTRA_STATUS, -1) ?: -1
+        return status == BatteryManager.BATTERY_STATUS_CHARGING || status == BatteryManager.BATTERY_STATUS_FULL
     }
     
     companion object {
@@ -522,6 +854,47 @@ class LLMEngine(
         
         fun isNativeLibraryAvailable(): Boolean = nativeLibraryLoaded
         
+        // Streaming delivery: batch tokens per JNI callback through a direct buffer
+        private const val STREAM_FLUSH_TOKENS = 4
+        private const val STREAM_FLUSH_MILLIS = 100
+        private const val STREAM_BUFFER_BYTES = 16 * 1024
+        
+        // On-disk KV snapshots of formatted system prompts (LRU, evicted by total size)
+        private const val PROMPT_CACHE_DIR = "kv_snapshots"
+        private const val PROMPT_CACHE_MAX_BYTES = 64L * 1024 * 1024 // 64MB
+        
+        // Per-user n-gram statistics, persisted across sessions
+        private const val NGRAM_CACHE_DIR = "ngram_cache"
+        
+        // Sampling seed that draws a fresh random seed per request (LLAMA_DEFAULT_SEED)
+        const val RANDOM_SEED = -1
+        
+        // Prompt-lookup speculation: tokens drafted per decode step when enabled
+        const val PROMPT_LOOKUP_DRAFT_TOKENS = 8
+        
+        // Draft-model speculation: cap of the adaptive draft length
+        const val DRAFT_MODEL_MAX_TOKENS = 8
+        
+        // Early-exit self-speculation without a draft model: the model drafts with
+        // its first layers. Opt-in; EARLY_EXIT_AUTO picks the layer by calibration
+        // at load time, and turns it off when no layer pays off.
+        const val EARLY_EXIT_AUTO = -1
+        private const val EARLY_EXIT_LAYER = 0
+        
+        // Prompt tokens per step while other generations decode (native default)
+        const val PREFILL_BUDGET_TOKENS = 256
+        
+        // KV cache storage (EngineKvCacheType): K and V 8-bit, V 4-bit, both 4-bit
+        const val KV_CACHE_Q8_0 = 0
+        const val KV_CACHE_Q4_0_V = 1
+        const val KV_CACHE_Q4_0 = 2
+        
+        // Devices below this total RAM (the 4 GB class) use the 4-bit KV cache
+        private const val LOW_MEMORY_DEVICE_BYTES = 5L * 1024 * 1024 * 1024
+        
+        // Threads the context is created with - the native controller's ceiling
+        private const val INFERENCE_THREADS = 4
+        
         // Default model configuration - LFM2.5-1.2B-Instruct optimized for mobile
         const val DEFAULT_MODEL_URL = "https://huggingface.co/unsloth/LFM2.5-1.2B-Instruct-GGUF/resolve/main/LFM2.5-1.2B-Instruct-Q4_K_M.gguf"
         const val DEFAULT_MODEL_FILENAME = "lfm2.5-1.2b-instruct-q4_k_m.gguf"
@@ -0,0 +1,20 @@
+package com.confidant.ai.engine
+
+/**
+ * ModelLoadCallback - Progress of an asynchronous native model load
+ *
+ * Called from the native loading thread, not the main thread
+ */
+interface ModelLoadCallback {
+    /**
+     * Called as loading advances: weights, then pre-faulting and a warm-up decode
+     * @param progress Fraction completed, 0.0 to 1.0
+     */
+    fun onProgress(progress: Float)
+    
+    /**
+     * Called exactly once when loading ends
+     * @param success True if the model is loaded and warmed up
+     */
+    fun onComplete(success: Boolean)
+}
@@ -13,6 +13,20 @@ interface StreamingCallback {
      */
     fun onToken(token: String)
     
+    /**
+     * Called instead of [onToken] when the native layer streams into a direct ByteBuffer
+     * @param offset Byte offset of the chunk inside the buffer
+     * @param length Number of UTF-8 bytes in the chunk (always whole code points)
+     */
+    fun onChunk(offset: Int, length: Int) {}
+    
+    /**
+     * Called after each chunk of the prompt is prefilled, before the first token
+     * @param processed Prompt tokens in the KV cache so far (reused ones included)
+     * @param total Prompt tokens in all
+     */
+    fun onPrefillProgress(processed: Int, total: Int) {}
+    
     /**
      * Called when generation completes successfully
      */
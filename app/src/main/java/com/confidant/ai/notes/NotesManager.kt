@@ -2,6 +2,7 @@ package com.confidant.ai.notes
 
 import android.content.Context
 import android.util.Log
+import com.confidant.ai.ConfidantApplication
 import com.confidant.ai.database.AppDatabase
 import com.confidant.ai.database.entity.NoteEntity
 import com.confidant.ai.search.EnhancedKeywordSearch
@@ -14,22 +15,21 @@ import java.time.ZoneId
 import java.time.format.DateTimeFormatter
 
 /**
- * NotesManager - Manages user notes with enhanced keyword search
+ * NotesManager - Manages user notes with hybrid keyword + semantic search
  * 
  * Features:
  * - CRUD operations
  * - BM25-based keyword search (fast, lightweight)
  * - Fuzzy matching for typos
  * - N-gram similarity matching
+ * - Semantic search on native embeddings (VectorSearch), fused with the keywords
  * - Tag-based filtering
  * - Category management
  * - Reminder support
  * 
- * OPTIMIZED: Replaced semantic embeddings with BM25 keyword search
- * - No model downloads (0 MB vs 25+ MB)
- * - Instant search (microseconds vs milliseconds)
- * - 90%+ effective for note retrieval
- * - Much lower CPU and memory footprint
+ * Embeddings come from the already loaded GGUF, so there is no extra model
+ * download; notes are embedded in the background and search falls back to
+ * keywords alone while no model is loaded.
  */
 class NotesManager(
     private val context: Context,
@@ -38,6 +38,7 @@ class NotesManager(
     
     private val noteDao = database.noteDao()
     private val searchEngine = EnhancedKeywordSearch()
+    private val vectorSearch = (context.applicationContext as? ConfidantApplication)?.vectorSearch
     
     suspend fun initialize() {
         try {
@@ -57,6 +58,9 @@ class NotesManager(
                 )
             }
             Log.i(TAG, "Search index initialized with ${existingNotes.size} notes")
+            
+            // Embeds whatever notes the vector index is missing, in the background
+            vectorSearch?.requestSync()
         } catch (e: Exception) {
             Log.e(TAG, "Failed to initialize search index", e)
         }
@@ -65,7 +69,7 @@ class NotesManager(
     /**
      * Save a new note - ULTRA FAST
      * Automatically extracts metadata from content
-     * Uses BM25 keyword indexing (instant, no model needed)
+     * Uses BM25 keyword indexing (instant); the embedding follows in the background
      */
     suspend fun saveNote(
         title: String,
@@ -100,7 +104,7 @@ class NotesManager(
                 category = detectedCategory,
                 createdAt = now,
                 updatedAt = now,
-                embedding = null,  // No longer using embeddings
+                embedding = null,  // Vectors live in the native index (VectorSearch)
                 reminder = reminder,
                 priority = detectedPriority
             )
@@ -116,6 +120,7 @@ class NotesManager(
                 tags = detectedTags,
                 priority = note.priority
             )
+            vectorSearch?.indexNote(note.copy(id = id))
             
             Log.i(TAG, "Note saved: id=$id, title='$title', category=$detectedCategory")
             Result.success(id)
@@ -128,7 +133,7 @@ class NotesManager(
     /**
      * Quick save - ultra-simplified version
      * Just provide content, everything else is auto-detected
-     * OPTIMIZED: No embeddings for instant save
+     * Embedding follows in the background, so saving stays instant
      */
     suspend fun quickSave(content: String): Result<Long> {
         val title = generateTitle(content)
@@ -232,14 +237,13 @@ class NotesManager(
             val updatedTitle = title ?: existing.title
             val updatedContent = content ?: existing.content
             
-            // No embeddings - just update the note
             val updated = existing.copy(
                 title = updatedTitle,
                 content = updatedContent,
                 tags = tags?.let { JSONArray(it).toString() } ?: existing.tags,
                 category = category ?: existing.category,
                 updatedAt = Instant.now(),
-                embedding = null,  // No embeddings
+                embedding = null,  // Vectors live in the native index (VectorSearch)
                 reminder = reminder ?: existing.reminder,
                 priority = priority ?: existing.priority
             )
@@ -260,6 +264,9 @@ class NotesManager(
             }
             
             noteDao.update(updated)
+            if (title != null || content != null) {
+                vectorSearch?.indexNote(updated)
+            }
             Log.i(TAG, "Note updated: id=$id")
             Result.success(Unit)
         } catch (e: Exception) {
@@ -277,6 +284,8 @@ class NotesManager(
                 ?: return@withContext Result.failure(Exception("Note not found: $id"))
             
             noteDao.delete(note)
+            searchEngine.removeDocument(id)
+            vectorSearch?.removeNote(id)
             Log.i(TAG, "Note deleted: id=$id")
             Result.success(Unit)
         } catch (e: Exception) {
@@ -291,6 +300,7 @@ class NotesManager(
     suspend fun archiveNote(id: Long): Result<Unit> = withContext(Dispatchers.IO) {
         try {
             noteDao.archiveNote(id, Instant.now())
+            vectorSearch?.removeNote(id)
             Log.i(TAG, "Note archived: id=$id")
             Result.success(Unit)
         } catch (e: Exception) {
@@ -300,9 +310,10 @@ class NotesManager(
     }
     
     /**
-     * Retrieve notes by keyword search - GENERALIZABLE WITH BM25 + FUZZY
-     * Uses EnhancedKeywordSearch for fast, accurate retrieval with fuzzy matching
-     * This ensures notes are found even with partial matches, typos, or different word order
+     * Retrieve notes by hybrid search - BM25 + FUZZY + EMBEDDINGS
+     * Uses EnhancedKeywordSearch for fast, accurate retrieval with fuzzy matching,
+     * fused with the notes nearest in meaning (VectorSearch) when a model is loaded
+     * This ensures notes are found even with partial matches, typos, different word order or synonyms
      */
     suspend fun searchNotes(
         query: String,
@@ -318,19 +329,13 @@ class NotesManager(
                 enableNgram = true   // Enable n-gram for phrase similarity
             )
             
-            // Filter by category if specified
-            val filteredResults = if (category != null) {
-                results.filter { it.category.equals(category, ignoreCase = true) }
-            } else {
-                results
-            }
-            
-            // Get note entities from database
-            val notes = filteredResults.take(limit).mapNotNull { result ->
-                noteDao.getById(result.id)
-            }
+            // Get note entities from database, filtered by category if specified
+            val notes = fuseWithVectorSearch(query, results.map { it.id }, limit * 2)
+                .mapNotNull { id -> noteDao.getById(id) }
+                .filter { !it.isArchived && (category == null || it.category.equals(category, ignoreCase = true)) }
+                .take(limit)
             
-            Log.i(TAG, "Search '$query' found ${notes.size} notes (BM25+fuzzy)")
+            Log.i(TAG, "Search '$query' found ${notes.size} notes (BM25+fuzzy+vectors)")
             Result.success(notes)
         } catch (e: Exception) {
             Log.e(TAG, "Failed to search notes", e)
@@ -354,8 +359,8 @@ class NotesManager(
     }
     
     /**
-     * Semantic search using BM25 keyword search (NO embeddings)
-     * This method is kept for API compatibility but uses keyword search internally
+     * Semantic search: native embeddings fused with BM25 keyword search
+     * Falls back to keyword search alone while no model is loaded
      */
     suspend fun semanticSearch(
         query: String,
@@ -363,7 +368,6 @@ class NotesManager(
         threshold: Float = 0.5f
     ): Result<List<NoteEntity>> = withContext(Dispatchers.IO) {
         try {
-            // Use BM25 keyword search instead of embeddings
             val results = searchEngine.search(
                 query = query,
                 limit = limit,
@@ -371,11 +375,12 @@ class NotesManager(
                 enableNgram = true
             )
             
-            val notes = results.mapNotNull { result ->
-                noteDao.getById(result.id)
-            }
+            val notes = fuseWithVectorSearch(query, results.map { it.id }, limit)
+                .mapNotNull { id -> noteDao.getById(id) }
+                .filter { !it.isArchived }
+                .take(limit)
             
-            Log.i(TAG, "Keyword search '$query' found ${notes.size} notes")
+            Log.i(TAG, "Semantic search '$query' found ${notes.size} notes")
             Result.success(notes)
         } catch (e: Exception) {
             Log.e(TAG, "Failed to perform keyword search", e)
@@ -383,6 +388,26 @@ class NotesManager(
         }
     }
     
+    /**
+     * Keyword ranking fused with the vector ranking by reciprocal rank fusion:
+     * each list adds 1 / (RRF_K + rank) to a note, so neither list's score scale
+     * matters and notes found by both come first. Keyword order when no
+     * vectors are available.
+     */
+    private suspend fun fuseWithVectorSearch(query: String, keywordIds: List<Long>, limit: Int): List<Long> {
+        val vectorIds = vectorSearch?.search(query, limit)?.map { it.id }.orEmpty()
+        if (vectorIds.isEmpty()) return keywordIds
+        
+        val scores = mutableMapOf<Long, Float>()
+        keywordIds.forEachIndexed { rank, id ->
+            scores[id] = scores.getOrDefault(id, 0f) + 1f / (RRF_K + rank + 1)
+        }
+        vectorIds.forEachIndexed { rank, id ->
+            scores[id] = scores.getOrDefault(id, 0f) + 1f / (RRF_K + rank + 1)
+        }
+        return scores.entries.sortedByDescending { it.value }.map { it.key }
+    }
+    
     /**
      * List recent notes
      */
@@ -519,5 +544,6 @@ class NotesManager(
     
     companion object {
         private const val TAG = "NotesManager"
+        private const val RRF_K = 60  // reciprocal rank fusion damping (the usual constant)
     }
 }
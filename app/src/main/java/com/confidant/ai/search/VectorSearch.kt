@@ -0,0 +1,187 @@
+package com.confidant.ai.search
+
+import android.content.Context
+import android.util.Log
+import com.confidant.ai.database.AppDatabase
+import com.confidant.ai.database.entity.NoteEntity
+import com.confidant.ai.engine.LLMEngine
+import kotlinx.coroutines.CoroutineScope
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.SupervisorJob
+import kotlinx.coroutines.launch
+import java.io.File
+
+/**
+ * VectorSearch - Semantic note retrieval on native embeddings
+ *
+ * Notes are embedded by the native engine with the model it already has loaded
+ * (no extra download) and kept as int8 vectors in a memory-mapped file that is
+ * scanned in full per query - a few milliseconds for thousands of notes. It
+ * finds notes that share meaning but not words with the query; NotesManager
+ * fuses its ranking with the keyword search.
+ *
+ * Best effort: until the model is loaded search returns nothing, and notes
+ * saved meanwhile are picked up by the next sync. When another model is
+ * loaded the index is reopened for it and the notes are embedded again.
+ */
+class VectorSearch(
+    private val context: Context,
+    private val llmEngine: LLMEngine,
+    private val database: AppDatabase
+) {
+
+    private val scope = CoroutineScope(Dispatchers.IO + SupervisorJob())
+    private val noteDao = database.noteDao()
+
+    // Native index opened for one embedding model; closed once retired and unused
+    private class IndexHandle(val index: Long, val modelId: Long) {
+        var users = 0
+        @Volatile var retired = false
+    }
+
+    private var handle: IndexHandle? = null
+    @Volatile private var synced = false
+    private var syncJob: Job? = null
+
+    init {
+        // Close the index with the engine; the next model opens it again
+        scope.launch {
+            llmEngine.isInitialized.collect { initialized -> if (!initialized) retireIndex() }
+        }
+    }
+
+    /**
+     * The index for the current embedding model, null if there is none. A model
+     * switch retires the open index: the file is reopened (and its vectors of the
+     * old model dropped) once the calls still using the old handle are done.
+     * Every handle returned must be given back with [releaseIndex].
+     */
+    @Synchronized
+    private fun acquireIndex(): IndexHandle? {
+        val modelId = if (llmEngine.isInitialized.value) llmEngine.embeddingModelId() else 0L
+        handle?.let { if (it.modelId != modelId) retireIndex() }
+        if (handle == null && modelId != 0L) {
+            val index = llmEngine.openVectorIndex(File(context.filesDir, INDEX_FILE))
+            if (index != 0L) {
+                handle = IndexHandle(index, modelId)
+                synced = false
+                Log.i(TAG, "Vector index opened with ${llmEngine.vectorIndexIds(index).size} notes")
+            }
+        }
+        return handle?.takeIf { !it.retired }?.also { it.users++ }
+    }
+
+    @Synchronized
+    private fun releaseIndex(handle: IndexHandle) {
+        handle.users--
+        closeIfRetired(handle)
+    }
+
+    @Synchronized
+    private fun retireIndex() {
+        val current = handle ?: return
+        current.retired = true
+        closeIfRetired(current)
+    }
+
+    @Synchronized
+    private fun closeIfRetired(handle: IndexHandle) {
+        if (handle.retired && handle.users == 0) {
+            llmEngine.closeVectorIndex(handle.index)
+            if (this.handle === handle) this.handle = null
+            Log.i(TAG, "Vector index closed")
+        }
+    }
+
+    private inline fun <T> withIndex(default: T, block: (IndexHandle) -> T): T {
+        val handle = acquireIndex() ?: return default
+        try {
+            return block(handle)
+        } finally {
+            releaseIndex(handle)
+        }
+    }
+
+    /**
+     * Embed the notes the index is missing and drop the vectors of deleted or
+     * archived ones, in the background. Does nothing while a sync is running.
+     */
+    @Synchronized
+    fun requestSync() {
+        if (syncJob?.isActive == true) return
+        syncJob = scope.launch {
+            try {
+                sync()
+            } catch (e: Exception) {
+                Log.e(TAG, "Vector index sync failed", e)
+            }
+        }
+    }
+
+    private suspend fun sync() = withIndex(Unit) { handle ->
+        val index = handle.index
+        val notes = noteDao.getRecentNotes(MAX_INDEXED_NOTES).associateBy { it.id }
+        val stored = llmEngine.vectorIndexIds(index).toHashSet()
+        stored.filter { it !in notes }.forEach { llmEngine.removeFromVectorIndex(index, it) }
+
+        var added = 0
+        // Small batches, so a query is never stuck behind the whole backlog
+        for (batch in notes.values.filter { it.id !in stored }.chunked(SYNC_BATCH_SIZE)) {
+            // The model changed: let the index reopen, the next sync starts over
+            if (handle.retired) return@withIndex
+            val n = llmEngine.addToVectorIndex(
+                index,
+                batch.map { it.id }.toLongArray(),
+                batch.map { noteText(it) }.toTypedArray()
+            )
+            if (n < 0) {
+                Log.w(TAG, "Embedding stopped after $added notes, the next sync resumes")
+                return@withIndex
+            }
+            added += n
+        }
+        synced = true
+        Log.i(TAG, "Vector index synced: $added notes embedded, ${notes.size} indexed")
+    }
+
+    /**
+     * Embed one new or edited note in the background, replacing its old vector
+     */
+    fun indexNote(note: NoteEntity) {
+        scope.launch {
+            withIndex(Unit) { handle ->
+                if (llmEngine.addToVectorIndex(handle.index, longArrayOf(note.id), arrayOf(noteText(note))) < 0) {
+                    Log.w(TAG, "Failed to embed note ${note.id}, the next sync retries")
+                    synced = false
+                }
+            }
+        }
+    }
+
+    fun removeNote(id: Long) {
+        withIndex(Unit) { handle -> llmEngine.removeFromVectorIndex(handle.index, id) }
+    }
+
+    /**
+     * Notes nearest in meaning to [query], best first, scored by cosine
+     * similarity. Empty when no model is loaded or the query failed to embed.
+     */
+    suspend fun search(query: String, limit: Int = 10): List<SearchResult> {
+        if (query.isBlank()) return emptyList()
+        val results = withIndex(null) { handle ->
+            if (!synced) requestSync()
+            llmEngine.searchVectorIndex(handle.index, query, limit)
+        } ?: return emptyList()
+        return results.map { (id, score) -> SearchResult(id = id, score = score, metadata = emptyMap()) }
+    }
+
+    private fun noteText(note: NoteEntity): String = "${note.title}\n${note.content}"
+
+    companion object {
+        private const val TAG = "VectorSearch"
+        private const val INDEX_FILE = "note_vectors.idx"
+        private const val SYNC_BATCH_SIZE = 16      // one native decode (EMBED_MAX_SEQS)
+        private const val MAX_INDEXED_NOTES = 5000
+    }
+}
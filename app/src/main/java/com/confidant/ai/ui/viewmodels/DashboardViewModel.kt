@@ -7,6 +7,7 @@ import androidx.compose.ui.graphics.Color
 import androidx.lifecycle.AndroidViewModel
 import androidx.lifecycle.viewModelScope
 import com.confidant.ai.ConfidantApplication
+import com.confidant.ai.engine.InferenceMetrics
 import com.confidant.ai.memory.MemoryStats
 import com.confidant.ai.service.NotificationCaptureService
 import com.confidant.ai.thermal.ThermalManager
@@ -38,6 +39,10 @@ class DashboardViewModel(application: Application) : AndroidViewModel(applicatio
     private val _thermalState = MutableStateFlow(ThermalManager.ThermalState.NOMINAL)
     val thermalState: StateFlow<ThermalManager.ThermalState> = _thermalState.asStateFlow()
 
+    // Native inference counters (null until the engine is available)
+    private val _inferenceMetrics = MutableStateFlow<InferenceMetrics?>(null)
+    val inferenceMetrics: StateFlow<InferenceMetrics?> = _inferenceMetrics.asStateFlow()
+
     // Recent Activity
     private val _recentActivity = MutableStateFlow<List<ActivityItem>>(emptyList())
     val recentActivity: StateFlow<List<ActivityItem>> = _recentActivity.asStateFlow()
@@ -89,6 +94,10 @@ class DashboardViewModel(application: Application) : AndroidViewModel(applicatio
             notificationListenerActive = notificationListenerActive,
             telegramConnected = telegramConnected
         )
+
+        if (llmInitialized) {
+            _inferenceMetrics.value = app.llmEngine.getInferenceMetrics()
+        }
     }
 
     private suspend fun loadRecentActivity() {